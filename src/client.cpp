@@ -893,8 +893,9 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		/*infostream<<"Client: Thread: BLOCKDATA for ("
 				<<p.X<<","<<p.Y<<","<<p.Z<<")"<<std::endl;*/
 
-		std::string datastring((char*)&data[8], datasize-8);
-		std::istringstream istr(datastring, std::ios_base::binary);
+		// Read the block straight from the packet
+		MemoryStreamBuffer databuf((char*)&data[8], datasize-8);
+		std::istream istr(&databuf);
 
 		const v2s16 p2d(p.X, p.Z);
 		MapSector* const sector = m_env.getMap().emergeSector(p2d);
@@ -165,6 +165,7 @@ void config_default_init()
 	config_set_default("world.game.environment.season","auto",NULL);
 	config_set_default("world.game.motd","",NULL);
 	config_set_default("world.map.type","default",NULL);
+	config_set_default("world.map.database","sqlite3",NULL);
 
 	/* server */
 	config_set_default("world.server.chunk.range.active","2",NULL);
@@ -191,7 +192,15 @@ void config_default_init()
 #endif
 	config_set_default("server.net.chunk.max","20",NULL);
 	config_set_default("server.chunk.timeout","19",NULL);
+	config_set_default("server.emerge.threads","2",NULL);
+	config_set_default("server.nodestep.threads","4",NULL);
+	config_set_default("server.nodestep.budget","20",NULL);
+	config_set_default("server.mob.budget","20",NULL);
+	config_set_default("server.liquid.threads","2",NULL);
+	config_set_default("server.liquid.budget","50",NULL);
 	config_set_default("server.save.interval","60",NULL);
+	config_set_default("server.save.queue.max","256",NULL);
+	config_set_default("server.map.benchmark","false",NULL);
 
 
 	config_set_default("global.api.address","servers.voxelands.com",NULL);
@@ -163,68 +163,72 @@ SharedBuffer<u8> makeReliablePacket(
 	ReliablePacketBuffer
 */
 
+ReliablePacketBuffer::ReliablePacketBuffer():
+	m_slots(RELIABLE_BUFFER_SIZE),
+	m_size(0),
+	m_first(0),
+	m_last(0),
+	m_time(0.0),
+	m_head(-1),
+	m_tail(-1)
+{
+	for(u32 i=0; i<RELIABLE_BUFFER_SIZE; i++)
+		m_slots[i].packet = NULL;
+}
+ReliablePacketBuffer::~ReliablePacketBuffer()
+{
+	for(u32 i=0; i<RELIABLE_BUFFER_SIZE; i++)
+		delete m_slots[i].packet;
+}
+
 void ReliablePacketBuffer::print()
 {
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++)
+	if(empty())
+		return;
+	for(u16 s=m_first;; s++)
 	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		dout_con << s << " ";
+		if(m_slots[s % RELIABLE_BUFFER_SIZE].packet != NULL)
+			dout_con << s << " ";
+		if(s == m_last)
+			break;
 	}
 }
 bool ReliablePacketBuffer::empty()
 {
-	return m_list.empty();
+	return m_size == 0;
 }
 u32 ReliablePacketBuffer::size()
 {
-	return m_list.getSize();
-}
-RPBSearchResult ReliablePacketBuffer::findPacket(u16 seqnum)
-{
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++)
-	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		/*dout_con<<"findPacket(): finding seqnum="<<seqnum
-				<<", comparing to s="<<s<<std::endl;*/
-		if(s == seqnum)
-			break;
-	}
-	return i;
+	return m_size;
 }
-RPBSearchResult ReliablePacketBuffer::notFound()
+bool ReliablePacketBuffer::fits(u16 seqnum)
 {
-	return m_list.end();
+	if(empty())
+		return true;
+	u16 first = seqnum_higher(m_first, seqnum) ? seqnum : m_first;
+	u16 last = seqnum_higher(seqnum, m_last) ? seqnum : m_last;
+	return (u16)(last - first) < RELIABLE_BUFFER_SIZE;
 }
 u16 ReliablePacketBuffer::getFirstSeqnum()
 {
 	if(empty())
 		throw NotFoundException("Buffer is empty");
-	BufferedPacket p = *m_list.begin();
-	return readU16(&p.data[BASE_HEADER_SIZE+1]);
+	return m_first;
 }
 BufferedPacket ReliablePacketBuffer::popFirst()
 {
 	if(empty())
 		throw NotFoundException("Buffer is empty");
-	BufferedPacket p = *m_list.begin();
-	core::list<BufferedPacket>::Iterator i = m_list.begin();
-	m_list.erase(i);
-	return p;
+	return take(m_first);
 }
 BufferedPacket ReliablePacketBuffer::popSeqnum(u16 seqnum)
 {
-	RPBSearchResult r = findPacket(seqnum);
-	if(r == notFound()){
+	BufferedPacket *p = m_slots[seqnum % RELIABLE_BUFFER_SIZE].packet;
+	if(p == NULL || readU16(&p->data[BASE_HEADER_SIZE+1]) != seqnum){
 		dout_con << "Not found" << std::endl;
 		throw NotFoundException("seqnum not found in buffer");
 	}
-	BufferedPacket p = *r;
-	m_list.erase(r);
-	return p;
+	return take(seqnum);
 }
 void ReliablePacketBuffer::insert(BufferedPacket &p)
 {
@@ -232,85 +236,118 @@ void ReliablePacketBuffer::insert(BufferedPacket &p)
 	u8 type = readU8(&p.data[BASE_HEADER_SIZE+0]);
 	assert(type == TYPE_RELIABLE);
 	u16 seqnum = readU16(&p.data[BASE_HEADER_SIZE+1]);
+	assert(fits(seqnum));
 
-	// Find the right place for the packet and insert it there
+	s16 i = seqnum % RELIABLE_BUFFER_SIZE;
+	Slot &slot = m_slots[i];
+	// Anything else there would be too far away to fit
+	if(slot.packet != NULL)
+		throw AlreadyExistsException("Same seqnum in list");
 
-	// If list is empty, just add it
-	if(m_list.empty())
+	if(empty())
 	{
-		m_list.push_back(p);
-		// Done.
-		return;
-	}
-	// Otherwise find the right place
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	// Find the first packet in the list which has a higher seqnum
-	for(; i != m_list.end(); i++){
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		if(s == seqnum){
-			throw AlreadyExistsException("Same seqnum in list");
-		}
-		if(seqnum_higher(s, seqnum)){
-			break;
-		}
+		m_first = seqnum;
+		m_last = seqnum;
 	}
-	// If we're at the end of the list, add the packet to the
-	// end of the list
-	if(i == m_list.end())
+	else
 	{
-		m_list.push_back(p);
-		// Done.
-		return;
+		if(seqnum_higher(m_first, seqnum))
+			m_first = seqnum;
+		if(seqnum_higher(seqnum, m_last))
+			m_last = seqnum;
 	}
-	// Insert before i
-	m_list.insert_before(i, p);
-}
 
-void ReliablePacketBuffer::incrementTimeouts(float dtime)
-{
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++){
-		i->time += dtime;
-		i->totaltime += dtime;
-	}
+	slot.packet = new BufferedPacket(p);
+	slot.sent = m_time - p.time;
+	slot.buffered = m_time - p.totaltime;
+	link(i);
+	m_size++;
 }
 
-void ReliablePacketBuffer::resetTimedOuts(float timeout)
+void ReliablePacketBuffer::incrementTimeouts(float dtime)
 {
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++){
-		if(i->time >= timeout)
-			i->time = 0.0;
-	}
+	m_time += dtime;
 }
 
 bool ReliablePacketBuffer::anyTotaltimeReached(float timeout)
 {
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++){
-		if(i->totaltime >= timeout)
-			return true;
-	}
-	return false;
+	// Outgoing packets are buffered in seqnum order, the first one has
+	// been buffered the longest
+	if(empty())
+		return false;
+	return m_time - m_slots[m_first % RELIABLE_BUFFER_SIZE].buffered >= timeout;
 }
 
 core::list<BufferedPacket> ReliablePacketBuffer::getTimedOuts(float timeout)
 {
 	core::list<BufferedPacket> timed_outs;
-	core::list<BufferedPacket>::Iterator i;
-	i = m_list.begin();
-	for(; i != m_list.end(); i++)
+	for(u32 n=0; n<m_size && m_head != -1; n++)
 	{
-		if(i->time >= timeout)
-			timed_outs.push_back(*i);
+		s16 i = m_head;
+		Slot &slot = m_slots[i];
+		if(m_time - slot.sent < timeout)
+			break;
+
+		BufferedPacket p = *slot.packet;
+		p.time = m_time - slot.sent;
+		p.totaltime = m_time - slot.buffered;
+		timed_outs.push_back(p);
+
+		// To the back, it's sent again now
+		slot.sent = m_time;
+		unlink(i);
+		link(i);
 	}
 	return timed_outs;
 }
 
+BufferedPacket ReliablePacketBuffer::take(u16 seqnum)
+{
+	s16 i = seqnum % RELIABLE_BUFFER_SIZE;
+	Slot &slot = m_slots[i];
+
+	BufferedPacket p = *slot.packet;
+	p.time = m_time - slot.sent;
+	p.totaltime = m_time - slot.buffered;
+
+	delete slot.packet;
+	slot.packet = NULL;
+	unlink(i);
+	m_size--;
+
+	if(empty())
+		return p;
+	while(m_slots[m_first % RELIABLE_BUFFER_SIZE].packet == NULL)
+		m_first++;
+	while(m_slots[m_last % RELIABLE_BUFFER_SIZE].packet == NULL)
+		m_last--;
+	return p;
+}
+
+void ReliablePacketBuffer::link(s16 i)
+{
+	m_slots[i].prev = m_tail;
+	m_slots[i].next = -1;
+	if(m_tail != -1)
+		m_slots[m_tail].next = i;
+	else
+		m_head = i;
+	m_tail = i;
+}
+
+void ReliablePacketBuffer::unlink(s16 i)
+{
+	Slot &slot = m_slots[i];
+	if(slot.prev != -1)
+		m_slots[slot.prev].next = slot.next;
+	else
+		m_head = slot.next;
+	if(slot.next != -1)
+		m_slots[slot.next].prev = slot.prev;
+	else
+		m_tail = slot.prev;
+}
+
 /*
 	IncomingSplitBuffer
 */
@@ -438,11 +475,39 @@ Channel::Channel()
 	next_outgoing_seqnum = SEQNUM_INITIAL;
 	next_incoming_seqnum = SEQNUM_INITIAL;
 	next_outgoing_split_seqnum = SEQNUM_INITIAL;
+	window = CONGESTION_WINDOW_INITIAL;
+	slow_start_threshold = CONGESTION_WINDOW_MAX;
+	window_lost_timer = 0.0;
+	reliables_sent = 0;
+	reliables_resent = 0;
 }
 Channel::~Channel()
 {
 }
 
+void Channel::windowAcked()
+{
+	if(window < slow_start_threshold)
+		window += 1.0;
+	else
+		window += 1.0 / window;
+	if(window > CONGESTION_WINDOW_MAX)
+		window = CONGESTION_WINDOW_MAX;
+}
+
+void Channel::windowLost(float rtt)
+{
+	// Packets sent in the same round trip tend to be lost together
+	if(window_lost_timer < rtt)
+		return;
+	window_lost_timer = 0.0;
+
+	slow_start_threshold = window / 2;
+	if(slow_start_threshold < CONGESTION_WINDOW_MIN)
+		slow_start_threshold = CONGESTION_WINDOW_MIN;
+	window = slow_start_threshold;
+}
+
 /*
 	Peer
 */
@@ -467,20 +532,6 @@ Peer::~Peer()
 
 void Peer::reportRTT(float rtt)
 {
-	if(rtt >= 0.0){
-		if(rtt < 0.01){
-			if(m_max_packets_per_second < 100)
-				m_max_packets_per_second += 10;
-		} else if(rtt < 0.2){
-			if(m_max_packets_per_second < 100)
-				m_max_packets_per_second += 2;
-		} else {
-			m_max_packets_per_second *= 0.8;
-			if(m_max_packets_per_second < 10)
-				m_max_packets_per_second = 10;
-		}
-	}
-
 	if(rtt < -0.999)
 	{}
 	else if(avg_rtt < 0.0)
@@ -506,11 +557,27 @@ void Peer::reportRTT(float rtt)
 	resend_timeout = timeout;
 }
 
+void Peer::updateSendRate()
+{
+	float window = 0;
+	for(int i=0; i<CHANNEL_COUNT; i++)
+		window += channels[i].window;
+
+	float rtt = getRTT();
+	if(rtt < 0.01)
+		rtt = 0.01;
+
+	m_max_packets_per_second = window * 2 / rtt;
+	if(m_max_packets_per_second < 10)
+		m_max_packets_per_second = 10;
+}
+
 /*
 	Connection
 */
 
 Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout):
+	m_receive_thread(this),
 	m_protocol_id(protocol_id),
 	m_max_packet_size(max_packet_size),
 	m_timeout(timeout),
@@ -521,12 +588,18 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout):
 {
 	m_socket.setTimeoutMs(5);
 	m_peers_mutex.Init();
-	
+	m_command_mutex.Init();
+	for(u32 i=0; i<ACK_LATENCY_BUCKETS; i++)
+		m_ack_latency[i] = 0;
+	m_receive_time = 0;
+
 	Start();
+	m_receive_thread.Start();
 }
 
 Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 		PeerHandler *peerhandler):
+	m_receive_thread(this),
 	m_protocol_id(protocol_id),
 	m_max_packet_size(max_packet_size),
 	m_timeout(timeout),
@@ -537,14 +610,21 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 {
 	m_socket.setTimeoutMs(5);
 	m_peers_mutex.Init();
+	m_command_mutex.Init();
+	for(u32 i=0; i<ACK_LATENCY_BUCKETS; i++)
+		m_ack_latency[i] = 0;
+	m_receive_time = 0;
 
 	Start();
+	m_receive_thread.Start();
 }
 
 
 Connection::~Connection()
 {
 	stop();
+	m_receive_thread.stop();
+	flush();
 }
 
 /* Internal stuff */
@@ -556,10 +636,11 @@ void * Connection::Thread()
 	log_register_thread("Connection");
 	log_mutex.Unlock();
 
-	dout_con  <<  "Connection thread started"  <<  std::endl;
+	dout_con  <<  "Connection send thread started"  <<  std::endl;
 
 	u32 curtime = porting::getTimeMs();
 	u32 lasttime = curtime;
+	bool pending = false;
 
 	while(getRun())
 	{
@@ -573,16 +654,51 @@ void * Connection::Thread()
 		if(dtime < 0.0)
 			dtime = 0.0;
 
-		runTimeouts(dtime);
+		sendAcks();
 
-		while(m_command_queue.size() != 0){
-			ConnectionCommand c = m_command_queue.pop_front();
-			processCommand(c);
+		{
+			JMutexAutoLock peerlock(m_peers_mutex);
+
+			runTimeouts(dtime);
+
+			while(m_command_queue.size() != 0){
+				ConnectionCommand c = m_command_queue.pop_front();
+				processCommand(c);
+			}
+
+			send(dtime);
+			pending = (m_outgoing_queue.size() != 0);
 		}
 
-		send(dtime);
+		flush();
 
-		receive();
+		/*
+			Until there's something new, timeouts and resends still
+			need running. Packets held back by the send rate go out
+			a few at a time.
+		*/
+		m_send_wake.Wait(pending ? 1 : CONNECTION_SEND_IDLE_MS);
+
+		END_DEBUG_EXCEPTION_HANDLER(derr_con);
+	}
+
+	return NULL;
+}
+
+void * ConnectionReceiveThread::Thread()
+{
+	ThreadStarted();
+	log_mutex.Lock();
+	log_register_thread("ConnectionReceive");
+	log_mutex.Unlock();
+
+	dout_con  <<  "Connection receive thread started"  <<  std::endl;
+
+	while(getRun())
+	{
+		BEGIN_DEBUG_EXCEPTION_HANDLER
+
+		m_con->receive();
 
 		END_DEBUG_EXCEPTION_HANDLER(derr_con);
 	}
@@ -631,6 +747,11 @@ void Connection::processCommand(ConnectionCommand &c)
 			 << std::endl;
 		deletePeer(c.peer_id, false);
 		return;
+	case CONNCMD_ACK:
+		// ACKs only go through m_reply_queue, see sendAcks()
+		derr_con << getDesc() << " WARNING: CONNCMD_ACK in the command"
+			 << " queue, ignoring" << std::endl;
+		return;
 	}
 }
 
@@ -641,6 +762,7 @@ void Connection::send(float dtime)
 			j.atEnd() == false; j++)
 	{
 		Peer *peer = j.getNode()->getValue();
+		peer->updateSendRate();
 		peer->m_sendtime_accu += dtime;
 		peer->m_num_sent = 0;
 		peer->m_max_num_sent = peer->m_sendtime_accu *
@@ -652,11 +774,18 @@ void Connection::send(float dtime)
 		Peer *peer = getPeerNoEx(packet.peer_id);
 		if(!peer)
 			continue;
-		if(peer->channels[packet.channelnum].outgoing_reliables.size() >= 5){
+		// The newest packet can't be too far from the oldest unacked
+		// one either, the peer has to buffer all between them
+		Channel *channel = &peer->channels[packet.channelnum];
+		u32 span = 0;
+		if(channel->outgoing_reliables.empty() == false)
+			span = (u16)(channel->next_outgoing_seqnum -
+					channel->outgoing_reliables.getFirstSeqnum());
+		if(channel->outgoing_reliables.size() >= (u32)channel->window ||
+				span >= RELIABLE_BUFFER_SIZE/2){
 			postponed_packets.push_back(packet);
 		} else if(peer->m_num_sent < peer->m_max_num_sent){
-			rawSendAsPacket(packet.peer_id, packet.channelnum,
-					packet.data, packet.reliable);
+			rawSendAsPacket(packet);
 			peer->m_num_sent++;
 		} else {
 			postponed_packets.push_back(packet);
@@ -693,6 +822,7 @@ void Connection::receive()
 	try{
 		/* Check if some buffer has relevant data */
 		{
+			JMutexAutoLock peerlock(m_peers_mutex);
 			u16 peer_id;
 			SharedBuffer<u8> resultdata;
 			bool got = getFromBuffers(peer_id, resultdata);
@@ -721,6 +851,10 @@ void Connection::receive()
 		if(readU32(&packetdata[0]) != m_protocol_id)
 			continue;
 
+		m_receive_time = porting::getTimeUs();
+
+		JMutexAutoLock peerlock(m_peers_mutex);
+
 		u16 peer_id = readPeerId(*packetdata);
 		u8 channelnum = readChannel(*packetdata);
 		if(channelnum > CHANNEL_COUNT-1){
@@ -813,11 +947,14 @@ void Connection::receive()
 			putEvent(e);
 
 			// Create CONTROL packet to tell the peer id to the new peer.
-			SharedBuffer<u8> reply(4);
+			PacketBuffer reply(4);
 			writeU8(&reply[0], TYPE_CONTROL);
 			writeU8(&reply[1], CONTROLTYPE_SET_PEER_ID);
 			writeU16(&reply[2], peer_id_new);
-			sendAsPacket(peer_id_new, 0, reply, true);
+			ConnectionCommand c;
+			c.send(peer_id_new, 0, reply, true);
+			m_reply_queue.push_back(c);
+			m_send_wake.Post();
 
 			// We're now talking to a valid peer_id
 			peer_id = peer_id_new;
@@ -885,6 +1022,50 @@ void Connection::receive()
 	} // for
 }
 
+void Connection::sendAcks()
+{
+	if(m_reply_queue.size() == 0)
+		return;
+
+	core::list<u32> received_times;
+	{
+		JMutexAutoLock peerlock(m_peers_mutex);
+
+		while(m_reply_queue.size() != 0){
+			ConnectionCommand c = m_reply_queue.pop_front();
+			if(c.type == CONNCMD_ACK){
+				SharedBuffer<u8> reply(4);
+				writeU8(&reply[0], TYPE_CONTROL);
+				writeU8(&reply[1], CONTROLTYPE_ACK);
+				writeU16(&reply[2], c.seqnum);
+				rawSendAsPacket(c.peer_id, c.channelnum, reply, false);
+				received_times.push_back(c.received_time);
+			}else{
+				// Control packets go out as they are, not split
+				sendAsPacket(c.peer_id, c.channelnum, c.data, c.reliable);
+			}
+		}
+	}
+
+	// They go ahead of anything else
+	flush();
+
+	u32 now = porting::getTimeUs();
+	JMutexAutoLock peerlock(m_peers_mutex);
+	for(core::list<u32>::Iterator i = received_times.begin();
+			i != received_times.end(); i++)
+	{
+		u32 us = now - *i;
+		u32 limit = ACK_LATENCY_FIRST_US;
+		u32 bucket = 0;
+		while(bucket < ACK_LATENCY_BUCKETS-1 && us >= limit){
+			bucket++;
+			limit *= 2;
+		}
+		m_ack_latency[bucket]++;
+	}
+}
+
 void Connection::runTimeouts(float dtime)
 {
 	core::list<u16> timeouted_peers;
@@ -924,6 +1105,7 @@ void Connection::runTimeouts(float dtime)
 
 			// Increment reliable packet times
 			channel->outgoing_reliables.incrementTimeouts(dtime);
+			channel->window_lost_timer += dtime;
 
 			// Check reliable packet total times, remove peer if
 			// over timeout.
@@ -944,7 +1126,11 @@ void Connection::runTimeouts(float dtime)
 			timed_outs = channel->
 					outgoing_reliables.getTimedOuts(resend_timeout);
 
-			channel->outgoing_reliables.resetTimedOuts(resend_timeout);
+			if(timed_outs.size() != 0)
+			{
+				channel->reliables_resent += timed_outs.size();
+				channel->windowLost(peer->getRTT());
+			}
 
 			j = timed_outs.begin();
 			for(; j != timed_outs.end(); j++)
@@ -960,6 +1146,9 @@ void Connection::runTimeouts(float dtime)
 						 << "from_peer_id=" << peer_id
 						 << ", channel=" << ((int)channel&0xff)
 						 << ", seqnum=" << seqnum
+						 << ", window=" << peer->channels[i].window
+						 << ", resent=" << peer->channels[i].reliables_resent
+						 << "/" << peer->channels[i].reliables_sent
 						 << std::endl;
 
 				rawSend(*j);
@@ -1039,8 +1228,8 @@ void Connection::connect(Address address)
 
 	// Send a dummy packet to server with peer_id = PEER_ID_INEXISTENT
 	m_peer_id = PEER_ID_INEXISTENT;
-	SharedBuffer<u8> data(0);
-	Send(PEER_ID_SERVER, 0, data, true);
+	PacketBuffer data(0);
+	send(PEER_ID_SERVER, 0, data, true);
 }
 
 void Connection::disconnect()
@@ -1062,7 +1251,7 @@ void Connection::disconnect()
 	}
 }
 
-void Connection::sendToAll(u8 channelnum, SharedBuffer<u8> data, bool reliable)
+void Connection::sendToAll(u8 channelnum, PacketBuffer data, bool reliable)
 {
 	core::map<u16, Peer*>::Iterator j;
 	j = m_peers.getIterator();
@@ -1074,7 +1263,7 @@ void Connection::sendToAll(u8 channelnum, SharedBuffer<u8> data, bool reliable)
 }
 
 void Connection::send(u16 peer_id, u8 channelnum,
-		SharedBuffer<u8> data, bool reliable)
+		PacketBuffer data, bool reliable)
 {
 	dout_con << getDesc() << " sending to peer_id=" << peer_id << std::endl;
 
@@ -1089,22 +1278,42 @@ void Connection::send(u16 peer_id, u8 channelnum,
 	if(reliable)
 		chunksize_max -= RELIABLE_HEADER_SIZE;
 
-	core::list<SharedBuffer<u8> > originals;
-	originals = makeAutoSplitPacket(data, chunksize_max,
-			channel->next_outgoing_split_seqnum);
-
-	core::list<SharedBuffer<u8> >::Iterator i;
-	i = originals.begin();
-	for(; i != originals.end(); i++)
+	/*
+		Like makeAutoSplitPacket(), but the packets are parts of data
+		with their headers kept apart
+	*/
+	if(data.getSize() + ORIGINAL_HEADER_SIZE <= chunksize_max)
 	{
-		SharedBuffer<u8> original = *i;
+		OutgoingPacket packet(peer_id, channelnum, data, reliable);
+		writeU8(&packet.header[0], TYPE_ORIGINAL);
+		packet.header_size = ORIGINAL_HEADER_SIZE;
+		m_outgoing_queue.push_back(packet);
+		return;
+	}
+
+	u16 seqnum = channel->next_outgoing_split_seqnum;
+	channel->next_outgoing_split_seqnum++;
 
-		sendAsPacket(peer_id, channelnum, original, reliable);
+	u32 maximum_data_size = chunksize_max - SPLIT_HEADER_SIZE;
+	u16 chunk_count = (data.getSize() + maximum_data_size - 1) / maximum_data_size;
+	for(u16 chunk_num=0; chunk_num<chunk_count; chunk_num++)
+	{
+		OutgoingPacket packet(peer_id, channelnum, data, reliable);
+		packet.offset = chunk_num * maximum_data_size;
+		packet.size = data.getSize() - packet.offset;
+		if(packet.size > maximum_data_size)
+			packet.size = maximum_data_size;
+		writeU8(&packet.header[0], TYPE_SPLIT);
+		writeU16(&packet.header[1], seqnum);
+		writeU16(&packet.header[3], chunk_count);
+		writeU16(&packet.header[5], chunk_num);
+		packet.header_size = SPLIT_HEADER_SIZE;
+		m_outgoing_queue.push_back(packet);
 	}
 }
 
 void Connection::sendAsPacket(u16 peer_id, u8 channelnum,
-		SharedBuffer<u8> data, bool reliable)
+		PacketBuffer data, bool reliable)
 {
 	OutgoingPacket packet(peer_id, channelnum, data, reliable);
 	m_outgoing_queue.push_back(packet);
@@ -1113,25 +1322,62 @@ void Connection::sendAsPacket(u16 peer_id, u8 channelnum,
 void Connection::rawSendAsPacket(u16 peer_id, u8 channelnum,
 		SharedBuffer<u8> data, bool reliable)
 {
-	Peer *peer = getPeerNoEx(peer_id);
+	OutgoingPacket packet(peer_id, channelnum,
+			PacketBuffer(*data, data.getSize()), reliable);
+	rawSendAsPacket(packet);
+}
+
+void Connection::rawSendAsPacket(OutgoingPacket &packet)
+{
+	Peer *peer = getPeerNoEx(packet.peer_id);
 	if(!peer)
 		return;
-	Channel *channel = &(peer->channels[channelnum]);
+	Channel *channel = &(peer->channels[packet.channelnum]);
 
-	if(reliable)
+	// The base header, the reliable one if it is, then the packet's own
+	u8 header[BASE_HEADER_SIZE + RELIABLE_HEADER_SIZE + SPLIT_HEADER_SIZE];
+	u32 header_size = BASE_HEADER_SIZE;
+	writeU32(&header[0], m_protocol_id);
+	writeU16(&header[4], m_peer_id);
+	writeU8(&header[6], packet.channelnum);
+
+	u16 seqnum = 0;
+	if(packet.reliable)
 	{
-		u16 seqnum = channel->next_outgoing_seqnum;
+		seqnum = channel->next_outgoing_seqnum;
 		channel->next_outgoing_seqnum++;
 
-		SharedBuffer<u8> reliable = makeReliablePacket(data, seqnum);
+		writeU8(&header[header_size], TYPE_RELIABLE);
+		writeU16(&header[header_size+1], seqnum);
+		header_size += RELIABLE_HEADER_SIZE;
+	}
 
-		// Add base headers and make a packet
-		BufferedPacket p = makePacket(peer->address, reliable,
-				m_protocol_id, m_peer_id, channelnum);
+	memcpy(&header[header_size], packet.header, packet.header_size);
+	header_size += packet.header_size;
 
+	BufferedPacket p;
+	p.address = peer->address;
+	if(packet.offset == 0 && packet.size == packet.data.getSize() &&
+			packet.data.unique() && packet.data.getHeadroom() >= header_size)
+	{
+		// Nothing else uses the data, so the headers go right before it
+		memcpy(packet.data.prepend(header_size), header, header_size);
+		p.data = packet.data;
+	}
+	else
+	{
+		p.data = PacketBuffer(header, header_size);
+		p.tail = packet.data;
+		p.tail_offset = packet.offset;
+		p.tail_size = packet.size;
+	}
+
+	if(packet.reliable)
+	{
 		try{
 			// Buffer the packet
 			channel->outgoing_reliables.insert(p);
+			channel->reliables_sent++;
 		}
 		catch(AlreadyExistsException &e)
 		{
@@ -1141,31 +1387,38 @@ void Connection::rawSendAsPacket(u16 peer_id, u8 channelnum,
 					"in outgoing buffer" << std::endl;
 			//assert(0);
 		}
-
-		// Send the packet
-		rawSend(p);
 	}
-	else
-	{
-		// Add base headers and make a packet
-		BufferedPacket p = makePacket(peer->address, data,
-				m_protocol_id, m_peer_id, channelnum);
 
-		// Send the packet
-		rawSend(p);
-	}
+	// Send the packet
+	rawSend(p);
 }
 
 void Connection::rawSend(const BufferedPacket &packet)
 {
 	try{
-		m_socket.Send(packet.address, *packet.data, packet.data.getSize());
+		// The socket only points at them
+		m_flushing.push_back(packet.data);
+		if(packet.tail_size == 0){
+			m_socket.QueueSendParts(packet.address, NULL, 0,
+					*packet.data, packet.data.getSize());
+		}else{
+			m_flushing.push_back(packet.tail);
+			m_socket.QueueSendParts(packet.address,
+					*packet.data, packet.data.getSize(),
+					&packet.tail[packet.tail_offset], packet.tail_size);
+		}
 	} catch(SendFailedException &e){
 		derr_con << "Connection::rawSend(): SendFailedException: "
 				 << packet.address.serializeString() << std::endl;
 	}
 }
 
+void Connection::flush()
+{
+	m_socket.Flush();
+	m_flushing.clear();
+}
+
 Peer* Connection::getPeer(u16 peer_id)
 {
 	core::map<u16, Peer*>::Node *node = m_peers.find(peer_id);
@@ -1316,6 +1569,9 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 				// (avg_rtt and resend_timeout)
 				Peer *peer = getPeer(peer_id);
 				peer->reportRTT(rtt);
+				channel->windowAcked();
+				// Room for more in the window
+				m_send_wake.Post();
 
 				//PrintInfo(dout_con);
 				//dout_con<<"RTT = "<<rtt<<std::endl;
@@ -1436,6 +1692,11 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 		bool is_future_packet = seqnum_higher(seqnum, channel->next_incoming_seqnum);
 		bool is_old_packet = seqnum_higher(channel->next_incoming_seqnum, seqnum);
 
+		// Not ACKed, so it's sent again once there's room for it
+		if(is_future_packet && (u16)(seqnum - channel->next_incoming_seqnum)
+				>= RELIABLE_BUFFER_SIZE)
+			throw InvalidIncomingDataException("Reliable packet too far ahead");
+
 		PrintInfo();
 		if(is_future_packet)
 			dout_con << "BUFFERING";
@@ -1452,12 +1713,11 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 		//DEBUG
 		//assert(channel->incoming_reliables.size() < 100);
 
-		// Send a CONTROLTYPE_ACK
-		SharedBuffer<u8> reply(4);
-		writeU8(&reply[0], TYPE_CONTROL);
-		writeU8(&reply[1], CONTROLTYPE_ACK);
-		writeU16(&reply[2], seqnum);
-		rawSendAsPacket(peer_id, channelnum, reply, false);
+		// Have the send thread send a CONTROLTYPE_ACK
+		ConnectionCommand c;
+		c.ack(peer_id, channelnum, seqnum, m_receive_time);
+		m_reply_queue.push_back(c);
+		m_send_wake.Post();
 
 		//if(seqnum_higher(seqnum, channel->next_incoming_seqnum))
 		if(is_future_packet)
@@ -1560,7 +1820,9 @@ ConnectionEvent Connection::waitEvent(u32 timeout_ms)
 
 void Connection::putCommand(ConnectionCommand &c)
 {
+	JMutexAutoLock lock(m_command_mutex);
 	m_command_queue.push_back(c);
+	m_send_wake.Post();
 }
 
 void Connection::Serve(unsigned short port)
@@ -1631,6 +1893,17 @@ u32 Connection::Receive(u16 &peer_id, SharedBuffer<u8> &data)
 }
 
 void Connection::SendToAll(u8 channelnum, SharedBuffer<u8> data, bool reliable)
+{
+	SendToAll(channelnum, PacketBuffer(*data, data.getSize()), reliable);
+}
+
+void Connection::Send(u16 peer_id, u8 channelnum,
+		SharedBuffer<u8> data, bool reliable)
+{
+	Send(peer_id, channelnum, PacketBuffer(*data, data.getSize()), reliable);
+}
+
+void Connection::SendToAll(u8 channelnum, PacketBuffer data, bool reliable)
 {
 	assert(channelnum < CHANNEL_COUNT);
 
@@ -1640,7 +1913,7 @@ void Connection::SendToAll(u8 channelnum, SharedBuffer<u8> data, bool reliable)
 }
 
 void Connection::Send(u16 peer_id, u8 channelnum,
-		SharedBuffer<u8> data, bool reliable)
+		PacketBuffer data, bool reliable)
 {
 	assert(channelnum < CHANNEL_COUNT);
 
@@ -1673,9 +1946,36 @@ void Connection::DeletePeer(u16 peer_id)
 	putCommand(c);
 }
 
+void Connection::getAckLatency(u32 counts[ACK_LATENCY_BUCKETS])
+{
+	JMutexAutoLock peerlock(m_peers_mutex);
+	for(u32 i=0; i<ACK_LATENCY_BUCKETS; i++)
+		counts[i] = m_ack_latency[i];
+}
+
+void Connection::printAckLatency(std::ostream &out)
+{
+	u32 counts[ACK_LATENCY_BUCKETS];
+	getAckLatency(counts);
+
+	out<<"ACK turnaround:";
+	u32 limit = ACK_LATENCY_FIRST_US;
+	for(u32 i=0; i<ACK_LATENCY_BUCKETS; i++){
+		if(i == ACK_LATENCY_BUCKETS-1)
+			out<<" rest="<<counts[i];
+		else
+			out<<" <"<<limit<<"us="<<counts[i];
+		limit *= 2;
+	}
+	out<<std::endl;
+}
+
 void Connection::PrintInfo(std::ostream &out)
 {
-	out<<getDesc()<<": ";
+	char buf[64];
+	snprintf(buf, 64, "%.1f/%.1f", m_socket.getReceivedPerCall(),
+			m_socket.getSentPerCall());
+	out<<getDesc()<<" ("<<buf<<" packets per recv/send call): ";
 }
 
 void Connection::PrintInfo()
@@ -28,10 +28,12 @@
 
 #include <iostream>
 #include <fstream>
+#include <vector>
 #include "debug.h"
 #include "common_irrlicht.h"
 #include "socket.h"
 #include "utility.h"
+#include "packetbuffer.h"
 #include "exceptions.h"
 #include "constants.h"
 
@@ -120,18 +122,31 @@ inline bool seqnum_higher(u16 higher, u16 lower)
 	if(lower > higher && lower - higher > SEQNUM_MAX/2){
 		return true;
 	}
+	if(higher > lower && higher - lower > SEQNUM_MAX/2){
+		return false;
+	}
 	return (higher > lower);
 }
 
 struct BufferedPacket
 {
+	BufferedPacket():
+		tail_offset(0), tail_size(0), time(0.0), totaltime(0.0)
+	{}
 	BufferedPacket(u8 *a_data, u32 a_size):
-		data(a_data, a_size), time(0.0), totaltime(0.0)
+		data(a_data, a_size), tail_offset(0), tail_size(0),
+		time(0.0), totaltime(0.0)
 	{}
 	BufferedPacket(u32 a_size):
-		data(a_size), time(0.0), totaltime(0.0)
+		data(a_size), tail_offset(0), tail_size(0),
+		time(0.0), totaltime(0.0)
 	{}
-	SharedBuffer<u8> data; // Data of the packet, including headers
+	PacketBuffer data; // Data of the packet, including headers
+	// Outgoing packets can have the rest of their data in a part of a
+	// bigger buffer, sent after data without copying it
+	PacketBuffer tail;
+	u32 tail_offset;
+	u32 tail_size;
 	float time; // Seconds from buffering the packet or re-sending
 	float totaltime; // Seconds from buffering the packet
 	Address address; // Sender or destination
@@ -256,6 +271,7 @@ checking at all.
 * [5] u16 chunk_num
 */
 #define TYPE_SPLIT 2
+#define SPLIT_HEADER_SIZE 7
 /*
 * RELIABLE: Delivery of all RELIABLE packets shall be forced by ACKs,
 * and they shall be delivered in the same order as sent. This is done
@@ -274,32 +290,65 @@ checking at all.
 #define SEQNUM_INITIAL 65500
 
 /*
-	A buffer which stores reliable packets and sorts them internally
-	for fast access to the smallest one.
+	A buffer which stores reliable packets by seqnum, in a ring indexed
+	with seqnum % RELIABLE_BUFFER_SIZE. The seqnums in it can't be
+	RELIABLE_BUFFER_SIZE or more apart; for outgoing packets the
+	congestion window keeps them closer than that.
+
+	The packets are also kept in the order they were last sent in, so
+	the ones to re-send are found at the front without looking at the
+	rest.
 */
 
-typedef core::list<BufferedPacket>::Iterator RPBSearchResult;
+// Has to divide SEQNUM_MAX+1 and be more than CONGESTION_WINDOW_MAX
+#define RELIABLE_BUFFER_SIZE 1024
 
 class ReliablePacketBuffer
 {
 public:
+	ReliablePacketBuffer();
+	~ReliablePacketBuffer();
 
 	void print();
 	bool empty();
 	u32 size();
-	RPBSearchResult findPacket(u16 seqnum);
-	RPBSearchResult notFound();
+	// Whether a packet with this seqnum can be buffered with the others
+	bool fits(u16 seqnum);
 	u16 getFirstSeqnum();
 	BufferedPacket popFirst();
 	BufferedPacket popSeqnum(u16 seqnum);
 	void insert(BufferedPacket &p);
 	void incrementTimeouts(float dtime);
-	void resetTimedOuts(float timeout);
 	bool anyTotaltimeReached(float timeout);
+	// Packets last sent timeout seconds ago or more, which are then
+	// timed from now as they're about to be sent again
 	core::list<BufferedPacket> getTimedOuts(float timeout);
 
 private:
-	core::list<BufferedPacket> m_list;
+	struct Slot
+	{
+		BufferedPacket *packet;
+		// When it was last sent and when it was buffered, in m_time
+		double sent;
+		double buffered;
+		// Next and previous in sending order, -1 for none
+		s16 prev;
+		s16 next;
+	};
+
+	BufferedPacket take(u16 seqnum);
+	void link(s16 i);
+	void unlink(s16 i);
+
+	std::vector<Slot> m_slots;
+	u32 m_size;
+	u16 m_first;
+	u16 m_last;
+	// Seconds counted by incrementTimeouts()
+	double m_time;
+	// First and last in sending order
+	s16 m_head;
+	s16 m_tail;
 };
 
 /*
@@ -342,6 +391,25 @@ struct Channel
 	ReliablePacketBuffer outgoing_reliables;
 
 	IncomingSplitBuffer incoming_splits;
+
+	/*
+		Congestion control. Each ACK grows the window by one packet
+		until it reaches slow_start_threshold, after that by one packet
+		for each round trip. Losing packets halves it, at most once a
+		round trip.
+	*/
+	void windowAcked();
+	void windowLost(float rtt);
+
+	// Reliable packets that can be waiting for an ACK
+	float window;
+	float slow_start_threshold;
+	// Seconds since the window was last halved
+	float window_lost_timer;
+
+	// Reliable packets sent and re-sent
+	u32 reliables_sent;
+	u32 reliables_resent;
 };
 
 class Peer;
@@ -382,6 +450,20 @@ public:
 	*/
 	void reportRTT(float rtt);
 
+	/*
+		Works out m_max_packets_per_second from the channel windows,
+		so a window can be sent about twice each round trip.
+	*/
+	void updateSendRate();
+
+	// avg_rtt, or RTT_DEFAULT until it has been measured
+	float getRTT()
+	{
+		if(avg_rtt < 0.0)
+			return RTT_DEFAULT;
+		return avg_rtt;
+	}
+
 	Channel channels[CHANNEL_COUNT];
 
 	// Address of the peer
@@ -412,19 +494,30 @@ private:
 	Connection
 */
 
+/*
+	A part of the data, sent after a TYPE_ORIGINAL or TYPE_SPLIT header
+	or none, so data split in packets isn't copied
+*/
 struct OutgoingPacket
 {
 	u16 peer_id;
 	u8 channelnum;
-	SharedBuffer<u8> data;
+	PacketBuffer data;
+	u32 offset;
+	u32 size;
 	bool reliable;
+	u8 header[SPLIT_HEADER_SIZE];
+	u8 header_size;
 
-	OutgoingPacket(u16 peer_id_, u8 channelnum_, SharedBuffer<u8> data_,
+	OutgoingPacket(u16 peer_id_, u8 channelnum_, PacketBuffer data_,
 			bool reliable_):
 		peer_id(peer_id_),
 		channelnum(channelnum_),
 		data(data_),
-		reliable(reliable_)
+		offset(0),
+		size(data_.getSize()),
+		reliable(reliable_),
+		header_size(0)
 	{
 	}
 };
@@ -490,6 +583,7 @@ enum ConnectionCommandType{
 	CONNCMD_SEND,
 	CONNCMD_SEND_TO_ALL,
 	CONNCMD_DELETE_PEER,
+	CONNCMD_ACK,
 };
 
 struct ConnectionCommand
@@ -499,8 +593,11 @@ struct ConnectionCommand
 	Address address;
 	u16 peer_id;
 	u8 channelnum;
-	Buffer<u8> data;
+	PacketBuffer data;
 	bool reliable;
+	u16 seqnum;
+	// porting::getTimeUs() when the acked packet came
+	u32 received_time;
 
 	ConnectionCommand(): type(CONNCMD_NONE) {}
 
@@ -519,7 +616,7 @@ struct ConnectionCommand
 		type = CONNCMD_DISCONNECT;
 	}
 	void send(u16 peer_id_, u8 channelnum_,
-			SharedBuffer<u8> data_, bool reliable_)
+			PacketBuffer data_, bool reliable_)
 	{
 		type = CONNCMD_SEND;
 		peer_id = peer_id_;
@@ -527,7 +624,7 @@ struct ConnectionCommand
 		data = data_;
 		reliable = reliable_;
 	}
-	void sendToAll(u8 channelnum_, SharedBuffer<u8> data_, bool reliable_)
+	void sendToAll(u8 channelnum_, PacketBuffer data_, bool reliable_)
 	{
 		type = CONNCMD_SEND_TO_ALL;
 		channelnum = channelnum_;
@@ -539,8 +636,49 @@ struct ConnectionCommand
 		type = CONNCMD_DELETE_PEER;
 		peer_id = peer_id_;
 	}
+	void ack(u16 peer_id_, u8 channelnum_, u16 seqnum_, u32 received_time_)
+	{
+		type = CONNCMD_ACK;
+		peer_id = peer_id_;
+		channelnum = channelnum_;
+		seqnum = seqnum_;
+		received_time = received_time_;
+	}
 };
 
+// Ack turnaround times are counted in buckets, the first up to 125us
+// and each one after it twice as long, the last one has the rest
+#define ACK_LATENCY_BUCKETS 12
+#define ACK_LATENCY_FIRST_US 125
+
+class Connection;
+
+class ConnectionReceiveThread : public SimpleThread
+{
+	Connection *m_con;
+
+public:
+
+	ConnectionReceiveThread(Connection *con):
+		SimpleThread(),
+		m_con(con)
+	{
+	}
+
+	void * Thread();
+};
+
+/*
+	Connection runs two threads. The receive thread waits for packets,
+	processes them, makes the events and asks for ACKs to be sent. The
+	send thread (Thread()) sends the ACKs first, then does the commands,
+	the timeouts and the outgoing queue, so neither a burst of incoming
+	packets nor a lot to send holds up the other.
+
+	The queues between the threads and the user of the interface don't
+	lock. Both threads lock m_peers_mutex to use the peers, and only push
+	events with it locked, so they take turns as the one pushing events.
+*/
 class Connection: public SimpleThread
 {
 public:
@@ -564,28 +702,40 @@ public:
 	u32 Receive(u16 &peer_id, SharedBuffer<u8> &data);
 	void SendToAll(u8 channelnum, SharedBuffer<u8> data, bool reliable);
 	void Send(u16 peer_id, u8 channelnum, SharedBuffer<u8> data, bool reliable);
+	// The data isn't copied, nothing may write to it after this
+	void SendToAll(u8 channelnum, PacketBuffer data, bool reliable);
+	void Send(u16 peer_id, u8 channelnum, PacketBuffer data, bool reliable);
 	void RunTimeouts(float dtime); // dummy
 	u16 GetPeerID(){ return m_peer_id; }
 	Address GetPeerAddress(u16 peer_id);
 	float GetPeerAvgRTT(u16 peer_id);
 	void DeletePeer(u16 peer_id);
 
+	// Counts of ACKs sent after each turnaround time bucket
+	void getAckLatency(u32 counts[ACK_LATENCY_BUCKETS]);
+	void printAckLatency(std::ostream &out);
+
 private:
+	friend class ConnectionReceiveThread;
+
 	void putEvent(ConnectionEvent &e);
 	void processCommand(ConnectionCommand &c);
 	void send(float dtime);
 	void receive();
+	void sendAcks();
 	void runTimeouts(float dtime);
 	void serve(u16 port);
 	void connect(Address address);
 	void disconnect();
-	void sendToAll(u8 channelnum, SharedBuffer<u8> data, bool reliable);
-	void send(u16 peer_id, u8 channelnum, SharedBuffer<u8> data, bool reliable);
+	void sendToAll(u8 channelnum, PacketBuffer data, bool reliable);
+	void send(u16 peer_id, u8 channelnum, PacketBuffer data, bool reliable);
 	void sendAsPacket(u16 peer_id, u8 channelnum,
-			SharedBuffer<u8> data, bool reliable);
+			PacketBuffer data, bool reliable);
 	void rawSendAsPacket(u16 peer_id, u8 channelnum,
 			SharedBuffer<u8> data, bool reliable);
+	void rawSendAsPacket(OutgoingPacket &packet);
 	void rawSend(const BufferedPacket &packet);
+	void flush();
 	Peer* getPeer(u16 peer_id);
 	Peer* getPeerNoEx(u16 peer_id);
 	core::list<Peer*> getPeers();
@@ -609,12 +759,27 @@ private:
 	bool deletePeer(u16 peer_id, bool timeout);
 
 	Queue<OutgoingPacket> m_outgoing_queue;
-	MutexedQueue<ConnectionEvent> m_event_queue;
-	MutexedQueue<ConnectionCommand> m_command_queue;
+	SPSCQueue<ConnectionEvent> m_event_queue;
+	SPSCQueue<ConnectionCommand> m_command_queue;
+	// Threads using the interface take turns putting commands
+	JMutex m_command_mutex;
+	// ACKs and replies from the receive thread to the send thread
+	SPSCQueue<ConnectionCommand> m_reply_queue;
+	// Posted when there's something new for the send thread
+	JSemaphore m_send_wake;
+
+	ConnectionReceiveThread m_receive_thread;
+
+	// Only changed with m_peers_mutex locked
+	u32 m_ack_latency[ACK_LATENCY_BUCKETS];
+	// When the packet being processed came, for the receive thread
+	u32 m_receive_time;
 
 	u32 m_protocol_id;
 	u32 m_max_packet_size;
 	float m_timeout;
+	// What the socket has been given to send, kept until it's flushed
+	std::vector<PacketBuffer> m_flushing;
 	UDPSocket m_socket;
 	u16 m_peer_id;
 
@@ -42,11 +42,22 @@
 #define INTERNET_SIMULATOR 0
 
 #define CONNECTION_TIMEOUT 30
+// How long the connection send thread waits for something to send
+// before running the timeouts anyway, in milliseconds
+#define CONNECTION_SEND_IDLE_MS 10
 
 #define RESEND_TIMEOUT_MIN 0.333
 #define RESEND_TIMEOUT_MAX 3.0
 // resend_timeout = avg_rtt * this
 #define RESEND_TIMEOUT_FACTOR 4
+// Round trip time assumed until there's an ACK to measure it
+#define RTT_DEFAULT 0.1
+
+// How many reliable packets a channel may have waiting for an ACK, the
+// window grows while ACKs come and halves when packets are lost
+#define CONGESTION_WINDOW_INITIAL 5
+#define CONGESTION_WINDOW_MIN 2
+#define CONGESTION_WINDOW_MAX 512
 
 #define PI 3.14159
 
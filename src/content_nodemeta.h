@@ -31,6 +31,7 @@
 
 class ServerEnvironment;
 class Inventory;
+class InventoryList;
 
 class SignNodeMetadata : public NodeMetadata
 {
@@ -427,11 +428,14 @@ public:
 	virtual Inventory* getInventory() {return m_inventory;}
 	virtual void inventoryModified();
 	virtual bool step(float dtime, v3s16 pos, ServerEnvironment *env);
+	virtual bool fastForward(float dtime, v3s16 pos, ServerEnvironment *env);
 	virtual bool nodeRemovalDisabled();
 	virtual std::string getDrawSpecString(Player *player);
 	virtual std::vector<NodeBox> getNodeBoxes(MapNode &n);
 
 private:
+	bool burnFuel(InventoryList *fuel_list);
+
 	Inventory *m_inventory;
 	float m_active_timer;
 	float m_burn_counter;
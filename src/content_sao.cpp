@@ -104,7 +104,9 @@ MobSAO::MobSAO(ServerEnvironment *env, u16 id, v3f pos, content_t type):
 	m_shooting(false),
 	m_shooting_timer(0),
 	m_shoot_y(0),
-	m_last_sound(0)
+	m_last_sound(0),
+	m_ai_tier(MOB_AI_FULL),
+	m_ai_dtime(0)
 {
 	ServerActiveObject::registerType(getType(), create);
 	if ((type&CONTENT_MOB_MASK) == CONTENT_MOB_MASK) {
@@ -136,7 +138,9 @@ MobSAO::MobSAO(ServerEnvironment *env, u16 id, v3f pos, v3f speed, content_t typ
 	m_shooting(false),
 	m_shooting_timer(0),
 	m_shoot_y(0),
-	m_last_sound(0)
+	m_last_sound(0),
+	m_ai_tier(MOB_AI_FULL),
+	m_ai_dtime(0)
 {
 	ServerActiveObject::registerType(getType(), create);
 	if ((type&CONTENT_MOB_MASK) == CONTENT_MOB_MASK) {
@@ -207,6 +211,12 @@ std::string MobSAO::getClientInitializationData()
 	writeU8(os,(u8)m_shooting);
 	return os.str();
 }
+void MobSAO::deferStep(float dtime)
+{
+	m_ai_dtime += dtime;
+	if (m_ai_dtime > MOB_AI_MAX_DTIME)
+		m_ai_dtime = MOB_AI_MAX_DTIME;
+}
 void MobSAO::step(float dtime, bool send_recommended)
 {
 	const MobFeatures& m = content_mob_features(m_content);
@@ -219,6 +229,9 @@ void MobSAO::step(float dtime, bool send_recommended)
 	bool notices_player = false;
 	bool following = false;
 
+	deferStep(dtime);
+	m_ai_tier = MOB_AI_FULL;
+
 	/* don't do anything if there's no nearby player */
 	if (m_disturbing_player == "") {
 		float distance = 40*BS;
@@ -235,19 +248,35 @@ void MobSAO::step(float dtime, bool send_recommended)
 				distance = dist;
 		}
 		array_free(players,1);
-		if (distance > 32*BS) {
+		if (distance > MOB_AI_FROZEN_DISTANCE) {
 			/* kill of anything that shouldn't be on its own */
 			if (
 				m.level == MOB_AGGRESSIVE
 				|| (m.motion == MM_THROWN || m.motion == MM_CONSTANT || m.motion == MM_STATIC)
 			)
 				m_removed = true;
+			m_ai_tier = MOB_AI_FROZEN;
+			m_ai_dtime = 0;
 			return;
 		}
-		if (distance > 16*BS && myrand_range(0,10) != 0)
-			dont_move = true;
+		if (distance > MOB_AI_REDUCED_DISTANCE) {
+			/* projectiles still need to fly smoothly */
+			if (m.motion != MM_THROWN && m.motion != MM_CONSTANT) {
+				m_ai_tier = MOB_AI_REDUCED;
+				if (m_ai_dtime < MOB_AI_REDUCED_INTERVAL) {
+					if (send_recommended && m_base_position.getDistanceFrom(m_last_sent_position) > 0.5*BS)
+						sendPosition();
+					return;
+				}
+			}
+			if (myrand_range(0,10) != 0)
+				dont_move = true;
+		}
 	}
 
+	dtime = m_ai_dtime;
+	m_ai_dtime = 0;
+
 	if (m.follow_item != CONTENT_IGNORE || m.motion == MM_SEEKER || m.angry_motion == MM_SEEKER || m.angry_motion == MM_FLEE)
 		notices_player = true;
 
@@ -738,6 +767,10 @@ void MobSAO::stepMotionSeeker(float dtime, float offset)
 			}
 		}
 
+		/* Go the way the other mobs after this player go */
+		if (m_walk_around && !m_next_pos_exists && distance >= min)
+			followField(floatToInt(player_pos,BS),true);
+
 		if (m_walk_around && !m_next_pos_exists) {
 			/* Find some position where to go next */
 			v3s16 dps[3*3*3];
@@ -926,6 +959,9 @@ void MobSAO::stepMotionFlee(float dtime)
 			}
 		}
 
+		if (m_walk_around && !m_next_pos_exists)
+			followField(floatToInt(player_pos,BS),false);
+
 		if (m_walk_around && !m_next_pos_exists) {
 			/* Find some position where to go next */
 			v3s16 dps[3*3*3];
@@ -1257,49 +1293,60 @@ void MobSAO::stepMotionConstant(float dtime)
 		return;
 	}
 }
-bool MobSAO::checkFreePosition(v3s16 p0)
+/*
+	Sets the next position to a neighbour that is closer to (or further
+	from) target by the shared flow field, returns false if there is none
+*/
+bool MobSAO::followField(v3s16 target, bool closer)
 {
-	assert(m_env);
-	Map *map = &m_env->getMap();
+	Pathfinder *pathfinder = m_env->getPathfinder();
 	v3s16 size = content_mob_features(m_content).getSizeBlocks();
-	if (content_mob_features(m_content).motion_type == MMT_SWIM) {
-		for (int dx=0; dx<size.X; dx++)
-		for (int dy=0; dy<size.Y; dy++)
-		for (int dz=0; dz<size.Z; dz++) {
-			v3s16 dp(dx, dy, dz);
-			v3s16 p = p0 + dp;
-			MapNode n = map->getNodeNoEx(p);
-			if (n.getContent() != CONTENT_WATERSOURCE)
-				return false;
-		}
-	}else{
-		for (int dx=0; dx<size.X; dx++)
-		for (int dy=0; dy<size.Y; dy++)
-		for (int dz=0; dz<size.Z; dz++) {
-			v3s16 dp(dx, dy, dz);
-			v3s16 p = p0 + dp;
-			MapNode n = map->getNodeNoEx(p);
-			if (n.getContent() != CONTENT_AIR && content_features(n).walkable)
-				return false;
-			if (content_features(n).liquid_type == LIQUID_SOURCE)
-				return false;
+	v3s16 pos_i = floatToInt(m_base_position, BS);
+	s32 here = pathfinder->getDistance(target,size,pos_i);
+	if (here < 0)
+		return false;
+
+	v3s16 dps[3*3*3];
+	int num_dps = 0;
+	for (int dx=-1; dx<=1; dx++)
+	for (int dy=-1; dy<=1; dy++)
+	for (int dz=-1; dz<=1; dz++) {
+		if (dx == 0 && dz == 0)
+			continue;
+		if (dx != 0 && dz != 0 && dy != 0)
+			continue;
+		dps[num_dps++] = v3s16(dx,dy,dz);
+	}
+	u32 order[3*3*3];
+	get_random_u32_array(order, num_dps);
+
+	s32 best = here;
+	for (int i=0; i<num_dps; i++) {
+		v3s16 p = dps[order[i]] + pos_i;
+		s32 d = pathfinder->getDistance(target,size,p);
+		if (d < 0)
+			continue;
+		if (closer ? d < best : d > best) {
+			best = d;
+			m_next_pos_i = p;
 		}
 	}
-	MapNode n = map->getNodeNoEx(p0+v3s16(0,-1,0));
-	if (!content_features(n).jumpable)
+	if (best == here)
 		return false;
+
+	m_next_pos_exists = true;
 	return true;
 }
+bool MobSAO::checkFreePosition(v3s16 p0)
+{
+	assert(m_env);
+	const MobFeatures& m = content_mob_features(m_content);
+	return m_env->getPathfinder()->isFree(p0,m.getSizeBlocks(),m.motion_type == MMT_SWIM);
+}
 bool MobSAO::checkWalkablePosition(v3s16 p0)
 {
 	assert(m_env);
-	v3s16 p = p0 + v3s16(0,-1,0);
-	MapNode n = m_env->getMap().getNodeNoEx(p);
-	if (n.getContent() != CONTENT_AIR) {
-		if (content_features(n).liquid_type == LIQUID_NONE && content_features(n).walkable)
-			return true;
-	}
-	return false;
+	return m_env->getPathfinder()->isWalkable(p0);
 }
 bool MobSAO::checkFreeAndWalkablePosition(v3s16 p0)
 {
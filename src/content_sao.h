@@ -31,6 +31,27 @@
 #include "content_object.h"
 #include "content_mob.h"
 
+/*
+	How much of its AI a mob ran in its last step, by how far it is
+	from the nearest player
+*/
+enum MobAITier
+{
+	MOB_AI_FULL = 0,
+	MOB_AI_REDUCED,
+	MOB_AI_FROZEN,
+	MOB_AI_TIERS
+};
+
+// Mobs further away than these from any player have reduced or no AI
+#define MOB_AI_REDUCED_DISTANCE (16*BS)
+#define MOB_AI_FROZEN_DISTANCE (32*BS)
+// How often mobs with reduced AI are stepped
+#define MOB_AI_REDUCED_INTERVAL 0.5
+// Most time a mob's step is put off for, any more is dropped so the mob
+// doesn't jump through walls when it's stepped
+#define MOB_AI_MAX_DTIME 1.0
+
 class MobSAO : public ServerActiveObject
 {
 public:
@@ -44,6 +65,11 @@ public:
 	std::string getStaticData();
 	std::string getClientInitializationData();
 	void step(float dtime, bool send_recommended);
+	// Puts the step off, it is taken with the next one
+	void deferStep(float dtime);
+	// Time put off that the next step will take
+	float getDeferredTime() {return m_ai_dtime;}
+	MobAITier getAITier() {return m_ai_tier;}
 	InventoryItem* createPickedUpItem(content_t punch_item);
 	u16 punch(content_t punch_item, v3f dir, const std::string &playername);
 	bool rightClick(Player *player);
@@ -68,6 +94,7 @@ private:
 	void stepMotionThrown(float dtime);
 	void stepMotionConstant(float dtime);
 
+	bool followField(v3s16 target, bool closer);
 	bool checkFreePosition(v3s16 p0);
 	bool checkWalkablePosition(v3s16 p0);
 	bool checkFreeAndWalkablePosition(v3s16 p0);
@@ -99,6 +126,9 @@ private:
 	float m_shooting_timer;
 	float m_shoot_y;
 	float m_last_sound;
+
+	MobAITier m_ai_tier;
+	float m_ai_dtime;
 };
 
 #endif
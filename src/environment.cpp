@@ -44,6 +44,8 @@
 #include "nvp.h"
 #include "path.h"
 
+#include <algorithm>
+
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
 Environment::Environment():
@@ -248,61 +250,182 @@ float Environment::stepTimeOfDay(float dtime)
 	ActiveBlockList
 */
 
-void fillRadiusBlock(v3s16 p0, s16 r, std::set<v3s16> &list)
+static bool inRadiusBlock(v3s16 p, v3s16 p0, s16 r)
+{
+	return (
+		p.X >= p0.X-r && p.X <= p0.X+r
+		&& p.Y >= p0.Y-r && p.Y <= p0.Y+r
+		&& p.Z >= p0.Z-r && p.Z <= p0.Z+r
+	);
+}
+
+void ActiveBlockList::addRadius(v3s16 p0, s16 r, const v3s16 *except, std::set<v3s16> &blocks_added)
+{
+	v3s16 p;
+	for(p.X=p0.X-r; p.X<=p0.X+r; p.X++)
+	for(p.Y=p0.Y-r; p.Y<=p0.Y+r; p.Y++)
+	for(p.Z=p0.Z-r; p.Z<=p0.Z+r; p.Z++)
+	{
+		if (except && inRadiusBlock(p,*except,r))
+			continue;
+		u16 &count = m_list[p];
+		if (count++ == 0) {
+			blocks_added.insert(p);
+		}
+	}
+}
+
+void ActiveBlockList::removeRadius(v3s16 p0, s16 r, const v3s16 *except, std::set<v3s16> &blocks_removed)
 {
 	v3s16 p;
 	for(p.X=p0.X-r; p.X<=p0.X+r; p.X++)
 	for(p.Y=p0.Y-r; p.Y<=p0.Y+r; p.Y++)
 	for(p.Z=p0.Z-r; p.Z<=p0.Z+r; p.Z++)
 	{
-		// Set in list
-		list.insert(p);
+		if (except && inRadiusBlock(p,*except,r))
+			continue;
+		std::map<v3s16,u16>::iterator i = m_list.find(p);
+		if (i == m_list.end())
+			continue;
+		if (--i->second == 0) {
+			m_list.erase(i);
+			blocks_removed.insert(p);
+		}
 	}
 }
 
-void ActiveBlockList::update(std::list<v3s16> &active_positions,
+/*
+	Each block counts how many of the players' areas it is in. Only the
+	players that moved to another block are looked at, and of their areas
+	only where the old and the new one don't overlap.
+*/
+void ActiveBlockList::update(std::map<u16,v3s16> &active_positions,
 		s16 radius,
 		std::set<v3s16> &blocks_removed,
 		std::set<v3s16> &blocks_added)
 {
+	// With a new radius every area changes
+	bool all = (radius != m_radius);
+
 	/*
-		Create the new list
+		Add the new areas before taking away the old ones, so blocks
+		that stay active are never counted as removed
 	*/
-	std::set<v3s16> newlist;
-	for (std::list<v3s16>::iterator i = active_positions.begin(); i != active_positions.end(); i++) {
-		fillRadiusBlock(*i, radius, newlist);
+	for (std::map<u16,v3s16>::iterator i = active_positions.begin(); i != active_positions.end(); i++) {
+		std::map<u16,v3s16>::iterator o = m_positions.find(i->first);
+		if (all || o == m_positions.end()) {
+			addRadius(i->second, radius, NULL, blocks_added);
+		}else if (o->second != i->second) {
+			addRadius(i->second, radius, &o->second, blocks_added);
+		}
 	}
 
-	/*
-		Find out which blocks on the old list are not on the new list
-	*/
-	// Go through old list
-	for (std::set<v3s16>::iterator i = m_list.begin(); i != m_list.end(); i++) {
-		v3s16 p = *i;
-		// If not on new list, it's been removed
-		if (newlist.find(p) == newlist.end())
-			blocks_removed.insert(p);
+	for (std::map<u16,v3s16>::iterator o = m_positions.begin(); o != m_positions.end(); o++) {
+		std::map<u16,v3s16>::iterator i = active_positions.find(o->first);
+		if (all || i == active_positions.end()) {
+			removeRadius(o->second, m_radius, NULL, blocks_removed);
+		}else if (o->second != i->second) {
+			removeRadius(o->second, m_radius, &i->second, blocks_removed);
+		}
 	}
 
-	/*
-		Find out which blocks on the new list are not on the old list
-	*/
-	// Go through new list
-	for (std::set<v3s16>::iterator i = newlist.begin(); i != newlist.end(); i++) {
-		v3s16 p = *i;
-		// If not on old list, it's been added
-		if (m_list.find(p) == m_list.end())
-			blocks_added.insert(p);
+	m_positions = active_positions;
+	m_radius = radius;
+}
+
+/*
+	ActiveObjectIndex
+*/
+
+static v3s16 active_object_block(v3f pos)
+{
+	return getNodeBlockPos(floatToInt(pos, BS));
+}
+
+void ActiveObjectIndex::add(u16 id, v3f pos)
+{
+	v3s16 bp = active_object_block(pos);
+	m_objects[id] = bp;
+	m_blocks[bp].insert(id);
+}
+
+void ActiveObjectIndex::remove(u16 id)
+{
+	std::map<u16, v3s16>::iterator i = m_objects.find(id);
+	if (i == m_objects.end())
+		return;
+
+	std::map<v3s16, std::set<u16> >::iterator b = m_blocks.find(i->second);
+	if (b != m_blocks.end()) {
+		b->second.erase(id);
+		if (b->second.empty())
+			m_blocks.erase(b);
 	}
+	m_objects.erase(i);
+}
 
-	/*
-		Update m_list
-	*/
-	m_list.clear();
-	for (std::set<v3s16>::iterator i = newlist.begin(); i != newlist.end(); i++) {
-		v3s16 p = *i;
-		m_list.insert(p);
+void ActiveObjectIndex::update(u16 id, v3f pos)
+{
+	std::map<u16, v3s16>::iterator i = m_objects.find(id);
+	if (i != m_objects.end() && i->second == active_object_block(pos))
+		return;
+
+	remove(id);
+	add(id, pos);
+}
+
+void ActiveObjectIndex::find(v3f pos, f32 radius, std::vector<u16> &ids)
+{
+	// One more block all round for objects that moved since their update
+	v3s16 min = active_object_block(pos - v3f(radius,radius,radius)) - v3s16(1,1,1);
+	v3s16 max = active_object_block(pos + v3f(radius,radius,radius)) + v3s16(1,1,1);
+	u32 start = ids.size();
+
+	u32 volume = (u32)(max.X-min.X+1)*(max.Y-min.Y+1)*(max.Z-min.Z+1);
+	if (volume > m_blocks.size()) {
+		// Fewer blocks have objects in than are in range
+		for (std::map<v3s16, std::set<u16> >::iterator b = m_blocks.begin(); b != m_blocks.end(); b++) {
+			v3s16 bp = b->first;
+			if (
+				bp.X < min.X || bp.X > max.X
+				|| bp.Y < min.Y || bp.Y > max.Y
+				|| bp.Z < min.Z || bp.Z > max.Z
+			)
+				continue;
+			ids.insert(ids.end(), b->second.begin(), b->second.end());
+		}
+	}else{
+		v3s16 bp;
+		for (bp.X=min.X; bp.X<=max.X; bp.X++)
+		for (bp.Y=min.Y; bp.Y<=max.Y; bp.Y++)
+		for (bp.Z=min.Z; bp.Z<=max.Z; bp.Z++) {
+			std::map<v3s16, std::set<u16> >::iterator b = m_blocks.find(bp);
+			if (b == m_blocks.end())
+				continue;
+			ids.insert(ids.end(), b->second.begin(), b->second.end());
+		}
 	}
+
+	std::sort(ids.begin()+start, ids.end());
+}
+
+void active_object_step_order(std::map<u16, ServerActiveObject*> &objects, u16 next, std::vector<ServerActiveObject*> &order)
+{
+	order.reserve(order.size()+objects.size());
+	std::map<u16, ServerActiveObject*>::iterator start = objects.lower_bound(next);
+	for (std::map<u16, ServerActiveObject*>::iterator i = start; i != objects.end(); i++) {
+		order.push_back(i->second);
+	}
+	for (std::map<u16, ServerActiveObject*>::iterator i = objects.begin(); i != start; i++) {
+		order.push_back(i->second);
+	}
+}
+
+u32 block_missed_nodesteps(u32 game_time, u32 stamp)
+{
+	if (stamp == BLOCK_TIMESTAMP_UNDEFINED || game_time <= stamp)
+		return 0;
+	return (game_time-stamp)/NODESTEP_INTERVAL;
 }
 
 /*
@@ -312,15 +435,34 @@ void ActiveBlockList::update(std::list<v3s16> &active_positions,
 ServerEnvironment::ServerEnvironment(ServerMap *map, Server *server):
 	m_map(map),
 	m_server(server),
+	m_active_object_step_next(0),
+	m_pathfinder(map),
 	m_send_recommended_timer(0),
+	m_circuit_flood(NULL),
+	m_circuit_step(0),
 	m_game_time(0),
 	m_game_time_fraction_counter(0),
-	m_players_sleeping(false)
+	m_players_sleeping(false),
+	m_nodestep_season(0),
+	m_nodestep_time(0),
+	m_nodestep_unsafe_fire(false),
+	m_nodestep_next(0),
+	m_nodestep_timer(0.0),
+	m_nodestep_block_time(0.0)
 {
+	m_nodestep_mutex.Init();
+	m_map->addEventReceiver(&m_pathfinder);
 }
 
 ServerEnvironment::~ServerEnvironment()
 {
+	// They're only working during step()
+	for (std::vector<NodestepThread*>::iterator i = m_nodestep_threads.begin();
+			i != m_nodestep_threads.end(); i++) {
+		(*i)->stopWorker();
+		delete *i;
+	}
+
 	// Clear active block list.
 	// This makes the next one delete all active objects.
 	m_active_blocks.clear();
@@ -328,86 +470,58 @@ ServerEnvironment::~ServerEnvironment()
 	// Convert all objects to static and delete the active objects
 	deactivateFarObjects(true);
 
+	m_map->removeEventReceiver(&m_pathfinder);
+
 	// Drop/delete map
 	m_map->drop();
 }
 
+/*
+	Player files are written to a temporary file which is then renamed
+	over the old one, so a crash while saving doesn't leave it cut off
+*/
+static bool save_player_file(const std::string &path, const std::string &data)
+{
+	const std::string tmp = path + ".tmp";
+	{
+		std::ofstream os(tmp.c_str(), std::ios_base::binary);
+		if (os.good())
+			os.write(data.c_str(), data.size());
+		os.flush();
+		if (os.good() == false) {
+			os.close();
+			remove(tmp.c_str());
+			return false;
+		}
+	}
+#ifdef _WIN32
+	// rename() doesn't replace files here
+	remove(path.c_str());
+#endif
+	if (rename(tmp.c_str(), path.c_str()) != 0) {
+		remove(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
 void ServerEnvironment::serializePlayers()
 {
 	Player *player;
 	uint32_t i;
-	dirlist_t *list;
-	dirlist_t *list_file;
-	nvp_t *saved_players = NULL;
 	char path[1024];
+	std::set<std::string> names;
+	u32 saved = 0;
 
 	if (path_create((char*)"player",NULL)) {
 		infostream<<"failed to open players path"<<std::endl;
 		return;
 	}
 
-	list = path_dirlist((char*)"player",NULL);
-	list_file = list;
-
-	while (list_file) {
-		if (list_file->dir) {
-			list_file = list_file->next;
-			continue;
-		}
-
-		// Load player to see what is its name
-		ServerRemotePlayer testplayer;
-		{
-			if (!path_get((char*)"player",list_file->name,1,path,1024)) {
-				list_file = list_file->next;
-				continue;
-			}
-			// Open file and deserialize
-			std::ifstream is(path, std::ios_base::binary);
-			if (is.good() == false) {
-				infostream<<"Failed to read "<<path<<std::endl;
-				list_file = list_file->next;
-				continue;
-			}
-			testplayer.deSerialize(is);
-		}
-
-		//infostream<<"Loaded test player with name "<<testplayer.getName()<<std::endl;
-
-		// Search for the player
-		std::string playername = testplayer.getName();
-		player = getPlayer(playername.c_str());
-		if (player == NULL) {
-			path_remove(NULL,path);
-			list_file = list_file->next;
-			continue;
-		}
-
-		//infostream<<"Found matching player, overwriting."<<std::endl;
-
-		// OK, found. Save player there.
-		{
-			// Open file and serialize
-			std::ofstream os(path, std::ios_base::binary);
-			if (os.good() == false) {
-				infostream<<"Failed to overwrite "<<path<<std::endl;
-				list_file = list_file->next;
-				continue;
-			}
-			player->serialize(os);
-			nvp_set(&saved_players, (char*)player->getName(), (char*)player->getName(), player);
-		}
-		list_file = list_file->next;
-	}
-	
-	path_dirlist_free(list);
-	
 	for (i=0; i<m_players->length; i++) {
 		player = (Player*)array_get_ptr(m_players,i);
 		if (!player)
 			continue;
-		if (nvp_get(&saved_players, (char*)player->getName()) != NULL)
-			continue;
 		char* playername = const_cast<char*>(player->getName());
 		/* don't save unnamed player */
 		if (!playername[0])
@@ -415,20 +529,43 @@ void ServerEnvironment::serializePlayers()
 		/* ... or dodgy names */
 		if (string_allowed(playername, PLAYERNAME_ALLOWED_CHARS) == false)
 			continue;
+		names.insert(playername);
 
-		if (path_get((char*)"player",playername,0,path,1024)) {
-			// Open file and serialize
-			std::ofstream os(path, std::ios_base::binary);
-			if (os.good() == false) {
-				infostream<<"Failed to overwrite "<<path<<std::endl;
+		/* only players that changed since they were last saved are written */
+		std::ostringstream os(std::ios_base::binary);
+		player->serialize(os);
+		const std::string data = os.str();
+		if (!player->isDirty(data))
+			continue;
+
+		std::map<std::string,std::string>::iterator f = m_player_files.find(playername);
+		if (f == m_player_files.end()) {
+			if (!path_get((char*)"player",playername,0,path,1024))
 				continue;
-			}
-			player->serialize(os);
-			nvp_set(&saved_players, (char*)player->getName(), (char*)player->getName(), player);
+			f = m_player_files.insert(std::make_pair(std::string(playername),std::string(path))).first;
+		}
+
+		if (!save_player_file(f->second,data)) {
+			infostream<<"Failed to overwrite "<<f->second<<std::endl;
+			continue;
+		}
+		player->setSaved(data);
+		saved++;
+	}
+
+	/* remove the files of players that no longer exist */
+	std::map<std::string,std::string>::iterator f = m_player_files.begin();
+	while (f != m_player_files.end()) {
+		if (names.find(f->first) != names.end()) {
+			f++;
+			continue;
 		}
+		path_remove(NULL,(char*)f->second.c_str());
+		m_player_files.erase(f++);
 	}
 
-	nvp_free(&saved_players,0);
+	if (saved)
+		infostream<<"Saved "<<saved<<" of "<<names.size()<<" players"<<std::endl;
 }
 
 void ServerEnvironment::deSerializePlayers()
@@ -441,6 +578,8 @@ void ServerEnvironment::deSerializePlayers()
 	if (!path_get((char*)"player",NULL,1,path,1024))
 		return;
 
+	m_player_files.clear();
+
 	list = path_dirlist((char*)"player",NULL);
 	list_file = list;
 
@@ -450,20 +589,37 @@ void ServerEnvironment::deSerializePlayers()
 			continue;
 		}
 
-		// Load player to see what is its name
-		ServerRemotePlayer testplayer;
+		if (!path_get((char*)"player",list_file->name,1,path,1024)) {
+			list_file = list_file->next;
+			continue;
+		}
+
+		// Left over from a save that didn't finish
+		const std::string filename = list_file->name;
+		if (filename.size() > 4 && filename.substr(filename.size()-4) == ".tmp") {
+			path_remove(NULL,path);
+			list_file = list_file->next;
+			continue;
+		}
+
+		// Read the file once, it's deserialized from memory
+		std::string data;
 		{
-			if (!path_get((char*)"player",list_file->name,1,path,1024)) {
-				list_file = list_file->next;
-				continue;
-			}
-			// Open file and deserialize
 			std::ifstream is(path, std::ios_base::binary);
 			if (is.good() == false) {
 				infostream<<"Failed to read "<<path<<std::endl;
 				list_file = list_file->next;
 				continue;
 			}
+			std::ostringstream os(std::ios_base::binary);
+			os<<is.rdbuf();
+			data = os.str();
+		}
+
+		// Load player to see what is its name
+		ServerRemotePlayer testplayer;
+		{
+			std::istringstream is(data, std::ios_base::binary);
 			testplayer.deSerialize(is);
 		}
 
@@ -490,20 +646,24 @@ void ServerEnvironment::deSerializePlayers()
 		{
 			infostream<<"Reading player "<<testplayer.getName()<<" from "
 					<<path<<std::endl;
-			// Open file and deserialize
-			std::ifstream is(path, std::ios_base::binary);
-			if (is.good() == false) {
-				infostream<<"Failed to read "<<path<<std::endl;
-				list_file = list_file->next;
-				continue;
-			}
+			std::istringstream is(data, std::ios_base::binary);
 			player->deSerialize(is);
 		}
 
+		// Nothing to save until the player changes
+		{
+			std::ostringstream os(std::ios_base::binary);
+			player->serialize(os);
+			player->setSaved(os.str());
+		}
+		m_player_files[playername] = path;
+
 		if (newplayer)
 			addPlayer(player);
 		list_file = list_file->next;
 	}
+
+	path_dirlist_free(list);
 }
 
 void ServerEnvironment::saveMeta()
@@ -579,8 +739,19 @@ void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 	// Activate stored objects
 	activateObjects(block);
 
+	/*
+		Catch up on the nodesteps missed while unloaded. Node ticks
+		aren't saved, so growing things would start over otherwise.
+		additional_dtime isn't time the block missed, it's left out.
+	*/
+	u32 nodesteps = block_missed_nodesteps(m_game_time,stamp);
+	if (nodesteps) {
+		block->incNodeTicks(nodesteps);
+		plantgrowth_catchup(this,block,nodesteps);
+	}
+
 	// Run node metadata
-	bool changed = block->m_node_metadata.step((float)dtime_s, block->getPosRelative(),this);
+	bool changed = block->m_node_metadata.fastForward((float)dtime_s, block->getPosRelative(),this);
 	bool cchanged = block->m_node_metadata.stepCircuit((float)dtime_s, block->getPosRelative(),this);
 	if (changed || cchanged) {
 		MapEditEvent event;
@@ -626,6 +797,7 @@ void ServerEnvironment::clearAllObjects()
 	// Remove references from m_active_objects
 	for (std::vector<u16>::iterator i = objects_to_remove.begin(); i != objects_to_remove.end(); i++) {
 		m_active_objects.erase(*i);
+		m_active_object_index.remove(*i);
 	}
 
 	core::list<v3s16> loadable_blocks;
@@ -691,18 +863,15 @@ bool ServerEnvironment::searchNear(v3s16 pos, v3s16 radius_min, v3s16 radius_max
 				if (!x && !y && !z)
 					continue;
 				p = pos+v3s16(x,y,z);
-				MapNode n_test;
+				content_t c_test;
 				bp = getNodeBlockPos(p);
 				if (bp == blockpos)
-				{
-					bool pos_ok;
-					n_test = block->getNodeNoCheck(p-relpos,&pos_ok);
-				}
+					c_test = block->getNodeContent(p-relpos);
 				else
-					n_test = m_map->getNodeNoEx(p);
+					c_test = m_map->getNodeNoEx(p).getContent();
 				for (std::vector<content_t>::iterator i=c.begin(); i != c.end(); i++)
 				{
-					if (n_test.getContent() == *i)
+					if (c_test == *i)
 					{
 						if (found != NULL)
 							*found = p;
@@ -737,17 +906,16 @@ bool ServerEnvironment::searchNearInv(v3s16 pos, v3s16 radius_min, v3s16 radius_
 				if (!x && !y && !z)
 					continue;
 				p = pos+v3s16(x,y,z);
-				MapNode n_test;
+				content_t c_test;
 				bp = getNodeBlockPos(p);
 				if (bp == blockpos) {
-					bool pos_ok;
-					n_test = block->getNodeNoCheck(p-relpos,&pos_ok);
+					c_test = block->getNodeContent(p-relpos);
 				}else{
-					n_test = m_map->getNodeNoEx(p);
+					c_test = m_map->getNodeNoEx(p).getContent();
 				}
 				bool s = false;
 				for (std::vector<content_t>::iterator i=c.begin(); i != c.end(); i++) {
-					if (n_test.getContent() == *i) {
+					if (c_test == *i) {
 						s = true;
 						break;
 					}
@@ -1057,6 +1225,49 @@ bool ServerEnvironment::dropToParcel(v3s16 pos, InventoryItem *item)
 	return false;
 }
 
+/*
+	Contents with a case in the nodestep switch below, keep this in
+	sync with it. CONTENT_AIR is left out as it's only handled in space,
+	where the nodestep visits it anyway.
+*/
+static const content_t nodestep_contents[] = {
+	CONTENT_MUD, CONTENT_CLAY,
+	CONTENT_FARM_WHEAT, CONTENT_FARM_MELON, CONTENT_FARM_PUMPKIN,
+	CONTENT_FARM_POTATO, CONTENT_FARM_CARROT, CONTENT_FARM_BEETROOT,
+	CONTENT_FARM_COTTON,
+	CONTENT_WATER, CONTENT_WATERSOURCE, CONTENT_ICE, CONTENT_SNOW,
+	CONTENT_SNOW_BLOCK, CONTENT_FARM_DIRT, CONTENT_FARM_GRAPEVINE,
+	CONTENT_FARM_TRELLIS_GRAPE, CONTENT_WILDGRASS_SHORT,
+	CONTENT_WILDGRASS_LONG, CONTENT_FLOWER_STEM, CONTENT_DEADGRASS,
+	CONTENT_FLOWER_ROSE, CONTENT_FLOWER_DAFFODIL, CONTENT_FLOWER_TULIP,
+	CONTENT_CACTUS, CONTENT_CACTUS_BLOSSOM, CONTENT_CACTUS_FLOWER,
+	CONTENT_CACTUS_FRUIT, CONTENT_APPLE_LEAVES, CONTENT_JUNGLELEAVES,
+	CONTENT_CONIFER_LEAVES, CONTENT_LEAVES, CONTENT_LEAVES_AUTUMN,
+	CONTENT_LEAVES_WINTER, CONTENT_LEAVES_SNOWY, CONTENT_APPLE_BLOSSOM,
+	CONTENT_FIRE_SHORTTERM, CONTENT_FIRE, CONTENT_FLASH, CONTENT_TNT,
+	CONTENT_COBBLE, CONTENT_SAPLING, CONTENT_YOUNG_TREE,
+	CONTENT_APPLE_SAPLING, CONTENT_YOUNG_APPLE_TREE, CONTENT_JUNGLESAPLING,
+	CONTENT_YOUNG_JUNGLETREE, CONTENT_CONIFER_SAPLING,
+	CONTENT_YOUNG_CONIFER_TREE, CONTENT_APPLE, CONTENT_SAND, CONTENT_SPONGE,
+	CONTENT_PAPYRUS, CONTENT_STEAM, CONTENT_LAVASOURCE, CONTENT_LAVA,
+	CONTENT_VACUUM, CONTENT_LIFE_SUPPORT
+};
+
+void content_nodestep_init()
+{
+	for (u32 i=0; i<=MAX_CONTENT; i++) {
+		const ContentFeatures &f = content_features(i);
+		u8 flags = 0;
+		if (f.draw_type == CDT_DIRTLIKE || i == CONTENT_SAND || i == CONTENT_STONE)
+			flags |= NODESTEP_SPAWN;
+		if (f.draw_type == CDT_CUBELIKE || f.draw_type == CDT_GLASSLIKE || f.draw_type == CDT_DIRTLIKE)
+			flags |= NODESTEP_SNOW;
+		g_content_nodestep[i] = flags;
+	}
+	for (u32 i=0; i<sizeof(nodestep_contents)/sizeof(nodestep_contents[0]); i++)
+		g_content_nodestep[nodestep_contents[i]] |= NODESTEP_HANDLER;
+}
+
 void ServerEnvironment::step(float dtime)
 {
 	DSTACK(__FUNCTION_NAME);
@@ -1081,7 +1292,7 @@ void ServerEnvironment::step(float dtime)
 
 
 	bool blockstep = m_active_blocks_management_interval.step(dtime, 2.0);
-	std::list<v3s16> players_blockpos;
+	std::map<u16,v3s16> players_blockpos;
 
 	bool sleepskip = true;
 
@@ -1143,7 +1354,7 @@ void ServerEnvironment::step(float dtime)
 			*/
 			if (blockstep) {
 				v3s16 blockpos = getNodeBlockPos(floatToInt(playerpos, BS));
-				players_blockpos.push_back(blockpos);
+				players_blockpos[player->peer_id] = blockpos;
 			}
 		}
 		if (!pc)
@@ -1214,6 +1425,10 @@ void ServerEnvironment::step(float dtime)
 		std::set<v3s16> blocks_added;
 		m_active_blocks.update(players_blockpos, active_block_range, blocks_removed, blocks_added);
 
+		g_profiler->avg("SEnv: active blocks", m_active_blocks.m_list.size());
+		g_profiler->avg("SEnv: active blocks added", blocks_added.size());
+		g_profiler->avg("SEnv: active blocks removed", blocks_removed.size());
+
 		/*
 			Handle removed blocks
 		*/
@@ -1241,6 +1456,15 @@ void ServerEnvironment::step(float dtime)
 			Handle added blocks
 		*/
 
+		// Load the ones that aren't in memory together
+		{
+			core::list<v3s16> load;
+			for (std::set<v3s16>::iterator i = blocks_added.begin(); i != blocks_added.end(); i++) {
+				load.push_back(*i);
+			}
+			m_map->loadBlocks(load);
+		}
+
 		for (std::set<v3s16>::iterator i = blocks_added.begin(); i != blocks_added.end(); i++)
 		{
 			v3s16 p = *i;
@@ -1248,9 +1472,13 @@ void ServerEnvironment::step(float dtime)
 			/*infostream<<"Server: Block ("<<p.X<<","<<p.Y<<","<<p.Z
 					<<") became active"<<std::endl;*/
 
-			MapBlock* const block = m_map->emergeBlock(p,false);
+			MapBlock* const block = m_map->getBlockNoCreateNoEx(p);
 			if (!block)
 				continue;
+			if (block->isDummy()) {
+				block->ResetCurrent();
+				continue;
+			}
 
 			activateBlock(block);
 			block->ResetCurrent();
@@ -1262,20 +1490,40 @@ void ServerEnvironment::step(float dtime)
 	*/
 	bool circuitstep = m_active_blocks_circuit_interval.step(dtime, 0.5);
 	bool metastep = m_active_blocks_nodemetadata_interval.step(dtime, 1.0);
-	bool nodestep = m_active_blocks_test_interval.step(dtime, 10.0);
 
-	if (circuitstep || metastep || nodestep)
+	if (circuitstep) {
+		m_circuit_step++;
+
+		// Forget links nothing has gone through for a while
+		if (m_circuit_step%120 == 0) {
+			for (std::map<v3s16,CircuitLinks>::iterator i = m_circuit_links.begin(); i != m_circuit_links.end(); ) {
+				if (m_circuit_step-i->second.used > 10) {
+					m_circuit_links.erase(i++);
+				}else{
+					i++;
+				}
+			}
+			for (std::map<v3s16,CircuitFlood>::iterator i = m_circuit_floods.begin(); i != m_circuit_floods.end(); ) {
+				if (m_circuit_step-i->second.used > 10) {
+					m_circuit_floods.erase(i++);
+				}else{
+					i++;
+				}
+			}
+		}
+		g_profiler->avg("SEnv: circuit links", m_circuit_links.size());
+		g_profiler->avg("SEnv: circuit floods", m_circuit_floods.size());
+	}
+
+	if (circuitstep || metastep)
 	{
 		float circuit_dtime = 0.5;
 		float meta_dtime = 1.0;
-		u16 season = getSeason();
-		uint16_t time = getTimeOfDay();
-		bool unsafe_fire = config_get_bool("world.game.environment.fire.spread");
 		
-		for (std::set<v3s16>::iterator i = m_active_blocks.m_list.begin();
+		for (std::map<v3s16,u16>::iterator i = m_active_blocks.m_list.begin();
 		     i != m_active_blocks.m_list.end(); i++)
 		{
-			v3s16 bp = *i;
+			v3s16 bp = i->first;
 
 			MapBlock* const block = m_map->getBlockNoCreateNoEx(bp);
 			if (!block)
@@ -1358,123 +1606,612 @@ void ServerEnvironment::step(float dtime)
 				m_poststep_nodeswaps.clear();
 			}
 
-			if (!nodestep)
-				continue;
+			block->ResetCurrent();
+		}
+	}
 
-			bool has_steam_sound = false;
+	/*
+		Step the nodes of some of the active blocks
+	*/
+	stepNodestepQueue(dtime);
 
-			/*
-				Do stuff!
+	/*
+		Take in map changes for mob pathfinding
+	*/
+	m_pathfinder.step(dtime);
 
-				Note that map modifications should be done using the event-
-				making map methods so that the server gets information
-				about them.
+	/*
+		Step active objects
+	*/
+	{
+		ScopeProfiler sp(g_profiler, "SEnv: step act. objs avg", SPT_AVG);
+		//TimeTaker timer("Step active objects");
 
-				Reading can be done quickly directly from the block.
+		g_profiler->avg("SEnv: num of objects", m_active_objects.size());
+		g_profiler->avg("SEnv: blocks with objects", m_active_object_index.blockCount());
 
-				Everything should bind to inside this single content
-				searching loop to keep things fast.
-			*/
+		// This helps the objects to send data at the same time
+		bool send_recommended = false;
+		u8 mob_level = mobLevelI(config_get("world.game.mob.spawn.level"));
+		m_send_recommended_timer += dtime;
+		if (m_send_recommended_timer > 0.10) {
+			m_send_recommended_timer = 0;
+			send_recommended = true;
+		}
 
-			if (block->last_spawn < m_time_of_day-6000)
-			{
-				MapNode n1 = block->getNodeNoEx(block->spawn_area+v3s16(0,1,0));
-				MapNode n2 = block->getNodeNoEx(block->spawn_area+v3s16(0,2,0));
-				u8 light = n1.getLightBlend(getDayNightRatio());
-				if (!content_features(n1.getContent()).air_equivalent
-						|| !content_features(n2.getContent()).air_equivalent)
-					block->has_spawn_area = false;
-
-				if (block->has_spawn_area && m_time_of_day > 19000 && m_time_of_day < 20000)
-				{
-					if (light <= LIGHT_SPAWN_DARK)
-					{
-						if (block->getPos().Y > 0 || myrand_range(0,5) == 0)
-						{
-							mob_spawn_hostile(block->spawn_area+block->getPosRelative(),false,this);
-						}
-					}
-					block->last_spawn = m_time_of_day;
-				}
-			}
+		/*
+			Mobs share a time budget, once it's used up the rest put
+			their step off. The next step starts where this one stopped
+			so they all get their turn.
+		*/
+		MobStepBudget mob_budget(config_get_int("server.mob.budget"),porting::getTimeMs());
+		u32 mob_tiers[MOB_AI_TIERS] = {0,0,0};
+		u32 mobs_deferred = 0;
 
-			v3s16 p0;
-			uint8_t biome = block->getBiome();
-			bool coldzone = false;
-			
-			switch (biome)
-			{
-			case BIOME_JUNGLE:
-				if (season == ENV_SEASON_WINTER && time > 4000 && time < 8000)
-					coldzone = true;
-				break;
-			case BIOME_OCEAN:
-				if (season == ENV_SEASON_WINTER)
-					coldzone = true;
-				break;
-			case BIOME_PLAINS:
-				if (season == ENV_SEASON_WINTER && (time < 6000 || time > 18000))
-					coldzone = true;
-				break;
-			case BIOME_FOREST:
-				if (season == ENV_SEASON_WINTER)
-					coldzone = true;
-				break;
-			case BIOME_SKY:
-			case BIOME_SNOWCAP:
-				coldzone = true;
-				break;
-			case BIOME_LAKE:
-			if (
-				season == ENV_SEASON_WINTER
-				|| (
-					season == ENV_SEASON_AUTUMN
-					&& (time < 6000 || time > 18000)
-				) || (
-					season == ENV_SEASON_SPRING
-					&& time > 4000
-					&& time < 8000
-				)
-			) {
-				coldzone = true;
+		std::vector<ServerActiveObject*> objects;
+		active_object_step_order(m_active_objects,m_active_object_step_next,objects);
+
+		for (std::vector<ServerActiveObject*>::iterator i = objects.begin(); i != objects.end(); i++) {
+			ServerActiveObject* obj = *i;
+
+			if(!obj)
+			    continue;
+			
+			// Remove non-peaceful mobs on peaceful mode
+			if (obj->level() > mob_level)
+				obj->m_removed = true;
+			// Don't step if is to be removed or stored statically
+			if (obj->m_removed)
+				continue;
+			if (obj->m_pending_deactivation) {
+				// The block in which the object resides in
+				v3s16 blockpos = getNodeBlockPos(floatToInt(obj->getBasePosition(), BS));
+				if (!m_active_blocks.contains(blockpos))
+					continue;
+				obj->m_pending_deactivation = false;
 			}
-				break;
-			case BIOME_BEACH:
-				if (season == ENV_SEASON_WINTER)
-					coldzone = true;
-				break;
-			case BIOME_UNKNOWN:
-			case BIOME_WOODLANDS:
-				if (season == ENV_SEASON_WINTER)
-					coldzone = true;
-			default:
-				break;
+			if (obj->getType() == ACTIVEOBJECT_TYPE_MOB) {
+				MobSAO *mob = (MobSAO*)obj;
+				if (mob_budget.isOver()) {
+					mob->deferStep(dtime);
+					mobs_deferred++;
+					continue;
+				}
+				mob->step(dtime, send_recommended);
+				mob_tiers[mob->getAITier()]++;
+				if (mob_budget.stepped(obj->getId(),porting::getTimeMs()))
+					m_active_object_step_next = mob_budget.getNext();
+			}else{
+				// Step object
+				obj->step(dtime, send_recommended);
 			}
-			
-			for (p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
-			for (p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
-			for (p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++) {
-				v3s16 p = p0 + block->getPosRelative();
-				block->incNodeTicks(p0);
-				MapNode n = block->getNodeNoEx(p0);
-				if (!block->has_spawn_area
-					&& (content_features(n.getContent()).draw_type == CDT_DIRTLIKE
-						|| n.getContent() == CONTENT_SAND
-						|| n.getContent() == CONTENT_STONE))
+			m_active_object_index.update(obj->getId(), obj->getBasePosition());
+			// Read messages from object
+			while (obj->m_messages_out.size() > 0) {
+				m_active_object_messages.push_back(obj->m_messages_out.pop_front());
+			}
+		}
+
+		g_profiler->avg("SEnv: mobs full AI", mob_tiers[MOB_AI_FULL]);
+		g_profiler->avg("SEnv: mobs reduced AI", mob_tiers[MOB_AI_REDUCED]);
+		g_profiler->avg("SEnv: mobs frozen", mob_tiers[MOB_AI_FROZEN]);
+		g_profiler->avg("SEnv: mobs deferred", mobs_deferred);
+	}
+
+	/*
+		Manage active objects
+	*/
+	if (m_object_management_interval.step(dtime, 0.5)) {
+		ScopeProfiler sp(g_profiler, "SEnv: remove removed objs avg /.5s", SPT_AVG);
+		/*
+			Remove objects that satisfy (m_removed && m_known_by_count==0)
+		*/
+		removeRemovedObjects();
+	}
+}
+
+/*
+	NodestepChanges
+*/
+
+NodestepChanges::NodestepChanges(ServerMap *map):
+	m_map(map),
+	m_block(NULL),
+	m_block_pos(0,0,0),
+	m_block_valid(false)
+{
+}
+
+MapNode NodestepChanges::getNodeNoEx(v3s16 p)
+{
+	if (m_nodes.size()) {
+		std::map<v3s16,MapNode>::iterator i = m_nodes.find(p);
+		if (i != m_nodes.end())
+			return i->second;
+	}
+
+	// Most reads are near the node being stepped, so the last block is
+	// kept to save locking the map for each of them
+	v3s16 blockpos = getNodeBlockPos(p);
+	if (!m_block_valid || blockpos != m_block_pos) {
+		m_block = m_map->getBlockNoCreateNoEx(blockpos);
+		m_block_pos = blockpos;
+		m_block_valid = true;
+	}
+	if (!m_block)
+		return MapNode(CONTENT_IGNORE);
+
+	return m_block->getNodeNoEx(p - blockpos*MAP_BLOCKSIZE);
+}
+
+void NodestepChanges::addNodeWithEvent(v3s16 p, MapNode n)
+{
+	NodestepChange c(NSC_ADD,p);
+	c.n = n;
+	m_changes.push_back(c);
+	m_nodes[p] = n;
+}
+
+void NodestepChanges::removeNodeWithEvent(v3s16 p)
+{
+	m_changes.push_back(NodestepChange(NSC_REMOVE,p));
+	m_nodes[p] = MapNode(CONTENT_AIR);
+}
+
+void NodestepChanges::updateNodeWithEvent(v3s16 p, MapNode n)
+{
+	NodestepChange c(NSC_UPDATE,p);
+	c.n = n;
+	m_changes.push_back(c);
+	m_nodes[p] = n;
+}
+
+void NodestepChanges::plantgrowth(void (*grow)(ServerEnvironment*,v3s16), v3s16 p)
+{
+	NodestepChange c(NSC_GROW,p);
+	c.grow = grow;
+	m_changes.push_back(c);
+}
+
+void NodestepChanges::plantgrowthPlant(v3s16 p, s16 height)
+{
+	NodestepChange c(NSC_GROW_PLANT,p);
+	c.height = height;
+	m_changes.push_back(c);
+}
+
+void NodestepChanges::spawnHostile(v3s16 p)
+{
+	m_changes.push_back(NodestepChange(NSC_SPAWN,p));
+}
+
+void NodestepChanges::dropToParcel(v3s16 p, InventoryItem *item)
+{
+	NodestepChange c(NSC_PARCEL,p);
+	c.item = item;
+	m_changes.push_back(c);
+}
+
+void NodestepChanges::energise(v3s16 src, v3s16 p)
+{
+	NodestepChange c(NSC_ENERGISE,p);
+	c.src = src;
+	m_changes.push_back(c);
+}
+
+void NodestepChanges::addEnvEvent(u8 type, v3f pos, std::string data)
+{
+	NodestepChange c(NSC_EVENT,v3s16(0,0,0));
+	c.event = type;
+	c.pos = pos;
+	c.data = data;
+	m_changes.push_back(c);
+}
+
+void NodestepChanges::setDelayedNode(v3s16 p, MapNode n)
+{
+	m_delayed[p] = n;
+}
+
+void NodestepChanges::apply(ServerEnvironment *env, std::map<v3s16,MapNode> &delayed)
+{
+	for (std::vector<NodestepChange>::iterator i = m_changes.begin(); i != m_changes.end(); i++) {
+		switch (i->type) {
+		case NSC_ADD:
+			m_map->addNodeWithEvent(i->p,i->n);
+			break;
+		case NSC_REMOVE:
+			m_map->removeNodeWithEvent(i->p);
+			break;
+		case NSC_UPDATE:
+			m_map->updateNodeWithEvent(i->p,i->n);
+			break;
+		case NSC_GROW:
+			i->grow(env,i->p);
+			break;
+		case NSC_GROW_PLANT:
+			plantgrowth_plant(env,i->p,i->height);
+			break;
+		case NSC_SPAWN:
+			mob_spawn_hostile(i->p,false,env);
+			break;
+		case NSC_PARCEL:
+			env->dropToParcel(i->p,i->item);
+			break;
+		case NSC_ENERGISE:
+		{
+			NodeMetadata *meta = m_map->getNodeMetadata(i->p);
+			if (meta && !meta->getEnergy())
+				meta->energise(ENERGY_MAX,i->src,i->src,i->p);
+			break;
+		}
+		case NSC_EVENT:
+			env->addEnvEvent(i->event,i->pos,i->data);
+			break;
+		}
+	}
+	m_changes.clear();
+	m_nodes.clear();
+
+	for (std::map<v3s16,MapNode>::iterator i = m_delayed.begin(); i != m_delayed.end(); i++) {
+		delayed[i->first] = i->second;
+	}
+	m_delayed.clear();
+}
+
+void NodestepThread::work()
+{
+	// myrand() is per thread
+	mysrand(m_seed);
+	m_env->nodestepWork();
+}
+
+/*
+	Every active block has its nodes stepped once each NODESTEP_INTERVAL
+	seconds. Doing them all at once lagged the server, so instead a share
+	of them is done each step, spread over the interval but at most as
+	many as fit in server.nodestep.budget milliseconds. Blocks that don't
+	fit are left for the next step.
+*/
+void ServerEnvironment::stepNodestepQueue(float dtime)
+{
+	m_nodestep_timer += dtime;
+	if (m_nodestep_timer >= NODESTEP_INTERVAL) {
+		m_nodestep_timer -= NODESTEP_INTERVAL;
+		if (m_nodestep_timer >= NODESTEP_INTERVAL)
+			m_nodestep_timer = 0;
+
+		// Whatever is still queued should have been done by now
+		g_profiler->avg("SEnv: nodestep backlog", m_nodestep_queue.size());
+
+		for (std::map<v3s16,u16>::iterator i = m_active_blocks.m_list.begin();
+		     i != m_active_blocks.m_list.end(); i++) {
+			if (m_nodestep_queued.insert(i->first).second)
+				m_nodestep_queue.push_back(i->first);
+		}
+	}
+
+	g_profiler->avg("SEnv: nodestep queued", m_nodestep_queue.size());
+
+	if (m_nodestep_queue.empty())
+		return;
+
+	// Enough to finish the queue by the end of the interval
+	float left = NODESTEP_INTERVAL - m_nodestep_timer;
+	if (left < dtime)
+		left = dtime;
+	u32 count = ceilf((float)m_nodestep_queue.size()*dtime/left);
+
+	float budget = config_get_float("server.nodestep.budget");
+	if (budget > 0.0 && m_nodestep_block_time > 0.0) {
+		u32 fits = budget/m_nodestep_block_time;
+		if (fits < 1)
+			fits = 1;
+		if (count > fits)
+			count = fits;
+	}
+
+	std::vector<MapBlock*> blocks;
+	while (blocks.size() < count && !m_nodestep_queue.empty()) {
+		v3s16 p = m_nodestep_queue.front();
+		m_nodestep_queue.pop_front();
+		m_nodestep_queued.erase(p);
+
+		// It may have become inactive while queued
+		if (!m_active_blocks.contains(p))
+			continue;
+		MapBlock* const block = m_map->getBlockNoCreateNoEx(p);
+		if (!block)
+			continue;
+
+		block->incNodeTicks();
+		blocks.push_back(block);
+		block->ResetCurrent();
+	}
+
+	if (blocks.empty())
+		return;
+
+	u32 start = porting::getTimeMs();
+
+	stepNodes(
+		blocks,
+		getSeason(),
+		getTimeOfDay(),
+		config_get_bool("world.game.environment.fire.spread")
+	);
+
+	// Anything under a millisecond shows as none, so round it up
+	u32 took = porting::getTimeMs()-start;
+	if (took < 1)
+		took = 1;
+	float block_time = (float)took/blocks.size();
+	if (m_nodestep_block_time > 0.0) {
+		m_nodestep_block_time = m_nodestep_block_time*0.9+block_time*0.1;
+	}else{
+		m_nodestep_block_time = block_time;
+	}
+
+	g_profiler->avg("SEnv: nodestep blocks per step", blocks.size());
+	g_profiler->avg("SEnv: nodestep ms per block", m_nodestep_block_time);
+}
+
+/*
+	Steps the nodes of the active blocks. Nearby blocks are grouped into
+	work units, which are shared out between threads when there are
+	enough of them to be worth waking the threads. While that runs
+	the map is only read, what the nodestep changes is collected for
+	each unit and applied here in order once every unit is done, so the
+	result doesn't depend on which thread stepped what.
+*/
+void ServerEnvironment::stepNodes(std::vector<MapBlock*> &blocks, u16 season, uint16_t time, bool unsafe_fire)
+{
+	ScopeProfiler sp(g_profiler, "SEnv: nodestep avg", SPT_AVG);
+
+	m_nodestep_season = season;
+	m_nodestep_time = time;
+	m_nodestep_unsafe_fire = unsafe_fire;
+
+	/*
+		Each unit is a cube of NODESTEP_UNIT_SIZE blocks to a side, so
+		what a block reads is mostly stepped on the same thread
+	*/
+	m_nodestep_units.clear();
+	{
+		std::map<v3s16,u32> units;
+		for (std::vector<MapBlock*>::iterator i = blocks.begin(); i != blocks.end(); i++) {
+			v3s16 up = getContainerPos((*i)->getPos(),NODESTEP_UNIT_SIZE);
+			std::map<v3s16,u32>::iterator u = units.find(up);
+			if (u == units.end()) {
+				units[up] = m_nodestep_units.size();
+				m_nodestep_units.push_back(NodestepUnit(m_map));
+				m_nodestep_units.back().blocks.push_back(*i);
+			}else{
+				m_nodestep_units[u->second].blocks.push_back(*i);
+			}
+		}
+	}
+	m_nodestep_next = 0;
+
+	int threads = config_get_int("server.nodestep.threads");
+	if (threads > 16)
+		threads = 16;
+	if ((u32)threads > m_nodestep_units.size())
+		threads = m_nodestep_units.size();
+	if (m_nodestep_units.size() < NODESTEP_THREAD_MIN_UNITS)
+		threads = 1;
+	if (threads < 1)
+		threads = 1;
+
+	{
+		ScopeProfiler sp(g_profiler, "SEnv: nodestep threaded avg", SPT_AVG);
+
+		// This thread is one of them
+		while (m_nodestep_threads.size() < (u32)threads-1) {
+			m_nodestep_threads.push_back(new NodestepThread(this,&m_nodestep_done));
+		}
+		for (int i=0; i<threads-1; i++) {
+			m_nodestep_threads[i]->setSeed(myrand());
+			m_nodestep_threads[i]->wake();
+		}
+
+		nodestepWork();
+
+		for (int i=0; i<threads-1; i++) {
+			m_nodestep_done.Wait();
+		}
+	}
+
+	g_profiler->avg("SEnv: nodestep threads", threads);
+	g_profiler->avg("SEnv: nodestep units", m_nodestep_units.size());
+
+	u32 visited = 0;
+	u32 changes = 0;
+	for (std::vector<NodestepUnit>::iterator i = m_nodestep_units.begin(); i != m_nodestep_units.end(); i++) {
+		visited += i->visited;
+		changes += i->changes.size();
+		i->changes.apply(this,m_delayed_node_changes);
+	}
+	if (blocks.size())
+		g_profiler->avg("SEnv: nodestep nodes visited", visited/blocks.size());
+	g_profiler->avg("SEnv: nodestep changes", changes);
+
+	// A list of positions and nodes that should be set *after* the entire loop runs
+	for (std::map<v3s16,MapNode>::iterator it = m_delayed_node_changes.begin();
+	     it != m_delayed_node_changes.end(); it++)
+	{
+		m_map->addNodeWithEvent(it->first, it->second);
+	}
+	m_delayed_node_changes.clear();
+
+	m_nodestep_units.clear();
+}
+
+/*
+	Steps units until there are none left, called by each nodestep thread
+*/
+void ServerEnvironment::nodestepWork()
+{
+	for (;;) {
+		u32 i;
+		{
+			JMutexAutoLock lock(m_nodestep_mutex);
+			if (m_nodestep_next >= m_nodestep_units.size())
+				break;
+			i = m_nodestep_next++;
+		}
+		NodestepUnit &unit = m_nodestep_units[i];
+		for (std::vector<MapBlock*>::iterator b = unit.blocks.begin(); b != unit.blocks.end(); b++) {
+			unit.visited += nodestepBlock(*b,unit.changes);
+		}
+	}
+}
+
+/*
+	Steps the nodes of one active block. This runs on several threads at
+	once, so the map is only read here and everything else is left to
+	changes, which is applied after every block has been stepped.
+	Returns the number of nodes visited.
+*/
+u32 ServerEnvironment::nodestepBlock(MapBlock *block, NodestepChanges &changes)
+{
+	const u16 season = m_nodestep_season;
+	const uint16_t time = m_nodestep_time;
+	const bool unsafe_fire = m_nodestep_unsafe_fire;
+
+	bool has_steam_sound = false;
+
+	/*
+		Do stuff!
+
+		Note that map modifications should be done through changes,
+		which applies them with the event-making map methods so that
+		the server gets information about them.
+
+		Reading can be done quickly directly from the block.
+
+		Everything should bind to inside this single content
+		searching loop to keep things fast.
+	*/
+
+	if (block->last_spawn < m_time_of_day-6000)
+	{
+		MapNode n1 = block->getNodeNoEx(block->spawn_area+v3s16(0,1,0));
+		MapNode n2 = block->getNodeNoEx(block->spawn_area+v3s16(0,2,0));
+		u8 light = n1.getLightBlend(getDayNightRatio());
+		if (!content_features(n1.getContent()).air_equivalent
+				|| !content_features(n2.getContent()).air_equivalent)
+			block->has_spawn_area = false;
+
+		if (block->has_spawn_area && m_time_of_day > 19000 && m_time_of_day < 20000)
+		{
+			if (light <= LIGHT_SPAWN_DARK)
+			{
+				if (block->getPos().Y > 0 || myrand_range(0,5) == 0)
 				{
-					MapNode n1 = block->getNodeNoEx(p0+v3s16(0,1,0));
-					MapNode n2 = block->getNodeNoEx(p0+v3s16(0,2,0));
-					if (content_features(n1.getContent()).air_equivalent
-						&& content_features(n2.getContent()).air_equivalent
-						&& myrand_range(0,5) == 0)
-					{
-						block->spawn_area = p0;
-						block->has_spawn_area = true;
-					}
+					changes.spawnHostile(block->spawn_area+block->getPosRelative());
 				}
+			}
+			block->last_spawn = m_time_of_day;
+		}
+	}
 
-				switch(n.getContent())
-				{
+	v3s16 p0;
+	uint8_t biome = block->getBiome();
+	bool coldzone = false;
+	
+	switch (biome)
+	{
+	case BIOME_JUNGLE:
+		if (season == ENV_SEASON_WINTER && time > 4000 && time < 8000)
+			coldzone = true;
+		break;
+	case BIOME_OCEAN:
+		if (season == ENV_SEASON_WINTER)
+			coldzone = true;
+		break;
+	case BIOME_PLAINS:
+		if (season == ENV_SEASON_WINTER && (time < 6000 || time > 18000))
+			coldzone = true;
+		break;
+	case BIOME_FOREST:
+		if (season == ENV_SEASON_WINTER)
+			coldzone = true;
+		break;
+	case BIOME_SKY:
+	case BIOME_SNOWCAP:
+		coldzone = true;
+		break;
+	case BIOME_LAKE:
+	if (
+		season == ENV_SEASON_WINTER
+		|| (
+			season == ENV_SEASON_AUTUMN
+			&& (time < 6000 || time > 18000)
+		) || (
+			season == ENV_SEASON_SPRING
+			&& time > 4000
+			&& time < 8000
+		)
+	) {
+		coldzone = true;
+	}
+		break;
+	case BIOME_BEACH:
+		if (season == ENV_SEASON_WINTER)
+			coldzone = true;
+		break;
+	case BIOME_UNKNOWN:
+	case BIOME_WOODLANDS:
+		if (season == ENV_SEASON_WINTER)
+			coldzone = true;
+	default:
+		break;
+	}
+	
+
+	/*
+		Only nodes that something below applies to are
+		visited, and blocks without any are skipped
+	*/
+	u8 visit = NODESTEP_HANDLER;
+	if (!block->has_spawn_area)
+		visit |= NODESTEP_SPAWN;
+	if (coldzone && biome != BIOME_BEACH)
+		visit |= NODESTEP_SNOW;
+	const bool visit_air = (biome == BIOME_SPACE);
+	const bool skip = visit == NODESTEP_HANDLER && !visit_air
+			&& block->getNodestepCount() == 0;
+	u32 visited = 0;
+
+	for (p0.X=0; !skip && p0.X<MAP_BLOCKSIZE; p0.X++)
+	for (p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
+	for (p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++) {
+		const content_t c = block->getNodeContent(p0);
+		if (!(content_nodestep(c) & visit) && !(visit_air && c == CONTENT_AIR))
+			continue;
+		visited++;
+
+		v3s16 p = p0 + block->getPosRelative();
+		MapNode n = block->getNodeNoEx(p0);
+		if (!block->has_spawn_area
+			&& (content_features(n.getContent()).draw_type == CDT_DIRTLIKE
+				|| n.getContent() == CONTENT_SAND
+				|| n.getContent() == CONTENT_STONE))
+		{
+			MapNode n1 = block->getNodeNoEx(p0+v3s16(0,1,0));
+			MapNode n2 = block->getNodeNoEx(p0+v3s16(0,2,0));
+			if (content_features(n1.getContent()).air_equivalent
+				&& content_features(n2.getContent()).air_equivalent
+				&& myrand_range(0,5) == 0)
+			{
+				block->spawn_area = p0;
+				block->has_spawn_area = true;
+			}
+		}
+
+		switch(n.getContent())
+		{
 	/*
 	 * param1:
 	 * 	top nibble:
@@ -1497,1715 +2234,1645 @@ void ServerEnvironment::step(float dtime)
 	 *		0 - fully grown
 	 *		1-15 - growth stages
 	 */
-				case CONTENT_MUD:
-					if (season == ENV_SEASON_SPRING) {
-						MapNode n_top = m_map->getNodeNoEx(p+v3s16(0,1,0));
-						if (n_top.getContent() == CONTENT_AIR) {
-							uint32_t r_result = myrand_range(0,500);
-							content_t add_content = CONTENT_IGNORE;
-							switch (biome) {
-							case BIOME_PLAINS:
-								if (r_result == 1) {
-									add_content = CONTENT_FARM_WHEAT;
-								}else if (r_result == 2) {
-									add_content = CONTENT_FARM_PUMPKIN;
-								}
-								break;
-							case BIOME_FOREST:
-								if (r_result == 1) {
-									add_content = CONTENT_FARM_COTTON;
-								}else if (r_result == 2) {
-									add_content = CONTENT_FARM_MELON;
-								}
-								break;
-							case BIOME_UNKNOWN:
-							case BIOME_WOODLANDS:
-								if (r_result == 1) {
-									add_content = CONTENT_FARM_POTATO;
-								}else if (r_result == 2) {
-									add_content = CONTENT_FARM_CARROT;
-								}else if (r_result == 3) {
-									add_content = CONTENT_FARM_BEETROOT;
-								}
-							default:
-								break;
-							}
-							if (add_content != CONTENT_IGNORE) {
-								std::vector<content_t> search;
-								search.push_back(add_content);
-								search.push_back(CONTENT_IGNORE);
-								if (!searchNear(p,v3s16(3,3,3),search,NULL)) {
-									n_top.setContent(add_content);
-									m_map->updateNodeWithEvent(p+v3s16(0,1,0), n_top);
-								}
-							}
+		case CONTENT_MUD:
+			if (season == ENV_SEASON_SPRING) {
+				MapNode n_top = changes.getNodeNoEx(p+v3s16(0,1,0));
+				if (n_top.getContent() == CONTENT_AIR) {
+					uint32_t r_result = myrand_range(0,500);
+					content_t add_content = CONTENT_IGNORE;
+					switch (biome) {
+					case BIOME_PLAINS:
+						if (r_result == 1) {
+							add_content = CONTENT_FARM_WHEAT;
+						}else if (r_result == 2) {
+							add_content = CONTENT_FARM_PUMPKIN;
+						}
+						break;
+					case BIOME_FOREST:
+						if (r_result == 1) {
+							add_content = CONTENT_FARM_COTTON;
+						}else if (r_result == 2) {
+							add_content = CONTENT_FARM_MELON;
+						}
+						break;
+					case BIOME_UNKNOWN:
+					case BIOME_WOODLANDS:
+						if (r_result == 1) {
+							add_content = CONTENT_FARM_POTATO;
+						}else if (r_result == 2) {
+							add_content = CONTENT_FARM_CARROT;
+						}else if (r_result == 3) {
+							add_content = CONTENT_FARM_BEETROOT;
 						}
+					default:
+						break;
 					}
-				case CONTENT_CLAY:
-				{
-					MapNode n_top = m_map->getNodeNoEx(p+v3s16(0,1,0));
-					if (content_features(n_top).air_equivalent) {
-						// coldzone, change to snow
-						if (coldzone && (n.param1&0x0F) != 0x04) {
-							// should only change to snow if there's nothing above it
-							std::vector<content_t> search;
-							search.push_back(CONTENT_SNOW);
-							search.push_back(CONTENT_AIR);
-							if (!searchNearInv(p,v3s16(0,0,0),v3s16(0,32,0),search,NULL)) {
-								n.param1 = 0x04;
-								m_map->updateNodeWithEvent(p, n);
-							}
-						// footsteps fade out
-						}else if ((n.param1&0x10) == 0x10 && n.envticks > 3) {
-							n.param1 &= ~0x10;
-							m_map->updateNodeWithEvent(p,n);
-						// autumn grass in autumn/winter
-						}else if (
-							biome == BIOME_DESERT
+					if (add_content != CONTENT_IGNORE) {
+						std::vector<content_t> search;
+						search.push_back(add_content);
+						search.push_back(CONTENT_IGNORE);
+						if (!searchNear(p,v3s16(3,3,3),search,NULL)) {
+							n_top.setContent(add_content);
+							changes.updateNodeWithEvent(p+v3s16(0,1,0), n_top);
+						}
+					}
+				}
+			}
+		case CONTENT_CLAY:
+		{
+			MapNode n_top = changes.getNodeNoEx(p+v3s16(0,1,0));
+			if (content_features(n_top).air_equivalent) {
+				// coldzone, change to snow
+				if (coldzone && (n.param1&0x0F) != 0x04) {
+					// should only change to snow if there's nothing above it
+					std::vector<content_t> search;
+					search.push_back(CONTENT_SNOW);
+					search.push_back(CONTENT_AIR);
+					if (!searchNearInv(p,v3s16(0,0,0),v3s16(0,32,0),search,NULL)) {
+						n.param1 = 0x04;
+						changes.updateNodeWithEvent(p, n);
+					}
+				// footsteps fade out
+				}else if ((n.param1&0x10) == 0x10 && n.envticks > 3) {
+					n.param1 &= ~0x10;
+					changes.updateNodeWithEvent(p,n);
+				// autumn grass in autumn/winter
+				}else if (
+					biome == BIOME_DESERT
+					|| (
+						biome != BIOME_WASTELANDS
+						&& biome != BIOME_SPACE
+						&& biome != BIOME_THEDEEP
+						&& (
+							(n.param1&0x0F) == 0x01
+						) && (
+							season == ENV_SEASON_WINTER
 							|| (
-								biome != BIOME_WASTELANDS
-								&& biome != BIOME_SPACE
-								&& biome != BIOME_THEDEEP
+								season == ENV_SEASON_AUTUMN
 								&& (
-									(n.param1&0x0F) == 0x01
-								) && (
-									season == ENV_SEASON_WINTER
-									|| (
-										season == ENV_SEASON_AUTUMN
-										&& (
-											getSeasonDay() > 20
-											|| myrand_range(0,5) == 0
-										)
-									)
+									getSeasonDay() > 20
+									|| myrand_range(0,5) == 0
 								)
 							)
-						) {
-							n.param1 &= ~0x0F;
-							n.param1 |= 0x02;
-							m_map->updateNodeWithEvent(p,n);
-						// green grass in spring/summer
-						}else if (
-							biome != BIOME_WASTELANDS
-							&& biome != BIOME_THEDEEP
-							&& (
-								biome == BIOME_SPACE
+						)
+					)
+				) {
+					n.param1 &= ~0x0F;
+					n.param1 |= 0x02;
+					changes.updateNodeWithEvent(p,n);
+				// green grass in spring/summer
+				}else if (
+					biome != BIOME_WASTELANDS
+					&& biome != BIOME_THEDEEP
+					&& (
+						biome == BIOME_SPACE
+						|| (
+							(
+								(n.param1&0x0F) == 0x02
+							) && (
+								season == ENV_SEASON_SUMMER
 								|| (
-									(
-										(n.param1&0x0F) == 0x02
-									) && (
-										season == ENV_SEASON_SUMMER
-										|| (
-											season == ENV_SEASON_SPRING
-											&& (
-												getSeasonDay() > 20
-												|| myrand_range(0,5) == 0
-											)
-										)
+									season == ENV_SEASON_SPRING
+									&& (
+										getSeasonDay() > 20
+										|| myrand_range(0,5) == 0
 									)
 								)
 							)
-						) {
-							n.param1 &= ~0x0F;
-							n.param1 |= 0x01;
-							m_map->updateNodeWithEvent(p,n);
-						// melt snow out of the coldzone
-						}else if (
-							(n.param1&0x0F) == 0x04
-							&& !coldzone
-						) {
-							n.param1 &= ~0x0F;
-							if (season == ENV_SEASON_SUMMER) {
-								n.param1 |= 0x01;
-							}else{
-								n.param1 |= 0x02;
-							}
-							n.param2 = 0;
-							m_map->updateNodeWithEvent(p,n);
-						// grow
-						}else if (
-							(n.param1&0x0F) != 0x04
-							&& n_top.getLightBlend(getDayNightRatio()) >= 13
-						) {
-							plantgrowth_grass(this,p);
-						}
+						)
+					)
+				) {
+					n.param1 &= ~0x0F;
+					n.param1 |= 0x01;
+					changes.updateNodeWithEvent(p,n);
+				// melt snow out of the coldzone
+				}else if (
+					(n.param1&0x0F) == 0x04
+					&& !coldzone
+				) {
+					n.param1 &= ~0x0F;
+					if (season == ENV_SEASON_SUMMER) {
+						n.param1 |= 0x01;
 					}else{
-						if (n.param1 == 0x01) {
-							n.param1 = 0x02;
-							m_map->updateNodeWithEvent(p,n);
-						}else if (n.param1 != 0) {
-							n.param1 = 0;
-							n.param2 = 0;
-							m_map->updateNodeWithEvent(p,n);
-						}
+						n.param1 |= 0x02;
 					}
-					break;
+					n.param2 = 0;
+					changes.updateNodeWithEvent(p,n);
+				// grow
+				}else if (
+					(n.param1&0x0F) != 0x04
+					&& n_top.getLightBlend(getDayNightRatio()) >= 13
+				) {
+					changes.plantgrowth(plantgrowth_grass,p);
 				}
-				case CONTENT_FARM_WHEAT:
-				case CONTENT_FARM_MELON:
-				case CONTENT_FARM_PUMPKIN:
-				case CONTENT_FARM_POTATO:
-				case CONTENT_FARM_CARROT:
-				case CONTENT_FARM_BEETROOT:
-				case CONTENT_FARM_COTTON:
-				{
-					MapNode n_btm = m_map->getNodeNoEx(p+v3s16(0,-1,0));
-					if (n_btm.getContent() == CONTENT_FARM_DIRT) {
-						/* requires a glass roof (greenhouse) */
-						if (coldzone) {
-							std::vector<content_t> search;
-							search.push_back(CONTENT_GLASS);
-							search.push_back(CONTENT_GLASS_SLAB);
-							search.push_back(CONTENT_GLASS_SLAB_UD);
-							search.push_back(CONTENT_GLASSLIGHT);
-							search.push_back(CONTENT_GLASS_BLACK);
-							search.push_back(CONTENT_GLASS_BLACK_SLAB);
-							search.push_back(CONTENT_GLASS_BLACK_SLAB_UD);
-							search.push_back(CONTENT_GLASS_BLUE);
-							search.push_back(CONTENT_GLASS_BLUE_SLAB);
-							search.push_back(CONTENT_GLASS_BLUE_SLAB_UD);
-							search.push_back(CONTENT_GLASS_GREEN);
-							search.push_back(CONTENT_GLASS_GREEN_SLAB);
-							search.push_back(CONTENT_GLASS_GREEN_SLAB_UD);
-							search.push_back(CONTENT_GLASS_ORANGE);
-							search.push_back(CONTENT_GLASS_ORANGE_SLAB);
-							search.push_back(CONTENT_GLASS_ORANGE_SLAB_UD);
-							search.push_back(CONTENT_GLASS_PURPLE);
-							search.push_back(CONTENT_GLASS_PURPLE_SLAB);
-							search.push_back(CONTENT_GLASS_PURPLE_SLAB_UD);
-							search.push_back(CONTENT_GLASS_RED);
-							search.push_back(CONTENT_GLASS_RED_SLAB);
-							search.push_back(CONTENT_GLASS_RED_SLAB_UD);
-							search.push_back(CONTENT_GLASS_YELLOW);
-							search.push_back(CONTENT_GLASS_YELLOW_SLAB);
-							search.push_back(CONTENT_GLASS_YELLOW_SLAB_UD);
-							search.push_back(CONTENT_ROOFTILE_GLASS);
-							search.push_back(CONTENT_ROOFTILE_GLASS_BLACK);
-							search.push_back(CONTENT_ROOFTILE_GLASS_BLUE);
-							search.push_back(CONTENT_ROOFTILE_GLASS_GREEN);
-							search.push_back(CONTENT_ROOFTILE_GLASS_ORANGE);
-							search.push_back(CONTENT_ROOFTILE_GLASS_PURPLE);
-							search.push_back(CONTENT_ROOFTILE_GLASS_RED);
-							search.push_back(CONTENT_ROOFTILE_GLASS_YELLOW);
-							search.push_back(CONTENT_IGNORE);
-							if (!searchNearInv(p,v3s16(0,0,0),v3s16(0,16,0),search,NULL)) {
-								m_map->removeNodeWithEvent(p);
-							}
-						}
-					}else if (
-						season == ENV_SEASON_WINTER
-						|| (
-							season == ENV_SEASON_AUTUMN
-							&& myrand_range(0,10) == 0
-						)
-					) {
-						m_map->removeNodeWithEvent(p);
-					}
-					break;
+			}else{
+				if (n.param1 == 0x01) {
+					n.param1 = 0x02;
+					changes.updateNodeWithEvent(p,n);
+				}else if (n.param1 != 0) {
+					n.param1 = 0;
+					n.param2 = 0;
+					changes.updateNodeWithEvent(p,n);
 				}
-
-				case CONTENT_WATER:
-				case CONTENT_WATERSOURCE:
-				{
-					if (p.Y < 1024) {
-						bool chill = false;
-						if (coldzone) {
-							std::vector<content_t> search;
-							search.push_back(CONTENT_LAVASOURCE);
-							search.push_back(CONTENT_LAVA);
-							search.push_back(CONTENT_FIRE);
-							if (searchNear(p,v3s16(3,2,3),search,NULL))
-								chill = true;
-						}else if (season == ENV_SEASON_WINTER && biome != BIOME_DESERT) {
-							MapNode nu = m_map->getNodeNoEx(p+v3s16(0,-1,0));
-							MapNode no = m_map->getNodeNoEx(p+v3s16(0,1,0));
-							if (nu.getContent() == CONTENT_MUD && no.getContent() == CONTENT_AIR && myrand_range(0,3) == 0)
-								chill = true;
-						}
-
-						if (chill) {
-							n.setContent(CONTENT_ICE);
-							m_map->addNodeWithEvent(p, n);
-						}
+			}
+			break;
+		}
+		case CONTENT_FARM_WHEAT:
+		case CONTENT_FARM_MELON:
+		case CONTENT_FARM_PUMPKIN:
+		case CONTENT_FARM_POTATO:
+		case CONTENT_FARM_CARROT:
+		case CONTENT_FARM_BEETROOT:
+		case CONTENT_FARM_COTTON:
+		{
+			MapNode n_btm = changes.getNodeNoEx(p+v3s16(0,-1,0));
+			if (n_btm.getContent() == CONTENT_FARM_DIRT) {
+				/* requires a glass roof (greenhouse) */
+				if (coldzone) {
+					std::vector<content_t> search;
+					search.push_back(CONTENT_GLASS);
+					search.push_back(CONTENT_GLASS_SLAB);
+					search.push_back(CONTENT_GLASS_SLAB_UD);
+					search.push_back(CONTENT_GLASSLIGHT);
+					search.push_back(CONTENT_GLASS_BLACK);
+					search.push_back(CONTENT_GLASS_BLACK_SLAB);
+					search.push_back(CONTENT_GLASS_BLACK_SLAB_UD);
+					search.push_back(CONTENT_GLASS_BLUE);
+					search.push_back(CONTENT_GLASS_BLUE_SLAB);
+					search.push_back(CONTENT_GLASS_BLUE_SLAB_UD);
+					search.push_back(CONTENT_GLASS_GREEN);
+					search.push_back(CONTENT_GLASS_GREEN_SLAB);
+					search.push_back(CONTENT_GLASS_GREEN_SLAB_UD);
+					search.push_back(CONTENT_GLASS_ORANGE);
+					search.push_back(CONTENT_GLASS_ORANGE_SLAB);
+					search.push_back(CONTENT_GLASS_ORANGE_SLAB_UD);
+					search.push_back(CONTENT_GLASS_PURPLE);
+					search.push_back(CONTENT_GLASS_PURPLE_SLAB);
+					search.push_back(CONTENT_GLASS_PURPLE_SLAB_UD);
+					search.push_back(CONTENT_GLASS_RED);
+					search.push_back(CONTENT_GLASS_RED_SLAB);
+					search.push_back(CONTENT_GLASS_RED_SLAB_UD);
+					search.push_back(CONTENT_GLASS_YELLOW);
+					search.push_back(CONTENT_GLASS_YELLOW_SLAB);
+					search.push_back(CONTENT_GLASS_YELLOW_SLAB_UD);
+					search.push_back(CONTENT_ROOFTILE_GLASS);
+					search.push_back(CONTENT_ROOFTILE_GLASS_BLACK);
+					search.push_back(CONTENT_ROOFTILE_GLASS_BLUE);
+					search.push_back(CONTENT_ROOFTILE_GLASS_GREEN);
+					search.push_back(CONTENT_ROOFTILE_GLASS_ORANGE);
+					search.push_back(CONTENT_ROOFTILE_GLASS_PURPLE);
+					search.push_back(CONTENT_ROOFTILE_GLASS_RED);
+					search.push_back(CONTENT_ROOFTILE_GLASS_YELLOW);
+					search.push_back(CONTENT_IGNORE);
+					if (!searchNearInv(p,v3s16(0,0,0),v3s16(0,16,0),search,NULL)) {
+						changes.removeNodeWithEvent(p);
 					}
-					break;
 				}
-
-				case CONTENT_ICE:
-				{
-					bool found = false;
-					if (coldzone) {
-						std::vector<content_t> search;
-						search.push_back(CONTENT_LAVASOURCE);
-						search.push_back(CONTENT_LAVA);
-						search.push_back(CONTENT_FIRE);
-						found = searchNear(p,v3s16(3,2,3),search,NULL);
-					}else{
-						found = true;
-					}
-					if (found) {
-						if (searchNear(p,v3s16(5,1,5),CONTENT_WATERSOURCE,NULL)) {
-							n.setContent(CONTENT_WATER);
-							m_map->addNodeWithEvent(p, n);
-						}else{
-							n.setContent(CONTENT_WATERSOURCE);
-							m_map->addNodeWithEvent(p, n);
-						}
-					}
-					break;
+			}else if (
+				season == ENV_SEASON_WINTER
+				|| (
+					season == ENV_SEASON_AUTUMN
+					&& myrand_range(0,10) == 0
+				)
+			) {
+				changes.removeNodeWithEvent(p);
+			}
+			break;
+		}
+
+		case CONTENT_WATER:
+		case CONTENT_WATERSOURCE:
+		{
+			if (p.Y < 1024) {
+				bool chill = false;
+				if (coldzone) {
+					std::vector<content_t> search;
+					search.push_back(CONTENT_LAVASOURCE);
+					search.push_back(CONTENT_LAVA);
+					search.push_back(CONTENT_FIRE);
+					if (searchNear(p,v3s16(3,2,3),search,NULL))
+						chill = true;
+				}else if (season == ENV_SEASON_WINTER && biome != BIOME_DESERT) {
+					MapNode nu = changes.getNodeNoEx(p+v3s16(0,-1,0));
+					MapNode no = changes.getNodeNoEx(p+v3s16(0,1,0));
+					if (nu.getContent() == CONTENT_MUD && no.getContent() == CONTENT_AIR && myrand_range(0,3) == 0)
+						chill = true;
 				}
 
-				case CONTENT_SNOW:
-				{
-					MapNode n_test = m_map->getNodeNoEx(p+v3s16(0,-1,0));
-					if (n_test.getContent() == CONTENT_AIR || !coldzone)
-						m_map->removeNodeWithEvent(p);
-					break;
+				if (chill) {
+					n.setContent(CONTENT_ICE);
+					changes.addNodeWithEvent(p, n);
 				}
+			}
+			break;
+		}
 
-				case CONTENT_SNOW_BLOCK:
-				{
-					if (p.Y < 1) {
-						if (searchNear(p,v3s16(3,1,3),CONTENT_WATERSOURCE,NULL)) {
-							n.setContent(CONTENT_WATER);
-							m_map->addNodeWithEvent(p, n);
-						}else{
-							n.setContent(CONTENT_WATERSOURCE);
-							m_map->addNodeWithEvent(p, n);
-						}
-					}else{
-						std::vector<content_t> search;
-						search.push_back(CONTENT_LAVASOURCE);
-						search.push_back(CONTENT_LAVA);
-						search.push_back(CONTENT_FIRE);
-						if (searchNear(p,v3s16(3,2,3),search,NULL)) {
-							n.setContent(CONTENT_WATERSOURCE);
-							m_map->addNodeWithEvent(p, n);
-						}
-					}
-					break;
+		case CONTENT_ICE:
+		{
+			bool found = false;
+			if (coldzone) {
+				std::vector<content_t> search;
+				search.push_back(CONTENT_LAVASOURCE);
+				search.push_back(CONTENT_LAVA);
+				search.push_back(CONTENT_FIRE);
+				found = searchNear(p,v3s16(3,2,3),search,NULL);
+			}else{
+				found = true;
+			}
+			if (found) {
+				if (searchNear(p,v3s16(5,1,5),CONTENT_WATERSOURCE,NULL)) {
+					n.setContent(CONTENT_WATER);
+					changes.addNodeWithEvent(p, n);
+				}else{
+					n.setContent(CONTENT_WATERSOURCE);
+					changes.addNodeWithEvent(p, n);
 				}
+			}
+			break;
+		}
 
-				// Grow stuff on farm dirt
-				case CONTENT_FARM_DIRT:
-				{
-					if (n.envticks%4 == 0) { // with this plants take around 10 minutes to grow
-						s16 max_d = 3;
-						v3s16 temp_p = p;
-						v3s16 test_p;
-						MapNode testnode;
-						u8 water_found = 0; // 1 = flowing, 2 = source
-						bool ignore_found = false;
-						for(s16 z=-max_d; water_found < 2 && z<=max_d; z++) {
-						for(s16 x=-max_d; water_found < 2 && x<=max_d; x++) {
-							test_p = temp_p + v3s16(x,0,z);
-							testnode = m_map->getNodeNoEx(test_p);
-							if (testnode.getContent() == CONTENT_WATERSOURCE) {
-								water_found = 2;
-							}else if (testnode.getContent() == CONTENT_WATER) {
-								water_found = 1;
-							}else if (testnode.getContent() == CONTENT_IGNORE) {
-								ignore_found = true;
-							}
-						}
-						}
+		case CONTENT_SNOW:
+		{
+			MapNode n_test = changes.getNodeNoEx(p+v3s16(0,-1,0));
+			if (n_test.getContent() == CONTENT_AIR || !coldzone)
+				changes.removeNodeWithEvent(p);
+			break;
+		}
 
-						if (water_found) {
-							test_p = temp_p + v3s16(0,1,0);
-							testnode = m_map->getNodeNoEx(test_p);
-							if (
-								content_features(testnode).draw_type == CDT_PLANTLIKE
-								|| content_features(testnode).draw_type == CDT_CROPLIKE
-							) {
-								if (content_features(testnode).param2_type == CPT_PLANTGROWTH) {
-									plantgrowth_plant(this,test_p);
-								}else if (content_features(testnode).special_alternate_node != CONTENT_IGNORE) {
-									plantgrowth_seed(this,test_p);
-								}
-							}else if (content_features(testnode).draw_type == CDT_MELONLIKE) {
-								if (content_features(testnode).param2_type == CPT_PLANTGROWTH)
-									plantgrowth_plant(this,test_p);
-							}else if (testnode.getContent() == CONTENT_CACTUS) {
-								plantgrowth_cactus(this,test_p);
-							}else if (testnode.getContent() == CONTENT_FERTILIZER) {
-								plantgrowth_fertilizer(this,test_p);
-							}else if (testnode.getContent() == CONTENT_AIR) {
-								int chance = 5;
-								if (water_found == 1)
-									chance = 2;
-								if (myrand()%chance != 0) {
-									// grow flower
-									n.setContent(CONTENT_FLOWER_STEM);
-									m_map->addNodeWithEvent(test_p,n);
-								}
-							}
-						}else if (!ignore_found) {
-							// revert to mud
-							n.setContent(CONTENT_MUD);
-							m_map->addNodeWithEvent(p,n);
-						}
-					}
-					break;
+		case CONTENT_SNOW_BLOCK:
+		{
+			if (p.Y < 1) {
+				if (searchNear(p,v3s16(3,1,3),CONTENT_WATERSOURCE,NULL)) {
+					n.setContent(CONTENT_WATER);
+					changes.addNodeWithEvent(p, n);
+				}else{
+					n.setContent(CONTENT_WATERSOURCE);
+					changes.addNodeWithEvent(p, n);
 				}
-				/*
-					make vines die
-				 */
-				case CONTENT_FARM_GRAPEVINE:
-				{
-					if (n.envticks%3 == 0) {
-						MapNode n_btm = m_map->getNodeNoEx(p+v3s16(0,-1,0));
-						if (
-							n_btm.getContent() != CONTENT_FARM_GRAPEVINE
-							&& n_btm.getContent() != CONTENT_FARM_DIRT
-							&& n_btm.getContent() != CONTENT_MUD
-						) {
-							n.setContent(CONTENT_DEAD_VINE);
-							m_map->addNodeWithEvent(p, n);
-						}
-					}
-					break;
+			}else{
+				std::vector<content_t> search;
+				search.push_back(CONTENT_LAVASOURCE);
+				search.push_back(CONTENT_LAVA);
+				search.push_back(CONTENT_FIRE);
+				if (searchNear(p,v3s16(3,2,3),search,NULL)) {
+					n.setContent(CONTENT_WATERSOURCE);
+					changes.addNodeWithEvent(p, n);
 				}
-				case CONTENT_FARM_TRELLIS_GRAPE:
-				{
-					if (n.envticks%3 == 0) {
-						MapNode n_btm = m_map->getNodeNoEx(p+v3s16(0,-1,0));
-						if (
-							n_btm.getContent() != CONTENT_FARM_TRELLIS_GRAPE
-							&& n_btm.getContent() != CONTENT_FARM_DIRT
-							&& n_btm.getContent() != CONTENT_MUD
-						) {
-							n.setContent(CONTENT_TRELLIS_DEAD_VINE);
-							m_map->addNodeWithEvent(p, n);
-						}
+			}
+			break;
+		}
+
+		// Grow stuff on farm dirt
+		case CONTENT_FARM_DIRT:
+		{
+			if (n.envticks%4 == 0) { // with this plants take around 10 minutes to grow
+				s16 max_d = 3;
+				v3s16 temp_p = p;
+				v3s16 test_p;
+				MapNode testnode;
+				u8 water_found = 0; // 1 = flowing, 2 = source
+				bool ignore_found = false;
+				for(s16 z=-max_d; water_found < 2 && z<=max_d; z++) {
+				for(s16 x=-max_d; water_found < 2 && x<=max_d; x++) {
+					test_p = temp_p + v3s16(x,0,z);
+					testnode = changes.getNodeNoEx(test_p);
+					if (testnode.getContent() == CONTENT_WATERSOURCE) {
+						water_found = 2;
+					}else if (testnode.getContent() == CONTENT_WATER) {
+						water_found = 1;
+					}else if (testnode.getContent() == CONTENT_IGNORE) {
+						ignore_found = true;
 					}
-					break;
+				}
 				}
 
-				case CONTENT_WILDGRASS_SHORT:
-				{
-					MapNode n_btm = m_map->getNodeNoEx(p+v3s16(0,-1,0));
+				if (water_found) {
+					test_p = temp_p + v3s16(0,1,0);
+					testnode = changes.getNodeNoEx(test_p);
 					if (
-						n_btm.getContent() == CONTENT_GRASS
-						|| n_btm.getContent() == CONTENT_GRASS_AUTUMN
-						|| n_btm.getContent() == CONTENT_MUDSNOW
-						|| n_btm.getContent() == CONTENT_MUD
+						content_features(testnode).draw_type == CDT_PLANTLIKE
+						|| content_features(testnode).draw_type == CDT_CROPLIKE
 					) {
-						if (p.Y > -1 && n.envticks > 10) {
-							MapNode n_top = m_map->getNodeNoEx(p+v3s16(0,1,0));
-							if (n_btm.getContent() != CONTENT_MUD) {
-								if (n_top.getLightBlend(getDayNightRatio()) >= 13) {
-									u32 chance = 20;
-									switch (season) {
-									case ENV_SEASON_SUMMER:
-										chance = 10;
-										break;
-									case ENV_SEASON_AUTUMN:
-										chance = 15;
-										break;
-									case ENV_SEASON_SPRING:
-										chance = 5;
-										break;
-									default:;
-									}
-									if (myrand_range(0,chance) == 0) {
-										n.setContent(CONTENT_FLOWER_STEM);
-										m_map->addNodeWithEvent(p, n);
-									}else{
-										n.setContent(CONTENT_WILDGRASS_LONG);
-										m_map->addNodeWithEvent(p, n);
-									}
-								}
-							}
+						if (content_features(testnode).param2_type == CPT_PLANTGROWTH) {
+							changes.plantgrowthPlant(test_p);
+						}else if (content_features(testnode).special_alternate_node != CONTENT_IGNORE) {
+							changes.plantgrowth(plantgrowth_seed,test_p);
+						}
+					}else if (content_features(testnode).draw_type == CDT_MELONLIKE) {
+						if (content_features(testnode).param2_type == CPT_PLANTGROWTH)
+							changes.plantgrowthPlant(test_p);
+					}else if (testnode.getContent() == CONTENT_CACTUS) {
+						changes.plantgrowth(plantgrowth_cactus,test_p);
+					}else if (testnode.getContent() == CONTENT_FERTILIZER) {
+						changes.plantgrowth(plantgrowth_fertilizer,test_p);
+					}else if (testnode.getContent() == CONTENT_AIR) {
+						int chance = 5;
+						if (water_found == 1)
+							chance = 2;
+						if (myrand()%chance != 0) {
+							// grow flower
+							n.setContent(CONTENT_FLOWER_STEM);
+							changes.addNodeWithEvent(test_p,n);
 						}
-					}else{
-						m_map->removeNodeWithEvent(p);
 					}
-					break;
+				}else if (!ignore_found) {
+					// revert to mud
+					n.setContent(CONTENT_MUD);
+					changes.addNodeWithEvent(p,n);
 				}
-
-				case CONTENT_WILDGRASS_LONG:
-				{
-					MapNode n_btm = m_map->getNodeNoEx(p+v3s16(0,-1,0));
-					if (
-						n_btm.getContent() != CONTENT_GRASS
-						&& n_btm.getContent() != CONTENT_GRASS_AUTUMN
-						&& n_btm.getContent() != CONTENT_MUDSNOW
-						&& n_btm.getContent() != CONTENT_MUD
-					) {
-						m_map->removeNodeWithEvent(p);
-					}
-					break;
+			}
+			break;
+		}
+		/*
+			make vines die
+		 */
+		case CONTENT_FARM_GRAPEVINE:
+		{
+			if (n.envticks%3 == 0) {
+				MapNode n_btm = changes.getNodeNoEx(p+v3s16(0,-1,0));
+				if (
+					n_btm.getContent() != CONTENT_FARM_GRAPEVINE
+					&& n_btm.getContent() != CONTENT_FARM_DIRT
+					&& n_btm.getContent() != CONTENT_MUD
+				) {
+					n.setContent(CONTENT_DEAD_VINE);
+					changes.addNodeWithEvent(p, n);
+				}
+			}
+			break;
+		}
+		case CONTENT_FARM_TRELLIS_GRAPE:
+		{
+			if (n.envticks%3 == 0) {
+				MapNode n_btm = changes.getNodeNoEx(p+v3s16(0,-1,0));
+				if (
+					n_btm.getContent() != CONTENT_FARM_TRELLIS_GRAPE
+					&& n_btm.getContent() != CONTENT_FARM_DIRT
+					&& n_btm.getContent() != CONTENT_MUD
+				) {
+					n.setContent(CONTENT_TRELLIS_DEAD_VINE);
+					changes.addNodeWithEvent(p, n);
 				}
+			}
+			break;
+		}
 
-				case CONTENT_FLOWER_STEM:
-				{
-					MapNode n_btm = m_map->getNodeNoEx(p+v3s16(0,-1,0));
-					int ch = 0;
-					if (
-						n_btm.getContent() == CONTENT_GRASS
-						|| n_btm.getContent() == CONTENT_GRASS_AUTUMN
-						|| n_btm.getContent() == CONTENT_MUD
-					)
-						ch = 100;
-					if (n_btm.getContent() == CONTENT_FARM_DIRT)
-						ch = 50;
-					if (ch) {
-						if (season == ENV_SEASON_SPRING)
-							break;
-						if ((ch == 50 || p.Y > -1) && n.envticks > 20) {
-							MapNode n_top = m_map->getNodeNoEx(p+v3s16(0,1,0));
-							if (n_top.getLightBlend(getDayNightRatio()) >= 13) {
-								switch (myrand()%3) {
-								case 0:
-									n.setContent(CONTENT_FLOWER_ROSE);
-									m_map->addNodeWithEvent(p, n);
-									break;
-								case 1:
-									n.setContent(CONTENT_FLOWER_DAFFODIL);
-									m_map->addNodeWithEvent(p, n);
-									break;
-								case 2:
-									n.setContent(CONTENT_FLOWER_TULIP);
-									m_map->addNodeWithEvent(p, n);
-									break;
-								}
+		case CONTENT_WILDGRASS_SHORT:
+		{
+			MapNode n_btm = changes.getNodeNoEx(p+v3s16(0,-1,0));
+			if (
+				n_btm.getContent() == CONTENT_GRASS
+				|| n_btm.getContent() == CONTENT_GRASS_AUTUMN
+				|| n_btm.getContent() == CONTENT_MUDSNOW
+				|| n_btm.getContent() == CONTENT_MUD
+			) {
+				if (p.Y > -1 && n.envticks > 10) {
+					MapNode n_top = changes.getNodeNoEx(p+v3s16(0,1,0));
+					if (n_btm.getContent() != CONTENT_MUD) {
+						if (n_top.getLightBlend(getDayNightRatio()) >= 13) {
+							u32 chance = 20;
+							switch (season) {
+							case ENV_SEASON_SUMMER:
+								chance = 10;
+								break;
+							case ENV_SEASON_AUTUMN:
+								chance = 15;
+								break;
+							case ENV_SEASON_SPRING:
+								chance = 5;
+								break;
+							default:;
+							}
+							if (myrand_range(0,chance) == 0) {
+								n.setContent(CONTENT_FLOWER_STEM);
+								changes.addNodeWithEvent(p, n);
+							}else{
+								n.setContent(CONTENT_WILDGRASS_LONG);
+								changes.addNodeWithEvent(p, n);
 							}
 						}
-					}else{
-						m_map->removeNodeWithEvent(p);
 					}
-					break;
 				}
+			}else{
+				changes.removeNodeWithEvent(p);
+			}
+			break;
+		}
 
-				case CONTENT_DEADGRASS:
-				{
-					MapNode n_btm = m_map->getNodeNoEx(p+v3s16(0,-1,0));
-					if (
-						n_btm.getContent() == CONTENT_GRASS
-						|| n_btm.getContent() == CONTENT_GRASS_AUTUMN
-						|| n_btm.getContent() == CONTENT_MUDSNOW
-						|| n_btm.getContent() == CONTENT_MUD
-					) {
-						n.setContent(CONTENT_WILDGRASS_LONG);
-						m_map->addNodeWithEvent(p, n);
-					}else{
-						m_map->removeNodeWithEvent(p);
-					}
-					break;
-				}
+		case CONTENT_WILDGRASS_LONG:
+		{
+			MapNode n_btm = changes.getNodeNoEx(p+v3s16(0,-1,0));
+			if (
+				n_btm.getContent() != CONTENT_GRASS
+				&& n_btm.getContent() != CONTENT_GRASS_AUTUMN
+				&& n_btm.getContent() != CONTENT_MUDSNOW
+				&& n_btm.getContent() != CONTENT_MUD
+			) {
+				changes.removeNodeWithEvent(p);
+			}
+			break;
+		}
 
-				case CONTENT_FLOWER_ROSE:
-				case CONTENT_FLOWER_DAFFODIL:
-				case CONTENT_FLOWER_TULIP:
-				{
-					MapNode n_under = m_map->getNodeNoEx(p+v3s16(0,-1,0));
-					if (n_under.getContent() == CONTENT_GRASS || n_under.getContent() == CONTENT_GRASS_AUTUMN) {
-						u32 chance = 0;
-						switch (season) {
-						case ENV_SEASON_AUTUMN:
-							chance = 10;
+		case CONTENT_FLOWER_STEM:
+		{
+			MapNode n_btm = changes.getNodeNoEx(p+v3s16(0,-1,0));
+			int ch = 0;
+			if (
+				n_btm.getContent() == CONTENT_GRASS
+				|| n_btm.getContent() == CONTENT_GRASS_AUTUMN
+				|| n_btm.getContent() == CONTENT_MUD
+			)
+				ch = 100;
+			if (n_btm.getContent() == CONTENT_FARM_DIRT)
+				ch = 50;
+			if (ch) {
+				if (season == ENV_SEASON_SPRING)
+					break;
+				if ((ch == 50 || p.Y > -1) && n.envticks > 20) {
+					MapNode n_top = changes.getNodeNoEx(p+v3s16(0,1,0));
+					if (n_top.getLightBlend(getDayNightRatio()) >= 13) {
+						switch (myrand()%3) {
+						case 0:
+							n.setContent(CONTENT_FLOWER_ROSE);
+							changes.addNodeWithEvent(p, n);
 							break;
-						case ENV_SEASON_WINTER:
-							chance = 5;
+						case 1:
+							n.setContent(CONTENT_FLOWER_DAFFODIL);
+							changes.addNodeWithEvent(p, n);
+							break;
+						case 2:
+							n.setContent(CONTENT_FLOWER_TULIP);
+							changes.addNodeWithEvent(p, n);
 							break;
-						default:;
-						}
-						if (chance && myrand_range(0,chance) == 0) {
-							n.setContent(CONTENT_WILDGRASS_SHORT);
-							m_map->addNodeWithEvent(p, n);
 						}
-					}else if (n_under.getContent() != CONTENT_FLOWER_POT && n_under.getContent() != CONTENT_FARM_DIRT) {
-						n.setContent(CONTENT_WILDGRASS_SHORT);
-						m_map->addNodeWithEvent(p, n);
 					}
+				}
+			}else{
+				changes.removeNodeWithEvent(p);
+			}
+			break;
+		}
+
+		case CONTENT_DEADGRASS:
+		{
+			MapNode n_btm = changes.getNodeNoEx(p+v3s16(0,-1,0));
+			if (
+				n_btm.getContent() == CONTENT_GRASS
+				|| n_btm.getContent() == CONTENT_GRASS_AUTUMN
+				|| n_btm.getContent() == CONTENT_MUDSNOW
+				|| n_btm.getContent() == CONTENT_MUD
+			) {
+				n.setContent(CONTENT_WILDGRASS_LONG);
+				changes.addNodeWithEvent(p, n);
+			}else{
+				changes.removeNodeWithEvent(p);
+			}
+			break;
+		}
+
+		case CONTENT_FLOWER_ROSE:
+		case CONTENT_FLOWER_DAFFODIL:
+		case CONTENT_FLOWER_TULIP:
+		{
+			MapNode n_under = changes.getNodeNoEx(p+v3s16(0,-1,0));
+			if (n_under.getContent() == CONTENT_GRASS || n_under.getContent() == CONTENT_GRASS_AUTUMN) {
+				u32 chance = 0;
+				switch (season) {
+				case ENV_SEASON_AUTUMN:
+					chance = 10;
+					break;
+				case ENV_SEASON_WINTER:
+					chance = 5;
 					break;
+				default:;
 				}
+				if (chance && myrand_range(0,chance) == 0) {
+					n.setContent(CONTENT_WILDGRASS_SHORT);
+					changes.addNodeWithEvent(p, n);
+				}
+			}else if (n_under.getContent() != CONTENT_FLOWER_POT && n_under.getContent() != CONTENT_FARM_DIRT) {
+				n.setContent(CONTENT_WILDGRASS_SHORT);
+				changes.addNodeWithEvent(p, n);
+			}
+			break;
+		}
 
-				// cactus flowers and fruit
-				case CONTENT_CACTUS:
-				{
-					if (n.envticks > 30) {
-						bool fully_grown = false;
-						int found = 1;
-						v3s16 p_test = p;
-						MapNode n_test = m_map->getNodeNoEx(v3s16(p.X, p.Y+1, p.Z));
-
-						// can't grow anything if there's something above the cactus
-						if (n_test.getContent() != CONTENT_AIR)
-							break;
+		// cactus flowers and fruit
+		case CONTENT_CACTUS:
+		{
+			if (n.envticks > 30) {
+				bool fully_grown = false;
+				int found = 1;
+				v3s16 p_test = p;
+				MapNode n_test = changes.getNodeNoEx(v3s16(p.X, p.Y+1, p.Z));
+
+				// can't grow anything if there's something above the cactus
+				if (n_test.getContent() != CONTENT_AIR)
+					break;
 
-						while (fully_grown == false) {
-							p_test.Y--;
-							n_test = m_map->getNodeNoEx(p_test);
+				while (fully_grown == false) {
+					p_test.Y--;
+					n_test = changes.getNodeNoEx(p_test);
 
-							// look down the cactus counting the number of cactus nodes
-							if (n_test.getContent() == CONTENT_CACTUS) {
-								found++;
+					// look down the cactus counting the number of cactus nodes
+					if (n_test.getContent() == CONTENT_CACTUS) {
+						found++;
 
-								// cacti don't grow above 4 naturally, don't grow flowers on tall cactus-pillars
-								if (found > 4) {
-									break;
-								}
+						// cacti don't grow above 4 naturally, don't grow flowers on tall cactus-pillars
+						if (found > 4) {
+							break;
+						}
+					}else{
+						// cacti grow to 3 nodes on sand
+						// and 4 nodes on farm dirt
+						if (n_test.getContent() == CONTENT_SAND) {
+							if (found == 3) {
+								fully_grown = true;
+								break;
 							}else{
-								// cacti grow to 3 nodes on sand
-								// and 4 nodes on farm dirt
-								if (n_test.getContent() == CONTENT_SAND) {
-									if (found == 3) {
-										fully_grown = true;
-										break;
-									}else{
-										break;
-									}
-								}else if (n_test.getContent() == CONTENT_FARM_DIRT) {
-									if (found == 4) {
-										fully_grown = true;
-										break;
-									}else{
-										break;
-									}
-								}
+								break;
+							}
+						}else if (n_test.getContent() == CONTENT_FARM_DIRT) {
+							if (found == 4) {
+								fully_grown = true;
+								break;
+							}else{
+								break;
 							}
-						}
-
-						if (fully_grown == true) {
-							n.setContent(CONTENT_CACTUS_BLOSSOM);
-							m_map->addNodeWithEvent(v3s16(p.X, p.Y+1, p.Z), n);
 						}
 					}
-					break;
 				}
 
-				case CONTENT_CACTUS_BLOSSOM:
-				{
-					if (n.envticks > 30) {
-						MapNode n_test=m_map->getNodeNoEx(v3s16(p.X, p.Y-1, p.Z));
-						if (n_test.getContent() == CONTENT_CACTUS) {
-							n.setContent(CONTENT_CACTUS_FLOWER);
-							m_map->addNodeWithEvent(p, n);
-						}
-					}
-					break;
+				if (fully_grown == true) {
+					n.setContent(CONTENT_CACTUS_BLOSSOM);
+					changes.addNodeWithEvent(v3s16(p.X, p.Y+1, p.Z), n);
 				}
+			}
+			break;
+		}
 
-				case CONTENT_CACTUS_FLOWER:
-				{
-					if (n.envticks > 30) {
-						MapNode n_test=m_map->getNodeNoEx(v3s16(p.X, p.Y-1, p.Z));
-						// sometimes fruit, sometimes the flower dies
-						if (n_test.getContent() == CONTENT_CACTUS && myrand()%10 < 6) {
-							n.setContent(CONTENT_CACTUS_FRUIT);
-							m_map->addNodeWithEvent(p, n);
-						}else{
-							m_map->removeNodeWithEvent(p);
-						}
-					}
-					break;
+		case CONTENT_CACTUS_BLOSSOM:
+		{
+			if (n.envticks > 30) {
+				MapNode n_test=changes.getNodeNoEx(v3s16(p.X, p.Y-1, p.Z));
+				if (n_test.getContent() == CONTENT_CACTUS) {
+					n.setContent(CONTENT_CACTUS_FLOWER);
+					changes.addNodeWithEvent(p, n);
 				}
+			}
+			break;
+		}
 
-				case CONTENT_CACTUS_FRUIT:
-				{
-					if (n.envticks > 60) {
-						MapNode n_test=m_map->getNodeNoEx(v3s16(p.X, p.Y-1, p.Z));
-						// when the fruit dies, sometimes a new blossom appears
-						if (n_test.getContent() == CONTENT_CACTUS && myrand()%10 == 0) {
-							n.setContent(CONTENT_CACTUS_BLOSSOM);
-							m_map->addNodeWithEvent(p, n);
-						}else{
-							m_map->removeNodeWithEvent(p);
-							InventoryItem *item = InventoryItem::create(CONTENT_CRAFTITEM_MUSH,1,0,0);
-							dropToParcel(p,item);
-						}
-					}
-					break;
+		case CONTENT_CACTUS_FLOWER:
+		{
+			if (n.envticks > 30) {
+				MapNode n_test=changes.getNodeNoEx(v3s16(p.X, p.Y-1, p.Z));
+				// sometimes fruit, sometimes the flower dies
+				if (n_test.getContent() == CONTENT_CACTUS && myrand()%10 < 6) {
+					n.setContent(CONTENT_CACTUS_FRUIT);
+					changes.addNodeWithEvent(p, n);
+				}else{
+					changes.removeNodeWithEvent(p);
 				}
+			}
+			break;
+		}
 
-				// growing apples!
-				case CONTENT_APPLE_LEAVES:
-				{
-					std::vector<content_t> search;
-					search.push_back(CONTENT_APPLE_TREE);
-					search.push_back(CONTENT_YOUNG_APPLE_TREE);
-					search.push_back(CONTENT_IGNORE);
-					if (!searchNear(p,v3s16(3,3,3),search,NULL)) {
-						m_map->removeNodeWithEvent(p);
-						if (myrand()%10 == 0) {
-							InventoryItem *item = InventoryItem::create(CONTENT_APPLE_LEAVES,1,0,0);
-							/* actual drops/places grass or a sapling */
-							dropToParcel(p,item);
-						}
-					}else if (
-						n.envticks%30 == 0
-						&& (
-							season == ENV_SEASON_WINTER
-							|| season == ENV_SEASON_SPRING
-						) && (
-							biome == BIOME_UNKNOWN
-							|| biome == BIOME_LAKE
-							|| biome == BIOME_WOODLANDS
-							|| biome == BIOME_FOREST
-							|| biome == BIOME_PLAINS
-						)
-					) {
-						if (searchNear(p,v3s16(3,3,3),CONTENT_APPLE_TREE,NULL)) {
-							if (!searchNear(p,v3s16(1,1,1),CONTENT_APPLE_BLOSSOM,NULL)) {
-								n.setContent(CONTENT_APPLE_BLOSSOM);
-								m_map->addNodeWithEvent(p, n);
-							}
-						}
-					}
-					break;
+		case CONTENT_CACTUS_FRUIT:
+		{
+			if (n.envticks > 60) {
+				MapNode n_test=changes.getNodeNoEx(v3s16(p.X, p.Y-1, p.Z));
+				// when the fruit dies, sometimes a new blossom appears
+				if (n_test.getContent() == CONTENT_CACTUS && myrand()%10 == 0) {
+					n.setContent(CONTENT_CACTUS_BLOSSOM);
+					changes.addNodeWithEvent(p, n);
+				}else{
+					changes.removeNodeWithEvent(p);
+					InventoryItem *item = InventoryItem::create(CONTENT_CRAFTITEM_MUSH,1,0,0);
+					changes.dropToParcel(p,item);
 				}
-				case CONTENT_JUNGLELEAVES:
-				{
-					std::vector<content_t> search;
-					search.push_back(CONTENT_JUNGLETREE);
-					search.push_back(CONTENT_YOUNG_JUNGLETREE);
-					search.push_back(CONTENT_IGNORE);
-					if (!searchNear(p,v3s16(3,3,3),search,NULL)) {
-						m_map->removeNodeWithEvent(p);
-						if (myrand()%10 == 0) {
-							InventoryItem *item = InventoryItem::create(CONTENT_JUNGLELEAVES,1,0,0);
-							/* actual drops/places grass or a sapling */
-							dropToParcel(p,item);
-						}
-					}
-					break;
+			}
+			break;
+		}
+
+		// growing apples!
+		case CONTENT_APPLE_LEAVES:
+		{
+			std::vector<content_t> search;
+			search.push_back(CONTENT_APPLE_TREE);
+			search.push_back(CONTENT_YOUNG_APPLE_TREE);
+			search.push_back(CONTENT_IGNORE);
+			if (!searchNear(p,v3s16(3,3,3),search,NULL)) {
+				changes.removeNodeWithEvent(p);
+				if (myrand()%10 == 0) {
+					InventoryItem *item = InventoryItem::create(CONTENT_APPLE_LEAVES,1,0,0);
+					/* actual drops/places grass or a sapling */
+					changes.dropToParcel(p,item);
 				}
-				case CONTENT_CONIFER_LEAVES:
-				{
-					std::vector<content_t> search;
-					search.push_back(CONTENT_CONIFER_TREE);
-					search.push_back(CONTENT_YOUNG_CONIFER_TREE);
-					search.push_back(CONTENT_IGNORE);
-					if (!searchNear(p,v3s16(3,3,3),search,NULL)) {
-						m_map->removeNodeWithEvent(p);
-						if (myrand()%10 == 0) {
-							InventoryItem *item = InventoryItem::create(CONTENT_CONIFER_LEAVES,1,0,0);
-							/* actual drops/places grass or a sapling */
-							dropToParcel(p,item);
-						}
+			}else if (
+				n.envticks%30 == 0
+				&& (
+					season == ENV_SEASON_WINTER
+					|| season == ENV_SEASON_SPRING
+				) && (
+					biome == BIOME_UNKNOWN
+					|| biome == BIOME_LAKE
+					|| biome == BIOME_WOODLANDS
+					|| biome == BIOME_FOREST
+					|| biome == BIOME_PLAINS
+				)
+			) {
+				if (searchNear(p,v3s16(3,3,3),CONTENT_APPLE_TREE,NULL)) {
+					if (!searchNear(p,v3s16(1,1,1),CONTENT_APPLE_BLOSSOM,NULL)) {
+						n.setContent(CONTENT_APPLE_BLOSSOM);
+						changes.addNodeWithEvent(p, n);
 					}
-					break;
 				}
+			}
+			break;
+		}
+		case CONTENT_JUNGLELEAVES:
+		{
+			std::vector<content_t> search;
+			search.push_back(CONTENT_JUNGLETREE);
+			search.push_back(CONTENT_YOUNG_JUNGLETREE);
+			search.push_back(CONTENT_IGNORE);
+			if (!searchNear(p,v3s16(3,3,3),search,NULL)) {
+				changes.removeNodeWithEvent(p);
+				if (myrand()%10 == 0) {
+					InventoryItem *item = InventoryItem::create(CONTENT_JUNGLELEAVES,1,0,0);
+					/* actual drops/places grass or a sapling */
+					changes.dropToParcel(p,item);
+				}
+			}
+			break;
+		}
+		case CONTENT_CONIFER_LEAVES:
+		{
+			std::vector<content_t> search;
+			search.push_back(CONTENT_CONIFER_TREE);
+			search.push_back(CONTENT_YOUNG_CONIFER_TREE);
+			search.push_back(CONTENT_IGNORE);
+			if (!searchNear(p,v3s16(3,3,3),search,NULL)) {
+				changes.removeNodeWithEvent(p);
+				if (myrand()%10 == 0) {
+					InventoryItem *item = InventoryItem::create(CONTENT_CONIFER_LEAVES,1,0,0);
+					/* actual drops/places grass or a sapling */
+					changes.dropToParcel(p,item);
+				}
+			}
+			break;
+		}
 
-				// leaf decay
-				case CONTENT_LEAVES:
-				case CONTENT_LEAVES_AUTUMN:
-				case CONTENT_LEAVES_WINTER:
-				case CONTENT_LEAVES_SNOWY:
-				{
-					if (myrand()%4 == 0) {
-						v3s16 leaf_p = p;
-						std::vector<content_t> search;
-						search.push_back(CONTENT_TREE);
-						search.push_back(CONTENT_YOUNG_TREE);
-						search.push_back(CONTENT_IGNORE);
-						if (biome == BIOME_WASTELANDS) {
-							m_map->removeNodeWithEvent(leaf_p);
-						}else if (!searchNear(p,v3s16(3,3,3),search,NULL)) {
-							m_map->removeNodeWithEvent(leaf_p);
-							if (myrand()%10 == 0) {
-								InventoryItem *item = InventoryItem::create(CONTENT_LEAVES,1,0,0);
-								/* actual drops/places grass or a sapling */
-								dropToParcel(p,item);
-							}
-						}else if (biome == BIOME_DESERT || biome == BIOME_THEDEEP) {
-							if (n.getContent() != CONTENT_LEAVES_AUTUMN) {
-								n.setContent(CONTENT_LEAVES_AUTUMN);
-								m_map->addNodeWithEvent(p,n);
-							}
-						}else if (biome == BIOME_SPACE) {
-							if (n.getContent() != CONTENT_LEAVES) {
-								n.setContent(CONTENT_LEAVES);
-								m_map->addNodeWithEvent(p,n);
-							}
-						}else if (n.getContent() == CONTENT_LEAVES) {
-							if (season == ENV_SEASON_AUTUMN) {
-								n.setContent(CONTENT_LEAVES_AUTUMN);
-								m_map->addNodeWithEvent(p,n);
-							}else if (season == ENV_SEASON_WINTER) {
-								n.setContent(CONTENT_LEAVES_WINTER);
-								m_map->addNodeWithEvent(p,n);
-							}
-						}else if (n.getContent() == CONTENT_LEAVES_AUTUMN) {
-							if (season == ENV_SEASON_WINTER) {
-								n.setContent(CONTENT_LEAVES_WINTER);
-								m_map->addNodeWithEvent(p,n);
-							}else if (season != ENV_SEASON_AUTUMN) {
-								n.setContent(CONTENT_LEAVES);
-								m_map->addNodeWithEvent(p,n);
-							}
-						}else if (n.getContent() == CONTENT_LEAVES_WINTER) {
-							if (season == ENV_SEASON_AUTUMN) {
-								n.setContent(CONTENT_LEAVES_AUTUMN);
-								m_map->addNodeWithEvent(p,n);
-							}else if (season == ENV_SEASON_WINTER) {
-								if (myrand_range(0,5) && p.Y > 0) {
-									n.setContent(CONTENT_LEAVES_SNOWY);
-									m_map->addNodeWithEvent(p,n);
-								}
-							}else{
-								n.setContent(CONTENT_LEAVES);
-								m_map->addNodeWithEvent(p,n);
-							}
-						}else if (n.getContent() == CONTENT_LEAVES_SNOWY) {
-							if (season != ENV_SEASON_WINTER) {
-								n.setContent(CONTENT_LEAVES_WINTER);
-								m_map->addNodeWithEvent(p,n);
-							}
+		// leaf decay
+		case CONTENT_LEAVES:
+		case CONTENT_LEAVES_AUTUMN:
+		case CONTENT_LEAVES_WINTER:
+		case CONTENT_LEAVES_SNOWY:
+		{
+			if (myrand()%4 == 0) {
+				v3s16 leaf_p = p;
+				std::vector<content_t> search;
+				search.push_back(CONTENT_TREE);
+				search.push_back(CONTENT_YOUNG_TREE);
+				search.push_back(CONTENT_IGNORE);
+				if (biome == BIOME_WASTELANDS) {
+					changes.removeNodeWithEvent(leaf_p);
+				}else if (!searchNear(p,v3s16(3,3,3),search,NULL)) {
+					changes.removeNodeWithEvent(leaf_p);
+					if (myrand()%10 == 0) {
+						InventoryItem *item = InventoryItem::create(CONTENT_LEAVES,1,0,0);
+						/* actual drops/places grass or a sapling */
+						changes.dropToParcel(p,item);
+					}
+				}else if (biome == BIOME_DESERT || biome == BIOME_THEDEEP) {
+					if (n.getContent() != CONTENT_LEAVES_AUTUMN) {
+						n.setContent(CONTENT_LEAVES_AUTUMN);
+						changes.addNodeWithEvent(p,n);
+					}
+				}else if (biome == BIOME_SPACE) {
+					if (n.getContent() != CONTENT_LEAVES) {
+						n.setContent(CONTENT_LEAVES);
+						changes.addNodeWithEvent(p,n);
+					}
+				}else if (n.getContent() == CONTENT_LEAVES) {
+					if (season == ENV_SEASON_AUTUMN) {
+						n.setContent(CONTENT_LEAVES_AUTUMN);
+						changes.addNodeWithEvent(p,n);
+					}else if (season == ENV_SEASON_WINTER) {
+						n.setContent(CONTENT_LEAVES_WINTER);
+						changes.addNodeWithEvent(p,n);
+					}
+				}else if (n.getContent() == CONTENT_LEAVES_AUTUMN) {
+					if (season == ENV_SEASON_WINTER) {
+						n.setContent(CONTENT_LEAVES_WINTER);
+						changes.addNodeWithEvent(p,n);
+					}else if (season != ENV_SEASON_AUTUMN) {
+						n.setContent(CONTENT_LEAVES);
+						changes.addNodeWithEvent(p,n);
+					}
+				}else if (n.getContent() == CONTENT_LEAVES_WINTER) {
+					if (season == ENV_SEASON_AUTUMN) {
+						n.setContent(CONTENT_LEAVES_AUTUMN);
+						changes.addNodeWithEvent(p,n);
+					}else if (season == ENV_SEASON_WINTER) {
+						if (myrand_range(0,5) && p.Y > 0) {
+							n.setContent(CONTENT_LEAVES_SNOWY);
+							changes.addNodeWithEvent(p,n);
 						}
+					}else{
+						n.setContent(CONTENT_LEAVES);
+						changes.addNodeWithEvent(p,n);
+					}
+				}else if (n.getContent() == CONTENT_LEAVES_SNOWY) {
+					if (season != ENV_SEASON_WINTER) {
+						n.setContent(CONTENT_LEAVES_WINTER);
+						changes.addNodeWithEvent(p,n);
 					}
-					break;
 				}
+			}
+			break;
+		}
 
-				case CONTENT_APPLE_BLOSSOM:
-				{
-					if (n.envticks > 30) {
-						// don't turn all blossoms to apples
-						// blossoms look nice
-						if (searchNear(p,v3s16(3,3,3),CONTENT_APPLE_TREE,NULL)) {
-							int found_apple = 0;
-
-							for(s16 x=-2; x<=2; x++)
-							for(s16 y=-2; y<=2; y++)
-							for(s16 z=-2; z<=2; z++)
-							{
-								MapNode n_test = m_map->getNodeNoEx(p+v3s16(x,y,z));
-								if (n_test.getContent() == CONTENT_APPLE) {
-									++found_apple;
-								}
-							}
-							if (found_apple < season) {
-								n.setContent(CONTENT_APPLE);
-								m_map->addNodeWithEvent(p, n);
-							}
-						}else{
-							m_map->removeNodeWithEvent(p);
-							if (myrand()%5 == 0) {
-								m_map->removeNodeWithEvent(p);
-								InventoryItem *item = InventoryItem::create(CONTENT_CRAFTITEM_APPLE_BLOSSOM,1,0,0);
-								dropToParcel(p,item);
-							}
+		case CONTENT_APPLE_BLOSSOM:
+		{
+			if (n.envticks > 30) {
+				// don't turn all blossoms to apples
+				// blossoms look nice
+				if (searchNear(p,v3s16(3,3,3),CONTENT_APPLE_TREE,NULL)) {
+					int found_apple = 0;
+
+					for(s16 x=-2; x<=2; x++)
+					for(s16 y=-2; y<=2; y++)
+					for(s16 z=-2; z<=2; z++)
+					{
+						MapNode n_test = changes.getNodeNoEx(p+v3s16(x,y,z));
+						if (n_test.getContent() == CONTENT_APPLE) {
+							++found_apple;
 						}
 					}
-					break;
+					if (found_apple < season) {
+						n.setContent(CONTENT_APPLE);
+						changes.addNodeWithEvent(p, n);
+					}
+				}else{
+					changes.removeNodeWithEvent(p);
+					if (myrand()%5 == 0) {
+						changes.removeNodeWithEvent(p);
+						InventoryItem *item = InventoryItem::create(CONTENT_CRAFTITEM_APPLE_BLOSSOM,1,0,0);
+						changes.dropToParcel(p,item);
+					}
 				}
+			}
+			break;
+		}
 
-				// fire that goes out
-				case CONTENT_FIRE_SHORTTERM:
-				{
-					if (unsafe_fire) {
-						if (n.envticks > 2) {
-							s16 bs_rad = config_get_int("world.game.borderstone.radius");
-							bs_rad += 2;
-							// if any node is border stone protected, don't spread
-							if (!searchNear(p,v3s16(bs_rad,bs_rad,bs_rad),CONTENT_BORDERSTONE,NULL)) {
-								for(s16 x=-1; x<=1; x++)
-								for(s16 y=-1; y<=1; y++)
-								for(s16 z=-1; z<=1; z++)
-								{
-									MapNode n_test = m_map->getNodeNoEx(p+v3s16(x,y,z));
-									if (n_test.getContent() == CONTENT_FIRE || n_test.getContent() == CONTENT_FIRE_SHORTTERM)
-										continue;
-									if (content_features(n_test).flammable > 0) {
-										content_t c = n_test.getContent();
-										if (content_features(c).onact_also_affects != v3s16(0,0,0)) {
-											v3s16 p_other = p+v3s16(x,y,z)+n_test.getEffectedRotation();
-											n_test.setContent(CONTENT_FIRE_SHORTTERM);
-											m_map->addNodeWithEvent(p_other, n_test);
-										}
-										n_test.setContent(CONTENT_FIRE_SHORTTERM);
-										m_map->addNodeWithEvent(p+v3s16(x,y,z), n_test);
-									}
+		// fire that goes out
+		case CONTENT_FIRE_SHORTTERM:
+		{
+			if (unsafe_fire) {
+				if (n.envticks > 2) {
+					s16 bs_rad = config_get_int("world.game.borderstone.radius");
+					bs_rad += 2;
+					// if any node is border stone protected, don't spread
+					if (!searchNear(p,v3s16(bs_rad,bs_rad,bs_rad),CONTENT_BORDERSTONE,NULL)) {
+						for(s16 x=-1; x<=1; x++)
+						for(s16 y=-1; y<=1; y++)
+						for(s16 z=-1; z<=1; z++)
+						{
+							MapNode n_test = changes.getNodeNoEx(p+v3s16(x,y,z));
+							if (n_test.getContent() == CONTENT_FIRE || n_test.getContent() == CONTENT_FIRE_SHORTTERM)
+								continue;
+							if (content_features(n_test).flammable > 0) {
+								content_t c = n_test.getContent();
+								if (content_features(c).onact_also_affects != v3s16(0,0,0)) {
+									v3s16 p_other = p+v3s16(x,y,z)+n_test.getEffectedRotation();
+									n_test.setContent(CONTENT_FIRE_SHORTTERM);
+									changes.addNodeWithEvent(p_other, n_test);
 								}
+								n_test.setContent(CONTENT_FIRE_SHORTTERM);
+								changes.addNodeWithEvent(p+v3s16(x,y,z), n_test);
 							}
 						}
-						if (n.envticks > 10) {
-							m_map->removeNodeWithEvent(p);
-							InventoryItem *item = InventoryItem::create(CONTENT_CRAFTITEM_ASH,1,0,0);
-							dropToParcel(p,item);
-						}
-					}else if (n.envticks > 2) {
-						m_map->removeNodeWithEvent(p);
-						InventoryItem *item = InventoryItem::create(CONTENT_CRAFTITEM_ASH,1,0,0);
-						dropToParcel(p,item);
 					}
-					break;
 				}
+				if (n.envticks > 10) {
+					changes.removeNodeWithEvent(p);
+					InventoryItem *item = InventoryItem::create(CONTENT_CRAFTITEM_ASH,1,0,0);
+					changes.dropToParcel(p,item);
+				}
+			}else if (n.envticks > 2) {
+				changes.removeNodeWithEvent(p);
+				InventoryItem *item = InventoryItem::create(CONTENT_CRAFTITEM_ASH,1,0,0);
+				changes.dropToParcel(p,item);
+			}
+			break;
+		}
 
-				// fire that spreads just a little
-				case CONTENT_FIRE:
-				{
-					MapNode n_below = m_map->getNodeNoEx(p+v3s16(0,-1,0));
-					if (!content_features(n_below).flammable) {
-						m_map->removeNodeWithEvent(p);
-					}else{
-						s16 bs_rad = config_get_int("world.game.borderstone.radius");
-						bs_rad += 2;
-						// if any node is border stone protected, don't spread
-						if (!searchNear(p,v3s16(bs_rad,bs_rad,bs_rad),CONTENT_BORDERSTONE,NULL)) {
-							for(s16 x=-1; x<=1; x++)
-							for(s16 y=0; y<=1; y++)
-							for(s16 z=-1; z<=1; z++)
-							{
-								MapNode n_test = m_map->getNodeNoEx(p+v3s16(x,y,z));
-								if (n_test.getContent() == CONTENT_FIRE || n_test.getContent() == CONTENT_FIRE_SHORTTERM)
-									continue;
-								if (content_features(n_test).flammable > 0) {
-									content_t c = n_test.getContent();
-									if (content_features(c).onact_also_affects != v3s16(0,0,0)) {
-										v3s16 p_other = p+v3s16(x,y,z)+n_test.getEffectedRotation();
-										n_test.setContent(CONTENT_FIRE_SHORTTERM);
-										m_map->addNodeWithEvent(p_other, n_test);
-									}
-									n_test.setContent(CONTENT_FIRE_SHORTTERM);
-									m_map->addNodeWithEvent(p+v3s16(x,y,z), n_test);
-								}
+		// fire that spreads just a little
+		case CONTENT_FIRE:
+		{
+			MapNode n_below = changes.getNodeNoEx(p+v3s16(0,-1,0));
+			if (!content_features(n_below).flammable) {
+				changes.removeNodeWithEvent(p);
+			}else{
+				s16 bs_rad = config_get_int("world.game.borderstone.radius");
+				bs_rad += 2;
+				// if any node is border stone protected, don't spread
+				if (!searchNear(p,v3s16(bs_rad,bs_rad,bs_rad),CONTENT_BORDERSTONE,NULL)) {
+					for(s16 x=-1; x<=1; x++)
+					for(s16 y=0; y<=1; y++)
+					for(s16 z=-1; z<=1; z++)
+					{
+						MapNode n_test = changes.getNodeNoEx(p+v3s16(x,y,z));
+						if (n_test.getContent() == CONTENT_FIRE || n_test.getContent() == CONTENT_FIRE_SHORTTERM)
+							continue;
+						if (content_features(n_test).flammable > 0) {
+							content_t c = n_test.getContent();
+							if (content_features(c).onact_also_affects != v3s16(0,0,0)) {
+								v3s16 p_other = p+v3s16(x,y,z)+n_test.getEffectedRotation();
+								n_test.setContent(CONTENT_FIRE_SHORTTERM);
+								changes.addNodeWithEvent(p_other, n_test);
 							}
+							n_test.setContent(CONTENT_FIRE_SHORTTERM);
+							changes.addNodeWithEvent(p+v3s16(x,y,z), n_test);
 						}
 					}
-					break;
 				}
+			}
+			break;
+		}
 
-				// boom
-				case CONTENT_FLASH:
-					m_map->removeNodeWithEvent(p);
-					break;
+		// boom
+		case CONTENT_FLASH:
+			changes.removeNodeWithEvent(p);
+			break;
 
-				// boom
-				case CONTENT_TNT:
-				{
-					NodeMetadata *meta = m_map->getNodeMetadata(p);
-					if (meta && meta->getEnergy() == ENERGY_MAX) {
-						if (config_get_bool("world.game.environment.tnt")) {
-							s16 bs_rad = config_get_int("world.game.borderstone.radius");
-							bs_rad += 3;
-							// if any node is border stone protected, don't destroy anything
-							if (!searchNear(p,v3s16(bs_rad,bs_rad,bs_rad),CONTENT_BORDERSTONE,NULL)) {
-								for(s16 x=-2; x<=2; x++)
-								for(s16 y=-2; y<=2; y++)
-								for(s16 z=-2; z<=2; z++)
-								{
-									MapNode n_test = m_map->getNodeNoEx(p+v3s16(x,y,z));
-									if (n_test.getContent() == CONTENT_AIR)
-										continue;
-									if (n_test.getContent() == CONTENT_TNT) {
-										meta = m_map->getNodeMetadata(p+v3s16(x,y,z));
-										if (meta && !meta->getEnergy())
-											meta->energise(ENERGY_MAX,p,p,p+v3s16(x,y,z));
-										continue;
-									}
-									if (
-										(x == -2 && y == -2)
-										|| (x == 2 && y == -2)
-										|| (x == -2 && y == 2)
-										|| (x == 2 && y == 2)
-										|| (z == -2 && y == -2)
-										|| (z == 2 && y == -2)
-										|| (z == -2 && y == 2)
-										|| (z == 2 && y == 2)
-										|| (x == -2 && z == -2)
-										|| (x == 2 && z == -2)
-										|| (x == -2 && z == 2)
-										|| (x == 2 && z == 2)
-									) {
-										if (myrand()%3 == 0)
-											continue;
-									}
-									n_test.setContent(CONTENT_FLASH);
-									m_delayed_node_changes[p+v3s16(x,y,z)] = n_test;
-								}
+		// boom
+		case CONTENT_TNT:
+		{
+			NodeMetadata *meta = m_map->getNodeMetadata(p);
+			if (meta && meta->getEnergy() == ENERGY_MAX) {
+				if (config_get_bool("world.game.environment.tnt")) {
+					s16 bs_rad = config_get_int("world.game.borderstone.radius");
+					bs_rad += 3;
+					// if any node is border stone protected, don't destroy anything
+					if (!searchNear(p,v3s16(bs_rad,bs_rad,bs_rad),CONTENT_BORDERSTONE,NULL)) {
+						for(s16 x=-2; x<=2; x++)
+						for(s16 y=-2; y<=2; y++)
+						for(s16 z=-2; z<=2; z++)
+						{
+							MapNode n_test = changes.getNodeNoEx(p+v3s16(x,y,z));
+							if (n_test.getContent() == CONTENT_AIR)
+								continue;
+							if (n_test.getContent() == CONTENT_TNT) {
+								changes.energise(p,p+v3s16(x,y,z));
+								continue;
+							}
+							if (
+								(x == -2 && y == -2)
+								|| (x == 2 && y == -2)
+								|| (x == -2 && y == 2)
+								|| (x == 2 && y == 2)
+								|| (z == -2 && y == -2)
+								|| (z == 2 && y == -2)
+								|| (z == -2 && y == 2)
+								|| (z == 2 && y == 2)
+								|| (x == -2 && z == -2)
+								|| (x == 2 && z == -2)
+								|| (x == -2 && z == 2)
+								|| (x == 2 && z == 2)
+							) {
+								if (myrand()%3 == 0)
+									continue;
 							}
+							n_test.setContent(CONTENT_FLASH);
+							changes.setDelayedNode(p+v3s16(x,y,z),n_test);
 						}
-						// but still blow up
-						m_map->removeNodeWithEvent(p);
-						addEnvEvent(ENV_EVENT_SOUND,intToFloat(p,BS),"env-tnt");
 					}
-					break;
 				}
+				// but still blow up
+				changes.removeNodeWithEvent(p);
+				changes.addEnvEvent(ENV_EVENT_SOUND,intToFloat(p,BS),"env-tnt");
+			}
+			break;
+		}
 
-				// cobble becomes mossy underwater
-				case CONTENT_COBBLE:
-				{
-					if (n.envticks > 30 && n.envticks%4 == 0) {
-						MapNode a = m_map->getNodeNoEx(p+v3s16(0,1,0));
-						if (a.getContent() == CONTENT_WATERSOURCE) {
+		// cobble becomes mossy underwater
+		case CONTENT_COBBLE:
+		{
+			if (n.envticks > 30 && n.envticks%4 == 0) {
+				MapNode a = changes.getNodeNoEx(p+v3s16(0,1,0));
+				if (a.getContent() == CONTENT_WATERSOURCE) {
+					n.setContent(CONTENT_MOSSYCOBBLE);
+					changes.addNodeWithEvent(p,n);
+				}else{
+					bool found = false;
+					/* moss also grows */
+					for (s16 i=0; !found && i<6; i++) {
+						a = changes.getNodeNoEx(p+g_6dirs[i]);
+						if (a.getContent() == CONTENT_MOSSYCOBBLE) {
 							n.setContent(CONTENT_MOSSYCOBBLE);
-							m_map->addNodeWithEvent(p,n);
-						}else{
-							bool found = false;
-							/* moss also grows */
-							for (s16 i=0; !found && i<6; i++) {
-								a = m_map->getNodeNoEx(p+g_6dirs[i]);
-								if (a.getContent() == CONTENT_MOSSYCOBBLE) {
-									n.setContent(CONTENT_MOSSYCOBBLE);
-									m_map->addNodeWithEvent(p,n);
-									found = true;
-								}
-							}
+							changes.addNodeWithEvent(p,n);
+							found = true;
 						}
 					}
-					break;
 				}
+			}
+			break;
+		}
 
-				// Make trees from saplings!
-				case CONTENT_SAPLING:
-				{
-					if (n.envticks > 1000) {
-						// full grown tree
-						actionstream<<"A sapling grows into a tree at "<<PP(p)<<std::endl;
-						std::vector<content_t> search;
-						search.push_back(CONTENT_AIR);
-						search.push_back(CONTENT_TREE);
-						search.push_back(CONTENT_YOUNG_TREE);
-						search.push_back(CONTENT_APPLE_TREE);
-						search.push_back(CONTENT_YOUNG_APPLE_TREE);
-						search.push_back(CONTENT_JUNGLETREE);
-						search.push_back(CONTENT_YOUNG_JUNGLETREE);
-						search.push_back(CONTENT_CONIFER_TREE);
-						search.push_back(CONTENT_YOUNG_CONIFER_TREE);
-						search.push_back(CONTENT_LEAVES);
-						search.push_back(CONTENT_LEAVES_AUTUMN);
-						search.push_back(CONTENT_LEAVES_WINTER);
-						search.push_back(CONTENT_LEAVES_SNOWY);
-						search.push_back(CONTENT_JUNGLELEAVES);
-						search.push_back(CONTENT_CONIFER_LEAVES);
-						search.push_back(CONTENT_APPLE_LEAVES);
-						search.push_back(CONTENT_APPLE_BLOSSOM);
-						search.push_back(CONTENT_APPLE);
-						search.push_back(CONTENT_IGNORE);
-
-						core::map<v3s16, MapBlock*> modified_blocks;
-						if (!searchNearInv(p,v3s16(-10,2,-10),v3s16(10,12,10),search,NULL)) {
-							plantgrowth_largetree(this,p);
-						}else{
-							plantgrowth_tree(this,p);
-						}
-					}else if (n.envticks > 15) {
-						std::vector<content_t> search;
-						search.push_back(CONTENT_AIR);
-						search.push_back(CONTENT_TREE);
-						search.push_back(CONTENT_YOUNG_TREE);
-						search.push_back(CONTENT_APPLE_TREE);
-						search.push_back(CONTENT_YOUNG_APPLE_TREE);
-						search.push_back(CONTENT_JUNGLETREE);
-						search.push_back(CONTENT_YOUNG_JUNGLETREE);
-						search.push_back(CONTENT_CONIFER_TREE);
-						search.push_back(CONTENT_YOUNG_CONIFER_TREE);
-						search.push_back(CONTENT_LEAVES);
-						search.push_back(CONTENT_LEAVES_AUTUMN);
-						search.push_back(CONTENT_LEAVES_WINTER);
-						search.push_back(CONTENT_LEAVES_SNOWY);
-						search.push_back(CONTENT_JUNGLELEAVES);
-						search.push_back(CONTENT_CONIFER_LEAVES);
-						search.push_back(CONTENT_APPLE_LEAVES);
-						search.push_back(CONTENT_APPLE_BLOSSOM);
-						search.push_back(CONTENT_APPLE);
-						search.push_back(CONTENT_IGNORE);
-						content_t below = m_map->getNodeNoEx(p+v3s16(0,-1,0)).getContent();
-						if (
-							below == CONTENT_MUD
-						) {
-							v3s16 h;
-							if (!searchNearInv(p,v3s16(-2,2,-2),v3s16(2,7,2),search,&h)) {
-								// young tree 1
-								MapNode nn(CONTENT_YOUNG_TREE);
-								m_map->addNodeWithEvent(p,nn);
-								nn.setContent(CONTENT_LEAVES);
-								m_map->addNodeWithEvent(p+v3s16(0,1,0),nn);
-							}
-						}
+		// Make trees from saplings!
+		case CONTENT_SAPLING:
+		{
+			if (n.envticks > 1000) {
+				// full grown tree
+				actionstream<<"A sapling grows into a tree at "<<PP(p)<<std::endl;
+				std::vector<content_t> search;
+				search.push_back(CONTENT_AIR);
+				search.push_back(CONTENT_TREE);
+				search.push_back(CONTENT_YOUNG_TREE);
+				search.push_back(CONTENT_APPLE_TREE);
+				search.push_back(CONTENT_YOUNG_APPLE_TREE);
+				search.push_back(CONTENT_JUNGLETREE);
+				search.push_back(CONTENT_YOUNG_JUNGLETREE);
+				search.push_back(CONTENT_CONIFER_TREE);
+				search.push_back(CONTENT_YOUNG_CONIFER_TREE);
+				search.push_back(CONTENT_LEAVES);
+				search.push_back(CONTENT_LEAVES_AUTUMN);
+				search.push_back(CONTENT_LEAVES_WINTER);
+				search.push_back(CONTENT_LEAVES_SNOWY);
+				search.push_back(CONTENT_JUNGLELEAVES);
+				search.push_back(CONTENT_CONIFER_LEAVES);
+				search.push_back(CONTENT_APPLE_LEAVES);
+				search.push_back(CONTENT_APPLE_BLOSSOM);
+				search.push_back(CONTENT_APPLE);
+				search.push_back(CONTENT_IGNORE);
+
+				core::map<v3s16, MapBlock*> modified_blocks;
+				if (!searchNearInv(p,v3s16(-10,2,-10),v3s16(10,12,10),search,NULL)) {
+					changes.plantgrowth(plantgrowth_largetree,p);
+				}else{
+					changes.plantgrowth(plantgrowth_tree,p);
+				}
+			}else if (n.envticks > 15) {
+				std::vector<content_t> search;
+				search.push_back(CONTENT_AIR);
+				search.push_back(CONTENT_TREE);
+				search.push_back(CONTENT_YOUNG_TREE);
+				search.push_back(CONTENT_APPLE_TREE);
+				search.push_back(CONTENT_YOUNG_APPLE_TREE);
+				search.push_back(CONTENT_JUNGLETREE);
+				search.push_back(CONTENT_YOUNG_JUNGLETREE);
+				search.push_back(CONTENT_CONIFER_TREE);
+				search.push_back(CONTENT_YOUNG_CONIFER_TREE);
+				search.push_back(CONTENT_LEAVES);
+				search.push_back(CONTENT_LEAVES_AUTUMN);
+				search.push_back(CONTENT_LEAVES_WINTER);
+				search.push_back(CONTENT_LEAVES_SNOWY);
+				search.push_back(CONTENT_JUNGLELEAVES);
+				search.push_back(CONTENT_CONIFER_LEAVES);
+				search.push_back(CONTENT_APPLE_LEAVES);
+				search.push_back(CONTENT_APPLE_BLOSSOM);
+				search.push_back(CONTENT_APPLE);
+				search.push_back(CONTENT_IGNORE);
+				content_t below = changes.getNodeNoEx(p+v3s16(0,-1,0)).getContent();
+				if (
+					below == CONTENT_MUD
+				) {
+					v3s16 h;
+					if (!searchNearInv(p,v3s16(-2,2,-2),v3s16(2,7,2),search,&h)) {
+						// young tree 1
+						MapNode nn(CONTENT_YOUNG_TREE);
+						changes.addNodeWithEvent(p,nn);
+						nn.setContent(CONTENT_LEAVES);
+						changes.addNodeWithEvent(p+v3s16(0,1,0),nn);
 					}
 				}
-				break;
-				case CONTENT_YOUNG_TREE:
-				{
-					if (n.envticks > 15) {
-						content_t below = m_map->getNodeNoEx(p+v3s16(0,-1,0)).getContent();
-						if (
-							below == CONTENT_MUD
-						) {
-							content_t above = m_map->getNodeNoEx(p+v3s16(0,1,0)).getContent();
-							std::vector<content_t> search;
-							search.push_back(CONTENT_AIR);
-							search.push_back(CONTENT_TREE);
-							search.push_back(CONTENT_YOUNG_TREE);
-							search.push_back(CONTENT_APPLE_TREE);
-							search.push_back(CONTENT_YOUNG_APPLE_TREE);
-							search.push_back(CONTENT_JUNGLETREE);
-							search.push_back(CONTENT_YOUNG_JUNGLETREE);
-							search.push_back(CONTENT_CONIFER_TREE);
-							search.push_back(CONTENT_YOUNG_CONIFER_TREE);
-							search.push_back(CONTENT_LEAVES);
-							search.push_back(CONTENT_LEAVES_AUTUMN);
-							search.push_back(CONTENT_LEAVES_WINTER);
-							search.push_back(CONTENT_LEAVES_SNOWY);
-							search.push_back(CONTENT_JUNGLELEAVES);
-							search.push_back(CONTENT_CONIFER_LEAVES);
-							search.push_back(CONTENT_APPLE_LEAVES);
-							search.push_back(CONTENT_APPLE_BLOSSOM);
-							search.push_back(CONTENT_APPLE);
-							search.push_back(CONTENT_IGNORE);
-							if (above == CONTENT_LEAVES) {
-								// young tree 2
-								v3s16 h;
-								if (!searchNearInv(p,v3s16(-1,2,-1),v3s16(1,4,1),search,&h)) {
-									MapNode nn(CONTENT_YOUNG_TREE);
-									m_map->addNodeWithEvent(p+v3s16(0,1,0),nn);
-									m_map->addNodeWithEvent(p+v3s16(0,2,0),nn);
-									nn.setContent(CONTENT_LEAVES);
-									m_map->addNodeWithEvent(p+v3s16(0,3,0),nn);
-									m_map->addNodeWithEvent(p+v3s16(1,2,0),nn);
-									m_map->addNodeWithEvent(p+v3s16(-1,2,0),nn);
-									m_map->addNodeWithEvent(p+v3s16(0,2,1),nn);
-									m_map->addNodeWithEvent(p+v3s16(0,2,-1),nn);
-								}
-							}else if (above == CONTENT_YOUNG_TREE && n.envticks > 40) {
-								content_t abv = m_map->getNodeNoEx(p+v3s16(0,2,0)).getContent();
-								content_t top = m_map->getNodeNoEx(p+v3s16(0,3,0)).getContent();
-								if (abv == CONTENT_YOUNG_TREE && top == CONTENT_LEAVES) {
-									if (m_map->getNodeNoEx(p+v3s16(1,2,0)).getContent() == CONTENT_LEAVES)
-										m_map->removeNodeWithEvent(p+v3s16(1,2,0));
-									if (m_map->getNodeNoEx(p+v3s16(-1,2,0)).getContent() == CONTENT_LEAVES)
-										m_map->removeNodeWithEvent(p+v3s16(-1,2,0));
-									if (m_map->getNodeNoEx(p+v3s16(0,2,1)).getContent() == CONTENT_LEAVES)
-										m_map->removeNodeWithEvent(p+v3s16(0,2,1));
-									if (m_map->getNodeNoEx(p+v3s16(0,2,-1)).getContent() == CONTENT_LEAVES)
-										m_map->removeNodeWithEvent(p+v3s16(0,2,-1));
-									// full grown tree
-									actionstream<<"A sapling grows into a tree at "
-										<<PP(p)<<std::endl;
-
-									if (!searchNearInv(p,v3s16(-10,2,-10),v3s16(10,12,10),search,NULL)) {
-										plantgrowth_largetree(this,p);
-									}else{
-										plantgrowth_tree(this,p);
-									}
-								}
+			}
+		}
+		break;
+		case CONTENT_YOUNG_TREE:
+		{
+			if (n.envticks > 15) {
+				content_t below = changes.getNodeNoEx(p+v3s16(0,-1,0)).getContent();
+				if (
+					below == CONTENT_MUD
+				) {
+					content_t above = changes.getNodeNoEx(p+v3s16(0,1,0)).getContent();
+					std::vector<content_t> search;
+					search.push_back(CONTENT_AIR);
+					search.push_back(CONTENT_TREE);
+					search.push_back(CONTENT_YOUNG_TREE);
+					search.push_back(CONTENT_APPLE_TREE);
+					search.push_back(CONTENT_YOUNG_APPLE_TREE);
+					search.push_back(CONTENT_JUNGLETREE);
+					search.push_back(CONTENT_YOUNG_JUNGLETREE);
+					search.push_back(CONTENT_CONIFER_TREE);
+					search.push_back(CONTENT_YOUNG_CONIFER_TREE);
+					search.push_back(CONTENT_LEAVES);
+					search.push_back(CONTENT_LEAVES_AUTUMN);
+					search.push_back(CONTENT_LEAVES_WINTER);
+					search.push_back(CONTENT_LEAVES_SNOWY);
+					search.push_back(CONTENT_JUNGLELEAVES);
+					search.push_back(CONTENT_CONIFER_LEAVES);
+					search.push_back(CONTENT_APPLE_LEAVES);
+					search.push_back(CONTENT_APPLE_BLOSSOM);
+					search.push_back(CONTENT_APPLE);
+					search.push_back(CONTENT_IGNORE);
+					if (above == CONTENT_LEAVES) {
+						// young tree 2
+						v3s16 h;
+						if (!searchNearInv(p,v3s16(-1,2,-1),v3s16(1,4,1),search,&h)) {
+							MapNode nn(CONTENT_YOUNG_TREE);
+							changes.addNodeWithEvent(p+v3s16(0,1,0),nn);
+							changes.addNodeWithEvent(p+v3s16(0,2,0),nn);
+							nn.setContent(CONTENT_LEAVES);
+							changes.addNodeWithEvent(p+v3s16(0,3,0),nn);
+							changes.addNodeWithEvent(p+v3s16(1,2,0),nn);
+							changes.addNodeWithEvent(p+v3s16(-1,2,0),nn);
+							changes.addNodeWithEvent(p+v3s16(0,2,1),nn);
+							changes.addNodeWithEvent(p+v3s16(0,2,-1),nn);
+						}
+					}else if (above == CONTENT_YOUNG_TREE && n.envticks > 40) {
+						content_t abv = changes.getNodeNoEx(p+v3s16(0,2,0)).getContent();
+						content_t top = changes.getNodeNoEx(p+v3s16(0,3,0)).getContent();
+						if (abv == CONTENT_YOUNG_TREE && top == CONTENT_LEAVES) {
+							if (changes.getNodeNoEx(p+v3s16(1,2,0)).getContent() == CONTENT_LEAVES)
+								changes.removeNodeWithEvent(p+v3s16(1,2,0));
+							if (changes.getNodeNoEx(p+v3s16(-1,2,0)).getContent() == CONTENT_LEAVES)
+								changes.removeNodeWithEvent(p+v3s16(-1,2,0));
+							if (changes.getNodeNoEx(p+v3s16(0,2,1)).getContent() == CONTENT_LEAVES)
+								changes.removeNodeWithEvent(p+v3s16(0,2,1));
+							if (changes.getNodeNoEx(p+v3s16(0,2,-1)).getContent() == CONTENT_LEAVES)
+								changes.removeNodeWithEvent(p+v3s16(0,2,-1));
+							// full grown tree
+							actionstream<<"A sapling grows into a tree at "
+								<<PP(p)<<std::endl;
+
+							if (!searchNearInv(p,v3s16(-10,2,-10),v3s16(10,12,10),search,NULL)) {
+								changes.plantgrowth(plantgrowth_largetree,p);
+							}else{
+								changes.plantgrowth(plantgrowth_tree,p);
 							}
 						}
 					}
-					break;
 				}
+			}
+			break;
+		}
 
-				case CONTENT_APPLE_SAPLING:
-				{
-					if (n.envticks > 1000) {
-						actionstream<<"A sapling grows into a tree at "<<PP(p)<<std::endl;
+		case CONTENT_APPLE_SAPLING:
+		{
+			if (n.envticks > 1000) {
+				actionstream<<"A sapling grows into a tree at "<<PP(p)<<std::endl;
 
-						plantgrowth_appletree(this,p);
-					}else if (n.envticks > 15) {
-						std::vector<content_t> search;
-						search.push_back(CONTENT_AIR);
-						search.push_back(CONTENT_TREE);
-						search.push_back(CONTENT_YOUNG_TREE);
-						search.push_back(CONTENT_APPLE_TREE);
-						search.push_back(CONTENT_YOUNG_APPLE_TREE);
-						search.push_back(CONTENT_JUNGLETREE);
-						search.push_back(CONTENT_YOUNG_JUNGLETREE);
-						search.push_back(CONTENT_CONIFER_TREE);
-						search.push_back(CONTENT_YOUNG_CONIFER_TREE);
-						search.push_back(CONTENT_LEAVES);
-						search.push_back(CONTENT_LEAVES_AUTUMN);
-						search.push_back(CONTENT_LEAVES_WINTER);
-						search.push_back(CONTENT_LEAVES_SNOWY);
-						search.push_back(CONTENT_JUNGLELEAVES);
-						search.push_back(CONTENT_CONIFER_LEAVES);
-						search.push_back(CONTENT_APPLE_LEAVES);
-						search.push_back(CONTENT_APPLE_BLOSSOM);
-						search.push_back(CONTENT_APPLE);
-						search.push_back(CONTENT_IGNORE);
-						content_t below = m_map->getNodeNoEx(p+v3s16(0,-1,0)).getContent();
-						if (
-							below == CONTENT_MUD
-						) {
-							v3s16 h;
-							if (!searchNearInv(p,v3s16(-2,2,-2),v3s16(2,7,2),search,&h)) {
-								// young tree 1
-								MapNode nn(CONTENT_YOUNG_APPLE_TREE);
-								m_map->addNodeWithEvent(p,nn);
-								nn.setContent(CONTENT_APPLE_LEAVES);
-								m_map->addNodeWithEvent(p+v3s16(0,1,0),nn);
-							}
-						}
+				changes.plantgrowth(plantgrowth_appletree,p);
+			}else if (n.envticks > 15) {
+				std::vector<content_t> search;
+				search.push_back(CONTENT_AIR);
+				search.push_back(CONTENT_TREE);
+				search.push_back(CONTENT_YOUNG_TREE);
+				search.push_back(CONTENT_APPLE_TREE);
+				search.push_back(CONTENT_YOUNG_APPLE_TREE);
+				search.push_back(CONTENT_JUNGLETREE);
+				search.push_back(CONTENT_YOUNG_JUNGLETREE);
+				search.push_back(CONTENT_CONIFER_TREE);
+				search.push_back(CONTENT_YOUNG_CONIFER_TREE);
+				search.push_back(CONTENT_LEAVES);
+				search.push_back(CONTENT_LEAVES_AUTUMN);
+				search.push_back(CONTENT_LEAVES_WINTER);
+				search.push_back(CONTENT_LEAVES_SNOWY);
+				search.push_back(CONTENT_JUNGLELEAVES);
+				search.push_back(CONTENT_CONIFER_LEAVES);
+				search.push_back(CONTENT_APPLE_LEAVES);
+				search.push_back(CONTENT_APPLE_BLOSSOM);
+				search.push_back(CONTENT_APPLE);
+				search.push_back(CONTENT_IGNORE);
+				content_t below = changes.getNodeNoEx(p+v3s16(0,-1,0)).getContent();
+				if (
+					below == CONTENT_MUD
+				) {
+					v3s16 h;
+					if (!searchNearInv(p,v3s16(-2,2,-2),v3s16(2,7,2),search,&h)) {
+						// young tree 1
+						MapNode nn(CONTENT_YOUNG_APPLE_TREE);
+						changes.addNodeWithEvent(p,nn);
+						nn.setContent(CONTENT_APPLE_LEAVES);
+						changes.addNodeWithEvent(p+v3s16(0,1,0),nn);
 					}
 				}
-				break;
-				case CONTENT_YOUNG_APPLE_TREE:
-				{
-					if (n.envticks > 15) {
-						content_t below = m_map->getNodeNoEx(p+v3s16(0,-1,0)).getContent();
-						if (
-							below == CONTENT_MUD
-						) {
-							content_t above = m_map->getNodeNoEx(p+v3s16(0,1,0)).getContent();
-							std::vector<content_t> search;
-							search.push_back(CONTENT_AIR);
-							search.push_back(CONTENT_TREE);
-							search.push_back(CONTENT_YOUNG_TREE);
-							search.push_back(CONTENT_APPLE_TREE);
-							search.push_back(CONTENT_YOUNG_APPLE_TREE);
-							search.push_back(CONTENT_JUNGLETREE);
-							search.push_back(CONTENT_YOUNG_JUNGLETREE);
-							search.push_back(CONTENT_CONIFER_TREE);
-							search.push_back(CONTENT_YOUNG_CONIFER_TREE);
-							search.push_back(CONTENT_LEAVES);
-							search.push_back(CONTENT_LEAVES_AUTUMN);
-							search.push_back(CONTENT_LEAVES_WINTER);
-							search.push_back(CONTENT_LEAVES_SNOWY);
-							search.push_back(CONTENT_JUNGLELEAVES);
-							search.push_back(CONTENT_CONIFER_LEAVES);
-							search.push_back(CONTENT_APPLE_LEAVES);
-							search.push_back(CONTENT_APPLE_BLOSSOM);
-							search.push_back(CONTENT_APPLE);
-							search.push_back(CONTENT_IGNORE);
-							if (above == CONTENT_APPLE_LEAVES) {
-								// young tree 2
-								v3s16 h;
-								if (!searchNearInv(p,v3s16(-1,2,-1),v3s16(1,4,1),search,&h)) {
-									MapNode nn(CONTENT_YOUNG_APPLE_TREE);
-									m_map->addNodeWithEvent(p+v3s16(0,1,0),nn);
-									m_map->addNodeWithEvent(p+v3s16(0,2,0),nn);
-									nn.setContent(CONTENT_APPLE_LEAVES);
-									m_map->addNodeWithEvent(p+v3s16(0,3,0),nn);
-									m_map->addNodeWithEvent(p+v3s16(1,2,0),nn);
-									m_map->addNodeWithEvent(p+v3s16(-1,2,0),nn);
-									m_map->addNodeWithEvent(p+v3s16(0,2,1),nn);
-									m_map->addNodeWithEvent(p+v3s16(0,2,-1),nn);
-								}
-							}else if (above == CONTENT_YOUNG_APPLE_TREE && n.envticks > 40) {
-								content_t abv = m_map->getNodeNoEx(p+v3s16(0,2,0)).getContent();
-								content_t top = m_map->getNodeNoEx(p+v3s16(0,3,0)).getContent();
-								if (abv == CONTENT_YOUNG_APPLE_TREE && top == CONTENT_APPLE_LEAVES) {
-									if (m_map->getNodeNoEx(p+v3s16(1,2,0)).getContent() == CONTENT_APPLE_LEAVES)
-										m_map->removeNodeWithEvent(p+v3s16(1,2,0));
-									if (m_map->getNodeNoEx(p+v3s16(-1,2,0)).getContent() == CONTENT_APPLE_LEAVES)
-										m_map->removeNodeWithEvent(p+v3s16(-1,2,0));
-									if (m_map->getNodeNoEx(p+v3s16(0,2,1)).getContent() == CONTENT_APPLE_LEAVES)
-										m_map->removeNodeWithEvent(p+v3s16(0,2,1));
-									if (m_map->getNodeNoEx(p+v3s16(0,2,-1)).getContent() == CONTENT_APPLE_LEAVES)
-										m_map->removeNodeWithEvent(p+v3s16(0,2,-1));
-									actionstream<<"A sapling grows into a tree at "
-										<<PP(p)<<std::endl;
-
-									plantgrowth_appletree(this,p);
-								}
-							}
+			}
+		}
+		break;
+		case CONTENT_YOUNG_APPLE_TREE:
+		{
+			if (n.envticks > 15) {
+				content_t below = changes.getNodeNoEx(p+v3s16(0,-1,0)).getContent();
+				if (
+					below == CONTENT_MUD
+				) {
+					content_t above = changes.getNodeNoEx(p+v3s16(0,1,0)).getContent();
+					std::vector<content_t> search;
+					search.push_back(CONTENT_AIR);
+					search.push_back(CONTENT_TREE);
+					search.push_back(CONTENT_YOUNG_TREE);
+					search.push_back(CONTENT_APPLE_TREE);
+					search.push_back(CONTENT_YOUNG_APPLE_TREE);
+					search.push_back(CONTENT_JUNGLETREE);
+					search.push_back(CONTENT_YOUNG_JUNGLETREE);
+					search.push_back(CONTENT_CONIFER_TREE);
+					search.push_back(CONTENT_YOUNG_CONIFER_TREE);
+					search.push_back(CONTENT_LEAVES);
+					search.push_back(CONTENT_LEAVES_AUTUMN);
+					search.push_back(CONTENT_LEAVES_WINTER);
+					search.push_back(CONTENT_LEAVES_SNOWY);
+					search.push_back(CONTENT_JUNGLELEAVES);
+					search.push_back(CONTENT_CONIFER_LEAVES);
+					search.push_back(CONTENT_APPLE_LEAVES);
+					search.push_back(CONTENT_APPLE_BLOSSOM);
+					search.push_back(CONTENT_APPLE);
+					search.push_back(CONTENT_IGNORE);
+					if (above == CONTENT_APPLE_LEAVES) {
+						// young tree 2
+						v3s16 h;
+						if (!searchNearInv(p,v3s16(-1,2,-1),v3s16(1,4,1),search,&h)) {
+							MapNode nn(CONTENT_YOUNG_APPLE_TREE);
+							changes.addNodeWithEvent(p+v3s16(0,1,0),nn);
+							changes.addNodeWithEvent(p+v3s16(0,2,0),nn);
+							nn.setContent(CONTENT_APPLE_LEAVES);
+							changes.addNodeWithEvent(p+v3s16(0,3,0),nn);
+							changes.addNodeWithEvent(p+v3s16(1,2,0),nn);
+							changes.addNodeWithEvent(p+v3s16(-1,2,0),nn);
+							changes.addNodeWithEvent(p+v3s16(0,2,1),nn);
+							changes.addNodeWithEvent(p+v3s16(0,2,-1),nn);
+						}
+					}else if (above == CONTENT_YOUNG_APPLE_TREE && n.envticks > 40) {
+						content_t abv = changes.getNodeNoEx(p+v3s16(0,2,0)).getContent();
+						content_t top = changes.getNodeNoEx(p+v3s16(0,3,0)).getContent();
+						if (abv == CONTENT_YOUNG_APPLE_TREE && top == CONTENT_APPLE_LEAVES) {
+							if (changes.getNodeNoEx(p+v3s16(1,2,0)).getContent() == CONTENT_APPLE_LEAVES)
+								changes.removeNodeWithEvent(p+v3s16(1,2,0));
+							if (changes.getNodeNoEx(p+v3s16(-1,2,0)).getContent() == CONTENT_APPLE_LEAVES)
+								changes.removeNodeWithEvent(p+v3s16(-1,2,0));
+							if (changes.getNodeNoEx(p+v3s16(0,2,1)).getContent() == CONTENT_APPLE_LEAVES)
+								changes.removeNodeWithEvent(p+v3s16(0,2,1));
+							if (changes.getNodeNoEx(p+v3s16(0,2,-1)).getContent() == CONTENT_APPLE_LEAVES)
+								changes.removeNodeWithEvent(p+v3s16(0,2,-1));
+							actionstream<<"A sapling grows into a tree at "
+								<<PP(p)<<std::endl;
+
+							changes.plantgrowth(plantgrowth_appletree,p);
 						}
 					}
-					break;
 				}
+			}
+			break;
+		}
 
-				case CONTENT_JUNGLESAPLING:
-				{
-					if (n.envticks > 1000) {
-						actionstream<<"A sapling grows into a jungle tree at "<<PP(p)<<std::endl;
+		case CONTENT_JUNGLESAPLING:
+		{
+			if (n.envticks > 1000) {
+				actionstream<<"A sapling grows into a jungle tree at "<<PP(p)<<std::endl;
 
-						plantgrowth_jungletree(this,p);
-					}else if (n.envticks > 15) {
-						std::vector<content_t> search;
-						search.push_back(CONTENT_AIR);
-						search.push_back(CONTENT_TREE);
-						search.push_back(CONTENT_YOUNG_TREE);
-						search.push_back(CONTENT_APPLE_TREE);
-						search.push_back(CONTENT_YOUNG_APPLE_TREE);
-						search.push_back(CONTENT_JUNGLETREE);
-						search.push_back(CONTENT_YOUNG_JUNGLETREE);
-						search.push_back(CONTENT_CONIFER_TREE);
-						search.push_back(CONTENT_YOUNG_CONIFER_TREE);
-						search.push_back(CONTENT_LEAVES);
-						search.push_back(CONTENT_LEAVES_AUTUMN);
-						search.push_back(CONTENT_LEAVES_WINTER);
-						search.push_back(CONTENT_LEAVES_SNOWY);
-						search.push_back(CONTENT_JUNGLELEAVES);
-						search.push_back(CONTENT_CONIFER_LEAVES);
-						search.push_back(CONTENT_APPLE_LEAVES);
-						search.push_back(CONTENT_APPLE_BLOSSOM);
-						search.push_back(CONTENT_APPLE);
-						search.push_back(CONTENT_IGNORE);
-						content_t below = m_map->getNodeNoEx(p+v3s16(0,-1,0)).getContent();
-						if (
-							below == CONTENT_MUD
-						) {
-							v3s16 h;
-							if (!searchNearInv(p,v3s16(-2,2,-2),v3s16(2,10,2),search,&h)) {
-								// young tree 1
-								MapNode nn(CONTENT_YOUNG_JUNGLETREE);
-								m_map->addNodeWithEvent(p,nn);
-								nn.setContent(CONTENT_JUNGLELEAVES);
-								m_map->addNodeWithEvent(p+v3s16(0,1,0),nn);
-							}
-						}
+				changes.plantgrowth(plantgrowth_jungletree,p);
+			}else if (n.envticks > 15) {
+				std::vector<content_t> search;
+				search.push_back(CONTENT_AIR);
+				search.push_back(CONTENT_TREE);
+				search.push_back(CONTENT_YOUNG_TREE);
+				search.push_back(CONTENT_APPLE_TREE);
+				search.push_back(CONTENT_YOUNG_APPLE_TREE);
+				search.push_back(CONTENT_JUNGLETREE);
+				search.push_back(CONTENT_YOUNG_JUNGLETREE);
+				search.push_back(CONTENT_CONIFER_TREE);
+				search.push_back(CONTENT_YOUNG_CONIFER_TREE);
+				search.push_back(CONTENT_LEAVES);
+				search.push_back(CONTENT_LEAVES_AUTUMN);
+				search.push_back(CONTENT_LEAVES_WINTER);
+				search.push_back(CONTENT_LEAVES_SNOWY);
+				search.push_back(CONTENT_JUNGLELEAVES);
+				search.push_back(CONTENT_CONIFER_LEAVES);
+				search.push_back(CONTENT_APPLE_LEAVES);
+				search.push_back(CONTENT_APPLE_BLOSSOM);
+				search.push_back(CONTENT_APPLE);
+				search.push_back(CONTENT_IGNORE);
+				content_t below = changes.getNodeNoEx(p+v3s16(0,-1,0)).getContent();
+				if (
+					below == CONTENT_MUD
+				) {
+					v3s16 h;
+					if (!searchNearInv(p,v3s16(-2,2,-2),v3s16(2,10,2),search,&h)) {
+						// young tree 1
+						MapNode nn(CONTENT_YOUNG_JUNGLETREE);
+						changes.addNodeWithEvent(p,nn);
+						nn.setContent(CONTENT_JUNGLELEAVES);
+						changes.addNodeWithEvent(p+v3s16(0,1,0),nn);
 					}
 				}
-				break;
-				case CONTENT_YOUNG_JUNGLETREE:
-				{
-					if (n.envticks > 15) {
-						content_t below = m_map->getNodeNoEx(p+v3s16(0,-1,0)).getContent();
-						if (
-							below == CONTENT_MUD
-						) {
-							content_t above = m_map->getNodeNoEx(p+v3s16(0,1,0)).getContent();
-							std::vector<content_t> search;
-							search.push_back(CONTENT_AIR);
-							search.push_back(CONTENT_TREE);
-							search.push_back(CONTENT_YOUNG_TREE);
-							search.push_back(CONTENT_APPLE_TREE);
-							search.push_back(CONTENT_YOUNG_APPLE_TREE);
-							search.push_back(CONTENT_JUNGLETREE);
-							search.push_back(CONTENT_YOUNG_JUNGLETREE);
-							search.push_back(CONTENT_CONIFER_TREE);
-							search.push_back(CONTENT_YOUNG_CONIFER_TREE);
-							search.push_back(CONTENT_LEAVES);
-							search.push_back(CONTENT_LEAVES_AUTUMN);
-							search.push_back(CONTENT_LEAVES_WINTER);
-							search.push_back(CONTENT_LEAVES_SNOWY);
-							search.push_back(CONTENT_JUNGLELEAVES);
-							search.push_back(CONTENT_CONIFER_LEAVES);
-							search.push_back(CONTENT_APPLE_LEAVES);
-							search.push_back(CONTENT_APPLE_BLOSSOM);
-							search.push_back(CONTENT_APPLE);
-							search.push_back(CONTENT_IGNORE);
-							if (above == CONTENT_JUNGLELEAVES) {
-								// young tree 2
-								v3s16 h;
-								if (!searchNearInv(p,v3s16(-1,2,-1),v3s16(1,5,1),search,&h)) {
-									MapNode nn(CONTENT_YOUNG_JUNGLETREE);
-									m_map->addNodeWithEvent(p+v3s16(0,1,0),nn);
-									m_map->addNodeWithEvent(p+v3s16(0,2,0),nn);
-									m_map->addNodeWithEvent(p+v3s16(0,3,0),nn);
-									nn.setContent(CONTENT_JUNGLELEAVES);
-									m_map->addNodeWithEvent(p+v3s16(0,4,0),nn);
-									m_map->addNodeWithEvent(p+v3s16(1,3,0),nn);
-									m_map->addNodeWithEvent(p+v3s16(-1,3,0),nn);
-									m_map->addNodeWithEvent(p+v3s16(0,3,1),nn);
-									m_map->addNodeWithEvent(p+v3s16(0,3,-1),nn);
-								}
-							}else if (above == CONTENT_YOUNG_JUNGLETREE && n.envticks > 40) {
-								content_t abv = m_map->getNodeNoEx(p+v3s16(0,2,0)).getContent();
-								content_t abv1 = m_map->getNodeNoEx(p+v3s16(0,3,0)).getContent();
-								content_t top = m_map->getNodeNoEx(p+v3s16(0,4,0)).getContent();
-								if (abv == CONTENT_YOUNG_JUNGLETREE && abv1 == CONTENT_YOUNG_JUNGLETREE && top == CONTENT_JUNGLELEAVES) {
-									if (m_map->getNodeNoEx(p+v3s16(1,3,0)).getContent() == CONTENT_JUNGLELEAVES)
-										m_map->removeNodeWithEvent(p+v3s16(1,3,0));
-									if (m_map->getNodeNoEx(p+v3s16(-1,3,0)).getContent() == CONTENT_JUNGLELEAVES)
-										m_map->removeNodeWithEvent(p+v3s16(-1,3,0));
-									if (m_map->getNodeNoEx(p+v3s16(0,3,1)).getContent() == CONTENT_JUNGLELEAVES)
-										m_map->removeNodeWithEvent(p+v3s16(0,3,1));
-									if (m_map->getNodeNoEx(p+v3s16(0,3,-1)).getContent() == CONTENT_JUNGLELEAVES)
-										m_map->removeNodeWithEvent(p+v3s16(0,3,-1));
-									actionstream<<"A sapling grows into a jungle tree at "
-										<<PP(p)<<std::endl;
-
-									plantgrowth_jungletree(this,p);
-								}
-							}
+			}
+		}
+		break;
+		case CONTENT_YOUNG_JUNGLETREE:
+		{
+			if (n.envticks > 15) {
+				content_t below = changes.getNodeNoEx(p+v3s16(0,-1,0)).getContent();
+				if (
+					below == CONTENT_MUD
+				) {
+					content_t above = changes.getNodeNoEx(p+v3s16(0,1,0)).getContent();
+					std::vector<content_t> search;
+					search.push_back(CONTENT_AIR);
+					search.push_back(CONTENT_TREE);
+					search.push_back(CONTENT_YOUNG_TREE);
+					search.push_back(CONTENT_APPLE_TREE);
+					search.push_back(CONTENT_YOUNG_APPLE_TREE);
+					search.push_back(CONTENT_JUNGLETREE);
+					search.push_back(CONTENT_YOUNG_JUNGLETREE);
+					search.push_back(CONTENT_CONIFER_TREE);
+					search.push_back(CONTENT_YOUNG_CONIFER_TREE);
+					search.push_back(CONTENT_LEAVES);
+					search.push_back(CONTENT_LEAVES_AUTUMN);
+					search.push_back(CONTENT_LEAVES_WINTER);
+					search.push_back(CONTENT_LEAVES_SNOWY);
+					search.push_back(CONTENT_JUNGLELEAVES);
+					search.push_back(CONTENT_CONIFER_LEAVES);
+					search.push_back(CONTENT_APPLE_LEAVES);
+					search.push_back(CONTENT_APPLE_BLOSSOM);
+					search.push_back(CONTENT_APPLE);
+					search.push_back(CONTENT_IGNORE);
+					if (above == CONTENT_JUNGLELEAVES) {
+						// young tree 2
+						v3s16 h;
+						if (!searchNearInv(p,v3s16(-1,2,-1),v3s16(1,5,1),search,&h)) {
+							MapNode nn(CONTENT_YOUNG_JUNGLETREE);
+							changes.addNodeWithEvent(p+v3s16(0,1,0),nn);
+							changes.addNodeWithEvent(p+v3s16(0,2,0),nn);
+							changes.addNodeWithEvent(p+v3s16(0,3,0),nn);
+							nn.setContent(CONTENT_JUNGLELEAVES);
+							changes.addNodeWithEvent(p+v3s16(0,4,0),nn);
+							changes.addNodeWithEvent(p+v3s16(1,3,0),nn);
+							changes.addNodeWithEvent(p+v3s16(-1,3,0),nn);
+							changes.addNodeWithEvent(p+v3s16(0,3,1),nn);
+							changes.addNodeWithEvent(p+v3s16(0,3,-1),nn);
+						}
+					}else if (above == CONTENT_YOUNG_JUNGLETREE && n.envticks > 40) {
+						content_t abv = changes.getNodeNoEx(p+v3s16(0,2,0)).getContent();
+						content_t abv1 = changes.getNodeNoEx(p+v3s16(0,3,0)).getContent();
+						content_t top = changes.getNodeNoEx(p+v3s16(0,4,0)).getContent();
+						if (abv == CONTENT_YOUNG_JUNGLETREE && abv1 == CONTENT_YOUNG_JUNGLETREE && top == CONTENT_JUNGLELEAVES) {
+							if (changes.getNodeNoEx(p+v3s16(1,3,0)).getContent() == CONTENT_JUNGLELEAVES)
+								changes.removeNodeWithEvent(p+v3s16(1,3,0));
+							if (changes.getNodeNoEx(p+v3s16(-1,3,0)).getContent() == CONTENT_JUNGLELEAVES)
+								changes.removeNodeWithEvent(p+v3s16(-1,3,0));
+							if (changes.getNodeNoEx(p+v3s16(0,3,1)).getContent() == CONTENT_JUNGLELEAVES)
+								changes.removeNodeWithEvent(p+v3s16(0,3,1));
+							if (changes.getNodeNoEx(p+v3s16(0,3,-1)).getContent() == CONTENT_JUNGLELEAVES)
+								changes.removeNodeWithEvent(p+v3s16(0,3,-1));
+							actionstream<<"A sapling grows into a jungle tree at "
+								<<PP(p)<<std::endl;
+
+							changes.plantgrowth(plantgrowth_jungletree,p);
 						}
 					}
-					break;
 				}
+			}
+			break;
+		}
 
-				case CONTENT_CONIFER_SAPLING:
-				{
-					if (n.envticks > 1000) {
-						actionstream<<"A sapling grows into a conifer tree at "<<PP(p)<<std::endl;
+		case CONTENT_CONIFER_SAPLING:
+		{
+			if (n.envticks > 1000) {
+				actionstream<<"A sapling grows into a conifer tree at "<<PP(p)<<std::endl;
 
-						plantgrowth_conifertree(this,p);
-					}else if (n.envticks > 15) {
-						std::vector<content_t> search;
-						search.push_back(CONTENT_AIR);
-						search.push_back(CONTENT_TREE);
-						search.push_back(CONTENT_YOUNG_TREE);
-						search.push_back(CONTENT_APPLE_TREE);
-						search.push_back(CONTENT_YOUNG_APPLE_TREE);
-						search.push_back(CONTENT_JUNGLETREE);
-						search.push_back(CONTENT_YOUNG_JUNGLETREE);
-						search.push_back(CONTENT_CONIFER_TREE);
-						search.push_back(CONTENT_YOUNG_CONIFER_TREE);
-						search.push_back(CONTENT_LEAVES);
-						search.push_back(CONTENT_LEAVES_AUTUMN);
-						search.push_back(CONTENT_LEAVES_WINTER);
-						search.push_back(CONTENT_LEAVES_SNOWY);
-						search.push_back(CONTENT_JUNGLELEAVES);
-						search.push_back(CONTENT_CONIFER_LEAVES);
-						search.push_back(CONTENT_APPLE_LEAVES);
-						search.push_back(CONTENT_APPLE_BLOSSOM);
-						search.push_back(CONTENT_APPLE);
-						search.push_back(CONTENT_IGNORE);
-						content_t below = m_map->getNodeNoEx(p+v3s16(0,-1,0)).getContent();
-						if (
-							below == CONTENT_MUD
-						) {
-							v3s16 h;
-							if (!searchNearInv(p,v3s16(-2,2,-2),v3s16(2,12,2),search,&h)) {
-								// young tree 1
-								MapNode nn(CONTENT_YOUNG_CONIFER_TREE);
-								m_map->addNodeWithEvent(p,nn);
-								nn.setContent(CONTENT_CONIFER_LEAVES);
-								m_map->addNodeWithEvent(p+v3s16(0,1,0),nn);
-							}
-						}
-					}
-				}
-				break;
-				case CONTENT_YOUNG_CONIFER_TREE:
-				{
-					if (n.envticks > 15) {
-						content_t below = m_map->getNodeNoEx(p+v3s16(0,-1,0)).getContent();
-						if (
-							below == CONTENT_MUD
-						) {
-							content_t above = m_map->getNodeNoEx(p+v3s16(0,1,0)).getContent();
-							std::vector<content_t> search;
-							search.push_back(CONTENT_AIR);
-							search.push_back(CONTENT_TREE);
-							search.push_back(CONTENT_YOUNG_TREE);
-							search.push_back(CONTENT_APPLE_TREE);
-							search.push_back(CONTENT_YOUNG_APPLE_TREE);
-							search.push_back(CONTENT_JUNGLETREE);
-							search.push_back(CONTENT_YOUNG_JUNGLETREE);
-							search.push_back(CONTENT_CONIFER_TREE);
-							search.push_back(CONTENT_YOUNG_CONIFER_TREE);
-							search.push_back(CONTENT_LEAVES);
-							search.push_back(CONTENT_LEAVES_AUTUMN);
-							search.push_back(CONTENT_LEAVES_WINTER);
-							search.push_back(CONTENT_LEAVES_SNOWY);
-							search.push_back(CONTENT_JUNGLELEAVES);
-							search.push_back(CONTENT_CONIFER_LEAVES);
-							search.push_back(CONTENT_APPLE_LEAVES);
-							search.push_back(CONTENT_APPLE_BLOSSOM);
-							search.push_back(CONTENT_APPLE);
-							search.push_back(CONTENT_IGNORE);
-							if (above == CONTENT_CONIFER_LEAVES) {
-								// young tree 2
-								v3s16 h;
-								if (!searchNearInv(p,v3s16(-1,2,-1),v3s16(1,5,1),search,&h)) {
-									MapNode nn(CONTENT_YOUNG_CONIFER_TREE);
-									m_map->addNodeWithEvent(p+v3s16(0,1,0),nn);
-									m_map->addNodeWithEvent(p+v3s16(0,2,0),nn);
-									nn.setContent(CONTENT_CONIFER_LEAVES);
-									m_map->addNodeWithEvent(p+v3s16(0,3,0),nn);
-									m_map->addNodeWithEvent(p+v3s16(0,4,0),nn);
-									m_map->addNodeWithEvent(p+v3s16(1,2,0),nn);
-									m_map->addNodeWithEvent(p+v3s16(-1,2,0),nn);
-									m_map->addNodeWithEvent(p+v3s16(0,2,1),nn);
-									m_map->addNodeWithEvent(p+v3s16(0,2,-1),nn);
-								}
-							}else if (above == CONTENT_YOUNG_CONIFER_TREE && n.envticks > 40) {
-								content_t abv = m_map->getNodeNoEx(p+v3s16(0,2,0)).getContent();
-								content_t top = m_map->getNodeNoEx(p+v3s16(0,3,0)).getContent();
-								if (abv == CONTENT_YOUNG_CONIFER_TREE && top == CONTENT_CONIFER_LEAVES) {
-									if (m_map->getNodeNoEx(p+v3s16(1,2,0)).getContent() == CONTENT_CONIFER_LEAVES)
-										m_map->removeNodeWithEvent(p+v3s16(1,2,0));
-									if (m_map->getNodeNoEx(p+v3s16(-1,2,0)).getContent() == CONTENT_CONIFER_LEAVES)
-										m_map->removeNodeWithEvent(p+v3s16(-1,2,0));
-									if (m_map->getNodeNoEx(p+v3s16(0,2,1)).getContent() == CONTENT_CONIFER_LEAVES)
-										m_map->removeNodeWithEvent(p+v3s16(0,2,1));
-									if (m_map->getNodeNoEx(p+v3s16(0,2,-1)).getContent() == CONTENT_CONIFER_LEAVES)
-										m_map->removeNodeWithEvent(p+v3s16(0,2,-1));
-									actionstream<<"A sapling grows into a conifer tree at "
-										<<PP(p)<<std::endl;
-
-									plantgrowth_conifertree(this,p);
-								}
-							}
-						}
+				changes.plantgrowth(plantgrowth_conifertree,p);
+			}else if (n.envticks > 15) {
+				std::vector<content_t> search;
+				search.push_back(CONTENT_AIR);
+				search.push_back(CONTENT_TREE);
+				search.push_back(CONTENT_YOUNG_TREE);
+				search.push_back(CONTENT_APPLE_TREE);
+				search.push_back(CONTENT_YOUNG_APPLE_TREE);
+				search.push_back(CONTENT_JUNGLETREE);
+				search.push_back(CONTENT_YOUNG_JUNGLETREE);
+				search.push_back(CONTENT_CONIFER_TREE);
+				search.push_back(CONTENT_YOUNG_CONIFER_TREE);
+				search.push_back(CONTENT_LEAVES);
+				search.push_back(CONTENT_LEAVES_AUTUMN);
+				search.push_back(CONTENT_LEAVES_WINTER);
+				search.push_back(CONTENT_LEAVES_SNOWY);
+				search.push_back(CONTENT_JUNGLELEAVES);
+				search.push_back(CONTENT_CONIFER_LEAVES);
+				search.push_back(CONTENT_APPLE_LEAVES);
+				search.push_back(CONTENT_APPLE_BLOSSOM);
+				search.push_back(CONTENT_APPLE);
+				search.push_back(CONTENT_IGNORE);
+				content_t below = changes.getNodeNoEx(p+v3s16(0,-1,0)).getContent();
+				if (
+					below == CONTENT_MUD
+				) {
+					v3s16 h;
+					if (!searchNearInv(p,v3s16(-2,2,-2),v3s16(2,12,2),search,&h)) {
+						// young tree 1
+						MapNode nn(CONTENT_YOUNG_CONIFER_TREE);
+						changes.addNodeWithEvent(p,nn);
+						nn.setContent(CONTENT_CONIFER_LEAVES);
+						changes.addNodeWithEvent(p+v3s16(0,1,0),nn);
 					}
-					break;
 				}
-
-				// Apples should fall if there is no leaves block holding it
-				case CONTENT_APPLE:
-				{
-					v3s16 apple_p = p;
+			}
+		}
+		break;
+		case CONTENT_YOUNG_CONIFER_TREE:
+		{
+			if (n.envticks > 15) {
+				content_t below = changes.getNodeNoEx(p+v3s16(0,-1,0)).getContent();
+				if (
+					below == CONTENT_MUD
+				) {
+					content_t above = changes.getNodeNoEx(p+v3s16(0,1,0)).getContent();
 					std::vector<content_t> search;
+					search.push_back(CONTENT_AIR);
+					search.push_back(CONTENT_TREE);
+					search.push_back(CONTENT_YOUNG_TREE);
+					search.push_back(CONTENT_APPLE_TREE);
+					search.push_back(CONTENT_YOUNG_APPLE_TREE);
+					search.push_back(CONTENT_JUNGLETREE);
+					search.push_back(CONTENT_YOUNG_JUNGLETREE);
+					search.push_back(CONTENT_CONIFER_TREE);
+					search.push_back(CONTENT_YOUNG_CONIFER_TREE);
+					search.push_back(CONTENT_LEAVES);
+					search.push_back(CONTENT_LEAVES_AUTUMN);
+					search.push_back(CONTENT_LEAVES_WINTER);
+					search.push_back(CONTENT_LEAVES_SNOWY);
+					search.push_back(CONTENT_JUNGLELEAVES);
+					search.push_back(CONTENT_CONIFER_LEAVES);
 					search.push_back(CONTENT_APPLE_LEAVES);
+					search.push_back(CONTENT_APPLE_BLOSSOM);
+					search.push_back(CONTENT_APPLE);
 					search.push_back(CONTENT_IGNORE);
-					if (!searchNear(p,v3s16(1,1,1),search,NULL)) {
-						m_map->removeNodeWithEvent(apple_p);
-						InventoryItem *item = InventoryItem::create(CONTENT_CRAFTITEM_APPLE,1,0,0);
-						dropToParcel(p,item);
-					}
-					break;
-				}
-
-				// grow sponges on sand in water
-				case CONTENT_SAND:
-				{
-					if (n.envticks%30 == 0) {
-						MapNode n_top1 = m_map->getNodeNoEx(p+v3s16(0,1,0));
-						MapNode n_top2 = m_map->getNodeNoEx(p+v3s16(0,2,0));
-						if (
-							biome == BIOME_OCEAN
-							&& n_top1.getContent() == CONTENT_WATERSOURCE
-							&& n_top2.getContent() == CONTENT_WATERSOURCE
-						) {
-							std::vector<content_t> search;
-							search.push_back(CONTENT_SPONGE_FULL);
-							search.push_back(CONTENT_IGNORE);
-							if (!searchNear(p,v3s16(3,2,3),search,NULL)) {
-								n_top1.setContent(CONTENT_SPONGE_FULL);
-								m_map->addNodeWithEvent(p+v3s16(0,1,0), n_top1);
-							}
+					if (above == CONTENT_CONIFER_LEAVES) {
+						// young tree 2
+						v3s16 h;
+						if (!searchNearInv(p,v3s16(-1,2,-1),v3s16(1,5,1),search,&h)) {
+							MapNode nn(CONTENT_YOUNG_CONIFER_TREE);
+							changes.addNodeWithEvent(p+v3s16(0,1,0),nn);
+							changes.addNodeWithEvent(p+v3s16(0,2,0),nn);
+							nn.setContent(CONTENT_CONIFER_LEAVES);
+							changes.addNodeWithEvent(p+v3s16(0,3,0),nn);
+							changes.addNodeWithEvent(p+v3s16(0,4,0),nn);
+							changes.addNodeWithEvent(p+v3s16(1,2,0),nn);
+							changes.addNodeWithEvent(p+v3s16(-1,2,0),nn);
+							changes.addNodeWithEvent(p+v3s16(0,2,1),nn);
+							changes.addNodeWithEvent(p+v3s16(0,2,-1),nn);
+						}
+					}else if (above == CONTENT_YOUNG_CONIFER_TREE && n.envticks > 40) {
+						content_t abv = changes.getNodeNoEx(p+v3s16(0,2,0)).getContent();
+						content_t top = changes.getNodeNoEx(p+v3s16(0,3,0)).getContent();
+						if (abv == CONTENT_YOUNG_CONIFER_TREE && top == CONTENT_CONIFER_LEAVES) {
+							if (changes.getNodeNoEx(p+v3s16(1,2,0)).getContent() == CONTENT_CONIFER_LEAVES)
+								changes.removeNodeWithEvent(p+v3s16(1,2,0));
+							if (changes.getNodeNoEx(p+v3s16(-1,2,0)).getContent() == CONTENT_CONIFER_LEAVES)
+								changes.removeNodeWithEvent(p+v3s16(-1,2,0));
+							if (changes.getNodeNoEx(p+v3s16(0,2,1)).getContent() == CONTENT_CONIFER_LEAVES)
+								changes.removeNodeWithEvent(p+v3s16(0,2,1));
+							if (changes.getNodeNoEx(p+v3s16(0,2,-1)).getContent() == CONTENT_CONIFER_LEAVES)
+								changes.removeNodeWithEvent(p+v3s16(0,2,-1));
+							actionstream<<"A sapling grows into a conifer tree at "
+								<<PP(p)<<std::endl;
+
+							changes.plantgrowth(plantgrowth_conifertree,p);
 						}
 					}
-					break;
 				}
+			}
+			break;
+		}
 
-				// make sponge soak up water
-				case CONTENT_SPONGE:
-				{
-					v3s16 test_p;
-					MapNode testnode;
-					bool sponge_soaked = false;
-					s16 max_d = 2;
-					for(s16 z=-max_d; z<=max_d; z++) {
-					for(s16 y=-max_d; y<=max_d; y++) {
-					for(s16 x=-max_d; x<=max_d; x++) {
-						test_p = p + v3s16(x,y,z);
-						testnode = m_map->getNodeNoEx(test_p);
-						if (testnode.getContent() == CONTENT_WATERSOURCE) {
-							sponge_soaked = true;
-							testnode.setContent(CONTENT_AIR);
-							m_map->addNodeWithEvent(test_p, testnode);
-						}
-					}
-					}
-					}
-					if (sponge_soaked) {
-						n.setContent(CONTENT_SPONGE_FULL);
-						m_map->addNodeWithEvent(p, n);
+		// Apples should fall if there is no leaves block holding it
+		case CONTENT_APPLE:
+		{
+			v3s16 apple_p = p;
+			std::vector<content_t> search;
+			search.push_back(CONTENT_APPLE_LEAVES);
+			search.push_back(CONTENT_IGNORE);
+			if (!searchNear(p,v3s16(1,1,1),search,NULL)) {
+				changes.removeNodeWithEvent(apple_p);
+				InventoryItem *item = InventoryItem::create(CONTENT_CRAFTITEM_APPLE,1,0,0);
+				changes.dropToParcel(p,item);
+			}
+			break;
+		}
+
+		// grow sponges on sand in water
+		case CONTENT_SAND:
+		{
+			if (n.envticks%30 == 0) {
+				MapNode n_top1 = changes.getNodeNoEx(p+v3s16(0,1,0));
+				MapNode n_top2 = changes.getNodeNoEx(p+v3s16(0,2,0));
+				if (
+					biome == BIOME_OCEAN
+					&& n_top1.getContent() == CONTENT_WATERSOURCE
+					&& n_top2.getContent() == CONTENT_WATERSOURCE
+				) {
+					std::vector<content_t> search;
+					search.push_back(CONTENT_SPONGE_FULL);
+					search.push_back(CONTENT_IGNORE);
+					if (!searchNear(p,v3s16(3,2,3),search,NULL)) {
+						n_top1.setContent(CONTENT_SPONGE_FULL);
+						changes.addNodeWithEvent(p+v3s16(0,1,0), n_top1);
 					}
-					break;
 				}
+			}
+			break;
+		}
 
-				// make papyrus grow near water
-				case CONTENT_PAPYRUS:
-				{
-					if (n.envticks%10 == 0) {
-						MapNode n_btm = m_map->getNodeNoEx(p+v3s16(0,-1,0));
-						if (n_btm.getContent() == CONTENT_MUD) {
-							if (searchNear(p,v3s16(2,2,2),CONTENT_WATERSOURCE,NULL))
-								plantgrowth_plant(this,p,3);
-						}
-					}
-					break;
+		// make sponge soak up water
+		case CONTENT_SPONGE:
+		{
+			v3s16 test_p;
+			MapNode testnode;
+			bool sponge_soaked = false;
+			s16 max_d = 2;
+			for(s16 z=-max_d; z<=max_d; z++) {
+			for(s16 y=-max_d; y<=max_d; y++) {
+			for(s16 x=-max_d; x<=max_d; x++) {
+				test_p = p + v3s16(x,y,z);
+				testnode = changes.getNodeNoEx(test_p);
+				if (testnode.getContent() == CONTENT_WATERSOURCE) {
+					sponge_soaked = true;
+					testnode.setContent(CONTENT_AIR);
+					changes.addNodeWithEvent(test_p, testnode);
 				}
+			}
+			}
+			}
+			if (sponge_soaked) {
+				n.setContent(CONTENT_SPONGE_FULL);
+				changes.addNodeWithEvent(p, n);
+			}
+			break;
+		}
 
-				// steam dissipates
-				case CONTENT_STEAM:
-					m_map->removeNodeWithEvent(p);
-					break;
+		// make papyrus grow near water
+		case CONTENT_PAPYRUS:
+		{
+			if (n.envticks%10 == 0) {
+				MapNode n_btm = changes.getNodeNoEx(p+v3s16(0,-1,0));
+				if (n_btm.getContent() == CONTENT_MUD) {
+					if (searchNear(p,v3s16(2,2,2),CONTENT_WATERSOURCE,NULL))
+						changes.plantgrowthPlant(p,3);
+				}
+			}
+			break;
+		}
 
-				// make lava cool near water
-				case CONTENT_LAVASOURCE:
-				case CONTENT_LAVA:
-				{
-					MapNode testnode;
-					v3s16 test_p;
-					std::vector<content_t> search;
-					bool found = false;
-					search.push_back(CONTENT_WATER);
-					search.push_back(CONTENT_VACUUM);
-					search.push_back(CONTENT_WATERSOURCE);
-					if (coldzone) {
-						found = true;
-					}else if (searchNear(p,v3s16(1,1,1),search,&test_p)) {
-						testnode = m_map->getNodeNoEx(test_p);
-						found = true;
-						testnode.setContent(CONTENT_STEAM);
-						m_delayed_node_changes[test_p] = testnode;
-						if (!has_steam_sound) {
-							addEnvEvent(ENV_EVENT_SOUND,intToFloat(p,BS),"env-steam");
-							has_steam_sound = true;
-						}
-					}
+		// steam dissipates
+		case CONTENT_STEAM:
+			changes.removeNodeWithEvent(p);
+			break;
 
-					if (found == true && n.getContent() == CONTENT_LAVASOURCE) {
-						int material = myrand()%50;
-						switch(material) {
-						case 0:
-						case 1:
-						case 2:
-						case 3:
-						case 4:
-						case 5:
-						case 6:
-						case 7:
-							n = MapNode(CONTENT_STONE, MINERAL_COAL);
-							break;
-						case 8:
-						case 9:
-						case 10:
-						case 11:
-							n = MapNode(CONTENT_STONE, MINERAL_IRON);
-							break;
-						case 12:
-						case 13:
-						case 14:
-						case 15:
-							n = MapNode(CONTENT_STONE, MINERAL_TIN);
-							break;
-						case 16:
-						case 17:
-						case 18:
-						case 19:
-							n = MapNode(CONTENT_STONE, MINERAL_QUARTZ);
-							break;
-						case 20:
-						case 21:
-						case 22:
-						case 23:
-							n = MapNode(CONTENT_STONE, MINERAL_COPPER);
-							break;
-						case 24:
-							n = MapNode(CONTENT_STONE, MINERAL_SILVER);
-							break;
-						case 25:
-							n = MapNode(CONTENT_STONE, MINERAL_GOLD);
-							break;
-						default:
-							n.setContent(CONTENT_ROUGHSTONE);
-							break;
-						}
-						m_map->addNodeWithEvent(p, n);
-					}else if (found == true) {
-						n.setContent(CONTENT_ROUGHSTONE);
-						m_map->addNodeWithEvent(p, n);
-					}
+		// make lava cool near water
+		case CONTENT_LAVASOURCE:
+		case CONTENT_LAVA:
+		{
+			MapNode testnode;
+			v3s16 test_p;
+			std::vector<content_t> search;
+			bool found = false;
+			search.push_back(CONTENT_WATER);
+			search.push_back(CONTENT_VACUUM);
+			search.push_back(CONTENT_WATERSOURCE);
+			if (coldzone) {
+				found = true;
+			}else if (searchNear(p,v3s16(1,1,1),search,&test_p)) {
+				testnode = changes.getNodeNoEx(test_p);
+				found = true;
+				testnode.setContent(CONTENT_STEAM);
+				changes.setDelayedNode(test_p,testnode);
+				if (!has_steam_sound) {
+					changes.addEnvEvent(ENV_EVENT_SOUND,intToFloat(p,BS),"env-steam");
+					has_steam_sound = true;
+				}
+			}
 
+			if (found == true && n.getContent() == CONTENT_LAVASOURCE) {
+				int material = myrand()%50;
+				switch(material) {
+				case 0:
+				case 1:
+				case 2:
+				case 3:
+				case 4:
+				case 5:
+				case 6:
+				case 7:
+					n = MapNode(CONTENT_STONE, MINERAL_COAL);
 					break;
-				}
-				case CONTENT_AIR:
-				{
-					if (biome == BIOME_SPACE && !searchNear(p,v3s16(5,5,5),CONTENT_LIFE_SUPPORT,NULL)) {
-						n.setContent(CONTENT_VACUUM);
-						m_map->addNodeWithEvent(p,n);
-					}
+				case 8:
+				case 9:
+				case 10:
+				case 11:
+					n = MapNode(CONTENT_STONE, MINERAL_IRON);
 					break;
-				}
-				case CONTENT_VACUUM:
-				{
-					if (biome != BIOME_SPACE) {
-						n.setContent(CONTENT_AIR);
-						m_map->addNodeWithEvent(p,n);
-					}
+				case 12:
+				case 13:
+				case 14:
+				case 15:
+					n = MapNode(CONTENT_STONE, MINERAL_TIN);
 					break;
-				}
-				case CONTENT_LIFE_SUPPORT:
-				{
-					MapNode testnode;
-					v3s16 testpos;
-					for (s16 x=-5; x<5; x++)
-					for (s16 y=-5; y<5; y++)
-					for (s16 z=-5; z<5; z++) {
-						testpos = p+v3s16(x,y,z);
-						testnode = m_map->getNodeNoEx(testpos);
-						if (testnode.getContent() != CONTENT_VACUUM)
-							continue;
-						testnode.setContent(CONTENT_AIR);
-						m_map->addNodeWithEvent(testpos,testnode);
-					}
+				case 16:
+				case 17:
+				case 18:
+				case 19:
+					n = MapNode(CONTENT_STONE, MINERAL_QUARTZ);
+					break;
+				case 20:
+				case 21:
+				case 22:
+				case 23:
+					n = MapNode(CONTENT_STONE, MINERAL_COPPER);
+					break;
+				case 24:
+					n = MapNode(CONTENT_STONE, MINERAL_SILVER);
+					break;
+				case 25:
+					n = MapNode(CONTENT_STONE, MINERAL_GOLD);
+					break;
+				default:
+					n.setContent(CONTENT_ROUGHSTONE);
 					break;
 				}
-				}
-
-				if (coldzone && biome != BIOME_BEACH
-					&& (content_features(n).draw_type == CDT_CUBELIKE
-						|| content_features(n).draw_type == CDT_GLASSLIKE
-						|| (content_features(n).draw_type == CDT_DIRTLIKE
-							&& (n.param1&0x20) != 0x20
-							&& ((n.param1&0x0F) == 0x00
-								|| (n.param1&0x0F) == 0x04))))
-				{
-					if (myrand()%20 == 0)
-					{
-						std::vector<content_t> search;
-						search.push_back(CONTENT_AIR);
-						// check that it's on top, and somewhere snow could fall
-						// not 100% because torches
-						if (!searchNearInv(p,v3s16(0,1,0),v3s16(0,16,0),search,NULL)
-							&& !searchNear(p,v3s16(3,3,3),CONTENT_FIRE,NULL))
-						{
-							MapNode nn(CONTENT_SNOW);
-							m_map->addNodeWithEvent(p+v3s16(0,1,0),nn);
-							//n.param1 &= ~0x0F;
-							//n.param1 |= 0x04;
-							//n.envticks = 0;
-							//m_map->addNodeWithEvent(p,n);
-						}
-					}
-				}
+				changes.addNodeWithEvent(p, n);
+			}else if (found == true) {
+				n.setContent(CONTENT_ROUGHSTONE);
+				changes.addNodeWithEvent(p, n);
 			}
 
-			for (std::map<v3s16,MapNode>::iterator it = m_delayed_node_changes.begin();
-			     it != m_delayed_node_changes.end(); it++)
-			{
-				m_map->addNodeWithEvent(it->first, it->second);
+			break;
+		}
+		case CONTENT_AIR:
+		{
+			if (biome == BIOME_SPACE && !searchNear(p,v3s16(5,5,5),CONTENT_LIFE_SUPPORT,NULL)) {
+				n.setContent(CONTENT_VACUUM);
+				changes.addNodeWithEvent(p,n);
 			}
-			m_delayed_node_changes.clear();
-
-			if(block)
-			    block->ResetCurrent();		
+			break;
 		}
-	}
-
-	/*
-		Step active objects
-	*/
-	{
-		ScopeProfiler sp(g_profiler, "SEnv: step act. objs avg", SPT_AVG);
-		//TimeTaker timer("Step active objects");
-
-		g_profiler->avg("SEnv: num of objects", m_active_objects.size());
-
-		// This helps the objects to send data at the same time
-		bool send_recommended = false;
-		u8 mob_level = mobLevelI(config_get("world.game.mob.spawn.level"));
-		m_send_recommended_timer += dtime;
-		if (m_send_recommended_timer > 0.10) {
-			m_send_recommended_timer = 0;
-			send_recommended = true;
+		case CONTENT_VACUUM:
+		{
+			if (biome != BIOME_SPACE) {
+				n.setContent(CONTENT_AIR);
+				changes.addNodeWithEvent(p,n);
+			}
+			break;
 		}
-
-		for (std::map<u16, ServerActiveObject*>::iterator i = m_active_objects.begin(); i != m_active_objects.end(); i++) {
-			ServerActiveObject* obj = i->second;
-
-			if(!obj)
-			    continue;
-			
-			// Remove non-peaceful mobs on peaceful mode
-			if (obj->level() > mob_level)
-				obj->m_removed = true;
-			// Don't step if is to be removed or stored statically
-			if (obj->m_removed)
-				continue;
-			if (obj->m_pending_deactivation) {
-				// The block in which the object resides in
-				v3s16 blockpos = getNodeBlockPos(floatToInt(obj->getBasePosition(), BS));
-				if (!m_active_blocks.contains(blockpos))
+		case CONTENT_LIFE_SUPPORT:
+		{
+			MapNode testnode;
+			v3s16 testpos;
+			for (s16 x=-5; x<5; x++)
+			for (s16 y=-5; y<5; y++)
+			for (s16 z=-5; z<5; z++) {
+				testpos = p+v3s16(x,y,z);
+				testnode = changes.getNodeNoEx(testpos);
+				if (testnode.getContent() != CONTENT_VACUUM)
 					continue;
-				obj->m_pending_deactivation = false;
-			}
-			// Step object
-			obj->step(dtime, send_recommended);
-			// Read messages from object
-			while (obj->m_messages_out.size() > 0) {
-				m_active_object_messages.push_back(obj->m_messages_out.pop_front());
+				testnode.setContent(CONTENT_AIR);
+				changes.addNodeWithEvent(testpos,testnode);
 			}
+			break;
+		}
 		}
-	}
 
-	/*
-		Manage active objects
-	*/
-	if (m_object_management_interval.step(dtime, 0.5)) {
-		ScopeProfiler sp(g_profiler, "SEnv: remove removed objs avg /.5s", SPT_AVG);
-		/*
-			Remove objects that satisfy (m_removed && m_known_by_count==0)
-		*/
-		removeRemovedObjects();
+		if (coldzone && biome != BIOME_BEACH
+			&& (content_features(n).draw_type == CDT_CUBELIKE
+				|| content_features(n).draw_type == CDT_GLASSLIKE
+				|| (content_features(n).draw_type == CDT_DIRTLIKE
+					&& (n.param1&0x20) != 0x20
+					&& ((n.param1&0x0F) == 0x00
+						|| (n.param1&0x0F) == 0x04))))
+		{
+			if (myrand()%20 == 0)
+			{
+				std::vector<content_t> search;
+				search.push_back(CONTENT_AIR);
+				// check that it's on top, and somewhere snow could fall
+				// not 100% because torches
+				if (!searchNearInv(p,v3s16(0,1,0),v3s16(0,16,0),search,NULL)
+					&& !searchNear(p,v3s16(3,3,3),CONTENT_FIRE,NULL))
+				{
+					MapNode nn(CONTENT_SNOW);
+					changes.addNodeWithEvent(p+v3s16(0,1,0),nn);
+					//n.param1 &= ~0x0F;
+					//n.param1 |= 0x04;
+					//n.envticks = 0;
+					//changes.addNodeWithEvent(p,n);
+				}
+			}
+		}
 	}
+	return visited;
 }
 
 ServerActiveObject* ServerEnvironment::getActiveObject(u16 id)
@@ -3218,8 +3885,11 @@ ServerActiveObject* ServerEnvironment::getActiveObject(u16 id)
 
 void ServerEnvironment::getActiveObjects(v3f origin, f32 max_d, core::array<DistanceSortedActiveObject> &dest)
 {
-	for (std::map<u16, ServerActiveObject*>::iterator i = m_active_objects.begin(); i != m_active_objects.end(); i++) {
-		ServerActiveObject* obj = i->second;
+	std::vector<u16> ids;
+	m_active_object_index.find(origin, max_d, ids);
+
+	for (std::vector<u16>::iterator i = ids.begin(); i != ids.end(); i++) {
+		ServerActiveObject* obj = getActiveObject(*i);
 
 		if(!obj)
 		    continue;
@@ -3235,61 +3905,53 @@ void ServerEnvironment::getActiveObjects(v3f origin, f32 max_d, core::array<Dist
 	}
 }
 
-bool ServerEnvironment::propogateEnergy(u8 level, v3s16 powersrc, v3s16 signalsrc, v3s16 pos, core::map<v3s16,MapBlock*> &modified_blocks)
+/*
+	The versions of the blocks the nodes around pos are in, 0 for blocks
+	that aren't loaded
+*/
+void ServerEnvironment::getCircuitVersions(v3s16 pos, uint64_t versions[8])
 {
-	MapNode n = m_map->getNodeNoEx(pos);
-	NodeMetadata *m;
-	if (n.getContent() == CONTENT_IGNORE)
-		return false;
-	ContentFeatures &f = content_features(n);
-	if (f.energy_type == CET_NONE) {
-		if (powersrc != signalsrc || (n.getContent() != CONTENT_STONE && n.getContent() != CONTENT_LIMESTONE))
-			return false;
-	}else{
-		if ((f.energy_type == CET_SOURCE || f.energy_type == CET_SWITCH) && pos != powersrc)
-			return false;
-		if (f.energy_type == CET_GATE && pos == powersrc && level != ENERGY_MAX)
-			return false;
-		m = m_map->getNodeMetadata(pos);
-		if (!m)
-			return false;
-		{
-			MapNode n = m_map->getNodeNoEx(pos);
-			content_t c = n.getContent();
-			if (c >= CONTENT_DOOR_MIN && c <= CONTENT_DOOR_MAX) {
-				v3s16 mp(0,1,0);
-				if ((c&CONTENT_DOOR_SECT_MASK) == CONTENT_DOOR_SECT_MASK)
-					mp.Y = -1;
-
-				if (signalsrc != pos+mp)
-					propogateEnergy(level,powersrc,pos,pos+mp, modified_blocks);
-			}
-		}
-		if (!m->energise(level,powersrc,signalsrc,pos))
-			return false;
-		if (f.energy_type == CET_GATE)
-			level = ENERGY_MAX;
-		if (f.energy_type == CET_GATE && pos != powersrc)
-			return false;
-	}
-	if (level) {
-		if (f.powered_node != CONTENT_IGNORE) {
-			n.setContent(f.powered_node);
-			std::string st("");
-			m_map->addNodeAndUpdate(pos, n, modified_blocks, st);
-		}
+	v3s16 min = getNodeBlockPos(pos-v3s16(1,1,1));
+	v3s16 max = getNodeBlockPos(pos+v3s16(1,1,1));
+	int i = 0;
+	v3s16 bp;
+	for (bp.X=min.X; bp.X<=max.X; bp.X++)
+	for (bp.Y=min.Y; bp.Y<=max.Y; bp.Y++)
+	for (bp.Z=min.Z; bp.Z<=max.Z; bp.Z++) {
+		MapBlock *block = m_map->getBlockNoCreateNoEx(bp);
+		versions[i++] = block ? block->getNodeVersion() : 0;
 	}
-	if (f.energy_type == CET_DEVICE) {
-	    // devices receive power, but don't propogate it further
-	    return false;
+	for (; i<8; i++) {
+		versions[i] = 0;
 	}
+}
 
-	if (f.energy_type != CET_SOURCE && f.energy_type != CET_SWITCH)
-		level -= f.energy_drop;
+/*
+	Works out where energy goes on to from pos, or finds it if nothing
+	around pos has changed since the last time
+*/
+CircuitLinks *ServerEnvironment::getCircuitLinks(v3s16 pos)
+{
+	uint64_t versions[8];
+	getCircuitVersions(pos,versions);
+
+	std::map<v3s16,CircuitLinks>::iterator i = m_circuit_links.find(pos);
+	if (i != m_circuit_links.end()) {
+		int k;
+		for (k=0; k<8 && i->second.versions[k] == versions[k]; k++) {}
+		if (k == 8) {
+			i->second.used = m_circuit_step;
+			g_profiler->add("SEnv: circuit links cached", 1);
+			return &i->second;
+		}
+	}
+	g_profiler->add("SEnv: circuit links found", 1);
 
-	if (level < 1) {
-	    return false;
+	CircuitLinks &links = m_circuit_links[pos];
+	for (int k=0; k<8; k++) {
+		links.versions[k] = versions[k];
 	}
+	links.used = m_circuit_step;
 
 	MapNode n_plus_y = m_map->getNodeNoEx(pos + v3s16(0,1,0));
 	MapNode n_minus_x = m_map->getNodeNoEx(pos + v3s16(-1,0,0));
@@ -3414,102 +4076,247 @@ bool ServerEnvironment::propogateEnergy(u8 level, v3s16 powersrc, v3s16 signalsr
 		z_minus = true;
 	}
 
-	bool gate_x_plus = true;
-	bool gate_x_minus = true;
-	bool gate_z_plus = true;
-	bool gate_z_minus = true;
+	links.linked[0] = true;
+	if (x_plus) {
+		links.link[0] = pos+v3s16(1,0,0);
+	}else if (x_plus_y) {
+		links.link[0] = pos+v3s16(1,1,0);
+	}else if (x_plus_y_minus) {
+		links.link[0] = pos+v3s16(1,-1,0);
+	}else{
+		links.linked[0] = false;
+	}
+	links.linked[1] = true;
+	if (x_minus) {
+		links.link[1] = pos+v3s16(-1,0,0);
+	}else if (x_minus_y) {
+		links.link[1] = pos+v3s16(-1,1,0);
+	}else if (x_minus_y_minus) {
+		links.link[1] = pos+v3s16(-1,-1,0);
+	}else{
+		links.linked[1] = false;
+	}
+	links.linked[2] = true;
+	if (z_plus) {
+		links.link[2] = pos+v3s16(0,0,1);
+	}else if (z_plus_y) {
+		links.link[2] = pos+v3s16(0,1,1);
+	}else if (z_plus_y_minus) {
+		links.link[2] = pos+v3s16(0,-1,1);
+	}else{
+		links.linked[2] = false;
+	}
+	links.linked[3] = true;
+	if (z_minus) {
+		links.link[3] = pos+v3s16(0,0,-1);
+	}else if (z_minus_y) {
+		links.link[3] = pos+v3s16(0,1,-1);
+	}else if (z_minus_y_minus) {
+		links.link[3] = pos+v3s16(0,-1,-1);
+	}else{
+		links.linked[3] = false;
+	}
+
+	MapNode stone[4][3] = {
+		{n_plus_x, n_plus_xy, n_plus_x_y},
+		{n_minus_x, n_minus_xy, n_minus_x_y},
+		{n_plus_z, n_plus_zy, n_plus_z_y},
+		{n_minus_z, n_minus_zy, n_minus_z_y}
+	};
+	for (int d=0; d<4; d++) {
+		links.stone[d] = 0;
+		for (int k=0; k<3; k++) {
+			content_t c = stone[d][k].getContent();
+			if (c == CONTENT_STONE || c == CONTENT_LIMESTONE)
+				links.stone[d] |= 1<<k;
+		}
+	}
+
+	return &links;
+}
+
+void CircuitFlood::addNode(v3s16 pos)
+{
+	v3s16 min = getNodeBlockPos(pos-v3s16(1,1,1));
+	v3s16 max = getNodeBlockPos(pos+v3s16(1,1,1));
+	v3s16 bp;
+	for (bp.X=min.X; bp.X<=max.X; bp.X++)
+	for (bp.Y=min.Y; bp.Y<=max.Y; bp.Y++)
+	for (bp.Z=min.Z; bp.Z<=max.Z; bp.Z++) {
+		versions[bp] = 0;
+	}
+}
+
+void CircuitFlood::setVersions(Map *map)
+{
+	for (std::map<v3s16,uint64_t>::iterator i = versions.begin(); i != versions.end(); i++) {
+		MapBlock *block = map->getBlockNoCreateNoEx(i->first);
+		i->second = block ? block->getNodeVersion() : 0;
+	}
+}
+
+bool CircuitFlood::replay(Map *map)
+{
+	for (std::map<v3s16,uint64_t>::iterator i = versions.begin(); i != versions.end(); i++) {
+		MapBlock *block = map->getBlockNoCreateNoEx(i->first);
+		if ((block ? block->getNodeVersion() : 0) != i->second)
+			return false;
+	}
+	/*
+		While every node takes the energy as it did, the flood would go
+		the same way. If one doesn't, those before it have only been
+		energised again as the flood would have done first anyway.
+	*/
+	for (std::vector<CircuitEnergise>::iterator i = energised.begin(); i != energised.end(); i++) {
+		NodeMetadata *m = map->getNodeMetadata(i->pos);
+		if (!m || m->energise(i->level,i->powersrc,i->signalsrc,i->pos) != i->taken)
+			return false;
+	}
+	return true;
+}
+
+/*
+	Sources flood their circuit every circuit step to keep it powered,
+	the last flood from each is done again while nothing has changed
+*/
+bool ServerEnvironment::propogateEnergy(u8 level, v3s16 powersrc, v3s16 signalsrc, v3s16 pos, core::map<v3s16,MapBlock*> &modified_blocks)
+{
+	if (m_circuit_flood)
+		return floodEnergy(level,powersrc,signalsrc,pos,modified_blocks);
+	if (powersrc != pos || signalsrc != pos) {
+		CircuitFlood flood;
+		m_circuit_flood = &flood;
+		floodEnergy(level,powersrc,signalsrc,pos,modified_blocks);
+		m_circuit_flood = NULL;
+		return false;
+	}
+
+	std::map<v3s16,CircuitFlood>::iterator i = m_circuit_floods.find(pos);
+	if (i != m_circuit_floods.end() && i->second.level == level && i->second.replay(m_map)) {
+		i->second.used = m_circuit_step;
+		g_profiler->add("SEnv: circuit floods replayed", 1);
+		return false;
+	}
+	g_profiler->add("SEnv: circuit floods done", 1);
+
+	CircuitFlood &flood = m_circuit_floods[pos];
+	flood.level = level;
+	flood.energised.clear();
+	flood.versions.clear();
+	flood.used = m_circuit_step;
+	m_circuit_flood = &flood;
+	floodEnergy(level,powersrc,signalsrc,pos,modified_blocks);
+	m_circuit_flood = NULL;
+	flood.setVersions(m_map);
+
+	return false;
+}
+
+bool ServerEnvironment::floodEnergy(u8 level, v3s16 powersrc, v3s16 signalsrc, v3s16 pos, core::map<v3s16,MapBlock*> &modified_blocks)
+{
+	m_circuit_flood->addNode(pos);
+	MapNode n = m_map->getNodeNoEx(pos);
+	NodeMetadata *m;
+	if (n.getContent() == CONTENT_IGNORE)
+		return false;
+	ContentFeatures &f = content_features(n);
+	if (f.energy_type == CET_NONE) {
+		if (powersrc != signalsrc || (n.getContent() != CONTENT_STONE && n.getContent() != CONTENT_LIMESTONE))
+			return false;
+	}else{
+		if ((f.energy_type == CET_SOURCE || f.energy_type == CET_SWITCH) && pos != powersrc)
+			return false;
+		if (f.energy_type == CET_GATE && pos == powersrc && level != ENERGY_MAX)
+			return false;
+		m = m_map->getNodeMetadata(pos);
+		if (!m)
+			return false;
+		{
+			MapNode n = m_map->getNodeNoEx(pos);
+			content_t c = n.getContent();
+			if (c >= CONTENT_DOOR_MIN && c <= CONTENT_DOOR_MAX) {
+				v3s16 mp(0,1,0);
+				if ((c&CONTENT_DOOR_SECT_MASK) == CONTENT_DOOR_SECT_MASK)
+					mp.Y = -1;
+
+				if (signalsrc != pos+mp)
+					floodEnergy(level,powersrc,pos,pos+mp, modified_blocks);
+			}
+		}
+		CircuitEnergise e;
+		e.level = level;
+		e.powersrc = powersrc;
+		e.signalsrc = signalsrc;
+		e.pos = pos;
+		e.taken = m->energise(level,powersrc,signalsrc,pos);
+		m_circuit_flood->energised.push_back(e);
+		if (!e.taken)
+			return false;
+		if (f.energy_type == CET_GATE)
+			level = ENERGY_MAX;
+		if (f.energy_type == CET_GATE && pos != powersrc)
+			return false;
+	}
+	if (level) {
+		if (f.powered_node != CONTENT_IGNORE) {
+			n.setContent(f.powered_node);
+			std::string st("");
+			m_map->addNodeAndUpdate(pos, n, modified_blocks, st);
+		}
+	}
+	if (f.energy_type == CET_DEVICE) {
+	    // devices receive power, but don't propogate it further
+	    return false;
+	}
+
+	if (f.energy_type != CET_SOURCE && f.energy_type != CET_SWITCH)
+		level -= f.energy_drop;
+
+	if (level < 1) {
+	    return false;
+	}
+
+	// A copy, as the nodes around may change while energy goes on
+	CircuitLinks links = *getCircuitLinks(pos);
+	static const v3s16 dirs[4] = {
+		v3s16(1,0,0),
+		v3s16(-1,0,0),
+		v3s16(0,0,1),
+		v3s16(0,0,-1)
+	};
+
+	bool gate[4] = {true,true,true,true};
 	if (f.energy_type == CET_GATE) {
-		gate_x_plus = false;
-		gate_x_minus = false;
-		gate_z_plus = false;
-		gate_z_minus = false;
+		gate[0] = false;
+		gate[1] = false;
+		gate[2] = false;
+		gate[3] = false;
 		powersrc = pos;
 		v3s16 dir = n.getRotation();
 		if (dir == v3s16(1,1,1)) {
-			gate_z_plus = true;
+			gate[2] = true;
 		}else if (dir == v3s16(-1,1,1)) {
-			gate_x_plus = true;
+			gate[0] = true;
 		}else if (dir == v3s16(-1,1,-1)) {
-			gate_z_minus = true;
+			gate[3] = true;
 		}else if (dir == v3s16(1,1,-1)) {
-			gate_x_minus = true;
+			gate[1] = true;
 		}
 	}
 
-	if (gate_x_plus) {
-		if (x_plus) {
-			if ((pos+v3s16(1,0,0)) != signalsrc)
-				propogateEnergy(level,powersrc,pos,pos+v3s16(1,0,0), modified_blocks);
-		}else if (x_plus_y) {
-			if ((pos+v3s16(1,1,0)) != signalsrc)
-				propogateEnergy(level,powersrc,pos,pos+v3s16(1,1,0), modified_blocks);
-		}else if (x_plus_y_minus) {
-			if ((pos+v3s16(1,-1,0)) != signalsrc)
-				propogateEnergy(level,powersrc,pos,pos+v3s16(1,-1,0), modified_blocks);
-		}else if (powersrc == pos) {
-			if ((pos+v3s16(1,0,0)) != signalsrc && (n_plus_x.getContent() == CONTENT_STONE || n_plus_x.getContent() == CONTENT_LIMESTONE))
-				propogateEnergy(level,powersrc,pos,pos+v3s16(1,0,0), modified_blocks);
-			if ((pos+v3s16(1,1,0)) != signalsrc && (n_plus_xy.getContent() == CONTENT_STONE || n_plus_xy.getContent() == CONTENT_LIMESTONE))
-				propogateEnergy(level,powersrc,pos,pos+v3s16(1,1,0), modified_blocks);
-			if ((pos+v3s16(1,-1,0)) != signalsrc && (n_plus_x_y.getContent() == CONTENT_STONE || n_plus_x_y.getContent() == CONTENT_LIMESTONE))
-				propogateEnergy(level,powersrc,pos,pos+v3s16(1,-1,0), modified_blocks);
-		}
-	}
-	if (gate_x_minus) {
-		if (x_minus) {
-			if ((pos+v3s16(-1,0,0)) != signalsrc)
-				propogateEnergy(level,powersrc,pos,pos+v3s16(-1,0,0), modified_blocks);
-		}else if (x_minus_y) {
-			if ((pos+v3s16(-1,1,0)) != signalsrc)
-				propogateEnergy(level,powersrc,pos,pos+v3s16(-1,1,0), modified_blocks);
-		}else if (x_minus_y_minus) {
-			if ((pos+v3s16(-1,-1,0)) != signalsrc)
-				propogateEnergy(level,powersrc,pos,pos+v3s16(-1,-1,0), modified_blocks);
-		}else if (powersrc == pos) {
-			if ((pos+v3s16(-1,0,0)) != signalsrc && (n_minus_x.getContent() == CONTENT_STONE || n_minus_x.getContent() == CONTENT_LIMESTONE))
-				propogateEnergy(level,powersrc,pos,pos+v3s16(-1,0,0), modified_blocks);
-			if ((pos+v3s16(-1,1,0)) != signalsrc && (n_minus_xy.getContent() == CONTENT_STONE || n_minus_xy.getContent() == CONTENT_LIMESTONE))
-				propogateEnergy(level,powersrc,pos,pos+v3s16(-1,1,0), modified_blocks);
-			if ((pos+v3s16(-1,-1,0)) != signalsrc && (n_minus_x_y.getContent() == CONTENT_STONE || n_minus_x_y.getContent() == CONTENT_LIMESTONE))
-				propogateEnergy(level,powersrc,pos,pos+v3s16(-1,-1,0), modified_blocks);
-		}
-	}
-	if (gate_z_plus) {
-		if (z_plus) {
-			if ((pos+v3s16(0,0,1)) != signalsrc)
-				propogateEnergy(level,powersrc,pos,pos+v3s16(0,0,1), modified_blocks);
-		}else if (z_plus_y) {
-			if ((pos+v3s16(0,1,1)) != signalsrc)
-				propogateEnergy(level,powersrc,pos,pos+v3s16(0,1,1), modified_blocks);
-		}else if (z_plus_y_minus) {
-			if ((pos+v3s16(0,-1,1)) != signalsrc)
-				propogateEnergy(level,powersrc,pos,pos+v3s16(0,-1,1), modified_blocks);
-		}else if (powersrc == pos) {
-			if ((pos+v3s16(0,0,1)) != signalsrc && (n_plus_z.getContent() == CONTENT_STONE || n_plus_z.getContent() == CONTENT_LIMESTONE))
-				propogateEnergy(level,powersrc,pos,pos+v3s16(0,0,1), modified_blocks);
-			if ((pos+v3s16(0,1,1)) != signalsrc && (n_plus_zy.getContent() == CONTENT_STONE || n_plus_zy.getContent() == CONTENT_LIMESTONE))
-				propogateEnergy(level,powersrc,pos,pos+v3s16(0,1,1), modified_blocks);
-			if ((pos+v3s16(0,-1,1)) != signalsrc && (n_plus_z_y.getContent() == CONTENT_STONE || n_plus_z_y.getContent() == CONTENT_LIMESTONE))
-				propogateEnergy(level,powersrc,pos,pos+v3s16(0,-1,1), modified_blocks);
-		}
-	}
-	if (gate_z_minus) {
-		if (z_minus) {
-			if ((pos+v3s16(0,0,-1)) != signalsrc)
-				propogateEnergy(level,powersrc,pos,pos+v3s16(0,0,-1), modified_blocks);
-		}else if (z_minus_y) {
-			if ((pos+v3s16(0,1,-1)) != signalsrc)
-				propogateEnergy(level,powersrc,pos,pos+v3s16(0,1,-1), modified_blocks);
-		}else if (z_minus_y_minus) {
-			if ((pos+v3s16(0,-1,-1)) != signalsrc)
-				propogateEnergy(level,powersrc,pos,pos+v3s16(0,-1,-1), modified_blocks);
+	for (int i=0; i<4; i++) {
+		if (!gate[i])
+			continue;
+		if (links.linked[i]) {
+			if (links.link[i] != signalsrc)
+				floodEnergy(level,powersrc,pos,links.link[i], modified_blocks);
 		}else if (powersrc == pos) {
-			if ((pos+v3s16(0,0,-1)) != signalsrc && (n_minus_z.getContent() == CONTENT_STONE || n_minus_z.getContent() == CONTENT_LIMESTONE))
-				propogateEnergy(level,powersrc,pos,pos+v3s16(0,0,-1), modified_blocks);
-			if ((pos+v3s16(0,1,-1)) != signalsrc && (n_minus_zy.getContent() == CONTENT_STONE || n_minus_zy.getContent() == CONTENT_LIMESTONE))
-				propogateEnergy(level,powersrc,pos,pos+v3s16(0,1,-1), modified_blocks);
-			if ((pos+v3s16(0,-1,-1)) != signalsrc && (n_minus_z_y.getContent() == CONTENT_STONE || n_minus_z_y.getContent() == CONTENT_LIMESTONE))
-				propogateEnergy(level,powersrc,pos,pos+v3s16(0,-1,-1), modified_blocks);
+			if ((pos+dirs[i]) != signalsrc && (links.stone[i]&0x01))
+				floodEnergy(level,powersrc,pos,pos+dirs[i], modified_blocks);
+			if ((pos+dirs[i]+v3s16(0,1,0)) != signalsrc && (links.stone[i]&0x02))
+				floodEnergy(level,powersrc,pos,pos+dirs[i]+v3s16(0,1,0), modified_blocks);
+			if ((pos+dirs[i]+v3s16(0,-1,0)) != signalsrc && (links.stone[i]&0x04))
+				floodEnergy(level,powersrc,pos,pos+dirs[i]+v3s16(0,-1,0), modified_blocks);
 		}
 	}
 	return false;
@@ -3562,16 +4369,19 @@ void ServerEnvironment::getAddedActiveObjects(v3s16 pos, s16 radius,
 	v3f pos_f = intToFloat(pos, BS);
 	f32 radius_f = radius * BS;
 	/*
-		Go through the object list,
+		Go through the objects near pos,
 		- discard m_removed objects,
 		- discard objects that are too far away,
 		- discard objects that are found in current_objects.
 		- add remaining objects to added_objects
 	*/
-	for (std::map<u16, ServerActiveObject*>::iterator i = m_active_objects.begin(); i != m_active_objects.end(); i++) {
-		u16 id = i->first;
+	std::vector<u16> ids;
+	m_active_object_index.find(pos_f, radius_f, ids);
+
+	for (std::vector<u16>::iterator i = ids.begin(); i != ids.end(); i++) {
+		u16 id = *i;
 		// Get object
-		ServerActiveObject *object = i->second;
+		ServerActiveObject *object = getActiveObject(id);
 		if (object == NULL)
 			continue;
 		// Discard if removed
@@ -3679,6 +4489,7 @@ u16 ServerEnvironment::addActiveObjectRaw(ServerActiveObject *object, bool set_c
 	}
 
 	m_active_objects[object->getId()] = object;
+	m_active_object_index.add(object->getId(), object->getBasePosition());
 
 	verbosestream<<"ServerEnvironment::addActiveObjectRaw(): "
 			<<"Added id="<<object->getId()<<"; there are now "
@@ -3791,6 +4602,7 @@ void ServerEnvironment::removeRemovedObjects()
 	// Remove references from m_active_objects
 	for (std::list<u16>::iterator i = objects_to_remove.begin(); i != objects_to_remove.end(); ++i) {
 		m_active_objects.erase(*i);
+		m_active_object_index.remove(*i);
 	}
 }
 
@@ -4059,6 +4871,7 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 	// Remove references from m_active_objects
 	for (std::vector<u16>::iterator i = objects_to_remove.begin(); i != objects_to_remove.end(); ++i) {
 		m_active_objects.erase(*i);
+		m_active_object_index.remove(*i);
 	}
 }
 
@@ -39,6 +39,7 @@
 
 #include "common.h"
 
+#include <deque>
 #include <list>
 #include <map>
 #include <set>
@@ -49,6 +50,7 @@
 #include <ostream>
 #include "utility.h"
 #include "activeobject.h"
+#include "pathfinder.h"
 
 #include "array.h"
 
@@ -252,7 +254,15 @@ class Environment
 class ActiveBlockList
 {
 public:
-	void update(std::list<v3s16> &active_positions,
+	ActiveBlockList():
+		m_radius(-1)
+	{}
+
+	/*
+		active_positions are the block positions of the players, by
+		peer id. Blocks within radius of one of them are active.
+	*/
+	void update(std::map<u16,v3s16> &active_positions,
 			s16 radius,
 			std::set<v3s16> &blocks_removed,
 			std::set<v3s16> &blocks_added);
@@ -263,11 +273,233 @@ public:
 
 	void clear(){
 		m_list.clear();
+		m_positions.clear();
+		m_radius = -1;
+	}
+
+	// Active blocks, and how many players they are near
+	std::map<v3s16,u16> m_list;
+
+private:
+	void addRadius(v3s16 p0, s16 r, const v3s16 *except, std::set<v3s16> &blocks_added);
+	void removeRadius(v3s16 p0, s16 r, const v3s16 *except, std::set<v3s16> &blocks_removed);
+
+	// The positions the list was last updated with
+	std::map<u16,v3s16> m_positions;
+	s16 m_radius;
+};
+
+/*
+	Active objects by the block they are in, used by ServerEnvironment to
+	find the objects near a position without going through all of them.
+	Positions are updated as objects are stepped, so they can be up to a
+	step out of date; lookups take in the blocks around the radius too.
+*/
+
+class ActiveObjectIndex
+{
+public:
+	void add(u16 id, v3f pos);
+	void remove(u16 id);
+	// Moves the object if it is in another block now
+	void update(u16 id, v3f pos);
+	// Adds the ids of objects that may be within radius of pos, in order
+	void find(v3f pos, f32 radius, std::vector<u16> &ids);
+
+	u32 blockCount()
+	{
+		return m_blocks.size();
+	}
+
+	void clear()
+	{
+		m_blocks.clear();
+		m_objects.clear();
+	}
+
+private:
+	std::map<v3s16, std::set<u16> > m_blocks;
+	std::map<u16, v3s16> m_objects;
+};
+
+/*
+	The active objects in the order they are stepped: from the first with
+	an id of at least next, round to the one before it. When the mobs go
+	over their time budget next is the id after the last one stepped, so
+	the first mob left out is the first stepped next time.
+*/
+void active_object_step_order(std::map<u16, ServerActiveObject*> &objects, u16 next, std::vector<ServerActiveObject*> &order);
+
+/*
+	The time budget the mobs share each step, in milliseconds. Zero is
+	no budget. Once a mob's step ends at or after start+budget the rest
+	of the mobs are over budget and put their step off.
+*/
+class MobStepBudget
+{
+public:
+	MobStepBudget(u32 budget, u32 start):
+		m_budget(budget),
+		m_start(start),
+		m_over(false),
+		m_next(0)
+	{}
+
+	bool isOver() {return m_over;}
+
+	// Returns true if the step of mob id, ending at now, used the budget up
+	bool stepped(u16 id, u32 now)
+	{
+		if (m_over || !m_budget || now-m_start < m_budget)
+			return false;
+		m_over = true;
+		m_next = id+1;
+		return true;
 	}
 
-	std::set<v3s16> m_list;
+	// Where the next step's order starts, if this one went over budget
+	u16 getNext() {return m_next;}
+
+private:
+	u32 m_budget;
+	u32 m_start;
+	bool m_over;
+	u16 m_next;
+};
+
+/*
+	Nodestep
+
+	The nodes of active blocks are stepped on several threads. While
+	they run the map is only read, whatever the nodestep wants done is
+	kept in a NodestepChanges and applied afterwards.
+*/
+
+class ServerEnvironment;
+class InventoryItem;
+
+// Seconds between the nodesteps of each active block
+#define NODESTEP_INTERVAL 10.0
+// Active blocks are shared between threads in cubes of this many to a side
+#define NODESTEP_UNIT_SIZE 2
+// Units there must be for the nodestep threads to be used, fewer are
+// done sooner than the threads can be woken
+#define NODESTEP_THREAD_MIN_UNITS 4
+
+/*
+	The nodesteps a block missed while unloaded, from when it was last
+	active. Newly generated blocks have no timestamp and missed none.
+*/
+u32 block_missed_nodesteps(u32 game_time, u32 stamp);
+
+enum NodestepChangeType
+{
+	NSC_ADD,
+	NSC_REMOVE,
+	NSC_UPDATE,
+	NSC_GROW,
+	NSC_GROW_PLANT,
+	NSC_SPAWN,
+	NSC_PARCEL,
+	NSC_ENERGISE,
+	NSC_EVENT
+};
+
+struct NodestepChange
+{
+	NodestepChange(NodestepChangeType a_type, v3s16 a_p):
+		type(a_type),
+		p(a_p),
+		height(0),
+		grow(NULL),
+		item(NULL),
+		event(0)
+	{}
+
+	NodestepChangeType type;
+	v3s16 p;
+	MapNode n;
+	s16 height;
+	void (*grow)(ServerEnvironment*,v3s16);
+	InventoryItem *item;
+	v3s16 src;
+	u8 event;
+	v3f pos;
+	std::string data;
+};
+
+class NodestepChanges
+{
+public:
+	NodestepChanges(ServerMap *map);
+
+	// Reads see the changes that have been made here
+	MapNode getNodeNoEx(v3s16 p);
+
+	void addNodeWithEvent(v3s16 p, MapNode n);
+	void removeNodeWithEvent(v3s16 p);
+	void updateNodeWithEvent(v3s16 p, MapNode n);
+	void plantgrowth(void (*grow)(ServerEnvironment*,v3s16), v3s16 p);
+	void plantgrowthPlant(v3s16 p, s16 height=0);
+	void spawnHostile(v3s16 p);
+	void dropToParcel(v3s16 p, InventoryItem *item);
+	// energises the TNT at p, if it isn't already
+	void energise(v3s16 src, v3s16 p);
+	void addEnvEvent(u8 type, v3f pos, std::string data);
+	// set once all the other changes are done
+	void setDelayedNode(v3s16 p, MapNode n);
+
+	// Must only be called with the environment locked, by one thread
+	void apply(ServerEnvironment *env, std::map<v3s16,MapNode> &delayed);
+
+	u32 size()
+	{
+		return m_changes.size();
+	}
 
 private:
+	ServerMap *m_map;
+	std::vector<NodestepChange> m_changes;
+	std::map<v3s16,MapNode> m_nodes;
+	std::map<v3s16,MapNode> m_delayed;
+	// the last block read from
+	MapBlock *m_block;
+	v3s16 m_block_pos;
+	bool m_block_valid;
+};
+
+struct NodestepUnit
+{
+	NodestepUnit(ServerMap *map):
+		changes(map),
+		visited(0)
+	{}
+
+	std::vector<MapBlock*> blocks;
+	NodestepChanges changes;
+	u32 visited;
+};
+
+class NodestepThread : public WorkerThread
+{
+	ServerEnvironment *m_env;
+	unsigned m_seed;
+
+public:
+
+	NodestepThread(ServerEnvironment *env, JSemaphore *done):
+		WorkerThread("NodestepThread",done),
+		m_env(env),
+		m_seed(1)
+	{
+	}
+
+	void work();
+
+	void setSeed(unsigned seed)
+	{
+		m_seed = seed;
+	}
 };
 
 /*
@@ -276,6 +508,60 @@ private:
 	This is not thread-safe. Server uses an environment mutex.
 */
 
+/*
+	Where propogateEnergy() sends energy on to from a node, worked out
+	from the nodes around it and kept until one of their blocks changes
+*/
+struct CircuitLinks
+{
+	// For +X, -X, +Z and -Z, the node energy goes to if any
+	v3s16 link[4];
+	bool linked[4];
+	// Whether there's stone along, above and below (bits 0, 1 and 2)
+	u8 stone[4];
+	// Versions of the blocks the nodes around are in
+	uint64_t versions[8];
+	// Circuit step it was last used in
+	u32 used;
+};
+
+/*
+	A source's last flood of energy through its circuit, kept so the
+	same flood can be done again without finding the way through. It's
+	done over if a block it went through changes, or a node takes the
+	energy differently than it did.
+*/
+struct CircuitEnergise
+{
+	u8 level;
+	v3s16 powersrc;
+	v3s16 signalsrc;
+	v3s16 pos;
+	// What energise() returned
+	bool taken;
+};
+
+struct CircuitFlood
+{
+	CircuitFlood():
+		level(0),
+		used(0)
+	{}
+
+	// Notes the blocks propogateEnergy() looks at for pos
+	void addNode(v3s16 pos);
+	// Takes the versions of the blocks noted, once the flood is done
+	void setVersions(Map *map);
+	// Energises the nodes again, false if the flood has to be done over
+	bool replay(Map *map);
+
+	u8 level;
+	std::vector<CircuitEnergise> energised;
+	std::map<v3s16,uint64_t> versions;
+	// Circuit step it was last used in
+	u32 used;
+};
+
 class ServerEnvironment : public Environment
 {
 public:
@@ -292,6 +578,11 @@ public:
 		return *m_map;
 	}
 
+	Pathfinder * getPathfinder()
+	{
+		return &m_pathfinder;
+	}
+
 	Server * getServer()
 	{
 		return m_server;
@@ -406,8 +697,22 @@ public:
 	bool getCollidedPosition(v3s16 pos, v3s16 dir, v3s16 *result);
 	bool dropToParcel(v3s16 pos, InventoryItem *item);
 
+	// Steps nodestep units until none are left, run by each NodestepThread
+	void nodestepWork();
+
 private:
 
+	/*
+		Step the nodes of active blocks
+	*/
+	void stepNodestepQueue(float dtime);
+	void stepNodes(std::vector<MapBlock*> &blocks, u16 season, uint16_t time, bool unsafe_fire);
+	u32 nodestepBlock(MapBlock *block, NodestepChanges &changes);
+
+	void getCircuitVersions(v3s16 pos, uint64_t versions[8]);
+	CircuitLinks *getCircuitLinks(v3s16 pos);
+	bool floodEnergy(u8 level, v3s16 powersrc, v3s16 signalsrc, v3s16 pos, core::map<v3s16,MapBlock*> &modified_blocks);
+
 	/*
 		Internal ActiveObject interface
 		-------------------------------------------
@@ -458,6 +763,12 @@ private:
 	std::map<v3s16,MapNode>m_poststep_nodeswaps;
 	// Active object list
 	std::map<u16, ServerActiveObject*> m_active_objects;
+	// Where they are
+	ActiveObjectIndex m_active_object_index;
+	// Where the next step of active objects starts
+	u16 m_active_object_step_next;
+	// Where mobs go
+	Pathfinder m_pathfinder;
 	// Outgoing network message buffer for active objects
 	Queue<ActiveObjectMessage> m_active_object_messages;
 	// the env events for sending to clients
@@ -468,16 +779,40 @@ private:
 	// List of active blocks
 	ActiveBlockList m_active_blocks;
 	IntervalLimiter m_active_blocks_management_interval;
-	IntervalLimiter m_active_blocks_test_interval;
 	IntervalLimiter m_active_blocks_nodemetadata_interval;
 	IntervalLimiter m_active_blocks_circuit_interval;
+	// Found by propogateEnergy()
+	std::map<v3s16,CircuitLinks> m_circuit_links;
+	// The last flood from each source, and the one being done if any
+	std::map<v3s16,CircuitFlood> m_circuit_floods;
+	CircuitFlood *m_circuit_flood;
+	// Number of circuit steps done
+	u32 m_circuit_step;
 	// Time from the beginning of the game in seconds.
 	// Incremented in step().
 	u32 m_game_time;
 	// A helper variable for incrementing the latter
 	float m_game_time_fraction_counter;
+	// Player name to the file it's saved in
+	std::map<std::string,std::string> m_player_files;
 	// whether players are sleeping
 	int m_players_sleeping;
+	// The nodestep being run
+	u16 m_nodestep_season;
+	uint16_t m_nodestep_time;
+	bool m_nodestep_unsafe_fire;
+	std::vector<NodestepUnit> m_nodestep_units;
+	u32 m_nodestep_next;
+	JMutex m_nodestep_mutex;
+	std::vector<NodestepThread*> m_nodestep_threads;
+	// Posted by each nodestep thread when it's done
+	JSemaphore m_nodestep_done;
+	// Active blocks still to be stepped this interval
+	std::deque<v3s16> m_nodestep_queue;
+	std::set<v3s16> m_nodestep_queued;
+	float m_nodestep_timer;
+	// How long a block's nodestep takes, in milliseconds
+	float m_nodestep_block_time;
 };
 
 #ifndef SERVER
@@ -0,0 +1,91 @@
+/*
+
+    This file is a part of the JThread package, which contains some object-
+    oriented thread wrappers for different thread implementations.
+
+    Copyright (c) 2000-2011  Jori Liesenborgs (jori.liesenborgs@gmail.com)
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+
+*/
+
+
+#include "jsemaphore.h"
+#include <sys/time.h>
+#include <errno.h>
+
+namespace jthread
+{
+
+    JSemaphore::JSemaphore(int initval) : count(initval)
+    {
+	    pthread_mutex_init(&mutex,NULL);
+	    pthread_cond_init(&cond,NULL);
+    }
+
+    JSemaphore::~JSemaphore()
+    {
+	    pthread_cond_destroy(&cond);
+	    pthread_mutex_destroy(&mutex);
+    }
+
+    void JSemaphore::Post()
+    {
+	    pthread_mutex_lock(&mutex);
+	    count++;
+	    pthread_cond_signal(&cond);
+	    pthread_mutex_unlock(&mutex);
+    }
+
+    void JSemaphore::Wait()
+    {
+	    pthread_mutex_lock(&mutex);
+	    while (count == 0)
+		pthread_cond_wait(&cond,&mutex);
+	    count--;
+	    pthread_mutex_unlock(&mutex);
+    }
+
+    bool JSemaphore::Wait(unsigned int time_ms)
+    {
+	    struct timeval now;
+	    struct timespec until;
+	    gettimeofday(&now,NULL);
+	    until.tv_sec = now.tv_sec + time_ms/1000;
+	    until.tv_nsec = now.tv_usec*1000 + (long)(time_ms%1000)*1000000;
+	    if (until.tv_nsec >= 1000000000)
+	    {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	    }
+
+	    pthread_mutex_lock(&mutex);
+	    while (count == 0)
+	    {
+		if (pthread_cond_timedwait(&cond,&mutex,&until) == ETIMEDOUT)
+		    break;
+	    }
+	    bool got = count > 0;
+	    if (got)
+		count--;
+	    pthread_mutex_unlock(&mutex);
+	    return got;
+    }
+
+} // end namespace
@@ -0,0 +1,58 @@
+/*
+
+    This file is a part of the JThread package, which contains some object-
+    oriented thread wrappers for different thread implementations.
+
+    Copyright (c) 2000-2011  Jori Liesenborgs (jori.liesenborgs@gmail.com)
+
+    Permission is hereby granted, free of charge, to any person obtaining a
+    copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the
+    Software is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+    THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+    FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include "jsemaphore.h"
+
+namespace jthread
+{
+
+JSemaphore::JSemaphore(int initval)
+{
+	semaphore = CreateSemaphore(NULL,initval,0x7fffffff,NULL);
+}
+
+JSemaphore::~JSemaphore()
+{
+	CloseHandle(semaphore);
+}
+
+void JSemaphore::Post()
+{
+	ReleaseSemaphore(semaphore,1,NULL);
+}
+
+void JSemaphore::Wait()
+{
+	WaitForSingleObject(semaphore,INFINITE);
+}
+
+bool JSemaphore::Wait(unsigned int time_ms)
+{
+	return WaitForSingleObject(semaphore,time_ms) == WAIT_OBJECT_0;
+}
+
+} // end namespace
@@ -49,23 +49,6 @@
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
-/*
-	SQLite format specification:
-	- Initially only replaces sectors/ and sectors2/
-
-	If map.sqlite does not exist in the save dir
-	or the block was not found in the database
-	the map will try to load from sectors folder.
-	In either case, map.sqlite will be created
-	and all future saves will save there.
-
-	Structure of map.sqlite:
-	Tables:
-		blocks
-			(PK) INT pos
-			BLOB data
-*/
-
 /*
 	Map
 */
@@ -76,14 +59,29 @@ Map::Map(std::ostream &dout) : m_dout(dout),
 			       m_sectors_mutex(),
 			       m_sector_cache(NULL),
 			       m_sector_cache_p(),
-			       m_transforming_liquid()
+			       m_transforming_liquid(),
+			       m_liquid_next(0),
+			       m_liquid_start(0),
+			       m_liquid_budget(0),
+			       m_liquid_count(0),
+			       m_liquid_limit(0),
+			       m_liquid_rate_start(0),
+			       m_liquid_rate_count(0)
 {
 	m_sectors_mutex.Init();
 	assert(m_sectors_mutex.IsInitialized());
+	m_liquid_mutex.Init();
 }
 
 Map::~Map()
 {
+	// They're only working during transformLiquids()
+	for (std::vector<LiquidThread*>::iterator i = m_liquid_threads.begin();
+			i != m_liquid_threads.end(); i++) {
+		(*i)->stopWorker();
+		delete *i;
+	}
+
 	/*
 		Free all MapSectors
 	*/
@@ -1507,278 +1505,460 @@ struct NodeNeighbor {
 	v3s16 p;
 };
 
+LiquidQueue::LiquidQueue():
+	m_size(0)
+{
+	m_mutex.Init();
+}
+
+LiquidQueue::~LiquidQueue()
+{
+	for (std::map<v3s16, Block*>::iterator i = m_blocks.begin(); i != m_blocks.end(); i++) {
+		delete i->second;
+	}
+}
+
+void LiquidQueue::push_back(v3s16 p)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	v3s16 blockpos = getNodeBlockPos(p);
+	Block *b;
+	std::map<v3s16, Block*>::iterator i = m_blocks.find(blockpos);
+	if (i != m_blocks.end()) {
+		b = i->second;
+	}else{
+		b = new Block;
+		b->turn = m_turns.insert(m_turns.end(), blockpos);
+		m_blocks[blockpos] = b;
+	}
+
+	if (b->nodes.push_back(p))
+		m_size++;
+}
+
+void LiquidQueue::getBlocks(std::vector<v3s16> &blocks)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	for (std::list<v3s16>::iterator i = m_turns.begin(); i != m_turns.end(); i++) {
+		blocks.push_back(*i);
+	}
+}
+
+void LiquidQueue::takeBlock(v3s16 blockpos, std::vector<v3s16> &nodes)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	std::map<v3s16, Block*>::iterator i = m_blocks.find(blockpos);
+	if (i == m_blocks.end())
+		return;
+
+	Block *b = i->second;
+	while (b->nodes.size() > 0) {
+		nodes.push_back(b->nodes.pop_front());
+		m_size--;
+	}
+	m_turns.erase(b->turn);
+	m_blocks.erase(i);
+	delete b;
+}
+
+u32 LiquidQueue::size()
+{
+	JMutexAutoLock lock(m_mutex);
+	return m_size;
+}
+
+u32 LiquidQueue::blockCount()
+{
+	JMutexAutoLock lock(m_mutex);
+	return m_blocks.size();
+}
+
+void LiquidThread::work()
+{
+	m_map->liquidWork(m_index);
+}
+
+/*
+	Transforms queued liquid nodes a block at a time, the blocks taking
+	turns, until server.liquid.budget milliseconds have passed or three
+	times as many nodes as were queued have been done.
+
+	Transforming a node only changes that node and reads the six next to
+	it, so blocks that don't touch can be done at the same time. The
+	blocks are split into eight colours by which of their coordinates are
+	odd, no two blocks of a colour touch, and the blocks of each colour in
+	turn are shared out between the liquid threads.
+*/
 void Map::transformLiquids(core::map<v3s16, MapBlock*> & modified_blocks)
 {
 	DSTACK(__FUNCTION_NAME);
-	//TimeTaker timer("transformLiquids()");
+	ScopeProfiler sp(g_profiler, "Map: liquid transform avg", SPT_AVG);
 
-	u32 loopcount = 0;
 	u32 initial_size = m_transforming_liquid.size();
 
-	/*if(initial_size != 0)
-		infostream<<"transformLiquids(): initial_size="<<initial_size<<std::endl;*/
+	g_profiler->avg("Map: liquid queue", initial_size);
+	g_profiler->avg("Map: liquid blocks queued", m_transforming_liquid.blockCount());
+
+	int threads = config_get_int("server.liquid.threads");
+	if (threads > 16)
+		threads = 16;
+	if (threads < 1)
+		threads = 1;
+
+	m_liquid_start = porting::getTimeMs();
+	m_liquid_budget = config_get_int("server.liquid.budget");
+	m_liquid_count = 0;
+	m_liquid_limit = initial_size*3;
+
+	m_liquid_changes.resize(threads);
+	for (int i=0; i<threads; i++) {
+		m_liquid_changes[i].modified_blocks.clear();
+		m_liquid_changes[i].lighting_modified_blocks.clear();
+		m_liquid_changes[i].must_reflow.clear();
+		m_liquid_changes[i].transformed = 0;
+	}
+	while (m_liquid_threads.size() < (u32)threads-1) {
+		m_liquid_threads.push_back(new LiquidThread(this,m_liquid_threads.size()+1,&m_liquid_done));
+	}
 
-	// list of nodes that due to viscosity have not reached their max level height
-	UniqueQueue<v3s16> must_reflow;
+	while (m_transforming_liquid.size() != 0 && !liquidDone()) {
+		std::vector<v3s16> blocks;
+		m_transforming_liquid.getBlocks(blocks);
 
-	// List of MapBlocks that will require a lighting update (due to lava)
-	core::map<v3s16, MapBlock*> lighting_modified_blocks;
+		std::vector<v3s16> colours[8];
+		for (std::vector<v3s16>::iterator i = blocks.begin(); i != blocks.end(); i++) {
+			colours[(i->X&1)|((i->Y&1)<<1)|((i->Z&1)<<2)].push_back(*i);
+		}
 
-	while(m_transforming_liquid.size() != 0)
-	{
-		// This should be done here so that it is done when continue is used
-		if(loopcount >= initial_size * 3)
-			break;
-		loopcount++;
+		for (int c=0; c<8 && !liquidDone(); c++) {
+			if (colours[c].size() == 0)
+				continue;
+			m_liquid_blocks.swap(colours[c]);
+			m_liquid_next = 0;
 
-		/*
-			Get a queued transforming liquid node
-		*/
-		v3s16 p0 = m_transforming_liquid.pop_front();
-		MapNode n0 = getNodeNoEx(p0);
+			int t = threads;
+			if (m_liquid_blocks.size() < LIQUID_THREAD_MIN_BLOCKS)
+				t = 1;
 
-		/*
-			Collect information about current node
-		 */
-		s8 liquid_level = -1;
-		u8 liquid_kind = CONTENT_IGNORE;
-		LiquidType liquid_type = content_features(n0.getContent()).liquid_type;
-		
-		switch (liquid_type)
-		{
-		  case LIQUID_SOURCE:
-		    liquid_level = LIQUID_LEVEL_SOURCE;
-		    liquid_kind = content_features(n0.getContent()).liquid_alternative_flowing;
-		    break;
-		  case LIQUID_FLOWING:
-		    liquid_level = (n0.param2 & LIQUID_LEVEL_MASK);
-		    liquid_kind = n0.getContent();
-		    break;
-		  case LIQUID_NONE:
-		// if this is an air node, it *could* be transformed into a liquid. otherwise,
-		// continue with the next node.
-		    if (n0.getContent() != CONTENT_AIR)
-			continue;
-		    liquid_kind = CONTENT_AIR;
-		    break;
-		}
-
-		/*
-			Collect information about the environment
-		 */
-		const v3s16 *dirs = g_6dirs;
-		NodeNeighbor sources[6]; // surrounding sources
-		int num_sources = 0;
-		NodeNeighbor flows[6]; // surrounding flowing liquid nodes
-		int num_flows = 0;
-		NodeNeighbor airs[6]; // surrounding air
-		int num_airs = 0;
-		NodeNeighbor neutrals[6]; // nodes that are solid or another kind of liquid
-		int num_neutrals = 0;
-		bool flowing_down = false;
-		
-		for (u16 i = 0; i < 6; i++)
-		{
-		    NeighborType nt = NEIGHBOR_SAME_LEVEL;
-		    switch (i)
-		    {
-		      case 1:
-			nt = NEIGHBOR_UPPER;
-			break;
-		      case 4:
-			nt = NEIGHBOR_LOWER;
-			break;
-		    }
-			
-		    const v3s16 npos = p0 + dirs[i];
-		    const NodeNeighbor nb = {getNodeNoEx(npos), nt, npos};
-			
-		    switch (content_features(nb.n.getContent()).liquid_type)
-		    {
-		      case LIQUID_NONE:
-			if (nb.n.getContent() == CONTENT_AIR)
-			{
-			    airs[num_airs++] = nb;
-			// if the current node is a water source the neighbor
-			// should be enqueded for transformation regardless of whether the
-			// current node changes or not.
-			    if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
-				m_transforming_liquid.push_back(npos);
-			// if the current node happens to be a flowing node, it will start to flow down here.
-			    if (nb.t == NEIGHBOR_LOWER)
-				flowing_down = true;
+			// This thread is one of them
+			for (int i=0; i<t-1; i++) {
+				m_liquid_threads[i]->wake();
 			}
-			else if (nb.t == NEIGHBOR_LOWER && nb.n.getContent() == CONTENT_IGNORE)
-			{
-			    flowing_down = true;
-			    neutrals[num_neutrals++] = nb;
-			}
-			else
-			    neutrals[num_neutrals++] = nb;
-			break;
-		      case LIQUID_SOURCE:
-		    // if this node is not (yet) of a liquid type, choose the first liquid type we encounter
-			if (liquid_kind == CONTENT_AIR)
-			    liquid_kind = content_features(nb.n.getContent()).liquid_alternative_flowing;
-			if (content_features(nb.n.getContent()).liquid_alternative_flowing !=liquid_kind)
-			    neutrals[num_neutrals++] = nb;
-			else
-			{
-			// Do not count bottom source, it will screw things up
-			    if (dirs[i].Y != -1)
-				sources[num_sources++] = nb;
-			}
-			break;
-		      case LIQUID_FLOWING:
-		    // if this node is not (yet) of a liquid type, choose the first liquid type we encounter
-			if (liquid_kind == CONTENT_AIR)
-			    liquid_kind = content_features(nb.n.getContent()).liquid_alternative_flowing;
-			if (content_features(nb.n.getContent()).liquid_alternative_flowing != liquid_kind)
-			    neutrals[num_neutrals++] = nb;
-			else
-			{
-			    flows[num_flows++] = nb;
-			    if (nb.t == NEIGHBOR_LOWER)
-				flowing_down = true;
+
+			liquidWork(0);
+
+			for (int i=0; i<t-1; i++) {
+				m_liquid_done.Wait();
 			}
-			break;
-		    }
 		}
+	}
 
-		/*
-		  decide on the type (and possibly level) of the current node
-		 */
-		content_t new_node_content;
-		s8 new_node_level = -1;
-		s8 max_node_level = -1;
-		
-		if (num_sources >= 2 || liquid_type == LIQUID_SOURCE)
-		// liquid_kind will be set to either the flowing alternative of the node (if it's a liquid)
-		// or the flowing alternative of the first of the surrounding sources (if it's air), so
-		// it's perfectly safe to use liquid_kind here to determine the new node content.
-		    new_node_content = content_features(liquid_kind).liquid_alternative_source;
-		else if (num_sources == 1 && sources[0].t != NEIGHBOR_LOWER)
-		{
-		// liquid_kind is set properly, see above
-		    new_node_content = liquid_kind;
-		    max_node_level = new_node_level = LIQUID_LEVEL_MAX;
+	core::map<v3s16, MapBlock*> lighting_modified_blocks;
+	u32 transformed = 0;
+	for (int i=0; i<threads; i++) {
+		LiquidChanges &changes = m_liquid_changes[i];
+		for (core::map<v3s16, MapBlock*>::Iterator b = changes.modified_blocks.getIterator(); b.atEnd() == false; b++) {
+			modified_blocks.insert(b.getNode()->getKey(), b.getNode()->getValue());
 		}
-		else
-		{
-		// no surrounding sources, so get the maximum level that can flow into this node
-		    for (u16 i = 0; i < num_flows; i++)
-		    {
-			u8 nb_liquid_level = (flows[i].n.param2 & LIQUID_LEVEL_MASK);
-			switch (flows[i].t)
-			{
-			  case NEIGHBOR_UPPER:
-			    if (nb_liquid_level + WATER_DROP_BOOST > max_node_level)
-			    {
-				max_node_level = LIQUID_LEVEL_MAX;
-				if (nb_liquid_level + WATER_DROP_BOOST < LIQUID_LEVEL_MAX)
-				    max_node_level = nb_liquid_level + WATER_DROP_BOOST;
-			    } else if (nb_liquid_level > max_node_level)
-				max_node_level = nb_liquid_level;
-			    break;
-			  case NEIGHBOR_LOWER:
-			    break;
-			  case NEIGHBOR_SAME_LEVEL:
-			    if ((flows[i].n.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK &&
-					    nb_liquid_level > 0 && nb_liquid_level - 1 > max_node_level)
-				max_node_level = nb_liquid_level - 1;
-			    break;
-			}
-		    }
+		for (core::map<v3s16, MapBlock*>::Iterator b = changes.lighting_modified_blocks.getIterator(); b.atEnd() == false; b++) {
+			lighting_modified_blocks[b.getNode()->getKey()] = b.getNode()->getValue();
+		}
+		for (std::vector<v3s16>::iterator p = changes.must_reflow.begin(); p != changes.must_reflow.end(); p++) {
+			m_transforming_liquid.push_back(*p);
+		}
+		transformed += changes.transformed;
+	}
 
-		    u8 viscosity = content_features(liquid_kind).liquid_viscosity;
-		    if (viscosity > 1 && max_node_level != liquid_level)
-		    {
-		    // amount to gain, limited by viscosity
-		    // must be at least 1 in absolute value
-			s8 level_inc = max_node_level - liquid_level;
-			if (level_inc < -viscosity || level_inc > viscosity)
-			    new_node_level = liquid_level + level_inc/viscosity;
-			else if (level_inc < 0)
-			    new_node_level = liquid_level - 1;
-			else if (level_inc > 0)
-			    new_node_level = liquid_level + 1;
-			if (new_node_level != max_node_level)
-			    must_reflow.push_back(p0);
-		    }
-		    else
-			new_node_level = max_node_level;
+	updateLighting(lighting_modified_blocks, modified_blocks);
 
-		    if (new_node_level >= 0)
-			new_node_content = liquid_kind;
-		    else
-			new_node_content = CONTENT_AIR;
+	g_profiler->avg("Map: liquid nodes done", m_liquid_count);
+	g_profiler->avg("Map: liquid nodes changed", transformed);
+
+	// This isn't called at a steady rate, so it's worked out from the time
+	m_liquid_rate_count += m_liquid_count;
+	u32 now = porting::getTimeMs();
+	if (now-m_liquid_rate_start >= 1000) {
+		if (m_liquid_rate_start != 0)
+			g_profiler->avg("Map: liquid nodes per second", (float)m_liquid_rate_count*1000/(now-m_liquid_rate_start));
+		m_liquid_rate_start = now;
+		m_liquid_rate_count = 0;
+	}
+}
 
-		}
+bool Map::liquidDone()
+{
+	if (m_liquid_count >= m_liquid_limit)
+		return true;
+	if (m_liquid_budget > 0 && porting::getTimeMs()-m_liquid_start >= m_liquid_budget)
+		return true;
+	return false;
+}
 
-		/*
-		  check if anything has changed. if not, just continue with the next node.
-		*/
-		if (new_node_content == n0.getContent() &&
-				(content_features(n0.getContent()).liquid_type != LIQUID_FLOWING ||
-						((n0.param2 & LIQUID_LEVEL_MASK) == (u8)new_node_level &&
-								((n0.param2 & LIQUID_FLOW_DOWN_MASK) == LIQUID_FLOW_DOWN_MASK)
-								== flowing_down)))
-		    continue;
+void Map::liquidWork(u32 index)
+{
+	LiquidChanges &changes = m_liquid_changes[index];
+	std::vector<v3s16> nodes;
 
+	for (;;) {
+		{
+			JMutexAutoLock lock(m_liquid_mutex);
+			if (m_liquid_next >= m_liquid_blocks.size() || liquidDone())
+				break;
+			nodes.clear();
+			m_transforming_liquid.takeBlock(m_liquid_blocks[m_liquid_next++],nodes);
+			m_liquid_count += nodes.size();
+		}
+		for (std::vector<v3s16>::iterator i = nodes.begin(); i != nodes.end(); i++) {
+			transformLiquid(*i,changes);
+		}
+	}
+}
 
-	    /*
-	      update the current node
-	    */
-		if (content_features(new_node_content).liquid_type == LIQUID_FLOWING)
-		// set level to last 3 bits, flowing down bit to 4th bit
-		    n0.param2 = (flowing_down ? LIQUID_FLOW_DOWN_MASK : 0x00) | (new_node_level & LIQUID_LEVEL_MASK);
-		else
-		// set the liquid level and flow bit to 0
-		    n0.param2 = ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
+void Map::transformLiquid(v3s16 p0, LiquidChanges &changes)
+{
+	MapNode n0 = getNodeNoEx(p0);
 
-		n0.setContent(new_node_content);
-		setNode(p0, n0);
+	/*
+		Collect information about current node
+	 */
+	s8 liquid_level = -1;
+	u8 liquid_kind = CONTENT_IGNORE;
+	LiquidType liquid_type = content_features(n0.getContent()).liquid_type;
+	
+	switch (liquid_type)
+	{
+	  case LIQUID_SOURCE:
+	    liquid_level = LIQUID_LEVEL_SOURCE;
+	    liquid_kind = content_features(n0.getContent()).liquid_alternative_flowing;
+	    break;
+	  case LIQUID_FLOWING:
+	    liquid_level = (n0.param2 & LIQUID_LEVEL_MASK);
+	    liquid_kind = n0.getContent();
+	    break;
+	  case LIQUID_NONE:
+	// if this is an air node, it *could* be transformed into a liquid. otherwise,
+	// continue with the next node.
+	    if (n0.getContent() != CONTENT_AIR)
+		return;
+	    liquid_kind = CONTENT_AIR;
+	    break;
+	}
 
-	    // PB a traiter.
-		v3s16 blockpos = getNodeBlockPos(p0);
-		MapBlock* const block = getBlockNoCreateNoEx(blockpos);
+	/*
+		Collect information about the environment
+	 */
+	const v3s16 *dirs = g_6dirs;
+	NodeNeighbor sources[6]; // surrounding sources
+	int num_sources = 0;
+	NodeNeighbor flows[6]; // surrounding flowing liquid nodes
+	int num_flows = 0;
+	NodeNeighbor airs[6]; // surrounding air
+	int num_airs = 0;
+	NodeNeighbor neutrals[6]; // nodes that are solid or another kind of liquid
+	int num_neutrals = 0;
+	bool flowing_down = false;
+	
+	for (u16 i = 0; i < 6; i++)
+	{
+	    NeighborType nt = NEIGHBOR_SAME_LEVEL;
+	    switch (i)
+	    {
+	      case 1:
+		nt = NEIGHBOR_UPPER;
+		break;
+	      case 4:
+		nt = NEIGHBOR_LOWER;
+		break;
+	    }
 		
-		if(block)
+	    const v3s16 npos = p0 + dirs[i];
+	    const NodeNeighbor nb = {getNodeNoEx(npos), nt, npos};
+		
+	    switch (content_features(nb.n.getContent()).liquid_type)
+	    {
+	      case LIQUID_NONE:
+		if (nb.n.getContent() == CONTENT_AIR)
 		{
-		    modified_blocks.insert(blockpos, block);
-		// If node emits light, MapBlock requires lighting update
-		    if(content_features(n0).light_source != 0)
-			lighting_modified_blocks[block->getPos()] = block;
-		    
-		    block->ResetCurrent();
+		    airs[num_airs++] = nb;
+		// if the current node is a water source the neighbor
+		// should be enqueded for transformation regardless of whether the
+		// current node changes or not.
+		    if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
+			m_transforming_liquid.push_back(npos);
+		// if the current node happens to be a flowing node, it will start to flow down here.
+		    if (nb.t == NEIGHBOR_LOWER)
+			flowing_down = true;
+		}
+		else if (nb.t == NEIGHBOR_LOWER && nb.n.getContent() == CONTENT_IGNORE)
+		{
+		    flowing_down = true;
+		    neutrals[num_neutrals++] = nb;
 		}
+		else
+		    neutrals[num_neutrals++] = nb;
+		break;
+	      case LIQUID_SOURCE:
+	    // if this node is not (yet) of a liquid type, choose the first liquid type we encounter
+		if (liquid_kind == CONTENT_AIR)
+		    liquid_kind = content_features(nb.n.getContent()).liquid_alternative_flowing;
+		if (content_features(nb.n.getContent()).liquid_alternative_flowing !=liquid_kind)
+		    neutrals[num_neutrals++] = nb;
+		else
+		{
+		// Do not count bottom source, it will screw things up
+		    if (dirs[i].Y != -1)
+			sources[num_sources++] = nb;
+		}
+		break;
+	      case LIQUID_FLOWING:
+	    // if this node is not (yet) of a liquid type, choose the first liquid type we encounter
+		if (liquid_kind == CONTENT_AIR)
+		    liquid_kind = content_features(nb.n.getContent()).liquid_alternative_flowing;
+		if (content_features(nb.n.getContent()).liquid_alternative_flowing != liquid_kind)
+		    neutrals[num_neutrals++] = nb;
+		else
+		{
+		    flows[num_flows++] = nb;
+		    if (nb.t == NEIGHBOR_LOWER)
+			flowing_down = true;
+		}
+		break;
+	    }
+	}
 
-	    /*
-	      enqueue neighbors for update if neccessary
-	    */
-		switch (content_features(n0.getContent()).liquid_type)
+	/*
+	  decide on the type (and possibly level) of the current node
+	 */
+	content_t new_node_content;
+	s8 new_node_level = -1;
+	s8 max_node_level = -1;
+	
+	if (num_sources >= 2 || liquid_type == LIQUID_SOURCE)
+	// liquid_kind will be set to either the flowing alternative of the node (if it's a liquid)
+	// or the flowing alternative of the first of the surrounding sources (if it's air), so
+	// it's perfectly safe to use liquid_kind here to determine the new node content.
+	    new_node_content = content_features(liquid_kind).liquid_alternative_source;
+	else if (num_sources == 1 && sources[0].t != NEIGHBOR_LOWER)
+	{
+	// liquid_kind is set properly, see above
+	    new_node_content = liquid_kind;
+	    max_node_level = new_node_level = LIQUID_LEVEL_MAX;
+	}
+	else
+	{
+	// no surrounding sources, so get the maximum level that can flow into this node
+	    for (u16 i = 0; i < num_flows; i++)
+	    {
+		u8 nb_liquid_level = (flows[i].n.param2 & LIQUID_LEVEL_MASK);
+		switch (flows[i].t)
 		{
-		  case LIQUID_SOURCE:
-		  case LIQUID_FLOWING:
-		// make sure source flows into all neighboring nodes
-		    for (u16 i = 0; i < num_flows; i++)
-			if (flows[i].t != NEIGHBOR_UPPER)
-			    m_transforming_liquid.push_back(flows[i].p);
-		    for (u16 i = 0; i < num_airs; i++)
-			if (airs[i].t != NEIGHBOR_UPPER)
-			    m_transforming_liquid.push_back(airs[i].p);
+		  case NEIGHBOR_UPPER:
+		    if (nb_liquid_level + WATER_DROP_BOOST > max_node_level)
+		    {
+			max_node_level = LIQUID_LEVEL_MAX;
+			if (nb_liquid_level + WATER_DROP_BOOST < LIQUID_LEVEL_MAX)
+			    max_node_level = nb_liquid_level + WATER_DROP_BOOST;
+		    } else if (nb_liquid_level > max_node_level)
+			max_node_level = nb_liquid_level;
+		    break;
+		  case NEIGHBOR_LOWER:
 		    break;
-		  case LIQUID_NONE:
-		// this flow has turned to air; neighboring flows might need to do the same
-		    for (u16 i = 0; i < num_flows; i++)
-			m_transforming_liquid.push_back(flows[i].p);
+		  case NEIGHBOR_SAME_LEVEL:
+		    if ((flows[i].n.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK &&
+				    nb_liquid_level > 0 && nb_liquid_level - 1 > max_node_level)
+			max_node_level = nb_liquid_level - 1;
 		    break;
 		}
+	    }
+
+	    u8 viscosity = content_features(liquid_kind).liquid_viscosity;
+	    if (viscosity > 1 && max_node_level != liquid_level)
+	    {
+	    // amount to gain, limited by viscosity
+	    // must be at least 1 in absolute value
+		s8 level_inc = max_node_level - liquid_level;
+		if (level_inc < -viscosity || level_inc > viscosity)
+		    new_node_level = liquid_level + level_inc/viscosity;
+		else if (level_inc < 0)
+		    new_node_level = liquid_level - 1;
+		else if (level_inc > 0)
+		    new_node_level = liquid_level + 1;
+		if (new_node_level != max_node_level)
+		    changes.must_reflow.push_back(p0);
+	    }
+	    else
+		new_node_level = max_node_level;
+
+	    if (new_node_level >= 0)
+		new_node_content = liquid_kind;
+	    else
+		new_node_content = CONTENT_AIR;
+
+	}
+
+	/*
+	  check if anything has changed. if not, just continue with the next node.
+	*/
+	if (new_node_content == n0.getContent() &&
+			(content_features(n0.getContent()).liquid_type != LIQUID_FLOWING ||
+					((n0.param2 & LIQUID_LEVEL_MASK) == (u8)new_node_level &&
+							((n0.param2 & LIQUID_FLOW_DOWN_MASK) == LIQUID_FLOW_DOWN_MASK)
+							== flowing_down)))
+	    return;
+
+
+    /*
+      update the current node
+    */
+	if (content_features(new_node_content).liquid_type == LIQUID_FLOWING)
+	// set level to last 3 bits, flowing down bit to 4th bit
+	    n0.param2 = (flowing_down ? LIQUID_FLOW_DOWN_MASK : 0x00) | (new_node_level & LIQUID_LEVEL_MASK);
+	else
+	// set the liquid level and flow bit to 0
+	    n0.param2 = ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
+
+	n0.setContent(new_node_content);
+	setNode(p0, n0);
+	changes.transformed++;
+
+    // PB a traiter.
+	v3s16 blockpos = getNodeBlockPos(p0);
+	MapBlock* const block = getBlockNoCreateNoEx(blockpos);
+	
+	if(block)
+	{
+	    changes.modified_blocks.insert(blockpos, block);
+	// If node emits light, MapBlock requires lighting update
+	    if(content_features(n0).light_source != 0)
+		changes.lighting_modified_blocks[block->getPos()] = block;
+	    
+	    block->ResetCurrent();
+	}
+
+    /*
+      enqueue neighbors for update if neccessary
+    */
+	switch (content_features(n0.getContent()).liquid_type)
+	{
+	  case LIQUID_SOURCE:
+	  case LIQUID_FLOWING:
+	// make sure source flows into all neighboring nodes
+	    for (u16 i = 0; i < num_flows; i++)
+		if (flows[i].t != NEIGHBOR_UPPER)
+		    m_transforming_liquid.push_back(flows[i].p);
+	    for (u16 i = 0; i < num_airs; i++)
+		if (airs[i].t != NEIGHBOR_UPPER)
+		    m_transforming_liquid.push_back(airs[i].p);
+	    break;
+	  case LIQUID_NONE:
+	// this flow has turned to air; neighboring flows might need to do the same
+	    for (u16 i = 0; i < num_flows; i++)
+		m_transforming_liquid.push_back(flows[i].p);
+	    break;
 	}
-	//infostream<<"Map::transformLiquids(): loopcount="<<loopcount<<std::endl;
-	while (must_reflow.size() > 0)
-	    m_transforming_liquid.push_back(must_reflow.pop_front());
-	updateLighting(lighting_modified_blocks, modified_blocks);
 }
 
 NodeMetadata* Map::getNodeMetadata(v3s16 p)
@@ -1902,6 +2082,133 @@ void Map::nodeMetadataStep(float dtime,core::map<v3s16,MapBlock*> &changed_block
 	}
 }
 
+/*
+	ServerMapSaver
+*/
+
+ServerMapSaver::ServerMapSaver(ServerMap* const map):
+	m_map(map),
+	m_seq(0),
+	m_max_queued(256)
+{
+	m_queue_mutex.Init();
+	m_flush_mutex.Init();
+}
+
+void * ServerMapSaver::Thread()
+{
+	ThreadStarted();
+	log_mutex.Lock();
+	log_register_thread("ServerMapSaver");
+	log_mutex.Unlock();
+
+	DSTACK(__FUNCTION_NAME);
+
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	while(getRun())
+	{
+		// Let a few saves gather so they share a transaction
+		sleep_ms(100);
+		flush();
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	return NULL;
+}
+
+void ServerMapSaver::queueBlock(v3s16 p, const std::string &data)
+{
+	for(;;)
+	{
+	    {
+		JMutexAutoLock lock(m_queue_mutex);
+
+		std::map<v3s16, QueuedBlock>::iterator i = m_queue.find(p);
+		if (i != m_queue.end())
+		{
+		    i->second.data = data;
+		    i->second.seq = ++m_seq;
+		    return;
+		}
+		// Never wait on a thread that isn't there to empty the queue
+		if (m_queue.size() < m_max_queued || !IsRunning())
+		{
+		    QueuedBlock &b = m_queue[p];
+		    b.data = data;
+		    b.seq = ++m_seq;
+		    return;
+		}
+	    }
+	    sleep_ms(10);
+	}
+}
+
+bool ServerMapSaver::getQueued(v3s16 p, std::string &data)
+{
+	JMutexAutoLock lock(m_queue_mutex);
+
+	std::map<v3s16, QueuedBlock>::iterator i = m_queue.find(p);
+	if (i == m_queue.end()) {
+	    i = m_writing.find(p);
+	    if (i == m_writing.end())
+		return false;
+	}
+	data = i->second.data;
+	return true;
+}
+
+u32 ServerMapSaver::queuedCount()
+{
+	JMutexAutoLock lock(m_queue_mutex);
+	return m_queue.size()+m_writing.size();
+}
+
+void ServerMapSaver::flush()
+{
+	DSTACK(__FUNCTION_NAME);
+
+	JMutexAutoLock flushlock(m_flush_mutex);
+
+	/*
+		The queue is swapped out, but the blocks stay in m_writing until
+		they are committed, so that loadBlock() can still find them
+		while they are being written
+	*/
+	{
+	    JMutexAutoLock lock(m_queue_mutex);
+	    m_writing.swap(m_queue);
+	}
+	if (m_writing.empty())
+	    return;
+
+	u32 count = m_writing.size();
+	std::map<v3s16, QueuedBlock>::iterator i = m_writing.begin();
+	while (i != m_writing.end())
+	{
+	    JMutexAutoLock lock(m_map->m_database_mutex);
+
+	    m_map->verifyDatabase();
+
+	    m_map->m_database->beginSave();
+
+	    for (u32 n=0; n<SAVER_TRANSACTION_BLOCKS && i != m_writing.end(); n++, i++)
+		m_map->saveBlockData(i->first, i->second.data);
+
+	    m_map->m_database->endSave();
+	}
+
+	// Anything queued again while we were writing is in m_queue
+	std::map<v3s16, QueuedBlock> written;
+	{
+	    JMutexAutoLock lock(m_queue_mutex);
+	    written.swap(m_writing);
+	}
+
+	g_profiler->avg("ServerMapSaver: blocks per flush", count);
+}
+
 /*
 	ServerMap
 */
@@ -1909,12 +2216,14 @@ void Map::nodeMetadataStep(float dtime,core::map<v3s16,MapBlock*> &changed_block
 ServerMap::ServerMap() : Map(dout_server),
 			 m_seed(0),
 			 m_database(NULL),
-			 m_database_read(NULL),
-			 m_database_write(NULL)
+			 m_saver(this),
+			 m_saver_running(false)
 {
 	char b[1024];
 	infostream<<__FUNCTION_NAME<<std::endl;
 
+	m_database_mutex.Init();
+
 	config_load("world","world.cfg");
 
 	loadMapMeta();
@@ -1923,8 +2232,11 @@ ServerMap::ServerMap() : Map(dout_server),
 		Try to load map; if not found, create a new one.
 	*/
 
-	if (path_get("world","map.sqlite",1,b,1024))
-		return;
+	for (int i=0; MapDatabase::backends[i]; i++)
+	{
+		if (path_get("world",MapDatabase::getFileName(MapDatabase::backends[i]),1,b,1024))
+			return;
+	}
 
 	vlprintf(CN_ACTION,"Initializing new map");
 
@@ -1939,6 +2251,8 @@ ServerMap::~ServerMap()
 {
 	infostream<<__FUNCTION_NAME<<std::endl;
 
+	stopSaver();
+
 	try{
 	    save(true);
 	    infostream<<"Server: saved map"<<std::endl;
@@ -1951,14 +2265,8 @@ ServerMap::~ServerMap()
 	/*
 		Close database if it was opened
 	*/
-	if(m_database_read)
-	    sqlite3_finalize(m_database_read);
-	if(m_database_write)
-	    sqlite3_finalize(m_database_write);
-	if(m_database_list)
-	    sqlite3_finalize(m_database_list);
 	if(m_database)
-	    sqlite3_close(m_database);
+	    delete m_database;
 }
 
 void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
@@ -1982,6 +2290,16 @@ void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
 	{
 	//TimeTaker timer("initBlockMake() create area");
 
+	// Read what is on disk with one query rather than 27
+	    {
+		core::list<v3s16> area;
+		for (s16 x=-1; x<=1; x++)
+		for (s16 y=-1; y<=1; y++)
+		for (s16 z=-1; z<=1; z++)
+		    area.push_back(blockpos + v3s16(x,y,z));
+		loadBlocks(area);
+	    }
+
 	    for (s16 x=-1; x<=1; x++)
 		for (s16 z=-1; z<=1; z++) {
 		    v2s16 sectorpos(blockpos.X+x, blockpos.Z+z);
@@ -1993,8 +2311,10 @@ void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
 		    {
 			v3s16 p(blockpos.X+x, blockpos.Y+y, blockpos.Z+z);
 		    //MapBlock *block = createBlock(p);
-		    // 1) get from memory, 2) load from disk
-			MapBlock* block = emergeBlock(p, false);
+		    // 1) get from memory, 2) loaded from disk above
+			MapBlock* block = getBlockNoCreateNoEx(p);
+			if (block && block->isDummy())
+			    block = NULL;
 		    // 3) create a blank one
 			if (!block)
 			{
@@ -2011,6 +2331,8 @@ void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
 
 		    // Lighting will not be valid after make_chunk is called
 			block->setLightingExpired(true);
+		    // Keep it loaded until finishBlockMake()
+			block->resetUsageTimer();
 			block->ResetCurrent();
 		    }
 		}
@@ -2035,6 +2357,17 @@ void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
 	    data->vmanip->initialEmerge(bigarea_blocks_min, bigarea_blocks_max);
 	}
 
+	// The area is generated with the map unlocked, see finishBlockMake()
+	data->change_counts.clear();
+	for (s16 x=-1; x<=1; x++)
+	for (s16 y=-1; y<=1; y++)
+	for (s16 z=-1; z<=1; z++) {
+	    v3s16 p = blockpos + v3s16(x,y,z);
+	    MapBlock *block = getBlockNoCreateNoEx(p);
+	    if (block)
+		data->change_counts[p] = block->getChangeCount();
+	}
+
     // Data is ready now.
 }
 
@@ -2044,6 +2377,25 @@ MapBlock* ServerMap::finishBlockMake(mapgen::BlockMakeData *data,
 	if (data->no_op)
 		return NULL;
 
+	/*
+		The map may have changed while the area was being generated.
+		Neighbours that did are left as they are, so player edits,
+		liquids and so on aren't lost. If the block being generated
+		changed it's generated again.
+	*/
+	{
+		MapBlock *block = getBlockNoCreateNoEx(data->blockpos);
+		std::map<v3s16, uint64_t>::iterator i = data->change_counts.find(data->blockpos);
+		if (block && i != data->change_counts.end() && block->getChangeCount() != i->second) {
+			infostream<<__FUNCTION_NAME<<": block changed while being"
+				<<" generated, generating it again"<<std::endl;
+			mapgen::BlockMakeData again;
+			initBlockMake(&again, data->blockpos);
+			mapgen::make_block(&again);
+			return finishBlockMake(&again, changed_blocks);
+		}
+	}
+
 	/*
 		Blit generated stuff to map
 		NOTE: blitBackAll adds nearly everything to changed_blocks
@@ -2051,7 +2403,7 @@ MapBlock* ServerMap::finishBlockMake(mapgen::BlockMakeData *data,
 	{
 		// 70ms @cs=8
 		//TimeTaker timer("finishBlockMake() blitBackAll");
-		data->vmanip->blitBackAllWithMeta(&changed_blocks);
+		data->vmanip->blitBackAllWithMeta(&changed_blocks, &data->change_counts);
 	}
 
 	/*
@@ -2067,7 +2419,12 @@ MapBlock* ServerMap::finishBlockMake(mapgen::BlockMakeData *data,
 		Get central block
 	*/
 	MapBlock* const block = getBlockNoCreateNoEx(data->blockpos);
-	assert(block);
+	if (!block)
+	{
+		infostream<<"WARNING: "<<__FUNCTION_NAME
+			  <<": central block was unloaded"<<std::endl;
+		return NULL;
+	}
 
 	block->setBiome(data->biome);
 
@@ -2418,85 +2775,70 @@ s16 ServerMap::findGroundLevel(v2s16 p2d)
 	return level;
 }
 
-void ServerMap::createDatabase()
-{
-	assert(m_database);
-	const int e = sqlite3_exec(m_database,
-			"CREATE TABLE IF NOT EXISTS `blocks` ("
-			"`pos` INT NOT NULL PRIMARY KEY,"
-			"`data` BLOB"
-			");"
-			, NULL, NULL, NULL);
-	if(e == SQLITE_ABORT)
-	    throw FileNotGoodException("Could not create database structure");
-	else
-	    infostream<<"Server: Database structure was created";
-}
-
 void ServerMap::verifyDatabase()
 {
 	if(m_database)
 	    return;
 
-	{
-	    char buff[1024];
-	    bool needs_create = false;
-	    int d;
+	char buff[1024];
 
-	/*
-	  Open the database connection
-	*/
+	const char *name = config_get("world.map.database");
+	if (!name || !MapDatabase::getFileName(name))
+	{
+	    if (name)
+		infostream<<"WARNING: Unknown map database \""<<name
+			  <<"\", using sqlite3"<<std::endl;
+	    name = "sqlite3";
+	}
 
-	    if (!path_get((char*)"world",(char*)"map.sqlite",0,buff,1024))
-		throw FileNotGoodException("map.sqlite: Cannot find database file path");
+	if (!path_get("world",MapDatabase::getFileName(name),0,buff,1024))
+	    throw FileNotGoodException("Cannot find map database file path");
 
-	    if (path_create((char*)"world",NULL))
-		throw FileNotGoodException("map.sqlite: Cannot create database file path");
+	if (path_create((char*)"world",NULL))
+	    throw FileNotGoodException("Cannot create map database file path");
 
-	    if (!path_exists(buff))
-		needs_create = true;
+	const bool exists = path_exists(buff);
 
-	    d = sqlite3_open_v2(buff, &m_database, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
-	    
-	    if(d != SQLITE_OK)
-	    {
-		infostream<<"WARNING: Database failed to open: "<<sqlite3_errmsg(m_database)<<std::endl;
-		throw FileNotGoodException("map.sqlite: Cannot open database file");
-	    }
-
-	    if(needs_create)
-		createDatabase();
+	MapDatabase *db = MapDatabase::create(name, buff);
+	try{
+	    db->open();
 
-	    d = sqlite3_prepare(m_database, "SELECT `data` FROM `blocks` WHERE `pos`=? LIMIT 1", -1, &m_database_read, NULL);
-	    
-	    if(d != SQLITE_OK)
+	/*
+	  A world saved by another backend is converted the first time
+	  it is opened with this one, the old file is left alone
+	*/
+	    for (int i=0; !exists && MapDatabase::backends[i]; i++)
 	    {
-		infostream<<"WARNING: Database read statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
-		throw FileNotGoodException("map.sqlite: Cannot prepare read statement");
-	    }
+		char old_file[1024];
+		const char *old_name = MapDatabase::backends[i];
+		if (!strcmp(old_name, name))
+		    continue;
+		if (!path_get("world",MapDatabase::getFileName(old_name),1,old_file,1024))
+		    continue;
 
-	    d = sqlite3_prepare(m_database, "REPLACE INTO `blocks` VALUES(?, ?)", -1, &m_database_write, NULL);
-	    if(d != SQLITE_OK)
-	    {
-		infostream<<"WARNING: Database write statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
-		throw FileNotGoodException("map.sqlite: Cannot prepare write statement");
-	    }
+		vlprintf(CN_ACTION,"Converting map from %s to %s",old_name,name);
 
-	    d = sqlite3_prepare(m_database, "SELECT `pos` FROM `blocks`", -1, &m_database_list, NULL);
-	    if(d != SQLITE_OK)
-	    {
-		infostream<<"WARNING: Database list statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
-		throw FileNotGoodException("map.sqlite: Cannot prepare read statement");
+		MapDatabase *old_db = MapDatabase::create(old_name, old_file);
+		try{
+		    old_db->open();
+		    convertMapDatabase(old_db, db);
+		}
+		catch(FileNotGoodException &e)
+		{
+		    delete old_db;
+		    throw;
+		}
+		delete old_db;
+		break;
 	    }
-
-	    infostream<<"Server: Database opened"<<std::endl;
 	}
-}
+	catch(FileNotGoodException &e)
+	{
+	    delete db;
+	    throw;
+	}
 
-sqlite3_int64 ServerMap::getBlockAsInteger(const v3s16 pos)
-{
-	return (sqlite3_int64)pos.Z*16777216 +
-		(sqlite3_int64)pos.Y*4096 + (sqlite3_int64)pos.X;
+	m_database = db;
 }
 
 void ServerMap::save(bool only_changed)
@@ -2510,7 +2852,7 @@ void ServerMap::save(bool only_changed)
 	u32 block_count = 0;
 	u32 block_count_all = 0; // Number of blocks in memory
 
-    // Don't do anything with sqlite unless something is really saved
+    // Don't do anything with the database unless something is really saved
 	bool save_started = false;
 	JMutexAutoLock lock(m_sectors_mutex);
 
@@ -2562,41 +2904,17 @@ void ServerMap::save(bool only_changed)
 	}
 }
 
-static s32 unsignedToSigned(s32 i, s32 max_positive)
-{
-	if (i < max_positive)
-		return i;
-	return i - 2*max_positive;
-}
-
-// modulo of a negative number does not work consistently in C
-static sqlite3_int64 pythonmodulo(sqlite3_int64 i, sqlite3_int64 mod)
+void ServerMap::listAllLoadableBlocks(core::list<v3s16> &dst)
 {
-	if (i >= 0)
-		return i % mod;
-	return mod - ((-i) % mod);
-}
+	// Blocks that are only queued for saving aren't listed otherwise
+	if (m_saver_running)
+		m_saver.flush();
 
-v3s16 ServerMap::getIntegerAsBlock(sqlite3_int64 i)
-{
-	const s32 x = unsignedToSigned(pythonmodulo(i, 4096), 2048);
-	i = (i - x) / 4096;
-	const s32 y = unsignedToSigned(pythonmodulo(i, 4096), 2048);
-	i = (i - y) / 4096;
-	const s32 z = unsignedToSigned(pythonmodulo(i, 4096), 2048);
-	return v3s16(x,y,z);
-}
+	JMutexAutoLock lock(m_database_mutex);
 
-void ServerMap::listAllLoadableBlocks(core::list<v3s16> &dst)
-{
 	verifyDatabase();
 
-	while (sqlite3_step(m_database_list) == SQLITE_ROW)
-	{
-		sqlite3_int64 block_i = sqlite3_column_int64(m_database_list, 0);
-		v3s16 p = getIntegerAsBlock(block_i);
-		dst.push_back(p);
-	}
+	m_database->listBlocks(dst);
 }
 
 void ServerMap::loadMapMeta()
@@ -2627,16 +2945,60 @@ void ServerMap::loadMapMeta()
 
 void ServerMap::beginSave()
 {
+	// The saver groups its own writes into transactions
+	if (m_saver_running)
+	    return;
+
+	JMutexAutoLock lock(m_database_mutex);
 	verifyDatabase();
-	if(sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
-	    infostream<<"WARNING: beginSave() failed, saving might be slow.";
+	m_database->beginSave();
 }
 
 void ServerMap::endSave()
 {
+	if (m_saver_running)
+	    return;
+
+	JMutexAutoLock lock(m_database_mutex);
 	verifyDatabase();
-	if(sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
-	    infostream<<"WARNING: endSave() failed, map might not have saved.";
+	m_database->endSave();
+}
+
+void ServerMap::startSaver()
+{
+	const u32 max_queued = config_get_int("server.save.queue.max");
+
+	// A queue size of 0 keeps saving synchronous
+	if (m_saver_running || max_queued == 0)
+	    return;
+
+	{
+	    JMutexAutoLock lock(m_database_mutex);
+	    verifyDatabase();
+	}
+
+	m_saver.setMaxQueued(max_queued);
+	m_saver.setRun(true);
+	m_saver.Start();
+	m_saver_running = true;
+
+	infostream<<"ServerMap: Started write-behind saver"<<std::endl;
+}
+
+void ServerMap::stopSaver()
+{
+	if (!m_saver_running)
+	    return;
+
+	/*
+		Anything queued after this point is written synchronously by
+		the caller, so the other map users must have stopped already
+	*/
+	m_saver.stop();
+	m_saver.flush();
+	m_saver_running = false;
+
+	infostream<<"ServerMap: Stopped write-behind saver"<<std::endl;
 }
 
 void ServerMap::saveBlock(MapBlock* const block)
@@ -2663,51 +3025,84 @@ void ServerMap::saveBlock(MapBlock* const block)
 		[1] data
 	*/
 
-	verifyDatabase();
+	// Give back the node array of blocks that have become uniform
+	block->compact();
 
 	std::ostringstream o(std::ios_base::binary);
 
 	o.write((char*)&version, 1);
 
 	// Write basic data
-	block->serialize(o, version);
+	block->serialize(o, version, true);
 
 	// Write extra data stored on disk
 	block->serializeDiskExtra(o, version);
 
-	// Write block to database
-
-	std::string tmp = o.str();
-	const char *bytes = tmp.c_str();
-
-	if(sqlite3_bind_int64(m_database_write, 1,
-					getBlockAsInteger(p3d)) != SQLITE_OK)
-	    infostream<<"WARNING: Block position failed to bind: "
-		      <<sqlite3_errmsg(m_database)<<std::endl;
-	if(sqlite3_bind_blob(m_database_write, 2,(void *)bytes, o.tellp(),
-					NULL) != SQLITE_OK) // TODO this mught not be the right length
-		infostream<<"WARNING: Block data failed to bind: "
-			  <<sqlite3_errmsg(m_database)<<std::endl;
-	int written = sqlite3_step(m_database_write);
-	if(written != SQLITE_DONE)
-		infostream<<"WARNING: Block failed to save ("<<p3d.X
-			  <<", "<<p3d.Y<<", "<<p3d.Z<<") "
-		<<sqlite3_errmsg(m_database)<<std::endl;
-	// Make ready for later reuse
-	sqlite3_reset(m_database_write);
+	// Write block to database, or leave that to the saver
+
+	if (m_saver_running)
+	{
+	    m_saver.queueBlock(p3d, o.str());
+	}
+	else
+	{
+	    JMutexAutoLock lock(m_database_mutex);
+	    verifyDatabase();
+	    saveBlockData(p3d, o.str());
+	}
 
 	// We just wrote it to the disk so clear modified flag
 	block->resetModified();
 }
 
+void ServerMap::saveBlockData(v3s16 p3d, const std::string &data)
+{
+	m_database->saveBlock(p3d, data.c_str(), data.size());
+}
+
+/*
+	Deserializes blocks as the database reads them
+*/
+class ServerMapBlockLoader : public MapDatabaseReceiver
+{
+public:
+	ServerMapBlockLoader(ServerMap *map, core::map<v3s16, MapSector*> &sectors):
+		m_map(map),
+		m_sectors(sectors)
+	{}
+
+	void receiveBlock(v3s16 pos, const char *data, size_t len)
+	{
+		core::map<v3s16, MapSector*>::Node* const node = m_sectors.find(pos);
+		if (node == NULL)
+			return;
+		m_map->loadBlock(data, len, pos, node->getValue(), false);
+	}
+
+private:
+	ServerMap *m_map;
+	core::map<v3s16, MapSector*> &m_sectors;
+};
+
 void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector* sector,
 		bool save_after_load)
+{
+	loadBlock(blob->c_str(), blob->size(), p3d, sector, save_after_load);
+}
+
+/*
+	This is called with the database locked, so it must not touch the
+	database or m_sectors_mutex.
+*/
+void ServerMap::loadBlock(const char *data, size_t len, v3s16 p3d,
+		MapSector* sector, bool save_after_load)
 {
 	DSTACK(__FUNCTION_NAME);
 
 	try
 	{
-	    std::istringstream is(*blob, std::ios_base::binary);
+	    MemoryStreamBuffer buf(data, len);
+	    std::istream is(&buf);
 
 	    u8 version = SER_FMT_VER_INVALID;
 	    is.read((char*)&version, 1);
@@ -2716,13 +3111,6 @@ void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector* sector,
 		throw SerializationError("ServerMap::loadBlock(): Failed"
 				" to read MapBlock version");
 
-	/*u32 block_size = MapBlock::serializedLength(version);
-	  SharedBuffer<u8> data(block_size);
-	  is.read((char*)*data, block_size);*/
-
-	// This will always return a sector because we're the server
-	//MapSector *sector = emergeSector(p2d);
-
 	    bool created_new = false;
 	    MapBlock* block = sector->getBlockNoCreateNoEx(p3d.Y);
 		
@@ -2743,14 +3131,15 @@ void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector* sector,
 		sector->insertBlock(block);
 
 	/*
-	  Save blocks loaded in old format in new format
+	  Save blocks loaded in old format in new format, with the
+	  next save as the database may be locked now
 	*/
 
 	    if (version < SER_FMT_VER_HIGHEST || save_after_load)
-		saveBlock(block);
-
+		block->raiseModified(MOD_STATE_WRITE_NEEDED);
+	    else
 	// We just loaded it from, so it's up-to-date.
-	    block->resetModified();
+		block->resetModified();
 	    block->ResetCurrent();
 	}
 	catch(SerializationError &e)
@@ -2769,40 +3158,90 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 
 	v2s16 p2d(blockpos.X, blockpos.Z);
 
-	verifyDatabase();
-
-	if (sqlite3_bind_int64(m_database_read, 1,
-					getBlockAsInteger(blockpos)) != SQLITE_OK)
-	    infostream<<"WARNING: Could not bind block position for load: "
-		      <<sqlite3_errmsg(m_database)<<std::endl;
-	
-	if (sqlite3_step(m_database_read) == SQLITE_ROW)
+	// Data still waiting for the saver is newer than the database
+	std::string queued;
+	if (m_saver.getQueued(blockpos, queued))
 	{
+	    loadBlock(&queued, blockpos, createSector(p2d), false);
+	    return getBlockNoCreateNoEx(blockpos);
+	}
+
 	/*
-	  Make sure sector is loaded
+	  Make sure sector is loaded, before locking the database
 	*/
-	    MapSector* sector = createSector(p2d);
+	MapSector* const sector = createSector(p2d);
+
+	{
+	    JMutexAutoLock lock(m_database_mutex);
+
+	    verifyDatabase();
+
+	    core::map<v3s16, MapSector*> wanted;
+	    wanted.insert(blockpos, sector);
+	    core::list<v3s16> list;
+	    list.push_back(blockpos);
+
+	    ServerMapBlockLoader loader(this, wanted);
+	    m_database->loadBlocks(list, &loader);
+	}
+
+	return getBlockNoCreateNoEx(blockpos);
+}
+
+void ServerMap::loadBlocks(core::list<v3s16> &blocks)
+{
+	DSTACK(__FUNCTION_NAME);
 
 	/*
-	  Load block
+	  Find out what isn't in memory yet, and make sure the sectors are
+	  loaded before locking the database
 	*/
-	    const char* data =
-		(const char*) sqlite3_column_blob(m_database_read, 0);
-	    size_t len = sqlite3_column_bytes(m_database_read, 0);
+	core::map<v3s16, MapSector*> wanted;
 
-	    std::string datastr(data, len);
+	for (core::list<v3s16>::Iterator i = blocks.begin(); i != blocks.end(); i++)
+	{
+	    const v3s16 p = *i;
 
-	    loadBlock(&datastr, blockpos, sector, false);
+	    if (blockpos_over_limit(p) || wanted.find(p) != NULL)
+		continue;
 
-	    sqlite3_step(m_database_read);
-	// We should never get more than 1 row, so ok to reset
-	    sqlite3_reset(m_database_read);
+	    MapBlock* const block = getBlockNoCreateNoEx(p);
+	    if (block)
+	    {
+		block->ResetCurrent();
+		if (!block->isDummy())
+		    continue;
+	    }
 
-	    return getBlockNoCreateNoEx(blockpos);
+	    MapSector* const sector = createSector(v2s16(p.X, p.Z));
+
+	    std::string queued;
+	    if (m_saver.getQueued(p, queued))
+	    {
+		loadBlock(&queued, p, sector, false);
+		continue;
+	    }
+
+	    wanted.insert(p, sector);
 	}
-	sqlite3_reset(m_database_read);
 
-	return getBlockNoCreateNoEx(blockpos);
+	if (wanted.size() == 0)
+	    return;
+
+
+	JMutexAutoLock lock(m_database_mutex);
+
+	verifyDatabase();
+
+	core::list<v3s16> list;
+	for (core::map<v3s16, MapSector*>::Iterator i = wanted.getIterator();
+	     i.atEnd() == false; i++)
+	    list.push_back(i.getNode()->getKey());
+
+	ServerMapBlockLoader loader(this, wanted);
+	const u32 loaded = m_database->loadBlocks(list, &loader);
+
+	g_profiler->avg("ServerMap: blocks per batch read", loaded);
 }
 
 void ServerMap::PrintInfo(std::ostream &out)
@@ -3895,7 +4334,8 @@ void ManualMapVoxelManipulator::blitBackAll(
 }
 
 void ManualMapVoxelManipulator::blitBackAllWithMeta(
-		core::map<v3s16, MapBlock*> * modified_blocks)
+		core::map<v3s16, MapBlock*> * modified_blocks,
+		std::map<v3s16, uint64_t> *change_counts)
 {
 	if (m_area.getExtent() == v3s16(0,0,0))
 		return;
@@ -3928,6 +4368,16 @@ void ManualMapVoxelManipulator::blitBackAllWithMeta(
 		continue;
 	    }
 
+	    if (change_counts)
+	    {
+		std::map<v3s16, uint64_t>::iterator c = change_counts->find(p);
+		if (c == change_counts->end() || c->second != block->getChangeCount())
+		{
+		    block->ResetCurrent();
+		    continue;
+		}
+	    }
+
 	    block->copyFrom(*this);
 
 	    if (modified_blocks)
@@ -31,19 +31,22 @@
 #include <jthread.h>
 #include <iostream>
 #include <sstream>
+#include <string>
+#include <map>
+#include <list>
+#include <vector>
 
 #include "common_irrlicht.h"
+#include "utility.h"
 #include "mapgen.h"
 #include "mapnode.h"
 #include "constants.h"
 #include "voxel.h"
-
-extern "C" {
-	#include "sqlite3.h"
-}
+#include "mapdatabase.h"
 
 using namespace jthread;
 
+class Map;
 class MapSector;
 class ServerMapSector;
 class ClientMapSector;
@@ -129,6 +132,75 @@ class MapEventReceiver
 	virtual void onMapEditEvent(MapEditEvent *event) = 0;
 };
 
+/*
+	Liquid nodes waiting to be transformed, queued by the block they are
+	in. Blocks get their turn in the order they were first queued in, and
+	a block that has had its turn goes to the back.
+
+	This is thread-safe, the liquid threads queue nodes while running.
+*/
+class LiquidQueue
+{
+public:
+	LiquidQueue();
+	~LiquidQueue();
+
+	// Does nothing if the node is already queued
+	void push_back(v3s16 p);
+
+	// Blocks with nodes queued, in turn order
+	void getBlocks(std::vector<v3s16> &blocks);
+	// Takes out the nodes queued in a block
+	void takeBlock(v3s16 blockpos, std::vector<v3s16> &nodes);
+
+	u32 size();
+	u32 blockCount();
+
+private:
+	struct Block
+	{
+		UniqueQueue<v3s16> nodes;
+		std::list<v3s16>::iterator turn;
+	};
+
+	std::map<v3s16, Block*> m_blocks;
+	std::list<v3s16> m_turns;
+	u32 m_size;
+	JMutex m_mutex;
+};
+
+// What transforming liquids on one thread changed
+struct LiquidChanges
+{
+	core::map<v3s16, MapBlock*> modified_blocks;
+	// Blocks that will require a lighting update (due to lava)
+	core::map<v3s16, MapBlock*> lighting_modified_blocks;
+	// Nodes that due to viscosity have not reached their max level height
+	std::vector<v3s16> must_reflow;
+	u32 transformed;
+};
+
+// Blocks of one colour there must be for the liquid threads to be used,
+// fewer are done sooner than the threads can be woken
+#define LIQUID_THREAD_MIN_BLOCKS 16
+
+class LiquidThread : public WorkerThread
+{
+	Map *m_map;
+	u32 m_index;
+
+public:
+
+	LiquidThread(Map *map, u32 index, JSemaphore *done):
+		WorkerThread("LiquidThread",done),
+		m_map(map),
+		m_index(index)
+	{
+	}
+
+	void work();
+};
+
 class Map /*: public NodeContainer*/
 {
     public:
@@ -295,6 +367,8 @@ class Map /*: public NodeContainer*/
 	virtual void PrintInfo(std::ostream &out);
 
 	void transformLiquids(core::map<v3s16, MapBlock*> & modified_blocks);
+	// Transforms the nodes of blocks in m_liquid_blocks, for transformLiquids()
+	void liquidWork(u32 index);
 
 	/*
 		Node metadata
@@ -316,7 +390,11 @@ class Map /*: public NodeContainer*/
 	
         // Returns NULL if not found
 	MapBlock* getBlockNoCreateNoExNoLock(v3s16 p3d);
-	
+
+	void transformLiquid(v3s16 p0, LiquidChanges &changes);
+	// Whether transformLiquids() has used up its time or node count
+	bool liquidDone();
+
 	/*
 		Variables
 	*/
@@ -335,7 +413,81 @@ class Map /*: public NodeContainer*/
 	v2s16 m_sector_cache_p;
 
 	// Queued transforming water nodes
-	UniqueQueue<v3s16> m_transforming_liquid;
+	LiquidQueue m_transforming_liquid;
+
+	/*
+		Shared with the liquid threads while transformLiquids() runs
+	*/
+	std::vector<LiquidThread*> m_liquid_threads;
+	// Posted by each liquid thread when it's done
+	JSemaphore m_liquid_done;
+	// One for each thread, this one is the first
+	std::vector<LiquidChanges> m_liquid_changes;
+	std::vector<v3s16> m_liquid_blocks;
+	u32 m_liquid_next;
+	u32 m_liquid_start;
+	u32 m_liquid_budget;
+	u32 m_liquid_count;
+	u32 m_liquid_limit;
+	JMutex m_liquid_mutex;
+
+	// For working out the nodes transformed per second
+	u32 m_liquid_rate_start;
+	u32 m_liquid_rate_count;
+};
+
+class ServerMap;
+
+/*
+	ServerMapSaver
+
+	Write-behind thread for ServerMap. Blocks are serialized by the
+	caller and queued here, the thread takes the whole queue and writes
+	it to the database in transactions of SAVER_TRANSACTION_BLOCKS. A
+	block that is queued again before it is written only keeps its
+	newest data.
+*/
+
+// Blocks written in each transaction, the database is free for loading
+// blocks in between
+#define SAVER_TRANSACTION_BLOCKS 64
+
+class ServerMapSaver : public SimpleThread
+{
+public:
+	ServerMapSaver(ServerMap *map);
+
+	void * Thread();
+
+	// Queue serialized data for a block, waits while the queue is full
+	void queueBlock(v3s16 p, const std::string &data);
+	// Get queued data that has not been written yet
+	bool getQueued(v3s16 p, std::string &data);
+	// Write everything that is currently queued
+	void flush();
+
+	u32 queuedCount();
+	void setMaxQueued(u32 max)
+	{
+		m_max_queued = max;
+	}
+
+private:
+	struct QueuedBlock
+	{
+		std::string data;
+		u32 seq;
+	};
+
+	ServerMap *m_map;
+	JMutex m_queue_mutex;
+	std::map<v3s16, QueuedBlock> m_queue;
+	// Taken out of the queue by flush() and being written
+	std::map<v3s16, QueuedBlock> m_writing;
+	// Only one flush() at a time
+	JMutex m_flush_mutex;
+	u32 m_seq;
+	u32 m_max_queued;
 };
 
 /*
@@ -398,13 +550,8 @@ class ServerMap : public Map
 	/*
 		Database functions
 	*/
-	// Create the database structure
-	void createDatabase();
-	// Verify we can read/write to the database
+	// Open the database configured by world.map.database
 	void verifyDatabase();
-	// Get an integer suitable for a block
-	static sqlite3_int64 getBlockAsInteger(const v3s16 pos);
-	static v3s16 getIntegerAsBlock(sqlite3_int64 i);
 
 	// Call these before and after saving of blocks
 	void beginSave();
@@ -419,8 +566,12 @@ class ServerMap : public Map
 
 	void saveBlock(MapBlock *block);
 	MapBlock* loadBlock(v3s16 p);
+	// Loads the blocks that aren't in memory yet with as few queries as possible
+	void loadBlocks(core::list<v3s16> &blocks);
 	// Database version
 	void loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load=false);
+	void loadBlock(const char *data, size_t len, v3s16 p3d, MapSector *sector,
+			bool save_after_load=false);
 
 	// For debug printing
 	virtual void PrintInfo(std::ostream &out);
@@ -428,18 +579,34 @@ class ServerMap : public Map
 	uint64_t getSeed(){ return m_seed; }
 	MapGenType getType() {return m_type;}
 
+	/*
+		Write-behind saving, when the saver is running saveBlock()
+		only serializes and queues the block
+	*/
+	void startSaver();
+	// Stops the saver and writes everything it still has queued
+	void stopSaver();
+	bool saverRunning()
+	{
+		return m_saver_running;
+	}
+
     private:
+	friend class ServerMapSaver;
+
+	// Write serialized block data, m_database_mutex must be locked
+	void saveBlockData(v3s16 p, const std::string &data);
 	// Seed used for all kinds of randomness
 	uint64_t m_seed;
 	MapGenType m_type;
 
-	/*
-		SQLite database and statements
-	*/
-	sqlite3 *m_database;
-	sqlite3_stmt *m_database_read;
-	sqlite3_stmt *m_database_write;
-	sqlite3_stmt *m_database_list;
+	// Block storage, opened by verifyDatabase()
+	MapDatabase *m_database;
+	// Protects the database, shared with the saver
+	JMutex m_database_mutex;
+
+	ServerMapSaver m_saver;
+	bool m_saver_running;
 };
 
 /*
@@ -619,8 +786,11 @@ public:
 
 	// This is much faster with big chunks of generated data
 	void blitBackAll(core::map<v3s16, MapBlock*> * modified_blocks);
-	// Slower than above, but doesn't screw up node metadata
-	void blitBackAllWithMeta(core::map<v3s16, MapBlock*> * modified_blocks);
+	// Slower than above, but doesn't screw up node metadata. Blocks
+	// with a change count different from the one in change_counts
+	// are left as they are.
+	void blitBackAllWithMeta(core::map<v3s16, MapBlock*> * modified_blocks,
+			std::map<v3s16, uint64_t> *change_counts=NULL);
 
 protected:
 	bool m_create_area;
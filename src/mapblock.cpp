@@ -30,17 +30,22 @@
 // For g_settings
 #include "main.h"
 #include "light.h"
+#include "content_mapnode.h"
 #include <sstream>
 
+#include "xsync.h"
+
 #ifndef SERVER
 # include "sound.h"
-# include "xsync.h"
 #endif
 
 /*
 	MapBlock
 */
 
+// Every block gets its own range of node versions
+static volatile int block_versions = 0;
+
 MapBlock::MapBlock(Map* const parent,const v3s16 pos,const bool dummy):
 	has_spawn_area(false),
 	spawn_area(0,0,0),
@@ -48,8 +53,15 @@ MapBlock::MapBlock(Map* const parent,const v3s16 pos,const bool dummy):
 	m_parent(parent),
 	m_pos(pos),
 	m_biome(BIOME_UNKNOWN),
-	data(NULL),
+	m_content(NULL),
+	m_envticks(NULL),
+	m_param1(NULL),
+	m_param2(NULL),
+	m_nodestep_count(0),
+	m_node_version(((uint64_t)(u32)X1SyncInc(&block_versions)+1)<<32),
+	m_uniform(false),
 	m_modified(MOD_STATE_WRITE_NEEDED),
+	m_change_count(m_node_version),
 	is_underground(false),
 	m_lighting_expired(true),
 	m_day_night_differs(false),
@@ -88,8 +100,8 @@ MapBlock::~MapBlock()
 	}
 #endif
 
-	if (data)
-		delete[] data;
+	if (m_content)
+		delete[] (u8*)m_content;
 }
 
 void MapBlock::SetCurrent()
@@ -127,7 +139,7 @@ MapNode MapBlock::getNodeParent(v3s16 p, bool *is_valid_position)
 	if (isValidPosition(p.X,p.Y,p.Z) == false)
 		return m_parent->getNodeNoEx(getPosRelative() + p,
 				is_valid_position);
-	if (data == NULL)
+	if (isDummy())
 	{
 		if (is_valid_position)
 			*is_valid_position = false;
@@ -135,15 +147,105 @@ MapNode MapBlock::getNodeParent(v3s16 p, bool *is_valid_position)
 	}
 	if (is_valid_position)
 		*is_valid_position = true;
-	return data[p.Z * MAP_BLOCKSIZE2 + p.Y * MAP_BLOCKSIZE + p.X];
+	return getNodeIndex(p.Z * MAP_BLOCKSIZE2 + p.Y * MAP_BLOCKSIZE + p.X);
 }
 
 void MapBlock::setNodeParent(v3s16 p, MapNode & n)
 {
 	if (isValidPosition(p.X,p.Y,p.Z) == false)
 		m_parent->setNode(getPosRelative() + p, n);
-	else
-		data[p.Z * MAP_BLOCKSIZE2 + p.Y * MAP_BLOCKSIZE + p.X] = n;
+	else if (prepareWrite(n))
+		setNodeIndex(p.Z * MAP_BLOCKSIZE2 + p.Y * MAP_BLOCKSIZE + p.X, n);
+}
+
+/*
+	On the client the mesh thread reads blocks without locking the map,
+	so the node planes of a client block are never freed while in use.
+*/
+bool MapBlock::canReleaseData()
+{
+#ifndef SERVER
+	if (m_parent && m_parent->mapType() == MAPTYPE_CLIENT)
+		return false;
+#endif
+	return true;
+}
+
+void MapBlock::expand()
+{
+	if (!m_uniform)
+		return;
+
+	u8 *planes = new u8[MAP_BLOCKSIZE3*(sizeof(content_t)+sizeof(u32)+2)];
+	content_t *content = (content_t*)planes;
+	m_envticks = (u32*)(planes + MAP_BLOCKSIZE3*sizeof(content_t));
+	m_param1 = (u8*)(m_envticks + MAP_BLOCKSIZE3);
+	m_param2 = m_param1 + MAP_BLOCKSIZE3;
+
+	for (u32 i=0; i<MAP_BLOCKSIZE3; i++) {
+		content[i] = m_uniform_node.content;
+		m_envticks[i] = m_uniform_node.envticks;
+	}
+	memset(m_param1, m_uniform_node.param1, MAP_BLOCKSIZE3);
+	memset(m_param2, m_uniform_node.param2, MAP_BLOCKSIZE3);
+	m_nodestep_count = 0;
+	if (content_nodestep(m_uniform_node.content) & NODESTEP_HANDLER)
+		m_nodestep_count = MAP_BLOCKSIZE3;
+
+	m_content = content;
+	m_uniform = false;
+}
+
+void MapBlock::updateNodestepCount()
+{
+	m_nodestep_count = 0;
+	if (m_content == NULL)
+		return;
+	for (u32 i=0; i<MAP_BLOCKSIZE3; i++) {
+		if (content_nodestep(m_content[i]) & NODESTEP_HANDLER)
+			m_nodestep_count++;
+	}
+}
+
+void MapBlock::setUniform(const MapNode &n)
+{
+	if (m_content != NULL && !canReleaseData()) {
+		for (u32 i=0; i<MAP_BLOCKSIZE3; i++)
+			setNodeIndex(i, n);
+		return;
+	}
+
+	m_uniform_node = n;
+	m_uniform = true;
+	m_node_version++;
+	if (m_content != NULL) {
+		u8 *planes = (u8*)m_content;
+		m_content = NULL;
+		m_envticks = NULL;
+		m_param1 = NULL;
+		m_param2 = NULL;
+		delete[] planes;
+	}
+}
+
+bool MapBlock::compact()
+{
+	if (m_uniform)
+		return true;
+	if (m_content == NULL || !canReleaseData())
+		return false;
+
+	for (u32 i=1; i<MAP_BLOCKSIZE3; i++) {
+		if (m_content[i] != m_content[0] || m_envticks[i] != m_envticks[0])
+			return false;
+	}
+	for (u32 i=1; i<MAP_BLOCKSIZE3; i++) {
+		if (m_param1[i] != m_param1[0] || m_param2[i] != m_param2[0])
+			return false;
+	}
+
+	setUniform(getNodeIndex(0));
+	return true;
 }
 
 /*
@@ -219,7 +321,7 @@ bool MapBlock::propagateSunlight(core::map<v3s16, bool> & light_sources,
 			for (; y >= 0; y--)
 			{
 				v3s16 pos(x, y, z);
-				MapNode& n = getNodeRef(pos);
+				const MapNode n = getNodeIndex(z * MAP_BLOCKSIZE2 + y * MAP_BLOCKSIZE + x);
 				const ContentFeatures& f = content_features(n);
 
 				if (current_light != 0 && (current_light != LIGHT_SUN || !f.sunlight_propagates))
@@ -240,7 +342,13 @@ bool MapBlock::propagateSunlight(core::map<v3s16, bool> & light_sources,
 				const u8 old_light = n.getLight(LIGHTBANK_DAY);
 
 				if (current_light > old_light || remove_light)
-					n.setLight(LIGHTBANK_DAY, current_light);
+				{
+					// Uniform blocks stay so as long as nothing changes
+					MapNode lit = n;
+					lit.setLight(LIGHTBANK_DAY, current_light);
+					if (!(lit == n) && prepareWrite(lit))
+						setNodeIndex(z * MAP_BLOCKSIZE2 + y * MAP_BLOCKSIZE + x, lit);
+				}
 
 				if (diminish_light(current_light) != 0)
 					light_sources.insert(pos_relative + pos, true);
@@ -283,33 +391,57 @@ bool MapBlock::propagateSunlight(core::map<v3s16, bool> & light_sources,
 		}
 	}
 
+	// Sunlit sky and unlit underground often end up uniform again
+	compact();
+
 	return block_below_is_valid;
 }
 
 
 void MapBlock::copyTo(VoxelManipulator &dst)
 {
-	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
-	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
+	const v3s16 pos_relative = getPosRelative();
 
-	// Copy from data to VoxelManipulator
-	dst.copyFrom(data, data_area, v3s16(0,0,0),
-			getPosRelative(), data_size);
+	// Copy from the node planes to VoxelManipulator, a row at a time
+	for (s16 z=0; z<MAP_BLOCKSIZE; z++)
+	for (s16 y=0; y<MAP_BLOCKSIZE; y++)
+	{
+		const u32 i_src = z * MAP_BLOCKSIZE2 + y * MAP_BLOCKSIZE;
+		const s32 i_dst = dst.m_area.index(pos_relative.X,
+				pos_relative.Y+y, pos_relative.Z+z);
+
+		assert(i_dst + MAP_BLOCKSIZE <= dst.m_area.getVolume());
+		for (s16 x=0; x<MAP_BLOCKSIZE; x++)
+			dst.m_data[i_dst+x] = getNodeIndex(i_src+x);
+		memset(&dst.m_flags[i_dst], 0, MAP_BLOCKSIZE);
+	}
 }
 
 void MapBlock::copyFrom(VoxelManipulator &dst)
 {
-	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
-	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
+	const v3s16 pos_relative = getPosRelative();
 
-	// Copy from VoxelManipulator to data
-	dst.copyTo(data, data_area, v3s16(0,0,0),
-			getPosRelative(), data_size);
+	// Copy from VoxelManipulator to the node planes
+	expand();
+	for (s16 z=0; z<MAP_BLOCKSIZE; z++)
+	for (s16 y=0; y<MAP_BLOCKSIZE; y++)
+	{
+		const u32 i_dst = z * MAP_BLOCKSIZE2 + y * MAP_BLOCKSIZE;
+		const s32 i_src = dst.m_area.index(pos_relative.X,
+				pos_relative.Y+y, pos_relative.Z+z);
+
+		assert(i_src + MAP_BLOCKSIZE <= dst.m_area.getVolume());
+		for (s16 x=0; x<MAP_BLOCKSIZE; x++)
+			setNodeIndex(i_dst+x, dst.m_data[i_src+x]);
+	}
+	compact();
+
+	invalidatePacketCache();
 }
 
 void MapBlock::updateDayNightDiff()
 {
-	if(data == NULL)
+	if(isDummy())
 	{
 		m_day_night_differs = false;
 		return;
@@ -317,12 +449,22 @@ void MapBlock::updateDayNightDiff()
 
 	bool differs = false;
 
+	if (m_uniform) {
+		const MapNode &n = m_uniform_node;
+		differs = n.getLight(LIGHTBANK_DAY) != n.getLight(LIGHTBANK_NIGHT)
+				&& n.getContent() != CONTENT_AIR;
+		if (differs != m_day_night_differs)
+			invalidatePacketCache();
+		m_day_night_differs = differs;
+		return;
+	}
+
 	/*
 		Check if any lighting value differs
 	*/
 	for(u32 i=0; i<MAP_BLOCKSIZE3; i++)
 	{
-		const MapNode& n = data[i];
+		const MapNode n = getNodeIndex(i);
 		if(n.getLight(LIGHTBANK_DAY) != n.getLight(LIGHTBANK_NIGHT))
 		{
 			differs = true;
@@ -339,8 +481,7 @@ void MapBlock::updateDayNightDiff()
 		bool only_air = true;
 		for(u32 i=0; i<MAP_BLOCKSIZE3; i++)
 		{
-			const MapNode& n = data[i];
-			if(n.getContent() != CONTENT_AIR)
+			if(m_content[i] != CONTENT_AIR)
 			{
 				only_air = false;
 				break;
@@ -351,6 +492,8 @@ void MapBlock::updateDayNightDiff()
 	}
 
 	// Set member variable
+	if (differs != m_day_night_differs)
+		invalidatePacketCache();
 	m_day_night_differs = differs;
 }
 
@@ -363,7 +506,7 @@ s16 MapBlock::getGroundLevel(v2s16 p2d)
 		s16 y = MAP_BLOCKSIZE-1;
 		for(; y>=0; y--)
 		{
-			MapNode n = getNodeRef(p2d.X, y, p2d.Y);
+			MapNode n = getNodeNoEx(v3s16(p2d.X, y, p2d.Y));
 			if(content_features(n).walkable)
 			{
 				if(y == MAP_BLOCKSIZE-1)
@@ -384,31 +527,76 @@ s16 MapBlock::getGroundLevel(v2s16 p2d)
 	Serialization
 */
 
-void MapBlock::serialize(std::ostream &os, u8 version)
+/*
+	Node data from version 23 on. A block made of a single node is
+	written as just that node. Anything else gets a palette of the
+	content types in the block, the palette index of every node packed
+	into as few bits as the palette needs, and the param1 and param2
+	planes, each of which is one byte when it's the same everywhere.
+	All but the single node case is zlib'd.
+*/
+#define MAPBLOCK_NODES_UNIFORM 0
+#define MAPBLOCK_NODES_PALETTE 1
+#define MAPBLOCK_PLANE_UNIFORM 0
+#define MAPBLOCK_PLANE_RAW 1
+
+// Bits per palette index, kept to sizes that don't cross bytes
+static u8 palette_index_bits(u32 palette_size)
 {
-	if (!ser_ver_supported(version))
-		throw VersionMismatchException("ERROR: MapBlock format not supported");
+	if (palette_size <= 1)
+		return 0;
+	if (palette_size <= 2)
+		return 1;
+	if (palette_size <= 4)
+		return 2;
+	if (palette_size <= 16)
+		return 4;
+	if (palette_size <= 256)
+		return 8;
+	return 16;
+}
 
-	if (data == NULL)
-		throw SerializationError("ERROR: Not writing dummy block.");
+static void serialize_plane(std::string &dst, const u8 *plane)
+{
+	bool uniform = true;
+	for (u32 i=1; i<MAP_BLOCKSIZE3; i++) {
+		if (plane[i] != plane[0]) {
+			uniform = false;
+			break;
+		}
+	}
 
-	{
-		// First byte
-		u8 flags = 0;
-		if (is_underground)
-			flags |= 0x01;
-		if (m_day_night_differs)
-			flags |= 0x02;
-		if (m_lighting_expired)
-			flags |= 0x04;
-		if (m_generated == false)
-			flags |= 0x08;
-		os.write((char*)&flags, 1);
+	if (uniform) {
+		dst += (char)MAPBLOCK_PLANE_UNIFORM;
+		dst += (char)plane[0];
+		return;
+	}
 
-		if (version > 21)
-			os.write((char*)&m_biome,1);
+	dst += (char)MAPBLOCK_PLANE_RAW;
+	dst.append((const char*)plane, MAP_BLOCKSIZE3);
+}
+
+static u32 deserialize_plane(const std::string &src, u32 pos, u8 *plane)
+{
+	if (pos+2 > src.size())
+		throw SerializationError("MapBlock::deSerialize: param plane missing");
+
+	if (src[pos] == MAPBLOCK_PLANE_UNIFORM) {
+		memset(plane, (u8)src[pos+1], MAP_BLOCKSIZE3);
+		return pos+2;
+	}
+
+	if (pos+1+MAP_BLOCKSIZE3 > src.size())
+		throw SerializationError("MapBlock::deSerialize: param plane too short");
+	memcpy(plane, src.data()+pos+1, MAP_BLOCKSIZE3);
+	return pos+1+MAP_BLOCKSIZE3;
+}
+
+void MapBlock::serializeNodes(std::ostream &os, u8 version, SerializationCodec codec)
+{
+	const u32 nodecount = MAP_BLOCKSIZE3;
 
-		const u32 nodecount = MAP_BLOCKSIZE3;
+	if (version < 23) {
 		u32 sl = MapNode::serializedLength(version);
 
 		/*
@@ -417,7 +605,8 @@ void MapBlock::serialize(std::ostream &os, u8 version)
 		// Serialize nodes
 		SharedBuffer<u8> databuf_nodelist(nodecount*sl);
 		for (u32 i=0; i<nodecount; i++) {
-			data[i].serialize(&databuf_nodelist[i*sl], version);
+			MapNode n = getNodeIndex(i);
+			n.serialize(&databuf_nodelist[i*sl], version);
 		}
 
 		// Create buffer with different parameters sorted
@@ -430,7 +619,241 @@ void MapBlock::serialize(std::ostream &os, u8 version)
 			Compress data to output stream
 		*/
 
-		compress(databuf, os, version);
+		compress(databuf, os, version, codec);
+		return;
+	}
+
+	const MapNode first = mapnode_translate_from_internal(getNodeIndex(0), version);
+
+	bool uniform = true;
+	for (u32 i=1; m_content != NULL && i<nodecount; i++) {
+		if (
+			m_content[i] != m_content[0]
+			|| m_param1[i] != m_param1[0]
+			|| m_param2[i] != m_param2[0]
+		) {
+			uniform = false;
+			break;
+		}
+	}
+
+	if (uniform) {
+		writeU8(os, MAPBLOCK_NODES_UNIFORM);
+		writeU16(os, first.content);
+		writeU8(os, first.param1);
+		writeU8(os, first.param2);
+		return;
+	}
+
+	/*
+		Build the palette, contents above MAX_CONTENT aren't node types
+		and shouldn't turn up, they're looked up the slow way if they do
+	*/
+	u16 lookup[MAX_CONTENT+1];
+	memset(lookup, 0xFF, sizeof(lookup));
+	core::array<content_t> palette;
+	SharedBuffer<u16> indices(nodecount);
+	SharedBuffer<u8> param1(nodecount);
+	SharedBuffer<u8> param2(nodecount);
+
+	for (u32 i=0; i<nodecount; i++) {
+		const MapNode n = mapnode_translate_from_internal(getNodeIndex(i), version);
+		u32 index;
+		if (n.content <= MAX_CONTENT) {
+			index = lookup[n.content];
+			if (index == 0xFFFF) {
+				index = palette.size();
+				lookup[n.content] = index;
+				palette.push_back(n.content);
+			}
+		}else{
+			for (index=0; index<palette.size(); index++) {
+				if (palette[index] == n.content)
+					break;
+			}
+			if (index == palette.size())
+				palette.push_back(n.content);
+		}
+		indices[i] = index;
+		param1[i] = n.param1;
+		param2[i] = n.param2;
+	}
+
+	std::string buf;
+	buf.reserve(nodecount*3);
+
+	u8 tmp[2];
+	writeU16(tmp, palette.size());
+	buf.append((char*)tmp, 2);
+	for (u32 i=0; i<palette.size(); i++) {
+		writeU16(tmp, palette[i]);
+		buf.append((char*)tmp, 2);
+	}
+
+	const u8 bits = palette_index_bits(palette.size());
+	buf += (char)bits;
+	if (bits == 16) {
+		for (u32 i=0; i<nodecount; i++) {
+			writeU16(tmp, indices[i]);
+			buf.append((char*)tmp, 2);
+		}
+	}else if (bits > 0) {
+		const u32 per_byte = 8/bits;
+		for (u32 i=0; i<nodecount; i+=per_byte) {
+			u8 b = 0;
+			for (u32 k=0; k<per_byte; k++)
+				b |= indices[i+k]<<(k*bits);
+			buf += (char)b;
+		}
+	}
+
+	serialize_plane(buf, *param1);
+	serialize_plane(buf, *param2);
+
+	writeU8(os, MAPBLOCK_NODES_PALETTE);
+	std::string compressed;
+	compressBuffer((const u8*)buf.c_str(), buf.size(), compressed, codec);
+	os.write(compressed.c_str(), compressed.size());
+}
+
+void MapBlock::deSerializeNodes(std::istream &is, u8 version)
+{
+	const u32 nodecount = MAP_BLOCKSIZE3;
+
+	if (version < 23) {
+		u32 sl = MapNode::serializedLength(version);
+
+		expand();
+
+		// Uncompress data
+		std::ostringstream os(std::ios_base::binary);
+		decompress(is, os, version);
+		std::string s = os.str();
+		if (s.size() != nodecount*sl)
+			throw SerializationError("MapBlock::deSerialize: decompress resulted in size"
+						" other than nodecount*nodelength");
+
+		// deserialize nodes from buffer
+		for (u32 i=0; i<nodecount; i++)
+		{
+			SharedBuffer<u8> buf(sl);
+			for (u32 k=0; k<sl; k++)
+				buf[k] = s[i+(nodecount*k)];
+			MapNode n = getNodeIndex(i);
+			n.deSerialize(*buf, version);
+			setNodeIndex(i, n);
+		}
+		compact();
+		return;
+	}
+
+	const u8 layout = readU8(is);
+
+	if (layout == MAPBLOCK_NODES_UNIFORM) {
+		MapNode n;
+		n.content = readU16(is);
+		n.param1 = readU8(is);
+		n.param2 = readU8(is);
+		n = mapnode_translate_to_internal(n, version);
+		n.envticks = m_uniform ? m_uniform_node.envticks : 0;
+		setUniform(n);
+		return;
+	}
+	if (layout != MAPBLOCK_NODES_PALETTE)
+		throw SerializationError("MapBlock::deSerialize: unknown node layout");
+
+	expand();
+
+	std::string s;
+	decompressZlib(is, s);
+
+	if (s.size() < 2)
+		throw SerializationError("MapBlock::deSerialize: palette missing");
+	const u32 palette_size = readU16((u8*)s.data());
+	if (palette_size == 0 || palette_size > nodecount || 2+palette_size*2+1 > s.size())
+		throw SerializationError("MapBlock::deSerialize: bad palette");
+
+	// Only translate node by node if some palette entry needs it
+	bool translate = false;
+	core::array<content_t> palette;
+	palette.reallocate(palette_size);
+	for (u32 i=0; i<palette_size; i++) {
+		const content_t c = readU16((u8*)s.data()+2+i*2);
+		if (mapnode_translate_to_internal(MapNode(c), version).content != c)
+			translate = true;
+		palette.push_back(c);
+	}
+
+	u32 pos = 2+palette_size*2;
+	const u8 bits = s[pos++];
+	if (bits != palette_index_bits(palette_size))
+		throw SerializationError("MapBlock::deSerialize: bad palette index size");
+
+	if (bits == 0) {
+		for (u32 i=0; i<nodecount; i++)
+			m_content[i] = palette[0];
+	}else{
+		if (pos+nodecount*bits/8 > s.size())
+			throw SerializationError("MapBlock::deSerialize: node indices too short");
+		u8 *src = (u8*)s.data()+pos;
+		for (u32 i=0; i<nodecount; i++) {
+			u32 index;
+			if (bits == 16) {
+				index = readU16(src+i*2);
+			}else{
+				const u32 per_byte = 8/bits;
+				index = (src[i/per_byte]>>((i%per_byte)*bits))&((1<<bits)-1);
+			}
+			if (index >= palette_size)
+				throw SerializationError("MapBlock::deSerialize: bad palette index");
+			m_content[i] = palette[index];
+		}
+		pos += nodecount*bits/8;
+	}
+
+	updateNodestepCount();
+	m_node_version++;
+
+	pos = deserialize_plane(s, pos, m_param1);
+	pos = deserialize_plane(s, pos, m_param2);
+
+	if (translate) {
+		for (u32 i=0; i<nodecount; i++) {
+			const u32 envticks = m_envticks[i];
+			MapNode n = mapnode_translate_to_internal(getNodeIndex(i), version);
+			n.envticks = envticks;
+			setNodeIndex(i, n);
+		}
+	}
+}
+
+void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
+{
+	if (!ser_ver_supported(version))
+		throw VersionMismatchException("ERROR: MapBlock format not supported");
+
+	if (isDummy())
+		throw SerializationError("ERROR: Not writing dummy block.");
+
+	{
+		// First byte
+		u8 flags = 0;
+		if (is_underground)
+			flags |= 0x01;
+		if (m_day_night_differs)
+			flags |= 0x02;
+		if (m_lighting_expired)
+			flags |= 0x04;
+		if (m_generated == false)
+			flags |= 0x08;
+		os.write((char*)&flags, 1);
+
+		if (version > 21)
+			os.write((char*)&m_biome,1);
+
+		const SerializationCodec codec = serializationCodec(version, disk);
+
+		serializeNodes(os, version, codec);
 
 		/*
 			NodeMetadata
@@ -438,7 +861,7 @@ void MapBlock::serialize(std::ostream &os, u8 version)
 		{
 			std::ostringstream oss(std::ios_base::binary);
 			m_node_metadata.serialize(oss);
-			compressZlib(oss.str(), os);
+			compressZlib(oss.str(), os, codec);
 		}
 	}
 }
@@ -448,8 +871,9 @@ void MapBlock::deSerialize(std::istream &is, u8 version)
 	if (!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 
+	invalidatePacketCache();
+
 	{
-		const u32 nodecount = MAP_BLOCKSIZE3;
 		u8 flags;
 		
 		is.read((char*)&flags, 1);
@@ -457,27 +881,11 @@ void MapBlock::deSerialize(std::istream &is, u8 version)
 		m_day_night_differs = (flags & 0x02) ? true : false;
 		m_lighting_expired = (flags & 0x04) ? true : false;
 		m_generated = (flags & 0x08) ? false : true;
-		u32 sl = MapNode::serializedLength(version);
 
 		if (version > 21)
 			is.read((char*)&m_biome,1);
 
-		// Uncompress data
-		std::ostringstream os(std::ios_base::binary);
-		decompress(is, os, version);
-		std::string s = os.str();
-		if (s.size() != nodecount*sl)
-			throw SerializationError("MapBlock::deSerialize: decompress resulted in size"
-						" other than nodecount*nodelength");
-
-		// deserialize nodes from buffer
-		for (u32 i=0; i<nodecount; i++)
-		{
-			SharedBuffer<u8> buf(sl);
-			for (u32 k=0; k<sl; k++)
-				buf[k] = s[i+(nodecount*k)];
-			data[i].deSerialize(*buf, version);
-		}
+		deSerializeNodes(is, version);
 
 		/*
 			NodeMetadata
@@ -485,9 +893,10 @@ void MapBlock::deSerialize(std::istream &is, u8 version)
 		// Ignore errors
 		try
 		{
-			std::ostringstream oss(std::ios_base::binary);
-			decompressZlib(is, oss);
-			std::istringstream iss(oss.str(), std::ios_base::binary);
+			std::string s;
+			decompressZlib(is, s);
+			MemoryStreamBuffer buf(s.c_str(), s.size());
+			std::istream iss(&buf);
 			m_node_metadata.deSerialize(iss);
 		}
 		catch(SerializationError &e)
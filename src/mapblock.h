@@ -30,11 +30,14 @@
 #include <jmutex.h>
 #include <jmutexautolock.h>
 #include <exception>
+#include <map>
+#include <stdint.h>
 #include "debug.h"
 #include "common_irrlicht.h"
 #include "mapnode.h"
 #include "exceptions.h"
 #include "serialization.h"
+#include "packetbuffer.h"
 #include "constants.h"
 #include "voxel.h"
 #include "nodemetadata.h"
@@ -141,15 +144,9 @@ class MapBlock /*: public NodeContainer*/
 
 	void reallocate()
 	{
-		if(data != NULL)
-			delete[] data;
-				
-		data = new MapNode[MAP_BLOCKSIZE3];
-		
-		for(u32 i=0; i<MAP_BLOCKSIZE3; i++)
-			//data[i] = MapNode();
-			data[i] = MapNode(CONTENT_IGNORE);
-		
+		// The node planes are only allocated when something is written
+		setUniform(MapNode(CONTENT_IGNORE));
+
 		raiseModified(MOD_STATE_WRITE_NEEDED);
 	}
 
@@ -159,7 +156,7 @@ class MapBlock /*: public NodeContainer*/
 
 	bool isDummy()
 	{
-		return data == NULL;
+		return m_content == NULL && !m_uniform;
 	}
 	void unDummify()
 	{
@@ -167,6 +164,17 @@ class MapBlock /*: public NodeContainer*/
 		reallocate();
 	}
 
+	/*
+		A block made of a single node doesn't have node planes, they're
+		allocated the first time a different node is written.
+	*/
+	bool isUniform()
+	{
+		return m_uniform;
+	}
+	// Frees the node planes if all nodes are the same, returns isUniform()
+	bool compact();
+
 	/*
 		This is called internally or externally after the block is
 		modified, so that the block is saved and possibly not deleted from
@@ -198,6 +206,20 @@ class MapBlock /*: public NodeContainer*/
 	void raiseModified(u32 mod)
 	{
 		m_modified = MYMAX(m_modified, mod);
+		// Only the timestamp changes with less, which isn't sent
+		if (mod >= MOD_STATE_WRITE_NEEDED) {
+			invalidatePacketCache();
+			m_change_count++;
+		}
+	}
+	/*
+		Changes whenever anything that is saved changes, nodes, their
+		params or metadata, unlike getNodeVersion(). Like that it's
+		never the same for two blocks that have been at the same position.
+	*/
+	uint64_t getChangeCount()
+	{
+		return m_change_count;
 	}
 	u32 getModified()
 	{
@@ -259,7 +281,7 @@ class MapBlock /*: public NodeContainer*/
 	{
 		if(m_lighting_expired)
 			return false;
-		if(data == NULL)
+		if(isDummy())
 			return false;
 		return true;
 	}
@@ -286,6 +308,7 @@ class MapBlock /*: public NodeContainer*/
 	void setBiome(uint8_t biome)
 	{
 		m_biome = biome;
+		invalidatePacketCache();
 	}
 
 	core::aabbox3d<s16> getBox()
@@ -303,7 +326,7 @@ class MapBlock /*: public NodeContainer*/
 
 	bool isValidPosition(s16 x, s16 y, s16 z)
 	{
-		if (data == NULL)
+		if (isDummy())
 			return false;
 		return x >= 0 && x < MAP_BLOCKSIZE
 		    && y >= 0 && y < MAP_BLOCKSIZE
@@ -315,7 +338,7 @@ class MapBlock /*: public NodeContainer*/
 		*valid_position = isValidPosition(x, y, z);
 		if (!*valid_position)
 			return MapNode(CONTENT_IGNORE);
-		return data[z * MAP_BLOCKSIZE2 + y * MAP_BLOCKSIZE + x];
+		return getNodeIndex(z * MAP_BLOCKSIZE2 + y * MAP_BLOCKSIZE + x);
 	}
 
 	MapNode getNode(v3s16 p, bool *valid_position)
@@ -332,11 +355,56 @@ class MapBlock /*: public NodeContainer*/
 		return node;
 	}
 
+	/*
+		Only reads the content plane, for scans that don't need the
+		rest of the node. CONTENT_IGNORE if p is not in the block.
+	*/
+	content_t getNodeContent(v3s16 p)
+	{
+		if (!isValidPosition(p.X, p.Y, p.Z))
+			return CONTENT_IGNORE;
+		if (m_content == NULL)
+			return m_uniform_node.content;
+		return m_content[p.Z * MAP_BLOCKSIZE2 + p.Y * MAP_BLOCKSIZE + p.X];
+	}
+
+	/*
+		Changes whenever the content of a node changes, and is never the
+		same for two blocks that have been at the same position
+	*/
+	uint64_t getNodeVersion()
+	{
+		return m_node_version;
+	}
+
+	/*
+		Number of nodes with a nodestep handler, see content_nodestep()
+	*/
+	u32 getNodestepCount()
+	{
+		if (m_uniform) {
+			if (content_nodestep(m_uniform_node.content) & NODESTEP_HANDLER)
+				return MAP_BLOCKSIZE3;
+			return 0;
+		}
+		return m_nodestep_count;
+	}
+
+	/*
+		The content plane, indexed like the nodes.
+		NULL if the block is uniform or a dummy.
+	*/
+	const content_t *getContentPlane()
+	{
+		return m_content;
+	}
+
 	void setNode(s16 x, s16 y, s16 z, MapNode & n)
 	{
 		if (!isValidPosition(x,y,z))
 			throw InvalidPositionException();
-		data[z * MAP_BLOCKSIZE2 + y * MAP_BLOCKSIZE + x] = n;
+		if (prepareWrite(n))
+			setNodeIndex(z * MAP_BLOCKSIZE2 + y * MAP_BLOCKSIZE + x, n);
 		raiseModified(MOD_STATE_WRITE_NEEDED);
 	}
 
@@ -345,11 +413,17 @@ class MapBlock /*: public NodeContainer*/
 		setNode(p.X, p.Y, p.Z, n);
 	}
 
-	void incNodeTicks(v3s16 p)
+	// Advances envticks of every node in the block
+	void incNodeTicks(u32 count=1)
 	{
-		if (!isValidPosition(p.X,p.Y,p.Z))
+		if (m_uniform) {
+			m_uniform_node.envticks += count;
+			return;
+		}
+		if (m_content == NULL)
 			return;
-		data[p.Z * MAP_BLOCKSIZE2 + p.Y * MAP_BLOCKSIZE + p.X].envticks++;
+		for (u32 i=0; i<MAP_BLOCKSIZE3; i++)
+			m_envticks[i] += count;
 	}
 
 	/*
@@ -361,7 +435,7 @@ class MapBlock /*: public NodeContainer*/
 		*valid_position = isValidPosition(x, y, z);
 		if (!*valid_position)
 			return MapNode(CONTENT_IGNORE);
-		return data[z * MAP_BLOCKSIZE2 + y * MAP_BLOCKSIZE + x];
+		return getNodeIndex(z * MAP_BLOCKSIZE2 + y * MAP_BLOCKSIZE + x);
 	}
 
 	MapNode getNodeNoCheck(v3s16 p, bool *valid_position)
@@ -371,9 +445,10 @@ class MapBlock /*: public NodeContainer*/
 
 	void setNodeNoCheck(s16 x, s16 y, s16 z, MapNode & n)
 	{
-		if(data == NULL)
+		if(isDummy())
 			throw InvalidPositionException();
-		data[z * MAP_BLOCKSIZE2 + y * MAP_BLOCKSIZE + x] = n;
+		if (prepareWrite(n))
+			setNodeIndex(z * MAP_BLOCKSIZE2 + y * MAP_BLOCKSIZE + x, n);
 		raiseModified(MOD_STATE_WRITE_NEEDED);
 	}
 
@@ -506,11 +581,40 @@ class MapBlock /*: public NodeContainer*/
 	*/
 
 	// These don't write or read version by itself
-	void serialize(std::ostream &os, u8 version);
+	// disk chooses the codec for storing instead of sending
+	void serialize(std::ostream &os, u8 version, bool disk=false);
 	void deSerialize(std::istream &is, u8 version);
 	// Used after the basic ones when writing on disk (serverside)
 	void serializeDiskExtra(std::ostream &os, u8 version);
 	void deSerializeDiskExtra(std::istream &is, u8 version);
+
+	/*
+		The TOCLIENT_BLOCKDATA packet for each serialization version
+		the block has been sent with, so a block going to many clients
+		is serialized once. Anything that changes what serialize()
+		writes must drop it, raiseModified() does.
+	*/
+	bool getCachedPacket(u8 version, PacketBuffer &packet)
+	{
+		std::map<u8, PacketBuffer>::iterator i = m_packet_cache.find(version);
+		if (i == m_packet_cache.end())
+			return false;
+		packet = i->second;
+		return true;
+	}
+	void setCachedPacket(u8 version, PacketBuffer packet)
+	{
+		m_packet_cache[version] = packet;
+	}
+	void invalidatePacketCache()
+	{
+		m_packet_cache.clear();
+	}
+
+    private:
+	// The node data part of serialize() and deSerialize()
+	void serializeNodes(std::ostream &os, u8 version, SerializationCodec codec);
+	void deSerializeNodes(std::istream &is, u8 version);
 	
     public:
 
@@ -525,23 +629,56 @@ class MapBlock /*: public NodeContainer*/
 	*/
 
 	/*
-		Used only internally, because changes can't be tracked
+		Used only internally, because changes can't be tracked.
+		The block mustn't be a dummy, and setNodeIndex() needs the
+		node planes allocated.
 	*/
 
-	MapNode& getNodeRef(s16 x, s16 y, s16 z) const
+	MapNode getNodeIndex(u32 i) const
 	{
-		if(data == NULL)
-			throw InvalidPositionException();
-		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
-		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
-		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
-		return data[z * MAP_BLOCKSIZE2 + y * MAP_BLOCKSIZE + x];
+		if (m_content == NULL)
+			return m_uniform_node;
+		MapNode n(m_content[i], m_param1[i], m_param2[i]);
+		n.envticks = m_envticks[i];
+		return n;
 	}
-	MapNode& getNodeRef(v3s16 &p) const
+	void setNodeIndex(u32 i, const MapNode &n)
 	{
-		return getNodeRef(p.X, p.Y, p.Z);
+		if (m_content[i] != n.content) {
+			m_node_version++;
+			if (content_nodestep(m_content[i]) & NODESTEP_HANDLER)
+				m_nodestep_count--;
+			if (content_nodestep(n.content) & NODESTEP_HANDLER)
+				m_nodestep_count++;
+		}
+		m_content[i] = n.content;
+		m_param1[i] = n.param1;
+		m_param2[i] = n.param2;
+		m_envticks[i] = n.envticks;
 	}
 
+	/*
+		Called before n is written to a node. Returns false if the
+		block is uniform with n already, otherwise makes sure there are
+		node planes to write to.
+	*/
+	bool prepareWrite(const MapNode &n)
+	{
+		if (!m_uniform)
+			return true;
+		if (n == m_uniform_node && n.envticks == m_uniform_node.envticks)
+			return false;
+		expand();
+		return true;
+	}
+	// Allocates the node planes of a uniform block
+	void expand();
+	// Counts the nodes with a nodestep handler after bulk changes
+	void updateNodestepCount();
+	// Makes every node n, dropping the node planes where it's safe to
+	void setUniform(const MapNode &n);
+	bool canReleaseData();
+
     public:
 	/*
 		Public member variables
@@ -572,10 +709,28 @@ class MapBlock /*: public NodeContainer*/
 	uint8_t m_biome;
 
 	/*
-		If NULL, block is a dummy block.
+		The nodes, one plane per MapNode field so that scans over
+		contents don't read the rest. The planes are one allocation
+		starting at m_content.
+		If NULL, block is a dummy block or a uniform one.
 		Dummy blocks are used for caching not-found-on-disk blocks.
 	*/
-	MapNode* data;
+	content_t *m_content;
+	u32 *m_envticks;
+	u8 *m_param1;
+	u8 *m_param2;
+	// See getNodestepCount()
+	u16 m_nodestep_count;
+	// See getNodeVersion()
+	uint64_t m_node_version;
+
+	/*
+		If true, every node of the block is m_uniform_node and there
+		are no node planes. Most of the sky and deep underground is
+		stored this way.
+	*/
+	bool m_uniform;
+	MapNode m_uniform_node;
 
 	/*
 		- On the server, this is used for telling whether the
@@ -583,6 +738,8 @@ class MapBlock /*: public NodeContainer*/
 		- On the client, this is used for nothing.
 	*/
 	u32 m_modified;
+	// See getChangeCount()
+	uint64_t m_change_count;
 
 	/*
 		When propagating sunlight and the above block doesn't exist,
@@ -606,6 +763,9 @@ class MapBlock /*: public NodeContainer*/
 	// Whether day and night lighting differs
 	bool m_day_night_differs;
 
+	// See getCachedPacket()
+	std::map<u8, PacketBuffer> m_packet_cache;
+
 	bool m_generated;
 
 #ifndef SERVER // Only on client
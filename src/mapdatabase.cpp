@@ -0,0 +1,216 @@
+/************************************************************************
+* mapdatabase.cpp
+* voxelands - 3d voxel world sandbox game
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>
+************************************************************************/
+
+#include "mapdatabase.h"
+#include "utility.h"
+#include "log.h"
+
+const char *MapDatabase::backends[] = {
+	"sqlite3",
+	"log",
+	NULL
+};
+
+MapDatabase *MapDatabase::create(const std::string &name, const std::string &file)
+{
+	if (name == "sqlite3")
+		return new SQLiteMapDatabase(file);
+	if (name == "log")
+		return new LogMapDatabase(file);
+	return NULL;
+}
+
+const char *MapDatabase::getFileName(const std::string &name)
+{
+	if (name == "sqlite3")
+		return "map.sqlite";
+	if (name == "log")
+		return "map.vxlog";
+	return NULL;
+}
+
+int64_t MapDatabase::getBlockAsInteger(const v3s16 pos)
+{
+	return (int64_t)pos.Z*16777216 +
+		(int64_t)pos.Y*4096 + (int64_t)pos.X;
+}
+
+static s32 unsignedToSigned(s32 i, s32 max_positive)
+{
+	if (i < max_positive)
+		return i;
+	return i - 2*max_positive;
+}
+
+// modulo of a negative number does not work consistently in C
+static int64_t pythonmodulo(int64_t i, int64_t mod)
+{
+	if (i >= 0)
+		return i % mod;
+	return mod - ((-i) % mod);
+}
+
+v3s16 MapDatabase::getIntegerAsBlock(int64_t i)
+{
+	const s32 x = unsignedToSigned(pythonmodulo(i, 4096), 2048);
+	i = (i - x) / 4096;
+	const s32 y = unsignedToSigned(pythonmodulo(i, 4096), 2048);
+	i = (i - y) / 4096;
+	const s32 z = unsignedToSigned(pythonmodulo(i, 4096), 2048);
+	return v3s16(x,y,z);
+}
+
+/*
+	Converting
+*/
+
+class MapDatabaseCopier : public MapDatabaseReceiver
+{
+public:
+	MapDatabaseCopier(MapDatabase *to):
+		m_to(to)
+	{}
+
+	void receiveBlock(v3s16 pos, const char *data, size_t len)
+	{
+		m_to->saveBlock(pos, data, len);
+	}
+
+private:
+	MapDatabase *m_to;
+};
+
+u32 convertMapDatabase(MapDatabase *from, MapDatabase *to)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	core::list<v3s16> all;
+	from->listBlocks(all);
+
+	infostream<<"Converting "<<all.size()<<" blocks from "<<from->getName()
+			<<" to "<<to->getName()<<std::endl;
+
+	TimeTaker timer("convertMapDatabase()");
+
+	MapDatabaseCopier copier(to);
+	u32 count = 0;
+
+	core::list<v3s16>::Iterator i = all.begin();
+	while (i != all.end())
+	{
+		// Commit every now and then so nothing gets too big
+		core::list<v3s16> batch;
+		for (u32 j=0; j<1024 && i != all.end(); j++, i++)
+			batch.push_back(*i);
+
+		to->beginSave();
+		count += from->loadBlocks(batch, &copier);
+		to->endSave();
+	}
+
+	u32 ms = timer.stop(true);
+	infostream<<"Converted "<<count<<" blocks in "<<ms<<"ms"<<std::endl;
+
+	return count;
+}
+
+/*
+	Benchmarking
+*/
+
+class MapDatabaseBenchmark : public MapDatabaseReceiver
+{
+public:
+	MapDatabaseBenchmark():
+		count(0),
+		bytes(0)
+	{}
+
+	void receiveBlock(v3s16 pos, const char *data, size_t len)
+	{
+		count++;
+		bytes += len;
+		// Keep one copy of each for the write test
+		if (blocks.find(pos) == blocks.end())
+			blocks[pos] = std::string(data, len);
+	}
+
+	u32 count;
+	uint64_t bytes;
+	std::map<v3s16, std::string> blocks;
+};
+
+static void benchmark_result(std::ostream &out, const char *what, u32 count, u32 ms)
+{
+	out<<"  "<<what<<": "<<count<<" blocks in "<<ms<<"ms";
+	if (ms > 0)
+		out<<" ("<<((uint64_t)count*1000/ms)<<" blocks/s)";
+	out<<std::endl;
+}
+
+void benchmarkMapDatabase(MapDatabase *db, core::list<v3s16> &blocks,
+		std::ostream &out)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	out<<"MapDatabase benchmark: "<<db->getName()<<", "
+			<<blocks.size()<<" blocks"<<std::endl;
+
+	MapDatabaseBenchmark r;
+
+	// One block at a time, like ServerMap::loadBlock()
+	{
+		u32 t0 = porting::getTimeMs();
+		for (core::list<v3s16>::Iterator i = blocks.begin(); i != blocks.end(); i++)
+		{
+			core::list<v3s16> one;
+			one.push_back(*i);
+			db->loadBlocks(one, &r);
+		}
+		benchmark_result(out, "single reads", r.count, porting::getTimeMs()-t0);
+	}
+
+	// 27 at a time, like ServerMap::initBlockMake()
+	{
+		u32 count = r.count;
+		u32 t0 = porting::getTimeMs();
+		core::list<v3s16>::Iterator i = blocks.begin();
+		while (i != blocks.end())
+		{
+			core::list<v3s16> batch;
+			for (u32 j=0; j<27 && i != blocks.end(); j++, i++)
+				batch.push_back(*i);
+			db->loadBlocks(batch, &r);
+		}
+		benchmark_result(out, "batched reads", r.count-count, porting::getTimeMs()-t0);
+	}
+
+	// Everything rewritten in one go, like a ServerMap::save()
+	{
+		u32 t0 = porting::getTimeMs();
+		db->beginSave();
+		for (std::map<v3s16, std::string>::iterator i = r.blocks.begin();
+				i != r.blocks.end(); i++)
+			db->saveBlock(i->first, i->second.c_str(), i->second.size());
+		db->endSave();
+		benchmark_result(out, "writes", r.blocks.size(), porting::getTimeMs()-t0);
+	}
+
+	out<<"  average block size: "
+			<<(r.count ? r.bytes/r.count : 0)<<" bytes"<<std::endl;
+}
@@ -0,0 +1,195 @@
+/************************************************************************
+* mapdatabase.h
+* voxelands - 3d voxel world sandbox game
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>
+************************************************************************/
+
+#ifndef MAPDATABASE_HEADER
+#define MAPDATABASE_HEADER
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <map>
+
+#include "common_irrlicht.h"
+
+extern "C" {
+	#include "sqlite3.h"
+}
+
+// Number of blocks SQLiteMapDatabase reads with one query
+#define MAP_DATABASE_READ_BATCH 32
+
+/*
+	Gets the blocks read by MapDatabase::loadBlocks(), the data is only
+	valid until receiveBlock() returns
+*/
+class MapDatabaseReceiver
+{
+public:
+	virtual ~MapDatabaseReceiver()
+	{}
+
+	virtual void receiveBlock(v3s16 pos, const char *data, size_t len) = 0;
+};
+
+/*
+	Storage of serialized MapBlocks, keyed by block position.
+
+	This is not thread-safe, ServerMap locks around it.
+*/
+class MapDatabase
+{
+public:
+	virtual ~MapDatabase()
+	{}
+
+	// Name used for world.map.database
+	virtual const char *getName() = 0;
+	// Opens the store, creating it if needed
+	// Throws FileNotGoodException
+	virtual void open() = 0;
+
+	// Writes between these are committed together
+	virtual void beginSave() = 0;
+	virtual void endSave() = 0;
+
+	virtual void saveBlock(v3s16 pos, const char *data, size_t len) = 0;
+	// Gives the blocks that exist to r, returns how many there were
+	virtual u32 loadBlocks(core::list<v3s16> &blocks, MapDatabaseReceiver *r) = 0;
+	virtual void listBlocks(core::list<v3s16> &dst) = 0;
+
+	/*
+		Backends by name, these return NULL for unknown names
+	*/
+	// NULL terminated list of the names
+	static const char *backends[];
+	static MapDatabase *create(const std::string &name, const std::string &file);
+	// File name of the backend in the world directory
+	static const char *getFileName(const std::string &name);
+
+	// Get an integer suitable for a block
+	static int64_t getBlockAsInteger(const v3s16 pos);
+	static v3s16 getIntegerAsBlock(int64_t i);
+};
+
+/*
+	The original storage, one row per block in a sqlite table
+*/
+class SQLiteMapDatabase : public MapDatabase
+{
+public:
+	SQLiteMapDatabase(const std::string &file);
+	~SQLiteMapDatabase();
+
+	const char *getName()
+	{
+		return "sqlite3";
+	}
+	void open();
+
+	void beginSave();
+	void endSave();
+
+	void saveBlock(v3s16 pos, const char *data, size_t len);
+	u32 loadBlocks(core::list<v3s16> &blocks, MapDatabaseReceiver *r);
+	void listBlocks(core::list<v3s16> &dst);
+
+private:
+	void createDatabase();
+
+	std::string m_file;
+
+	sqlite3 *m_database;
+	sqlite3_stmt *m_database_read;
+	sqlite3_stmt *m_database_write;
+	sqlite3_stmt *m_database_list;
+	sqlite3_stmt *m_database_read_batch;
+};
+
+/*
+	Append-only log of blocks. Every save appends a record, an index
+	of the newest record of each block is built when the log is opened.
+	Reads come straight from a memory mapping of the file where there
+	is one. Superseded records are dropped by compact(), which open()
+	runs when they take up more than half the file.
+
+	File layout:
+	u8[8] "VXMAPLOG"
+	records:
+		u32 MAPLOG_RECORD_MAGIC
+		v3s16 position
+		u32 length
+		u32 adler32 of data
+		u8[length] data
+*/
+class LogMapDatabase : public MapDatabase
+{
+public:
+	LogMapDatabase(const std::string &file);
+	~LogMapDatabase();
+
+	const char *getName()
+	{
+		return "log";
+	}
+	void open();
+
+	void beginSave();
+	void endSave();
+
+	void saveBlock(v3s16 pos, const char *data, size_t len);
+	u32 loadBlocks(core::list<v3s16> &blocks, MapDatabaseReceiver *r);
+	void listBlocks(core::list<v3s16> &dst);
+
+	// Rewrites the log with only the newest record of each block
+	void compact();
+
+private:
+	struct Record
+	{
+		uint64_t offset; // of the data
+		u32 length;
+	};
+
+	void close();
+	void scan();
+	void flush();
+	// Gets a pointer to len bytes at offset, valid until the next call
+	const char *read(uint64_t offset, u32 len);
+
+	std::string m_file;
+	FILE *m_fd;
+	// End of the last good record, new ones are written here
+	uint64_t m_end;
+	// Bytes taken by records that have been written again since
+	uint64_t m_dead;
+	bool m_in_save;
+	bool m_unflushed;
+	std::map<v3s16, Record> m_index;
+
+	char *m_map;
+	uint64_t m_map_size;
+	std::string m_buffer;
+};
+
+// Copies every block from one database to another, returns the count
+u32 convertMapDatabase(MapDatabase *from, MapDatabase *to);
+// Times reading and rewriting the given blocks
+void benchmarkMapDatabase(MapDatabase *db, core::list<v3s16> &blocks,
+		std::ostream &out);
+
+#endif
@@ -0,0 +1,382 @@
+/************************************************************************
+* mapdatabase_log.cpp
+* voxelands - 3d voxel world sandbox game
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>
+************************************************************************/
+
+#include "mapdatabase.h"
+#include "debug.h"
+#include "exceptions.h"
+#include "utility.h"
+#include "log.h"
+
+#include <string.h>
+#include <zlib.h>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define MAPLOG_HEADER "VXMAPLOG"
+#define MAPLOG_HEADER_SIZE 8
+#define MAPLOG_RECORD_MAGIC 0x56584252
+#define MAPLOG_RECORD_HEADER_SIZE 18
+
+// The mapping is made this much larger than the file so it needn't be
+// redone every time the log grows
+#define MAPLOG_MAP_HEADROOM (64*1024*1024)
+
+// Don't bother compacting logs with less garbage than this
+#define MAPLOG_COMPACT_MIN (16*1024*1024)
+
+static bool log_seek(FILE *f, uint64_t offset, int whence=SEEK_SET)
+{
+#ifdef _WIN32
+	return _fseeki64(f, offset, whence) == 0;
+#else
+	return fseeko(f, offset, whence) == 0;
+#endif
+}
+
+static uint64_t log_size(FILE *f)
+{
+	if (!log_seek(f, 0, SEEK_END))
+		return 0;
+#ifdef _WIN32
+	return _ftelli64(f);
+#else
+	return ftello(f);
+#endif
+}
+
+static u32 log_checksum(const char *data, u32 len)
+{
+	return adler32(adler32(0, NULL, 0), (const Bytef*)data, len);
+}
+
+static bool log_write_record(FILE *f, v3s16 pos, const char *data, u32 len)
+{
+	u8 header[MAPLOG_RECORD_HEADER_SIZE];
+	writeU32(&header[0], MAPLOG_RECORD_MAGIC);
+	writeV3S16(&header[4], pos);
+	writeU32(&header[10], len);
+	writeU32(&header[14], log_checksum(data, len));
+
+	if (fwrite(header, 1, MAPLOG_RECORD_HEADER_SIZE, f) != MAPLOG_RECORD_HEADER_SIZE)
+		return false;
+	if (len && fwrite(data, 1, len, f) != len)
+		return false;
+	return true;
+}
+
+LogMapDatabase::LogMapDatabase(const std::string &file):
+	m_file(file),
+	m_fd(NULL),
+	m_end(0),
+	m_dead(0),
+	m_in_save(false),
+	m_unflushed(false),
+	m_map(NULL),
+	m_map_size(0)
+{
+}
+
+LogMapDatabase::~LogMapDatabase()
+{
+	close();
+}
+
+void LogMapDatabase::open()
+{
+	if (m_fd)
+		return;
+
+	m_fd = fopen(m_file.c_str(), "r+b");
+	if (!m_fd)
+	{
+		m_fd = fopen(m_file.c_str(), "w+b");
+		if (!m_fd)
+			throw FileNotGoodException("map log: Cannot open file");
+		if (fwrite(MAPLOG_HEADER, 1, MAPLOG_HEADER_SIZE, m_fd) != MAPLOG_HEADER_SIZE)
+			throw FileNotGoodException("map log: Cannot write file");
+		fflush(m_fd);
+		infostream<<"Server: Map log was created"<<std::endl;
+	}
+
+	scan();
+
+	if (m_dead > MAPLOG_COMPACT_MIN && m_dead > m_end/2)
+		compact();
+
+	infostream<<"Server: Map log opened, "<<m_index.size()<<" blocks"<<std::endl;
+}
+
+void LogMapDatabase::close()
+{
+	if (!m_fd)
+		return;
+
+	flush();
+
+#ifndef _WIN32
+	if (m_map)
+		munmap(m_map, m_map_size);
+#endif
+	m_map = NULL;
+	m_map_size = 0;
+
+	fclose(m_fd);
+	m_fd = NULL;
+}
+
+/*
+	Builds the index. Reading stops at the first record that is cut off
+	or doesn't match its checksum, new records are written over it.
+*/
+void LogMapDatabase::scan()
+{
+	m_index.clear();
+	m_dead = 0;
+
+	const uint64_t size = log_size(m_fd);
+
+	const char *header = NULL;
+	if (size >= MAPLOG_HEADER_SIZE)
+		header = read(0, MAPLOG_HEADER_SIZE);
+	if (!header || memcmp(header, MAPLOG_HEADER, MAPLOG_HEADER_SIZE))
+		throw FileNotGoodException("map log: Not a map log file");
+
+	uint64_t offset = MAPLOG_HEADER_SIZE;
+	while (offset + MAPLOG_RECORD_HEADER_SIZE <= size)
+	{
+		const char *p = read(offset, MAPLOG_RECORD_HEADER_SIZE);
+		if (!p || readU32((u8*)&p[0]) != MAPLOG_RECORD_MAGIC)
+			break;
+
+		const v3s16 pos = readV3S16((u8*)&p[4]);
+		const u32 len = readU32((u8*)&p[10]);
+		const u32 checksum = readU32((u8*)&p[14]);
+
+		if (offset + MAPLOG_RECORD_HEADER_SIZE + len > size)
+			break;
+
+		const char *data = read(offset + MAPLOG_RECORD_HEADER_SIZE, len);
+		if (!data || log_checksum(data, len) != checksum)
+			break;
+
+		std::map<v3s16, Record>::iterator i = m_index.find(pos);
+		if (i != m_index.end())
+			m_dead += MAPLOG_RECORD_HEADER_SIZE + i->second.length;
+
+		Record &r = m_index[pos];
+		r.offset = offset + MAPLOG_RECORD_HEADER_SIZE;
+		r.length = len;
+
+		offset += MAPLOG_RECORD_HEADER_SIZE + len;
+	}
+
+	if (offset < size)
+		infostream<<"WARNING: Map log: ignoring "<<(size - offset)
+			<<" bytes of incomplete data at the end"<<std::endl;
+
+	m_end = offset;
+}
+
+void LogMapDatabase::flush()
+{
+	if (!m_unflushed)
+		return;
+
+	fflush(m_fd);
+#ifndef _WIN32
+	fsync(fileno(m_fd));
+#endif
+	m_unflushed = false;
+}
+
+const char *LogMapDatabase::read(uint64_t offset, u32 len)
+{
+	// Records may still be in the stdio buffer
+	if (m_unflushed)
+		fflush(m_fd);
+
+#ifndef _WIN32
+	if (offset + len > m_map_size)
+	{
+		if (m_map)
+			munmap(m_map, m_map_size);
+		m_map = NULL;
+		m_map_size = 0;
+
+		// Only what is within the file is ever read from the mapping
+		const uint64_t size = log_size(m_fd) + MAPLOG_MAP_HEADROOM;
+		void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(m_fd), 0);
+		if (p != MAP_FAILED)
+		{
+			m_map = (char*)p;
+			m_map_size = size;
+		}
+	}
+	if (m_map && offset + len <= m_map_size)
+		return m_map + offset;
+#endif
+
+	// No mapping, read it the slow way
+	m_buffer.resize(len);
+	if (!log_seek(m_fd, offset))
+		return NULL;
+	if (len && fread(&m_buffer[0], 1, len, m_fd) != len)
+		return NULL;
+	return m_buffer.c_str();
+}
+
+void LogMapDatabase::beginSave()
+{
+	m_in_save = true;
+}
+
+void LogMapDatabase::endSave()
+{
+	m_in_save = false;
+	flush();
+}
+
+void LogMapDatabase::saveBlock(v3s16 pos, const char *data, size_t len)
+{
+	if (!log_seek(m_fd, m_end) || !log_write_record(m_fd, pos, data, len))
+	{
+		// The partial record is written over by the next one
+		infostream<<"WARNING: Block failed to save ("<<pos.X
+			<<", "<<pos.Y<<", "<<pos.Z<<") to map log"<<std::endl;
+		return;
+	}
+
+	std::map<v3s16, Record>::iterator i = m_index.find(pos);
+	if (i != m_index.end())
+		m_dead += MAPLOG_RECORD_HEADER_SIZE + i->second.length;
+
+	Record &r = m_index[pos];
+	r.offset = m_end + MAPLOG_RECORD_HEADER_SIZE;
+	r.length = len;
+
+	m_end += MAPLOG_RECORD_HEADER_SIZE + len;
+	m_unflushed = true;
+
+	if (!m_in_save)
+		flush();
+}
+
+u32 LogMapDatabase::loadBlocks(core::list<v3s16> &blocks, MapDatabaseReceiver *r)
+{
+	u32 loaded = 0;
+
+	for (core::list<v3s16>::Iterator i = blocks.begin(); i != blocks.end(); i++)
+	{
+		std::map<v3s16, Record>::iterator n = m_index.find(*i);
+		if (n == m_index.end())
+			continue;
+
+		const char *data = read(n->second.offset, n->second.length);
+		if (!data)
+		{
+			infostream<<"WARNING: Could not read block from map log"<<std::endl;
+			continue;
+		}
+
+		r->receiveBlock(*i, data, n->second.length);
+		loaded++;
+	}
+
+	return loaded;
+}
+
+void LogMapDatabase::listBlocks(core::list<v3s16> &dst)
+{
+	for (std::map<v3s16, Record>::iterator i = m_index.begin();
+			i != m_index.end(); i++)
+		dst.push_back(i->first);
+}
+
+void LogMapDatabase::compact()
+{
+	DSTACK(__FUNCTION_NAME);
+
+	flush();
+
+	infostream<<"Server: Compacting map log, "<<(m_dead/1024)
+		<<"KiB of "<<(m_end/1024)<<"KiB is old data"<<std::endl;
+
+	const std::string tmp = m_file + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "wb");
+	if (!f)
+	{
+		infostream<<"WARNING: Map log: cannot create "<<tmp<<std::endl;
+		return;
+	}
+
+	std::map<v3s16, Record> index;
+	uint64_t end = MAPLOG_HEADER_SIZE;
+	bool ok = fwrite(MAPLOG_HEADER, 1, MAPLOG_HEADER_SIZE, f) == MAPLOG_HEADER_SIZE;
+
+	for (std::map<v3s16, Record>::iterator i = m_index.begin();
+			ok && i != m_index.end(); i++)
+	{
+		const char *data = read(i->second.offset, i->second.length);
+		if (!data || !log_write_record(f, i->first, data, i->second.length))
+		{
+			ok = false;
+			break;
+		}
+		Record &r = index[i->first];
+		r.offset = end + MAPLOG_RECORD_HEADER_SIZE;
+		r.length = i->second.length;
+		end += MAPLOG_RECORD_HEADER_SIZE + i->second.length;
+	}
+
+	if (fflush(f) != 0)
+		ok = false;
+#ifndef _WIN32
+	if (ok && fsync(fileno(f)) != 0)
+		ok = false;
+#endif
+	fclose(f);
+
+	if (!ok)
+	{
+		infostream<<"WARNING: Map log: compacting failed, keeping the old log"<<std::endl;
+		remove(tmp.c_str());
+		return;
+	}
+
+	close();
+
+#ifdef _WIN32
+	// rename() doesn't replace files here
+	remove(m_file.c_str());
+#endif
+	if (rename(tmp.c_str(), m_file.c_str()) != 0)
+		throw FileNotGoodException("map log: Cannot replace log with compacted one");
+
+	m_fd = fopen(m_file.c_str(), "r+b");
+	if (!m_fd)
+		throw FileNotGoodException("map log: Cannot open file");
+
+	m_index = index;
+	m_end = end;
+	m_dead = 0;
+}
@@ -0,0 +1,228 @@
+/************************************************************************
+* mapdatabase_sqlite.cpp
+* voxelands - 3d voxel world sandbox game
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>
+************************************************************************/
+
+#include "mapdatabase.h"
+#include "debug.h"
+#include "exceptions.h"
+#include "log.h"
+#include "path.h"
+
+/*
+	Structure of map.sqlite:
+	Tables:
+		blocks
+			(PK) INT pos
+			BLOB data
+*/
+
+SQLiteMapDatabase::SQLiteMapDatabase(const std::string &file):
+	m_file(file),
+	m_database(NULL),
+	m_database_read(NULL),
+	m_database_write(NULL),
+	m_database_list(NULL),
+	m_database_read_batch(NULL)
+{
+}
+
+SQLiteMapDatabase::~SQLiteMapDatabase()
+{
+	if (m_database_read)
+		sqlite3_finalize(m_database_read);
+	if (m_database_write)
+		sqlite3_finalize(m_database_write);
+	if (m_database_list)
+		sqlite3_finalize(m_database_list);
+	if (m_database_read_batch)
+		sqlite3_finalize(m_database_read_batch);
+	if (m_database)
+		sqlite3_close(m_database);
+}
+
+void SQLiteMapDatabase::createDatabase()
+{
+	assert(m_database);
+	const int e = sqlite3_exec(m_database,
+			"CREATE TABLE IF NOT EXISTS `blocks` ("
+			"`pos` INT NOT NULL PRIMARY KEY,"
+			"`data` BLOB"
+			");"
+			, NULL, NULL, NULL);
+	if(e == SQLITE_ABORT)
+		throw FileNotGoodException("Could not create database structure");
+	else
+		infostream<<"Server: Database structure was created";
+}
+
+void SQLiteMapDatabase::open()
+{
+	if (m_database)
+		return;
+
+	const bool needs_create = !path_exists((char*)m_file.c_str());
+	int d;
+
+	d = sqlite3_open_v2(m_file.c_str(), &m_database, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+	if(d != SQLITE_OK)
+	{
+		infostream<<"WARNING: Database failed to open: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("map.sqlite: Cannot open database file");
+	}
+
+	if(needs_create)
+		createDatabase();
+
+	d = sqlite3_prepare(m_database, "SELECT `data` FROM `blocks` WHERE `pos`=? LIMIT 1", -1, &m_database_read, NULL);
+	if(d != SQLITE_OK)
+	{
+		infostream<<"WARNING: Database read statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("map.sqlite: Cannot prepare read statement");
+	}
+
+	d = sqlite3_prepare(m_database, "REPLACE INTO `blocks` VALUES(?, ?)", -1, &m_database_write, NULL);
+	if(d != SQLITE_OK)
+	{
+		infostream<<"WARNING: Database write statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("map.sqlite: Cannot prepare write statement");
+	}
+
+	d = sqlite3_prepare(m_database, "SELECT `pos` FROM `blocks`", -1, &m_database_list, NULL);
+	if(d != SQLITE_OK)
+	{
+		infostream<<"WARNING: Database list statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("map.sqlite: Cannot prepare read statement");
+	}
+
+	{
+		std::string sql = "SELECT `pos`, `data` FROM `blocks` WHERE `pos` IN (?";
+		for (int i=1; i<MAP_DATABASE_READ_BATCH; i++)
+			sql += ",?";
+		sql += ")";
+		d = sqlite3_prepare(m_database, sql.c_str(), -1, &m_database_read_batch, NULL);
+	}
+	if(d != SQLITE_OK)
+	{
+		infostream<<"WARNING: Database batch read statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("map.sqlite: Cannot prepare read statement");
+	}
+
+	infostream<<"Server: Database opened"<<std::endl;
+}
+
+void SQLiteMapDatabase::beginSave()
+{
+	if(sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
+		infostream<<"WARNING: beginSave() failed, saving might be slow.";
+}
+
+void SQLiteMapDatabase::endSave()
+{
+	if(sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+		infostream<<"WARNING: endSave() failed, map might not have saved.";
+}
+
+void SQLiteMapDatabase::saveBlock(v3s16 pos, const char *data, size_t len)
+{
+	if(sqlite3_bind_int64(m_database_write, 1,
+			getBlockAsInteger(pos)) != SQLITE_OK)
+		infostream<<"WARNING: Block position failed to bind: "
+			<<sqlite3_errmsg(m_database)<<std::endl;
+	if(sqlite3_bind_blob(m_database_write, 2, (const void*)data,
+			len, NULL) != SQLITE_OK)
+		infostream<<"WARNING: Block data failed to bind: "
+			<<sqlite3_errmsg(m_database)<<std::endl;
+	int written = sqlite3_step(m_database_write);
+	if(written != SQLITE_DONE)
+		infostream<<"WARNING: Block failed to save ("<<pos.X
+			<<", "<<pos.Y<<", "<<pos.Z<<") "
+			<<sqlite3_errmsg(m_database)<<std::endl;
+	// Make ready for later reuse
+	sqlite3_reset(m_database_write);
+}
+
+u32 SQLiteMapDatabase::loadBlocks(core::list<v3s16> &blocks, MapDatabaseReceiver *r)
+{
+	u32 loaded = 0;
+
+	/*
+		A single block doesn't need the batch statement
+	*/
+	if (blocks.size() == 1)
+	{
+		const v3s16 pos = *blocks.begin();
+
+		if (sqlite3_bind_int64(m_database_read, 1,
+				getBlockAsInteger(pos)) != SQLITE_OK)
+			infostream<<"WARNING: Could not bind block position for load: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+
+		if (sqlite3_step(m_database_read) == SQLITE_ROW)
+		{
+			const char* data =
+				(const char*) sqlite3_column_blob(m_database_read, 0);
+			size_t len = sqlite3_column_bytes(m_database_read, 0);
+
+			r->receiveBlock(pos, data, len);
+			loaded++;
+		}
+		// We should never get more than 1 row, so ok to reset
+		sqlite3_reset(m_database_read);
+
+		return loaded;
+	}
+
+	core::list<v3s16>::Iterator i = blocks.begin();
+	while (i != blocks.end())
+	{
+		const sqlite3_int64 first = getBlockAsInteger(*i);
+		int n = 0;
+
+		for (; n < MAP_DATABASE_READ_BATCH && i != blocks.end(); n++, i++)
+			sqlite3_bind_int64(m_database_read_batch, n+1,
+					getBlockAsInteger(*i));
+		// Fill the rest of the statement with a position already asked for
+		for (; n < MAP_DATABASE_READ_BATCH; n++)
+			sqlite3_bind_int64(m_database_read_batch, n+1, first);
+
+		while (sqlite3_step(m_database_read_batch) == SQLITE_ROW)
+		{
+			const v3s16 pos = getIntegerAsBlock(
+					sqlite3_column_int64(m_database_read_batch, 0));
+			const char* data =
+				(const char*) sqlite3_column_blob(m_database_read_batch, 1);
+			size_t len = sqlite3_column_bytes(m_database_read_batch, 1);
+
+			r->receiveBlock(pos, data, len);
+			loaded++;
+		}
+		sqlite3_reset(m_database_read_batch);
+	}
+
+	return loaded;
+}
+
+void SQLiteMapDatabase::listBlocks(core::list<v3s16> &dst)
+{
+	while (sqlite3_step(m_database_list) == SQLITE_ROW)
+	{
+		sqlite3_int64 block_i = sqlite3_column_int64(m_database_list, 0);
+		v3s16 p = getIntegerAsBlock(block_i);
+		dst.push_back(p);
+	}
+	sqlite3_reset(m_database_list);
+}
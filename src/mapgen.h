@@ -29,6 +29,7 @@
 #include "common_irrlicht.h"
 #include "utility.h" // UniqueQueue
 #include "mapnode.h"
+#include <map>
 
 class MapBlock;
 class ManualMapVoxelManipulator;
@@ -73,6 +74,9 @@ namespace mapgen
 		uint8_t surrounding_biomes[8];
 		v3s16 blockpos;
 		UniqueQueue<v3s16> transforming_liquid;
+		// MapBlock::getChangeCount() of each block when the area was
+		// copied, blocks that changed after are not written back
+		std::map<v3s16, uint64_t> change_counts;
 
 		BlockMakeData();
 		~BlockMakeData();
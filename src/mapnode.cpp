@@ -222,6 +222,7 @@ void ContentFeatures::setInventoryTextureNodeBox(content_t c, std::string top,
 #endif
 
 struct ContentFeatures g_content_features[MAX_CONTENT+1];
+u8 g_content_nodestep[MAX_CONTENT+1];
 
 ContentFeatures& content_features(content_t i)
 {
@@ -349,6 +350,8 @@ void init_mapnode()
 	content_mapnode_slab(repeat);
 	content_mapnode_sign(repeat);
 	content_mapnode_special(repeat);
+
+	content_nodestep_init();
 }
 
 v3s16 facedir_rotate(u8 facedir, v3s16 dir)
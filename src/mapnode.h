@@ -820,6 +820,26 @@ struct ContentFeatures
 ContentFeatures& content_features(content_t i);
 ContentFeatures& content_features(const MapNode& n);
 
+/*
+	What the nodestep in ServerEnvironment::step() does with each
+	content. MapBlocks count their nodes that have a handler, so that
+	blocks without any can be skipped.
+*/
+#define NODESTEP_HANDLER	0x01
+// Mobs can spawn on it
+#define NODESTEP_SPAWN		0x02
+// Can get snow on top in cold zones
+#define NODESTEP_SNOW		0x04
+extern u8 g_content_nodestep[MAX_CONTENT+1];
+inline u8 content_nodestep(content_t c)
+{
+	if (c > MAX_CONTENT)
+		return 0;
+	return g_content_nodestep[c];
+}
+// Fills in the table, next to the nodestep in environment.cpp
+void content_nodestep_init();
+
 struct SelectedNode
 {
 	v3s16 pos;
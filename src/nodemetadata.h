@@ -77,6 +77,9 @@ public:
 	// A step in time. Returns true if metadata changed.
 	virtual bool step(float dtime, v3s16 pos, ServerEnvironment *env) {return false;}
 	virtual bool stepCircuit(float dtime, v3s16 pos, ServerEnvironment *env) {return false;}
+	// Catches up on a long time spent unloaded in one go. Types that
+	// can do better than stepping the whole time should override this.
+	virtual bool fastForward(float dtime, v3s16 pos, ServerEnvironment *env) {return step(dtime,pos,env);}
 	virtual bool nodeRemovalDisabled(){return false;}
 	// Used to make custom inventory menus.
 	// See format in guiInventoryMenu.cpp.
@@ -136,6 +139,8 @@ public:
 	// A step in time. Returns true if something changed.
 	bool step(float dtime, v3s16 blockpos_nodes, ServerEnvironment *env);
 	bool stepCircuit(float dtime, v3s16 blockpos_nodes, ServerEnvironment *env);
+	// Like step, for when the block has been unloaded for dtime
+	bool fastForward(float dtime, v3s16 blockpos_nodes, ServerEnvironment *env);
 
 private:
 	core::map<v3s16, NodeMetadata*> m_data;
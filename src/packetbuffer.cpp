@@ -0,0 +1,229 @@
+/************************************************************************
+* packetbuffer.cpp
+* voxelands - 3d voxel world sandbox game
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>
+************************************************************************/
+
+#include "packetbuffer.h"
+#include "debug.h"
+#include "xsync.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <jmutex.h>
+#include <jmutexautolock.h>
+
+struct PacketBufferPool
+{
+	JMutex mutex;
+	PacketBufferBlock *free[PACKET_POOL_CLASSES];
+	u32 free_count[PACKET_POOL_CLASSES];
+	u32 reused;
+	u32 allocated;
+
+	PacketBufferPool():
+		reused(0),
+		allocated(0)
+	{
+		mutex.Init();
+		for (int i=0; i<PACKET_POOL_CLASSES; i++) {
+			free[i] = NULL;
+			free_count[i] = 0;
+		}
+	}
+	~PacketBufferPool()
+	{
+		for (int i=0; i<PACKET_POOL_CLASSES; i++) {
+			while (free[i] != NULL) {
+				PacketBufferBlock *b = free[i];
+				free[i] = b->next;
+				::free(b);
+			}
+		}
+	}
+};
+
+static PacketBufferPool g_packet_pool;
+
+static PacketBufferBlock *packet_block_get(u32 capacity)
+{
+	u32 pool_class = 0;
+	while (pool_class < PACKET_POOL_CLASSES && (1u<<(pool_class+PACKET_POOL_MIN_SHIFT)) < capacity) {
+		pool_class++;
+	}
+
+	PacketBufferBlock *b = NULL;
+	if (pool_class < PACKET_POOL_CLASSES) {
+		capacity = 1u<<(pool_class+PACKET_POOL_MIN_SHIFT);
+		JMutexAutoLock lock(g_packet_pool.mutex);
+		b = g_packet_pool.free[pool_class];
+		if (b != NULL) {
+			g_packet_pool.free[pool_class] = b->next;
+			g_packet_pool.free_count[pool_class]--;
+			g_packet_pool.reused++;
+		}else{
+			g_packet_pool.allocated++;
+		}
+	}
+
+	if (b == NULL) {
+		b = (PacketBufferBlock*)malloc(sizeof(PacketBufferBlock)+capacity);
+		assert(b != NULL);
+		b->capacity = capacity;
+		b->pool_class = pool_class;
+	}
+	b->refcount = 1;
+	b->next = NULL;
+	return b;
+}
+
+static void packet_block_put(PacketBufferBlock *b)
+{
+	if (b->pool_class < PACKET_POOL_CLASSES) {
+		JMutexAutoLock lock(g_packet_pool.mutex);
+		if (g_packet_pool.free_count[b->pool_class] < PACKET_POOL_KEEP) {
+			b->next = g_packet_pool.free[b->pool_class];
+			g_packet_pool.free[b->pool_class] = b;
+			g_packet_pool.free_count[b->pool_class]++;
+			return;
+		}
+	}
+	free(b);
+}
+
+PacketBuffer::PacketBuffer(u32 size):
+	m_block(packet_block_get(PACKET_HEADROOM+size)),
+	m_start(PACKET_HEADROOM),
+	m_size(size)
+{
+}
+
+PacketBuffer::PacketBuffer(const u8 *data, u32 size):
+	m_block(packet_block_get(PACKET_HEADROOM+size)),
+	m_start(PACKET_HEADROOM),
+	m_size(size)
+{
+	if (size)
+		memcpy(&m_block->data[m_start], data, size);
+}
+
+PacketBuffer::PacketBuffer(const PacketBuffer &buffer):
+	m_block(buffer.m_block),
+	m_start(buffer.m_start),
+	m_size(buffer.m_size)
+{
+	if (m_block)
+		X1SyncInc(&m_block->refcount);
+}
+
+PacketBuffer::~PacketBuffer()
+{
+	drop();
+}
+
+PacketBuffer & PacketBuffer::operator=(const PacketBuffer &buffer)
+{
+	if (this == &buffer)
+		return *this;
+
+	if (buffer.m_block)
+		X1SyncInc(&buffer.m_block->refcount);
+	drop();
+	m_block = buffer.m_block;
+	m_start = buffer.m_start;
+	m_size = buffer.m_size;
+	return *this;
+}
+
+bool PacketBuffer::unique() const
+{
+	return m_block != NULL && X1SyncGet(&m_block->refcount) == 1;
+}
+
+u8 *PacketBuffer::prepend(u32 size)
+{
+	assert(unique());
+	assert(m_start >= size);
+	m_start -= size;
+	m_size += size;
+	return &m_block->data[m_start];
+}
+
+void PacketBuffer::truncate(u32 size)
+{
+	if (size < m_size)
+		m_size = size;
+}
+
+void PacketBuffer::getPoolStats(u32 &reused, u32 &allocated)
+{
+	JMutexAutoLock lock(g_packet_pool.mutex);
+	reused = g_packet_pool.reused;
+	allocated = g_packet_pool.allocated;
+}
+
+void PacketBuffer::drop()
+{
+	if (m_block == NULL)
+		return;
+	if (X1SyncDec(&m_block->refcount) == 1)
+		packet_block_put(m_block);
+	m_block = NULL;
+	m_start = 0;
+	m_size = 0;
+}
+
+PacketBufferWriter::PacketBufferWriter(u32 reserve):
+	m_buffer(reserve),
+	m_size(0)
+{
+}
+
+PacketBuffer PacketBufferWriter::getBuffer()
+{
+	PacketBuffer b = m_buffer;
+	b.truncate(m_size);
+	return b;
+}
+
+PacketBufferWriter::int_type PacketBufferWriter::overflow(int_type c)
+{
+	if (c == traits_type::eof())
+		return traits_type::not_eof(c);
+	reserve(m_size+1);
+	m_buffer[m_size++] = (u8)c;
+	return c;
+}
+
+std::streamsize PacketBufferWriter::xsputn(const char *s, std::streamsize n)
+{
+	reserve(m_size+n);
+	memcpy(&m_buffer[m_size], s, n);
+	m_size += n;
+	return n;
+}
+
+void PacketBufferWriter::reserve(u32 size)
+{
+	if (size <= m_buffer.getSize())
+		return;
+	u32 capacity = m_buffer.getSize()*2;
+	if (capacity < size)
+		capacity = size;
+	PacketBuffer b(capacity);
+	if (m_size)
+		memcpy(*b, *m_buffer, m_size);
+	m_buffer = b;
+}
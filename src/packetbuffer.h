@@ -0,0 +1,134 @@
+/************************************************************************
+* packetbuffer.h
+* voxelands - 3d voxel world sandbox game
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>
+************************************************************************/
+
+#ifndef PACKETBUFFER_HEADER
+#define PACKETBUFFER_HEADER
+
+#include <streambuf>
+
+#include "common_irrlicht.h"
+
+// Kept free before the data of a new PacketBuffer, enough for all the
+// headers the connection puts in front of it
+#define PACKET_HEADROOM 32
+
+// Memory from 64 bytes to 64KB is kept for reuse, by powers of two
+#define PACKET_POOL_MIN_SHIFT 6
+#define PACKET_POOL_CLASSES 11
+// Most free blocks kept of each size
+#define PACKET_POOL_KEEP 256
+
+struct PacketBufferBlock
+{
+	volatile int refcount;
+	u32 capacity;
+	// PACKET_POOL_CLASSES if it isn't from the pool
+	u32 pool_class;
+	PacketBufferBlock *next;
+	u8 data[1];
+};
+
+/*
+	Refcounted buffer for data going out to the network. The memory
+	comes from a pool and goes back there when the last PacketBuffer
+	using it is gone, and it can be shared between threads as long as
+	nothing writes to it after it has been given to another one.
+
+	PACKET_HEADROOM bytes are kept free before the data, so when only one
+	PacketBuffer uses the memory the headers can be put in front of the
+	data without copying it.
+*/
+class PacketBuffer
+{
+public:
+	PacketBuffer():
+		m_block(NULL),
+		m_start(0),
+		m_size(0)
+	{
+	}
+	PacketBuffer(u32 size);
+	// Copies the data
+	PacketBuffer(const u8 *data, u32 size);
+	PacketBuffer(const PacketBuffer &buffer);
+	~PacketBuffer();
+
+	PacketBuffer & operator=(const PacketBuffer &buffer);
+
+	u8 & operator[](u32 i) const
+	{
+		return m_block->data[m_start+i];
+	}
+	u8 * operator*() const
+	{
+		if (m_block == NULL)
+			return NULL;
+		return &m_block->data[m_start];
+	}
+	u32 getSize() const
+	{
+		return m_size;
+	}
+
+	// Whether this is the only PacketBuffer using the memory
+	bool unique() const;
+	u32 getHeadroom() const
+	{
+		return m_start;
+	}
+	// Moves the start of the data back by size bytes and returns it,
+	// the buffer has to be unique and have the headroom
+	u8 *prepend(u32 size);
+	// Drops the data after size bytes
+	void truncate(u32 size);
+
+	// Blocks taken from the pool and allocated, for the tests
+	static void getPoolStats(u32 &reused, u32 &allocated);
+
+private:
+	void drop();
+
+	PacketBufferBlock *m_block;
+	u32 m_start;
+	u32 m_size;
+};
+
+/*
+	Output stream buffer writing into a PacketBuffer, for serializing
+	straight into a packet. It grows as needed.
+*/
+class PacketBufferWriter : public std::streambuf
+{
+public:
+	PacketBufferWriter(u32 reserve);
+
+	// What has been written so far
+	PacketBuffer getBuffer();
+
+protected:
+	virtual int_type overflow(int_type c);
+	virtual std::streamsize xsputn(const char *s, std::streamsize n);
+
+private:
+	void reserve(u32 size);
+
+	PacketBuffer m_buffer;
+	u32 m_size;
+};
+
+#endif
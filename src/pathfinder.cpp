@@ -0,0 +1,308 @@
+/************************************************************************
+* pathfinder.cpp
+* voxelands - 3d voxel world sandbox game
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>
+************************************************************************/
+
+#include "common.h"
+
+#include "pathfinder.h"
+#include "mapblock.h"
+#include "content_mapnode.h"
+#include "profiler.h"
+#include "main.h"
+
+#include <deque>
+#include <jmutexautolock.h>
+
+static u8 path_node_flags(MapNode n)
+{
+	content_t c = n.getContent();
+	const ContentFeatures &f = content_features(n);
+	u8 flags = 0;
+
+	if ((c == CONTENT_AIR || !f.walkable) && f.liquid_type != LIQUID_SOURCE)
+		flags |= PATH_NODE_FREE;
+	if (c == CONTENT_WATERSOURCE)
+		flags |= PATH_NODE_WATER;
+	if (f.jumpable)
+		flags |= PATH_NODE_JUMPABLE;
+	if (c != CONTENT_AIR && f.liquid_type == LIQUID_NONE && f.walkable)
+		flags |= PATH_NODE_WALKABLE;
+
+	return flags;
+}
+
+Pathfinder::Pathfinder(Map *map):
+	m_map(map),
+	m_last_pos(0,0,0),
+	m_last_block(NULL),
+	m_timer(0.0)
+{
+	m_changed_mutex.Init();
+}
+
+Pathfinder::~Pathfinder()
+{
+	for (std::map<v3s16, Block*>::iterator i = m_blocks.begin(); i != m_blocks.end(); i++) {
+		delete i->second;
+	}
+	for (std::map<std::pair<v3s16, v3s16>, Field*>::iterator i = m_fields.begin(); i != m_fields.end(); i++) {
+		delete i->second;
+	}
+}
+
+void Pathfinder::onMapEditEvent(MapEditEvent *event)
+{
+	// This can be called from the emerge threads
+	JMutexAutoLock lock(m_changed_mutex);
+
+	switch (event->type) {
+	case MEET_ADDNODE:
+	case MEET_REMOVENODE:
+		m_changed.insert(getNodeBlockPos(event->p));
+		break;
+	case MEET_OTHER:
+		for (core::map<v3s16, bool>::Iterator i = event->modified_blocks.getIterator(); i.atEnd() == false; i++) {
+			m_changed.insert(i.getNode()->getKey());
+		}
+		break;
+	default:;
+	}
+}
+
+void Pathfinder::invalidate(core::map<v3s16, MapBlock*> &blocks)
+{
+	for (core::map<v3s16, MapBlock*>::Iterator i = blocks.getIterator(); i.atEnd() == false; i++) {
+		invalidateBlock(i.getNode()->getKey());
+	}
+}
+
+void Pathfinder::invalidateBlock(v3s16 blockpos)
+{
+	std::map<v3s16, Block*>::iterator b = m_blocks.find(blockpos);
+	if (b != m_blocks.end()) {
+		if (b->second == m_last_block)
+			m_last_block = NULL;
+		delete b->second;
+		m_blocks.erase(b);
+	}
+
+	// Fields reaching into the block
+	s16 r = PATH_FIELD_RADIUS/MAP_BLOCKSIZE+1;
+	for (std::map<std::pair<v3s16, v3s16>, Field*>::iterator i = m_fields.begin(); i != m_fields.end(); ) {
+		v3s16 d = getNodeBlockPos(i->first.first) - blockpos;
+		if (abs(d.X) > r || abs(d.Y) > r || abs(d.Z) > r) {
+			i++;
+			continue;
+		}
+		delete i->second;
+		m_fields.erase(i++);
+	}
+}
+
+void Pathfinder::step(float dtime)
+{
+	{
+		JMutexAutoLock lock(m_changed_mutex);
+		for (std::set<v3s16>::iterator i = m_changed.begin(); i != m_changed.end(); i++) {
+			invalidateBlock(*i);
+		}
+		m_changed.clear();
+	}
+
+	for (std::map<std::pair<v3s16, v3s16>, Field*>::iterator i = m_fields.begin(); i != m_fields.end(); ) {
+		i->second->age += dtime;
+		if (i->second->age < PATH_FIELD_TIMEOUT) {
+			i++;
+			continue;
+		}
+		delete i->second;
+		m_fields.erase(i++);
+	}
+
+	m_timer += dtime;
+	if (m_timer < 1.0)
+		return;
+
+	for (std::map<v3s16, Block*>::iterator i = m_blocks.begin(); i != m_blocks.end(); ) {
+		i->second->age += m_timer;
+		if (i->second->age < PATH_BLOCK_TIMEOUT) {
+			i++;
+			continue;
+		}
+		if (i->second == m_last_block)
+			m_last_block = NULL;
+		delete i->second;
+		m_blocks.erase(i++);
+	}
+	m_timer = 0.0;
+
+	g_profiler->avg("Pathfinder: cached blocks", m_blocks.size());
+}
+
+u8 Pathfinder::getNode(v3s16 p)
+{
+	v3s16 blockpos = getNodeBlockPos(p);
+	v3s16 rel = p - blockpos*MAP_BLOCKSIZE;
+
+	if (m_last_block && m_last_pos == blockpos)
+		return m_last_block->nodes[rel.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + rel.Y*MAP_BLOCKSIZE + rel.X];
+
+	Block *b;
+	std::map<v3s16, Block*>::iterator i = m_blocks.find(blockpos);
+	if (i != m_blocks.end()) {
+		b = i->second;
+	}else{
+		MapBlock *block = m_map->getBlockNoCreateNoEx(blockpos);
+		// Not loaded, don't remember it
+		if (!block || block->isDummy())
+			return path_node_flags(MapNode(CONTENT_IGNORE));
+
+		b = new Block;
+		b->age = 0.0;
+		v3s16 np;
+		for (np.Z=0; np.Z<MAP_BLOCKSIZE; np.Z++)
+		for (np.Y=0; np.Y<MAP_BLOCKSIZE; np.Y++)
+		for (np.X=0; np.X<MAP_BLOCKSIZE; np.X++) {
+			b->nodes[np.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + np.Y*MAP_BLOCKSIZE + np.X] = path_node_flags(block->getNodeNoEx(np));
+		}
+		m_blocks[blockpos] = b;
+	}
+
+	m_last_pos = blockpos;
+	m_last_block = b;
+
+	return b->nodes[rel.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + rel.Y*MAP_BLOCKSIZE + rel.X];
+}
+
+bool Pathfinder::isFree(v3s16 p, v3s16 size, bool swim)
+{
+	u8 need = swim ? PATH_NODE_WATER : PATH_NODE_FREE;
+	v3s16 dp;
+	for (dp.X=0; dp.X<size.X; dp.X++)
+	for (dp.Y=0; dp.Y<size.Y; dp.Y++)
+	for (dp.Z=0; dp.Z<size.Z; dp.Z++) {
+		if (!(getNode(p+dp)&need))
+			return false;
+	}
+	return (getNode(p+v3s16(0,-1,0))&PATH_NODE_JUMPABLE) != 0;
+}
+
+bool Pathfinder::isWalkable(v3s16 p)
+{
+	return (getNode(p+v3s16(0,-1,0))&PATH_NODE_WALKABLE) != 0;
+}
+
+s32 Pathfinder::getDistance(v3s16 target, v3s16 size, v3s16 p)
+{
+	v3s16 d = p-target;
+	if (abs(d.X) > PATH_FIELD_RADIUS || abs(d.Y) > PATH_FIELD_RADIUS || abs(d.Z) > PATH_FIELD_RADIUS)
+		return -1;
+
+	Field *f = getField(target,size);
+	std::map<v3s16, u16>::iterator i = f->distance.find(p);
+	if (i == f->distance.end())
+		return -1;
+	return i->second;
+}
+
+Pathfinder::Field *Pathfinder::getField(v3s16 target, v3s16 size)
+{
+	std::pair<v3s16, v3s16> key(target,size);
+	std::map<std::pair<v3s16, v3s16>, Field*>::iterator i = m_fields.find(key);
+	if (i != m_fields.end())
+		return i->second;
+
+	// There are only a few fields, one or two for each player being followed
+	for (i = m_fields.begin(); i != m_fields.end(); i++) {
+		if (i->first.second != size)
+			continue;
+		v3s16 d = target-i->first.first;
+		if (abs(d.X) > PATH_FIELD_REUSE_DISTANCE || abs(d.Y) > PATH_FIELD_REUSE_DISTANCE || abs(d.Z) > PATH_FIELD_REUSE_DISTANCE)
+			continue;
+		if (fieldHas(i->second,target))
+			return i->second;
+	}
+
+	Field *f = new Field;
+	f->age = 0.0;
+	buildField(f,target,size);
+	m_fields[key] = f;
+	return f;
+}
+
+bool Pathfinder::fieldHas(Field *f, v3s16 target)
+{
+	for (s16 i=0; i<4; i++) {
+		if (f->distance.find(target) != f->distance.end())
+			return true;
+		target.Y--;
+	}
+	return false;
+}
+
+/*
+	Goes out from the target the way walking mobs move, one node along or
+	diagonally, or one node along and one up or down.
+*/
+void Pathfinder::buildField(Field *f, v3s16 target, v3s16 size)
+{
+	ScopeProfiler sp(g_profiler, "Pathfinder: build field", SPT_AVG);
+
+	// The target may be jumping or falling
+	v3s16 start = target;
+	for (s16 i=0; i<3 && !isFreeAndWalkable(start,size); i++) {
+		start.Y--;
+	}
+	if (!isFreeAndWalkable(start,size))
+		return;
+
+	v3s16 dps[3*3*3];
+	int num_dps = 0;
+	for (int dx=-1; dx<=1; dx++)
+	for (int dy=-1; dy<=1; dy++)
+	for (int dz=-1; dz<=1; dz++) {
+		if (dx == 0 && dz == 0)
+			continue;
+		if (dx != 0 && dz != 0 && dy != 0)
+			continue;
+		dps[num_dps++] = v3s16(dx,dy,dz);
+	}
+
+	std::deque<v3s16> queue;
+	f->distance[start] = 0;
+	queue.push_back(start);
+
+	while (queue.size() && f->distance.size() < PATH_FIELD_MAX_NODES) {
+		v3s16 p = queue.front();
+		queue.pop_front();
+		u16 distance = f->distance[p]+1;
+		for (int i=0; i<num_dps; i++) {
+			v3s16 np = p+dps[i];
+			v3s16 d = np-target;
+			if (abs(d.X) > PATH_FIELD_RADIUS || abs(d.Y) > PATH_FIELD_RADIUS || abs(d.Z) > PATH_FIELD_RADIUS)
+				continue;
+			if (f->distance.find(np) != f->distance.end())
+				continue;
+			if (!isFreeAndWalkable(np,size))
+				continue;
+			f->distance[np] = distance;
+			queue.push_back(np);
+		}
+	}
+
+	g_profiler->avg("Pathfinder: field nodes", f->distance.size());
+}
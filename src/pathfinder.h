@@ -0,0 +1,126 @@
+/************************************************************************
+* pathfinder.h
+* voxelands - 3d voxel world sandbox game
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful, but
+* WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>
+************************************************************************/
+
+#ifndef PATHFINDER_HEADER
+#define PATHFINDER_HEADER
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include "common_irrlicht.h"
+#include "map.h"
+#include <jmutex.h>
+
+// Cached blocks are read again after this long, as not every change to
+// the map sends an event
+#define PATH_BLOCK_TIMEOUT 10.0
+// Flow fields are built again after this long
+#define PATH_FIELD_TIMEOUT 1.0
+// Until then a field is also used for targets this many nodes from the
+// one it was built for, as long as they are in it
+#define PATH_FIELD_REUSE_DISTANCE 4
+// How far from its target a flow field reaches, in nodes
+#define PATH_FIELD_RADIUS 16
+// Most nodes a flow field has
+#define PATH_FIELD_MAX_NODES 8192
+
+// What mobs can do with a node
+#define PATH_NODE_FREE 0x01
+#define PATH_NODE_WATER 0x02
+#define PATH_NODE_JUMPABLE 0x04
+#define PATH_NODE_WALKABLE 0x08
+
+/*
+	Answers the map questions mobs ask when deciding where to go next.
+
+	What mobs can do with each node is cached by block, dropped when the
+	map sends an edit event for it. Walking mobs with the same size
+	following the same player share one flow field: the number of steps
+	from each node near the player to the player. So that a walking
+	player doesn't need a new field for each node moved, the field is
+	kept while the player is still near where it was built and in it,
+	until it times out.
+
+	Only to be used from the server thread, the edit events that come
+	from elsewhere are held until step().
+*/
+class Pathfinder : public MapEventReceiver
+{
+public:
+	Pathfinder(Map *map);
+	~Pathfinder();
+
+	void onMapEditEvent(MapEditEvent *event);
+	// For changes that don't send events
+	void invalidate(core::map<v3s16, MapBlock*> &blocks);
+
+	void step(float dtime);
+
+	// Whether a mob of this size fits at p
+	bool isFree(v3s16 p, v3s16 size, bool swim);
+	// Whether there's something to walk on under p
+	bool isWalkable(v3s16 p);
+	bool isFreeAndWalkable(v3s16 p, v3s16 size)
+	{
+		return isFree(p,size,false) && isWalkable(p);
+	}
+
+	// Steps a walking mob of this size at p needs to get to target, or
+	// to a node up to PATH_FIELD_REUSE_DISTANCE from it, or -1 if p is
+	// too far or there is no way
+	s32 getDistance(v3s16 target, v3s16 size, v3s16 p);
+
+private:
+	struct Block
+	{
+		u8 nodes[MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+		float age;
+	};
+
+	struct Field
+	{
+		std::map<v3s16, u16> distance;
+		float age;
+	};
+
+	u8 getNode(v3s16 p);
+	Field *getField(v3s16 target, v3s16 size);
+	// Whether the field has target, or the nodes it may be jumping from
+	bool fieldHas(Field *f, v3s16 target);
+	void buildField(Field *f, v3s16 target, v3s16 size);
+	void invalidateBlock(v3s16 blockpos);
+
+	Map *m_map;
+
+	std::map<v3s16, Block*> m_blocks;
+	// The last block looked at
+	v3s16 m_last_pos;
+	Block *m_last_block;
+
+	// By the target they were built for and mob size
+	std::map<std::pair<v3s16, v3s16>, Field*> m_fields;
+
+	// Blocks changed since the last step
+	std::set<v3s16> m_changed;
+	JMutex m_changed_mutex;
+
+	float m_timer;
+};
+
+#endif
@@ -451,15 +451,14 @@ void plantgrowth_seed(ServerEnvironment *env, v3s16 p0)
 	env->getMap().addNodeWithEvent(p0,n);
 }
 
-void plantgrowth_plant(ServerEnvironment *env, v3s16 p0, s16 height)
+/*
+	Grows the plant at p0 by one stage, up into the nodes above or onto a
+	trellis once the ones below are grown, returns false if it can't
+*/
+static bool plantgrowth_plant_stage(ServerEnvironment *env, v3s16 p0, s16 height)
 {
-	u32 tod = env->getTimeOfDay();
 	MapNode n = env->getMap().getNodeNoEx(p0);
-	u8 light = n.getLightBlend(env->getDayNightRatio());
 	content_t c = n.getContent();
-	// only grow during the day or with good light
-	if (light < LIGHT_MAX-3 && (tod < 6000 || tod > 18000))
-		return;
 	if (n.param2 == 0 && content_features(n).plantgrowth_trellis_node != CONTENT_IGNORE) {
 		c = content_features(n).plantgrowth_trellis_node;
 		v3s16 p;
@@ -468,14 +467,14 @@ void plantgrowth_plant(ServerEnvironment *env, v3s16 p0, s16 height)
 		search.push_back(CONTENT_TRELLIS);
 		search.push_back(CONTENT_TRELLIS_DEAD_VINE);
 		if (!env->searchNear(p0,v3s16(-1,0,-1),v3s16(1,0,1),search,&p))
-			return;
+			return false;
 		p0 = p;
 		n = env->getMap().getNodeNoEx(p0);
 		if (n.getContent() != c) {
 			n.setContent(c);
 			n.param2 = 1;
 			env->getMap().addNodeWithEvent(p0,n);
-			return;
+			return true;
 		}
 	}
 	if (n.param2 == 0) {
@@ -516,7 +515,7 @@ void plantgrowth_plant(ServerEnvironment *env, v3s16 p0, s16 height)
 			}
 		}
 		if (!grow)
-			return;
+			return false;
 	}
 
 	if (n.param2 == 15) {
@@ -528,6 +527,18 @@ void plantgrowth_plant(ServerEnvironment *env, v3s16 p0, s16 height)
 	/* update will fail if the content has changed, so add it */
 	if (!env->getMap().updateNodeWithEvent(p0,n))
 		env->getMap().addNodeWithEvent(p0,n);
+	return true;
+}
+
+void plantgrowth_plant(ServerEnvironment *env, v3s16 p0, s16 height)
+{
+	u32 tod = env->getTimeOfDay();
+	MapNode n = env->getMap().getNodeNoEx(p0);
+	u8 light = n.getLightBlend(env->getDayNightRatio());
+	// only grow during the day or with good light
+	if (light < LIGHT_MAX-3 && (tod < 6000 || tod > 18000))
+		return;
+	plantgrowth_plant_stage(env,p0,height);
 }
 
 void plantgrowth_grass(ServerEnvironment *env, v3s16 p0)
@@ -672,3 +683,57 @@ void plantgrowth_cactus(ServerEnvironment *env, v3s16 p0)
 	MapNode n(CONTENT_CACTUS);
 	env->getMap().addNodeWithEvent(p0+v3s16(0,height,0),n);
 }
+
+/*
+	Grows the crops in a block that missed nodesteps while it wasn't
+	loaded. Farm dirt that has water nearby grows the plant on it every
+	fourth nodestep, when it's light, so about every eighth one. Once
+	the plant on the dirt is grown the stages go to the nodes above and
+	the trellis, as they do in plantgrowth_plant().
+*/
+void plantgrowth_catchup(ServerEnvironment *env, MapBlock *block, u32 nodesteps)
+{
+	u32 stages = nodesteps/8;
+	if (!stages)
+		return;
+
+	std::vector<content_t> water;
+	water.push_back(CONTENT_WATERSOURCE);
+	water.push_back(CONTENT_WATER);
+
+	v3s16 p0;
+	for (p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
+	for (p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
+	for (p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++) {
+		content_t c = block->getNodeContent(p0);
+		if (content_features(c).param2_type != CPT_PLANTGROWTH)
+			continue;
+
+		v3s16 p = p0 + block->getPosRelative();
+		MapNode n = env->getMap().getNodeNoEx(p);
+
+		v3s16 dirt_p = p + v3s16(0,-1,0);
+		if (env->getMap().getNodeNoEx(dirt_p).getContent() != CONTENT_FARM_DIRT)
+			continue;
+		if (!env->searchNear(dirt_p,v3s16(-3,0,-3),v3s16(3,0,3),water,NULL))
+			continue;
+
+		u32 left = stages;
+		if (n.param2 != 0) {
+			if (n.param2+left > 15) {
+				left -= 16-n.param2;
+				n.param2 = 0;
+			}else{
+				n.param2 += left;
+				left = 0;
+			}
+			env->getMap().updateNodeWithEvent(p,n);
+		}
+
+		// it stops once it's as high as it grows
+		for (; left > 0; left--) {
+			if (!plantgrowth_plant_stage(env,p,0))
+				break;
+		}
+	}
+}
@@ -33,5 +33,6 @@ void plantgrowth_seed(ServerEnvironment *env, v3s16 p0);
 void plantgrowth_plant(ServerEnvironment *env, v3s16 p0, s16 height=0);
 void plantgrowth_grass(ServerEnvironment *env, v3s16 p0);
 void plantgrowth_cactus(ServerEnvironment *env, v3s16 p0);
+void plantgrowth_catchup(ServerEnvironment *env, MapBlock *block, u32 nodesteps);
 
 #endif
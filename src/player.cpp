@@ -37,6 +37,7 @@
 #endif
 #include "path.h"
 #include "content_clothesitem.h"
+#include <zlib.h>
 
 /* character def:
 gender:Yscale:XZscale:skintone:eyes:hairtone:hair:face:shirt-colour:pants-colour:shoe-type
@@ -72,7 +73,9 @@ Player::Player():
 	m_home(0,0,0),
 	m_hashome(false),
 	m_character(PLAYER_DEFAULT_CHARDEF),
-	m_given_clothes(false)
+	m_given_clothes(false),
+	m_saved_checksum(0),
+	m_saved(false)
 {
 	updateName("<not set>");
 	for (u8 i=0; i<PLAYERFLAG_COUNT; i++) {
@@ -277,6 +280,19 @@ void Player::serialize(std::ostream &os)
 	inventory.serialize(os);
 }
 
+bool Player::isDirty(const std::string &data)
+{
+	if (!m_saved)
+		return true;
+	return crc32(crc32(0, NULL, 0), (const Bytef*)data.c_str(), data.size()) != m_saved_checksum;
+}
+
+void Player::setSaved(const std::string &data)
+{
+	m_saved_checksum = crc32(crc32(0, NULL, 0), (const Bytef*)data.c_str(), data.size());
+	m_saved = true;
+}
+
 void Player::deSerialize(std::istream &is)
 {
 	nvp_t *list = NULL;
@@ -223,6 +223,14 @@ public:
 	void serialize(std::ostream &os);
 	void deSerialize(std::istream &is);
 
+	/*
+		Player state is changed in too many places to flag every
+		change, instead the player is dirty when its serialized data
+		differs from what was saved last.
+	*/
+	bool isDirty(const std::string &data);
+	void setSaved(const std::string &data);
+
 	bool touching_ground;
 	// This oscillates so that the player jumps a bit above the surface
 	bool in_water;
@@ -404,6 +412,9 @@ protected:
 	bool m_hasflag[PLAYERFLAG_COUNT];
 	std::string m_character;
 	bool m_given_clothes;
+	// Checksum of the data last saved or loaded, if m_saved
+	u32 m_saved_checksum;
+	bool m_saved;
 
 public:
 
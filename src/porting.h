@@ -78,6 +78,15 @@ bool * signal_handler_killstatus(void);
 	{
 		return GetTickCount();
 	}
+	// Microseconds, for timing short things
+	inline u32 getTimeUs()
+	{
+		LARGE_INTEGER freq, t;
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&t);
+		return (u32)(t.QuadPart / freq.QuadPart * 1000000 +
+				t.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+	}
 #else // Posix
 	#include <sys/time.h>
 	inline u32 getTimeMs()
@@ -86,6 +95,13 @@ bool * signal_handler_killstatus(void);
 		gettimeofday(&tv, NULL);
 		return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 	}
+	// Microseconds, for timing short things
+	inline u32 getTimeUs()
+	{
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return tv.tv_sec * 1000000 + tv.tv_usec;
+	}
 	/*#include <sys/timeb.h>
 	inline u32 getTimeMs()
 	{
@@ -25,6 +25,7 @@
 
 #include "serialization.h"
 #include "utility.h"
+#include <sstream>
 #ifdef _WIN32
 	#define ZLIB_WINAPI
 #endif
@@ -58,54 +59,129 @@ void zerr(int ret)
 	}
 }
 
-void compressZlib(SharedBuffer<u8> data, std::ostream &os)
+SerializationCodec serializationCodec(u8 version, bool disk)
+{
+	if (disk)
+		return CODEC_ZLIB_SMALL;
+	return CODEC_ZLIB_FAST;
+}
+
+static int codec_level(SerializationCodec codec)
+{
+	switch (codec) {
+	case CODEC_ZLIB_FAST:
+		return Z_BEST_SPEED;
+	case CODEC_ZLIB_SMALL:
+	default:
+		return Z_DEFAULT_COMPRESSION;
+	}
+}
+
+void compressBuffer(const u8 *data, u32 len, std::string &dst,
+		SerializationCodec codec)
 {
 	z_stream z;
-	const s32 bufsize = 16384;
-	char output_buffer[bufsize];
-	int status = 0;
-	int ret;
+	int status;
 
 	z.zalloc = Z_NULL;
 	z.zfree = Z_NULL;
 	z.opaque = Z_NULL;
 
-	ret = deflateInit(&z, -1);
-	if(ret != Z_OK)
+	if (deflateInit(&z, codec_level(codec)) != Z_OK)
 		throw SerializationError("compressZlib: deflateInit failed");
 
-	// Point zlib to our input buffer
-	z.next_in = (Bytef*)&data[0];
-	z.avail_in = data.getSize();
-	// And get all output
-	for(;;)
-	{
-		z.next_out = (Bytef*)output_buffer;
-		z.avail_out = bufsize;
+	// Room for the worst case, so it all goes in one call
+	const size_t start = dst.size();
+	const uLong bound = deflateBound(&z, len);
+	dst.resize(start+bound);
+
+	z.next_in = (Bytef*)data;
+	z.avail_in = len;
+	z.next_out = (Bytef*)&dst[start];
+	z.avail_out = bound;
+
+	status = deflate(&z, Z_FINISH);
+	if (status != Z_STREAM_END) {
+		deflateEnd(&z);
+		zerr(status);
+		throw SerializationError("compressZlib: deflate failed");
+	}
 
-		status = deflate(&z, Z_FINISH);
-		if(status == Z_NEED_DICT || status == Z_DATA_ERROR
-				|| status == Z_MEM_ERROR)
-		{
+	dst.resize(start+z.total_out);
+	deflateEnd(&z);
+}
+
+u32 decompressBuffer(const u8 *data, u32 len, std::string &dst)
+{
+	z_stream z;
+	int status;
+
+	z.zalloc = Z_NULL;
+	z.zfree = Z_NULL;
+	z.opaque = Z_NULL;
+	z.next_in = (Bytef*)data;
+	z.avail_in = len;
+
+	if (inflateInit(&z) != Z_OK)
+		throw SerializationError("decompressZlib: inflateInit failed");
+
+	const size_t start = dst.size();
+	for (;;) {
+		// Grow the output as needed, block data is a few times its input
+		if (dst.size() == start+z.total_out)
+			dst.resize(dst.size()+len*4+16384);
+		z.next_out = (Bytef*)&dst[start+z.total_out];
+		z.avail_out = dst.size()-(start+z.total_out);
+
+		status = inflate(&z, Z_NO_FLUSH);
+		if (status == Z_NEED_DICT || status == Z_DATA_ERROR
+				|| status == Z_MEM_ERROR) {
+			inflateEnd(&z);
 			zerr(status);
-			throw SerializationError("compressZlib: deflate failed");
+			throw SerializationError("decompressZlib: inflate failed");
 		}
-		int count = bufsize - z.avail_out;
-		if(count)
-			os.write(output_buffer, count);
-		// This determines zlib has given all output
-		if(status == Z_STREAM_END)
+		if (status == Z_STREAM_END)
 			break;
+		// Cut short, a block read partly is no use
+		if (z.avail_in == 0 && z.avail_out != 0) {
+			inflateEnd(&z);
+			throw SerializationError("decompressZlib: stream ended early");
+		}
 	}
 
-	deflateEnd(&z);
+	dst.resize(start+z.total_out);
+	const u32 used = len-z.avail_in;
+	inflateEnd(&z);
+
+	return used;
+}
 
+void compressZlib(SharedBuffer<u8> data, std::ostream &os, SerializationCodec codec)
+{
+	std::string buf;
+	compressBuffer(*data, data.getSize(), buf, codec);
+	os.write(buf.c_str(), buf.size());
 }
 
-void compressZlib(const std::string &data, std::ostream &os)
+void compressZlib(const std::string &data, std::ostream &os, SerializationCodec codec)
 {
-	SharedBuffer<u8> databuf((u8*)data.c_str(), data.size());
-	compressZlib(databuf, os);
+	std::string buf;
+	compressBuffer((const u8*)data.c_str(), data.size(), buf, codec);
+	os.write(buf.c_str(), buf.size());
+}
+
+void decompressZlib(std::istream &is, std::string &dst)
+{
+	MemoryStreamBuffer *mb = dynamic_cast<MemoryStreamBuffer*>(is.rdbuf());
+	if (mb) {
+		u32 used = decompressBuffer((const u8*)mb->current(), mb->remaining(), dst);
+		mb->skip(used);
+		return;
+	}
+
+	std::ostringstream os(std::ios_base::binary);
+	decompressZlib(is, os);
+	dst += os.str();
 }
 
 void decompressZlib(std::istream &is, std::ostream &os)
@@ -143,14 +219,16 @@ void decompressZlib(std::istream &is, std::ostream &os)
 			z.avail_in = input_buffer_len;
 			//dstream<<"read fail="<<is.fail()<<" bad="<<is.bad()<<std::endl;
 		}
-		if(z.avail_in == 0)
-		{
-			//dstream<<"z.avail_in == 0"<<std::endl;
-			break;
-		}
 
 		//dstream<<"1 z.avail_in="<<z.avail_in<<std::endl;
 		status = inflate(&z, Z_NO_FLUSH);
+		// There's no more input and it hasn't ended, a block read
+		// partly is no use
+		if(status == Z_BUF_ERROR)
+		{
+			inflateEnd(&z);
+			throw SerializationError("decompressZlib: stream ended early");
+		}
 		//dstream<<"2 z.avail_in="<<z.avail_in<<std::endl;
 		bytes_read += is.gcount() - z.avail_in;
 		//dstream<<"bytes_read="<<bytes_read<<std::endl;
@@ -190,11 +268,12 @@ void decompressZlib(std::istream &is, std::ostream &os)
 	inflateEnd(&z);
 }
 
-void compress(SharedBuffer<u8> data, std::ostream &os, u8 version)
+void compress(SharedBuffer<u8> data, std::ostream &os, u8 version,
+		SerializationCodec codec)
 {
 	if(version >= 11)
 	{
-		compressZlib(data, os);
+		compressZlib(data, os, codec);
 		return;
 	}
 
@@ -64,26 +64,81 @@
 	20: many existing content types translated to extended ones
 	21: u8 param0 replaced with content_t content
 	22: added biome id
+	23: node content palette with packed indices, separate param planes
 */
 // This represents an uninitialized or invalid format
 #define SER_FMT_VER_INVALID 255
 // Highest supported serialization version
-#define SER_FMT_VER_HIGHEST 22
+#define SER_FMT_VER_HIGHEST 23
 // Lowest supported serialization version
 #define SER_FMT_VER_LOWEST 20
 
 #define ser_ver_supported(v) (v >= SER_FMT_VER_LOWEST && v <= SER_FMT_VER_HIGHEST)
 
+/*
+	Compression codecs. From version 11 on everything is a zlib stream,
+	the codecs only differ in how hard they try so whatever one of them
+	writes is read the same way.
+*/
+enum SerializationCodec
+{
+	// Quick, for data sent over the network
+	CODEC_ZLIB_FAST,
+	// Smaller, for data stored on disk
+	CODEC_ZLIB_SMALL
+};
+
+// Codec for writing data of a version to disk or to the network
+SerializationCodec serializationCodec(u8 version, bool disk);
+
 /*
 	Misc. serialization functions
 */
 
-void compressZlib(SharedBuffer<u8> data, std::ostream &os);
-void compressZlib(const std::string &data, std::ostream &os);
+// These append to dst, decompressBuffer() returns how much of data it used
+void compressBuffer(const u8 *data, u32 len, std::string &dst,
+		SerializationCodec codec=CODEC_ZLIB_SMALL);
+u32 decompressBuffer(const u8 *data, u32 len, std::string &dst);
+
+void compressZlib(SharedBuffer<u8> data, std::ostream &os,
+		SerializationCodec codec=CODEC_ZLIB_SMALL);
+void compressZlib(const std::string &data, std::ostream &os,
+		SerializationCodec codec=CODEC_ZLIB_SMALL);
 void decompressZlib(std::istream &is, std::ostream &os);
+// Decompresses straight from memory when is reads a MemoryStreamBuffer
+void decompressZlib(std::istream &is, std::string &dst);
+
+/*
+	Input stream buffer over memory owned by someone else, for
+	deserializing without copying the data into a string first
+*/
+class MemoryStreamBuffer : public std::streambuf
+{
+public:
+	MemoryStreamBuffer(const char *data, size_t len)
+	{
+		char *p = const_cast<char*>(data);
+		setg(p, p, p+len);
+	}
+
+	// The data that hasn't been read yet
+	const char *current()
+	{
+		return gptr();
+	}
+	size_t remaining()
+	{
+		return egptr()-gptr();
+	}
+	void skip(size_t n)
+	{
+		gbump(n);
+	}
+};
 
 // These choose between zlib and a self-made one according to version
-void compress(SharedBuffer<u8> data, std::ostream &os, u8 version);
+void compress(SharedBuffer<u8> data, std::ostream &os, u8 version,
+		SerializationCodec codec=CODEC_ZLIB_SMALL);
 //void compress(const std::string &data, std::ostream &os, u8 version);
 void decompress(std::istream &is, std::ostream &os, u8 version);
 
@@ -141,7 +141,19 @@ void * EmergeThread::Thread()
 	*/
 	while(getRun())
 	{
-		QueuedBlockEmerge* const qptr = m_server->m_emerge_queue.pop();
+		/*
+			Read blocks wanted soon from disk, in as few queries as
+			possible
+		*/
+		{
+			core::list<v3s16> prefetch;
+			if (m_server->m_emerge_queue.popPrefetch(prefetch)) {
+				JMutexAutoLock envlock(m_server->m_env_mutex);
+				m_server->m_env.getServerMap().loadBlocks(prefetch);
+			}
+		}
+
+		QueuedBlockEmerge* const qptr = m_server->m_emerge_queue.popUnreserved();
 		if (qptr == NULL)
 			break;
 
@@ -158,8 +170,10 @@ void * EmergeThread::Thread()
 		|| p.Y < -MAP_GENERATION_LIMIT / MAP_BLOCKSIZE
 		|| p.Y > MAP_GENERATION_LIMIT / MAP_BLOCKSIZE
 		|| p.Z < -MAP_GENERATION_LIMIT / MAP_BLOCKSIZE
-		|| p.Z > MAP_GENERATION_LIMIT / MAP_BLOCKSIZE)
+		|| p.Z > MAP_GENERATION_LIMIT / MAP_BLOCKSIZE) {
+			m_server->m_emerge_queue.done(p);
 			continue;
+		}
 
 		//infostream<<"EmergeThread::Thread(): running"<<std::endl;
 
@@ -196,31 +210,31 @@ void * EmergeThread::Thread()
 		}
 
 		//vlprintf(CN_DEBUG,"EmergeThread: p=(%d,%d,%d) only_from_disk = %d",p.X,p.Y,p.Z,only_from_disk);
-		
-		JMutexAutoLock envlock(m_server->m_env_mutex);
-		ServerMap& map = ((ServerMap&) m_server->m_env.getMap());
 
-		//core::map<v3s16, MapBlock*> changed_blocks;
-		//core::map<v3s16, MapBlock*> lighting_invalidated_blocks;
+		ServerMap& map = ((ServerMap&) m_server->m_env.getMap());
 
 		MapBlock* block = NULL;
 		bool got_block = true;
+		bool emerged = false;
+		bool was_generated = false;
 		core::map<v3s16, MapBlock*> modified_blocks;
+		mapgen::BlockMakeData data;
 
 		/*
-			Fetch block from map or generate a single block
+			Fetch block from map, or load it, or prepare to generate it
 		*/
 		{
+			JMutexAutoLock envlock(m_server->m_env_mutex);
+
 			// Load sector if it isn't loaded
 			map.getSectorNoGenerateNoEx(p2d);
 			block = map.getBlockNoCreateNoEx(p);
-			    
+
 			if (!block || block->isDummy() || !block->isGenerated())
 			{
-				bool was_generated = false;
+				emerged = true;
 				//vlprintf(CN_DEBUG,"EmergeThread: not in memory, loading");
 
-				// Load/generate block
 				if(block)
 				    block->ResetCurrent();
 				block = map.loadBlock(p);
@@ -230,103 +244,129 @@ void * EmergeThread::Thread()
 					if (!block || block->isGenerated() == false)
 					{
 						//vlprintf(CN_DEBUG,"EmergeThread: generating");
-						block = map.generateBlock(p, modified_blocks);
+						map.initBlockMake(&data, p);
 						was_generated = true;
 					}
 				}
+			}
+		}
 
-				//vlprintf(CN_DEBUG,"EmergeThread: ended up with: %s",analyze_block(block).c_str());
+		/*
+			The voxel manipulator holds a copy of the area, so the
+			environment can carry on while this generates
+		*/
+		if (was_generated)
+		{
+			ScopeProfiler sp(g_profiler, "EmergeThread: make_block", SPT_AVG);
+			mapgen::make_block(&data);
+		}
 
-				if (!block)
-					got_block = false;
-				else
-				{
-					/*
-						Ignore map edit events, they will not need to be
-						sent to anybody because the block hasn't been sent
-						to anybody
-					*/
-					MapEditEventIgnorer ign(&m_server->m_ignore_map_edit_events);
+		JMutexAutoLock envlock(m_server->m_env_mutex);
 
-					// Activate objects and stuff
-					m_server->m_env.activateBlock(block, 3600);
-				}
+		if (was_generated)
+		{
+			// Something else may have generated it meanwhile
+			block = map.getBlockNoCreateNoEx(p);
+			if (!block || block->isDummy() || !block->isGenerated())
+				map.finishBlockMake(&data, modified_blocks);
+		}
 
-				if (was_generated && myrand_range(0,27) == 0)
-				{
-					bool has_spawn = false;
-					bool water_spawn = false;
-					v3s16 bsp(0,0,0);
-					v3s16 sp(0,0,0);
-					v3s16 wsp(0,0,0);
-
-					/* find a place to spawn, bias to water */
-					v3s16 p0;
-					for (p0.X=0; !water_spawn && p0.X<MAP_BLOCKSIZE; p0.X++) {
-					for (p0.Y=0; !water_spawn && p0.Y<MAP_BLOCKSIZE; p0.Y++) {
-					for (p0.Z=0; !water_spawn && p0.Z<MAP_BLOCKSIZE; p0.Z++) {
-						v3s16 p = p0 + block->getPosRelative();
-						MapNode n = block->getNodeNoEx(p0);
-						MapNode n1 = block->getNodeNoEx(p0+v3s16(0,1,0));
-						MapNode n2 = block->getNodeNoEx(p0+v3s16(0,2,0));
-						if (n1.getContent() == CONTENT_IGNORE || n2.getContent() == CONTENT_IGNORE)
-							continue;
-						if (
-							n.getContent() == CONTENT_WATERSOURCE
-							&& n1.getContent() == CONTENT_WATERSOURCE
-							&& n2.getContent() == CONTENT_WATERSOURCE
-						) {
-							water_spawn = true;
-							wsp = p;
-							break;
-						}
-						if (has_spawn)
-							continue;
-						if (
-							content_features(n.getContent()).draw_type == CDT_DIRTLIKE
-							&& content_features(n1.getContent()).air_equivalent
-							&& content_features(n2.getContent()).air_equivalent
-						) {
-							has_spawn = true;
-							sp = p+v3s16(0,1,0);
-							bsp = p0;
-						}
-					}
+		// The block may have been unloaded while unlocked
+		block = map.getBlockNoCreateNoEx(p);
+
+		if (emerged)
+		{
+			//vlprintf(CN_DEBUG,"EmergeThread: ended up with: %s",analyze_block(block).c_str());
+
+			if (!block)
+				got_block = false;
+			else
+			{
+				/*
+					Ignore map edit events, they will not need to be
+					sent to anybody because the block hasn't been sent
+					to anybody
+				*/
+				MapEditEventIgnorer ign(&m_server->m_ignore_map_edit_events);
+
+				// Activate objects and stuff
+				m_server->m_env.activateBlock(block, 3600);
+			}
+
+			if (block && was_generated && myrand_range(0,27) == 0)
+			{
+				bool has_spawn = false;
+				bool water_spawn = false;
+				v3s16 bsp(0,0,0);
+				v3s16 sp(0,0,0);
+				v3s16 wsp(0,0,0);
+
+				/* find a place to spawn, bias to water */
+				v3s16 p0;
+				for (p0.X=0; !water_spawn && p0.X<MAP_BLOCKSIZE; p0.X++) {
+				for (p0.Y=0; !water_spawn && p0.Y<MAP_BLOCKSIZE; p0.Y++) {
+				for (p0.Z=0; !water_spawn && p0.Z<MAP_BLOCKSIZE; p0.Z++) {
+					v3s16 p = p0 + block->getPosRelative();
+					MapNode n = block->getNodeNoEx(p0);
+					MapNode n1 = block->getNodeNoEx(p0+v3s16(0,1,0));
+					MapNode n2 = block->getNodeNoEx(p0+v3s16(0,2,0));
+					if (n1.getContent() == CONTENT_IGNORE || n2.getContent() == CONTENT_IGNORE)
+						continue;
+					if (
+						n.getContent() == CONTENT_WATERSOURCE
+						&& n1.getContent() == CONTENT_WATERSOURCE
+						&& n2.getContent() == CONTENT_WATERSOURCE
+					) {
+						water_spawn = true;
+						wsp = p;
+						break;
 					}
+					if (has_spawn)
+						continue;
+					if (
+						content_features(n.getContent()).draw_type == CDT_DIRTLIKE
+						&& content_features(n1.getContent()).air_equivalent
+						&& content_features(n2.getContent()).air_equivalent
+					) {
+						has_spawn = true;
+						sp = p+v3s16(0,1,0);
+						bsp = p0;
 					}
+				}
+				}
+				}
 
-					if (water_spawn)
-					{
-						if (myrand_range(0,5) == 0)
-							mob_spawn_hostile(wsp,true,&m_server->m_env);
-						else
-							mob_spawn_passive(wsp,true,&m_server->m_env);
-					}
-					else if (has_spawn)
-					{
-						MapNode n = block->getNodeNoEx(bsp);
-						u8 overlay = (n.param1&0x0F);
-						if (overlay == 0x01 || overlay == 0x02
-								|| (overlay == 0x04 && myrand_range(0,5) == 0)) {
-							mob_spawn_passive(sp,false,&m_server->m_env);
-						}else if (overlay == 0x00 && block->getPosRelative().Y < -16) {
-							mob_spawn(sp,CONTENT_MOB_RAT,&m_server->m_env);
-						}else if (overlay == 0x08) {
-							for (int i=0; i<4; i++) {
-								mob_spawn(sp,CONTENT_MOB_FIREFLY,&m_server->m_env);
-							}
+				if (water_spawn)
+				{
+					if (myrand_range(0,5) == 0)
+						mob_spawn_hostile(wsp,true,&m_server->m_env);
+					else
+						mob_spawn_passive(wsp,true,&m_server->m_env);
+				}
+				else if (has_spawn)
+				{
+					MapNode n = block->getNodeNoEx(bsp);
+					u8 overlay = (n.param1&0x0F);
+					if (overlay == 0x01 || overlay == 0x02
+							|| (overlay == 0x04 && myrand_range(0,5) == 0)) {
+						mob_spawn_passive(sp,false,&m_server->m_env);
+					}else if (overlay == 0x00 && block->getPosRelative().Y < -16) {
+						mob_spawn(sp,CONTENT_MOB_RAT,&m_server->m_env);
+					}else if (overlay == 0x08) {
+						for (int i=0; i<4; i++) {
+							mob_spawn(sp,CONTENT_MOB_FIREFLY,&m_server->m_env);
 						}
 					}
 				}
-
-				if(block)
-				    block->ResetCurrent();
 			}
 
-			// TODO: Some additional checking and lighting updating,
-			//       see emergeBlock
+			if(block)
+			    block->ResetCurrent();
 		}
 
+		// TODO: Some additional checking and lighting updating,
+		//       see emergeBlock
+
 		/*
 			Set sent status of modified blocks on clients
 		*/
@@ -355,6 +395,8 @@ void * EmergeThread::Thread()
 
 		if(block)
 		    block->ResetCurrent();
+
+		m_server->m_emerge_queue.done(p);
 	}
 
 	END_DEBUG_EXCEPTION_HANDLER(errorstream)
@@ -401,6 +443,23 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 
 	v3s16 center = getNodeBlockPos(center_nodepos);
 
+	/*
+		Have the blocks the player is heading for read from disk
+		before they are needed
+	*/
+	if (m_last_center != center && playerspeeddir.getLength() > 0.5) {
+		v3f ahead = playerpos + playerspeeddir*MAP_BLOCKSIZE*BS*3;
+		v3s16 ahead_block = getNodeBlockPos(floatToInt(ahead, BS));
+		core::list<v3s16> prefetch;
+		for (s16 x=-1; x<=1; x++)
+		for (s16 y=-1; y<=1; y++)
+		for (s16 z=-1; z<=1; z++) {
+			prefetch.push_back(ahead_block + v3s16(x,y,z));
+		}
+		server->m_emerge_queue.addPrefetch(prefetch);
+		server->triggerEmergeThreads();
+	}
+
 	// Camera position and direction
 	v3f camera_pos = player->getEyePosition();
 	v3f camera_dir = v3f(0,0,1);
@@ -703,7 +762,7 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 						flags |= BLOCK_EMERGE_FLAG_FROMDISK;
 
 					server->m_emerge_queue.addBlock(peer_id, p, flags);
-					server->m_emergethread.trigger();
+					server->triggerEmergeThreads();
 
 					if(nearest_emerged_d == -1)
 						nearest_emerged_d = d;
@@ -860,7 +919,6 @@ Server::Server():
 	m_env(new ServerMap(), this),
 	m_con(PROTOCOL_ID, 512, CONNECTION_TIMEOUT, this),
 	m_thread(this),
-	m_emergethread(this),
 	m_time_of_day_send_timer(0),
 	m_uptime(0),
 	m_shutdown_requested(false),
@@ -883,6 +941,17 @@ Server::Server():
 	m_step_dtime_mutex.Init();
 	m_step_dtime = 0.0;
 
+	{
+		int emerge_threads = config_get_int("server.emerge.threads");
+		if (emerge_threads < 1)
+			emerge_threads = 1;
+		if (emerge_threads > 16)
+			emerge_threads = 16;
+		for (int i=0; i<emerge_threads; i++) {
+			m_emergethreads.push_back(new EmergeThread(this));
+		}
+	}
+
 	// Register us to receive map edit events
 	m_env.getMap().addEventReceiver(this);
 
@@ -950,6 +1019,10 @@ Server::~Server()
 	*/
 	stop();
 
+	for (u32 i=0; i<m_emergethreads.size(); i++) {
+		delete m_emergethreads[i];
+	}
+
 	/*
 		Delete clients
 	*/
@@ -993,6 +1066,9 @@ void Server::start()
 	if (!m_con.getRun())
 		return;
 
+	// Start map saver before anything can queue blocks to it
+	m_env.getServerMap().startSaver();
+
 	// Start thread
 	m_thread.setRun(true);
 	m_thread.Start();
@@ -1039,17 +1115,35 @@ void Server::start()
 	infostream<<"Server: Started on port "<<port<<std::endl;
 }
 
+void Server::triggerEmergeThreads()
+{
+	// No point waking more threads than there are blocks queued
+	u32 queued = m_emerge_queue.size();
+	if (queued == 0 && m_emerge_queue.prefetchSize() > 0)
+		queued = 1;
+	for (u32 i=0; i<m_emergethreads.size() && i<queued; i++) {
+		m_emergethreads[i]->trigger();
+	}
+}
+
 void Server::stop()
 {
 	DSTACK(__FUNCTION_NAME);
 
 	infostream<<"Server: Stopping and waiting threads"<<std::endl;
 
-	// Stop threads (set run=false first so both start stopping)
+	// Stop threads (set run=false first so all start stopping)
 	m_thread.setRun(false);
-	m_emergethread.setRun(false);
+	for (u32 i=0; i<m_emergethreads.size(); i++) {
+		m_emergethreads[i]->setRun(false);
+	}
 	m_thread.stop();
-	m_emergethread.stop();
+	for (u32 i=0; i<m_emergethreads.size(); i++) {
+		m_emergethreads[i]->stop();
+	}
+
+	// Nothing else is saving blocks now, write what's still queued
+	m_env.getServerMap().stopSaver();
 
 	infostream<<"Server: Threads stopped"<<std::endl;
 }
@@ -1186,6 +1280,8 @@ void Server::AsyncRunStep()
 
 		core::map<v3s16, MapBlock*> modified_blocks;
 		m_env.getMap().transformLiquids(modified_blocks);
+		// Liquids don't send map edit events
+		m_env.getPathfinder()->invalidate(modified_blocks);
 		/*
 			Set the modified blocks unsent for all the clients
 		*/
@@ -1383,8 +1479,12 @@ void Server::AsyncRunStep()
 			i.atEnd()==false; i++)
 		{
 			RemoteClient *client = i.getNode()->getValue();
-			std::string reliable_data;
-			std::string unreliable_data;
+			// The messages are written straight into the packets, so
+			// what goes in each is found first
+			std::vector<ActiveObjectMessage*> reliable_messages;
+			std::vector<ActiveObjectMessage*> unreliable_messages;
+			u32 reliable_size = 0;
+			u32 unreliable_size = 0;
 			// Go through all objects in message buffer
 			for(core::map<u16, core::list<ActiveObjectMessage>* >::Iterator
 					j = buffered_messages.getIterator();
@@ -1400,43 +1500,44 @@ void Server::AsyncRunStep()
 				for(core::list<ActiveObjectMessage>::Iterator
 						k = list->begin(); k != list->end(); k++)
 				{
-					// Compose the full new data with header
-					ActiveObjectMessage aom = *k;
-					std::string new_data;
-					// Add object id
-					char buf[2];
-					writeU16((u8*)&buf[0], aom.id);
-					new_data.append(buf, 2);
-					// Add data
-					new_data += serializeString(aom.datastring);
-					// Add data to buffer
-					if(aom.reliable)
-						reliable_data += new_data;
-					else
-						unreliable_data += new_data;
+					ActiveObjectMessage &aom = *k;
+					if(aom.datastring.size() > 65535)
+						throw SerializationError("String too long for serializeString");
+					// Object id, then the data with its length
+					u32 size = 2 + 2 + aom.datastring.size();
+					if(aom.reliable){
+						reliable_messages.push_back(&aom);
+						reliable_size += size;
+					}else{
+						unreliable_messages.push_back(&aom);
+						unreliable_size += size;
+					}
 				}
 			}
 			/*
-				reliable_data and unreliable_data are now ready.
-				Send them.
+				Write them and send them.
 			*/
-			if(reliable_data.size() > 0)
-			{
-				SharedBuffer<u8> reply(2 + reliable_data.size());
-				writeU16(&reply[0], TOCLIENT_ACTIVE_OBJECT_MESSAGES);
-				memcpy((char*)&reply[2], reliable_data.c_str(),
-						reliable_data.size());
-				// Send as reliable
-				m_con.Send(client->peer_id, 0, reply, true);
-			}
-			if(unreliable_data.size() > 0)
+			for(u32 r=0; r<2; r++)
 			{
-				SharedBuffer<u8> reply(2 + unreliable_data.size());
+				bool reliable = (r == 0);
+				std::vector<ActiveObjectMessage*> &messages =
+						reliable ? reliable_messages : unreliable_messages;
+				u32 size = reliable ? reliable_size : unreliable_size;
+				if(size == 0)
+					continue;
+				PacketBuffer reply(2 + size);
 				writeU16(&reply[0], TOCLIENT_ACTIVE_OBJECT_MESSAGES);
-				memcpy((char*)&reply[2], unreliable_data.c_str(),
-						unreliable_data.size());
-				// Send as unreliable
-				m_con.Send(client->peer_id, 0, reply, false);
+				u32 pos = 2;
+				for(u32 k=0; k<messages.size(); k++)
+				{
+					ActiveObjectMessage *aom = messages[k];
+					writeU16(&reply[pos], aom->id);
+					writeU16(&reply[pos+2], aom->datastring.size());
+					memcpy(&reply[pos+4], aom->datastring.c_str(),
+							aom->datastring.size());
+					pos += 4 + aom->datastring.size();
+				}
+				m_con.Send(client->peer_id, 0, reply, reliable);
 			}
 		}
 
@@ -1606,7 +1707,7 @@ void Server::AsyncRunStep()
 		if (counter >= 2.0) {
 			counter = 0.0;
 
-			m_emergethread.trigger();
+			triggerEmergeThreads();
 		}
 	}
 
@@ -5748,24 +5849,33 @@ void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver)
 #endif
 
 	/*
-		Create a packet with the block in the right format
+		Create a packet with the block in the right format, or reuse
+		the one made when it was last sent to someone
 	*/
 
-	std::ostringstream os(std::ios_base::binary);
-	block->serialize(os, ver);
-	std::string s = os.str();
-	SharedBuffer<u8> blockdata((u8*)s.c_str(), s.size());
+	PacketBuffer reply;
+	if (block->getCachedPacket(ver, reply)) {
+		g_profiler->add("Server: block packets reused", 1);
+	}else{
+		// Serialized straight into the packet, the connection doesn't
+		// copy it again
+		PacketBufferWriter buf(4096-PACKET_HEADROOM);
+		std::ostream os(&buf);
+		os.write("\0\0\0\0\0\0\0\0", 8);
+		block->serialize(os, ver);
+
+		reply = buf.getBuffer();
+		writeU16(&reply[0], TOCLIENT_BLOCKDATA);
+		writeS16(&reply[2], p.X);
+		writeS16(&reply[4], p.Y);
+		writeS16(&reply[6], p.Z);
 
-	u32 replysize = 8 + blockdata.getSize();
-	SharedBuffer<u8> reply(replysize);
-	writeU16(&reply[0], TOCLIENT_BLOCKDATA);
-	writeS16(&reply[2], p.X);
-	writeS16(&reply[4], p.Y);
-	writeS16(&reply[6], p.Z);
-	memcpy(&reply[8], *blockdata, blockdata.getSize());
+		block->setCachedPacket(ver, reply);
+		g_profiler->add("Server: block packets serialized", 1);
+	}
 
 	/*infostream<<"Server: Sending block ("<<p.X<<","<<p.Y<<","<<p.Z<<")"
-			<<":  \tpacket size: "<<replysize<<std::endl;*/
+			<<":  \tpacket size: "<<reply.getSize()<<std::endl;*/
 
 	/*
 		Send packet
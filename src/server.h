@@ -127,12 +127,89 @@ public:
 		return q;
 	}
 
+	/*
+		Like pop(), but skips blocks whose neighbourhood overlaps that
+		of a block some other emerge thread is working on, generating
+		a block writes back all of its neighbours too.
+		done() must be called with the position when finished.
+	*/
+	QueuedBlockEmerge * popUnreserved()
+	{
+		JMutexAutoLock lock(m_mutex);
+
+		core::list<QueuedBlockEmerge*>::Iterator i;
+		for(i=m_queue.begin(); i!=m_queue.end(); i++)
+		{
+			QueuedBlockEmerge *q = *i;
+			if(isReserved(q->pos))
+				continue;
+			m_queue.erase(i);
+			m_reserved.push_back(q->pos);
+			return q;
+		}
+		return NULL;
+	}
+
+	void done(v3s16 pos)
+	{
+		JMutexAutoLock lock(m_mutex);
+
+		core::list<v3s16>::Iterator i;
+		for(i=m_reserved.begin(); i!=m_reserved.end(); i++)
+		{
+			if(*i == pos)
+			{
+				m_reserved.erase(i);
+				return;
+			}
+		}
+	}
+
 	u32 size()
 	{
 		JMutexAutoLock lock(m_mutex);
 		return m_queue.size();
 	}
 
+	/*
+		Blocks that are only to be read from disk ahead of time,
+		they are loaded together by the next emerge thread
+	*/
+	void addPrefetch(core::list<v3s16> &blocks)
+	{
+		JMutexAutoLock lock(m_mutex);
+
+		core::list<v3s16>::Iterator i;
+		for(i=blocks.begin(); i!=blocks.end(); i++)
+		{
+			// Don't pile up if the emerge threads can't keep up
+			if(m_prefetch.size() >= 256)
+				break;
+			m_prefetch.insert(*i, true);
+		}
+	}
+
+	// Returns false if there is nothing to prefetch
+	bool popPrefetch(core::list<v3s16> &dst)
+	{
+		JMutexAutoLock lock(m_mutex);
+
+		if(m_prefetch.size() == 0)
+			return false;
+
+		core::map<v3s16, bool>::Iterator i;
+		for(i=m_prefetch.getIterator(); i.atEnd()==false; i++)
+			dst.push_back(i.getNode()->getKey());
+		m_prefetch.clear();
+		return true;
+	}
+
+	u32 prefetchSize()
+	{
+		JMutexAutoLock lock(m_mutex);
+		return m_prefetch.size();
+	}
+
 	u32 peerItemCount(u16 peer_id)
 	{
 		JMutexAutoLock lock(m_mutex);
@@ -151,7 +228,23 @@ public:
 	}
 
 private:
+	// m_mutex must be locked
+	bool isReserved(v3s16 pos)
+	{
+		core::list<v3s16>::Iterator i;
+		for(i=m_reserved.begin(); i!=m_reserved.end(); i++)
+		{
+			v3s16 d = *i - pos;
+			if(abs(d.X) <= 2 && abs(d.Y) <= 2 && abs(d.Z) <= 2)
+				return true;
+		}
+		return false;
+	}
+
 	core::list<QueuedBlockEmerge*> m_queue;
+	// Blocks that emerge threads are working on
+	core::list<v3s16> m_reserved;
+	core::map<v3s16, bool> m_prefetch;
 	JMutex m_mutex;
 };
 
@@ -366,6 +459,8 @@ public:
 	~Server();
 	void start();
 	void stop();
+	// Starts emerge threads for what is in the emerge queue
+	void triggerEmergeThreads();
 	// This is mainly a way to pass the time to the server.
 	// Actual processing is done in an another thread.
 	bool step(float dtime);
@@ -607,9 +702,9 @@ private:
 
 	// The server mainly operates in this thread
 	ServerThread m_thread;
-	// This thread fetches and generates map
-	EmergeThread m_emergethread;
-	// Queue of block coordinates to be processed by the emerge thread
+	// These threads fetch and generate map, see server.emerge.threads
+	core::array<EmergeThread*> m_emergethreads;
+	// Queue of block coordinates to be processed by the emerge threads
 	BlockEmergeQueue m_emerge_queue;
 
 	/*
@@ -76,6 +76,7 @@
 #include "http.h"
 #include "thread.h"
 #include "path.h"
+#include "mapdatabase.h"
 
 // Global profiler
 Profiler main_profiler;
@@ -132,6 +133,52 @@ public:
 	}
 } main_dstream_no_stderr_log_out;
 
+/*
+	Copies the world's map into a scratch store of each database
+	backend and times reading and writing it, for server.map.benchmark
+*/
+static void map_database_benchmark()
+{
+	char file[1024];
+	// Deleted however this returns, the backends throw on errors
+	SharedPtr<MapDatabase> from;
+
+	for (int i=0; from == NULL && MapDatabase::backends[i]; i++)
+	{
+		const char *name = MapDatabase::backends[i];
+		if (!path_get("world",MapDatabase::getFileName(name),1,file,1024))
+			continue;
+		from = MapDatabase::create(name, file);
+		from->open();
+	}
+	if (from == NULL)
+	{
+		std::cout<<"No map to benchmark in this world"<<std::endl;
+		return;
+	}
+
+	core::list<v3s16> blocks;
+	from->listBlocks(blocks);
+
+	for (int i=0; MapDatabase::backends[i]; i++)
+	{
+		const char *name = MapDatabase::backends[i];
+		std::string scratch = std::string("benchmark.")+MapDatabase::getFileName(name);
+		if (!path_get("world",scratch.c_str(),0,file,1024))
+			continue;
+		remove(file);
+
+		{
+			SharedPtr<MapDatabase> to(MapDatabase::create(name, file));
+			to->open();
+			convertMapDatabase(&*from, &*to);
+			benchmarkMapDatabase(&*to, blocks, std::cout);
+		}
+
+		remove(file);
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	/*
@@ -232,6 +279,14 @@ int main(int argc, char *argv[])
 
 	world_init(NULL);
 
+	if (config_get_bool("server.map.benchmark"))
+	{
+		map_database_benchmark();
+		world_exit();
+		debugstreams_deinit();
+		return 0;
+	}
+
 	// Create server
 	Server server;
 	server.start();
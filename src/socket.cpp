@@ -169,6 +169,20 @@ UDPSocket::UDPSocket()
 	}
 
 	setTimeoutMs(0);
+
+	m_received_data.resize(UDP_BATCH_SIZE*UDP_BATCH_DATAGRAM_SIZE);
+	m_received.resize(UDP_BATCH_SIZE);
+	m_received_count = 0;
+	m_received_next = 0;
+
+	m_queued_data.resize(UDP_BATCH_SIZE*UDP_BATCH_DATAGRAM_SIZE);
+	m_queued.resize(UDP_BATCH_SIZE);
+	m_queued_count = 0;
+
+	m_send_calls = 0;
+	m_sent_datagrams = 0;
+	m_receive_calls = 0;
+	m_received_datagrams = 0;
 }
 
 UDPSocket::~UDPSocket()
@@ -176,6 +190,8 @@ UDPSocket::~UDPSocket()
 	if(DP)
 	dstream<<DPS<<"UDPSocket("<<(int)m_handle<<")::~UDPSocket()"<<std::endl;
 
+	Flush();
+
 #ifdef _WIN32
 	closesocket(m_handle);
 #else
@@ -246,6 +262,10 @@ void UDPSocket::Send(const Address & destination, const void * data, int size)
 	int sent = sendto(m_handle, (const char*)data, size,
 		0, (sockaddr*)&address, sizeof(sockaddr_in));
 
+	m_send_calls++;
+	if(sent == size)
+		m_sent_datagrams++;
+
 	if(sent != size)
 	{
 		throw SendFailedException("Failed to send packet");
@@ -254,24 +274,21 @@ void UDPSocket::Send(const Address & destination, const void * data, int size)
 
 int UDPSocket::Receive(Address & sender, void * data, int size)
 {
-	if(WaitData(m_timeout_ms) == false)
+	if(m_received_next >= m_received_count)
 	{
-		return -1;
+		if(WaitData(m_timeout_ms) == false)
+			return -1;
+		if(receiveBatch() == false)
+			return -1;
 	}
 
-	sockaddr_in address;
-	socklen_t address_len = sizeof(address);
-
-	int received = recvfrom(m_handle, (char*)data,
-			size, 0, (sockaddr*)&address, &address_len);
-
-	if(received < 0)
-		return -1;
-
-	unsigned int address_ip = ntohl(address.sin_addr.s_addr);
-	unsigned int address_port = ntohs(address.sin_port);
-
-	sender = Address(address_ip, address_port);
+	Datagram &d = m_received[m_received_next];
+	int received = d.size;
+	if(received > size)
+		received = size;
+	memcpy(data, &m_received_data[m_received_next*UDP_BATCH_DATAGRAM_SIZE], received);
+	sender = d.address;
+	m_received_next++;
 
 	if(DP){
 		//dstream<<DPS<<"UDPSocket("<<(int)m_handle<<")::Receive(): sender=";
@@ -291,6 +308,203 @@ int UDPSocket::Receive(Address & sender, void * data, int size)
 	return received;
 }
 
+bool UDPSocket::receiveBatch()
+{
+	m_received_count = 0;
+	m_received_next = 0;
+
+#ifdef UDP_BATCHING
+	sockaddr_in addresses[UDP_BATCH_SIZE];
+	iovec iovs[UDP_BATCH_SIZE];
+	mmsghdr msgs[UDP_BATCH_SIZE];
+	memset(msgs, 0, sizeof(msgs));
+	for(int i=0; i<UDP_BATCH_SIZE; i++)
+	{
+		iovs[i].iov_base = &m_received_data[i*UDP_BATCH_DATAGRAM_SIZE];
+		iovs[i].iov_len = UDP_BATCH_DATAGRAM_SIZE;
+		msgs[i].msg_hdr.msg_name = &addresses[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int got = recvmmsg(m_handle, msgs, UDP_BATCH_SIZE, MSG_DONTWAIT, NULL);
+	m_receive_calls++;
+	if(got <= 0)
+		return false;
+	m_received_datagrams += got;
+
+	for(int i=0; i<got; i++)
+	{
+		// Too big to be one of ours
+		if(msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+			continue;
+		Datagram &d = m_received[m_received_count];
+		d.address = Address(ntohl(addresses[i].sin_addr.s_addr),
+				ntohs(addresses[i].sin_port));
+		d.size = msgs[i].msg_len;
+		// Keep them packed at the front
+		if(m_received_count != (unsigned int)i)
+			memcpy(&m_received_data[m_received_count*UDP_BATCH_DATAGRAM_SIZE],
+					&m_received_data[i*UDP_BATCH_DATAGRAM_SIZE], d.size);
+		m_received_count++;
+	}
+#else
+	sockaddr_in address;
+	socklen_t address_len = sizeof(address);
+
+	int received = recvfrom(m_handle, &m_received_data[0],
+			UDP_BATCH_DATAGRAM_SIZE, 0, (sockaddr*)&address, &address_len);
+	m_receive_calls++;
+	if(received < 0)
+		return false;
+	m_received_datagrams++;
+
+	Datagram &d = m_received[0];
+	d.address = Address(ntohl(address.sin_addr.s_addr), ntohs(address.sin_port));
+	d.size = received;
+	m_received_count = 1;
+#endif
+
+	return m_received_count > 0;
+}
+
+void UDPSocket::QueueSend(const Address & destination, const void * data, int size)
+{
+#ifdef UDP_BATCHING
+	if(size > UDP_BATCH_DATAGRAM_SIZE)
+	{
+		// Keep the order
+		Flush();
+		Send(destination, data, size);
+		return;
+	}
+
+	char *copy = &m_queued_data[m_queued_count*UDP_BATCH_DATAGRAM_SIZE];
+	memcpy(copy, data, size);
+	queue(destination, NULL, 0, copy, size);
+#else
+	Send(destination, data, size);
+#endif
+}
+
+void UDPSocket::QueueSendParts(const Address & destination,
+		const void * header, int header_size, const void * data, int size)
+{
+#ifdef UDP_BATCHING
+	queue(destination, header, header_size, data, size);
+#else
+	std::vector<char> datagram(header_size+size);
+	if(header_size)
+		memcpy(&datagram[0], header, header_size);
+	if(size)
+		memcpy(&datagram[header_size], data, size);
+	Send(destination, &datagram[0], header_size+size);
+#endif
+}
+
+void UDPSocket::queue(const Address & destination,
+		const void * header, int header_size, const void * data, int size)
+{
+	if(INTERNET_SIMULATOR && myrand()%10==0)
+	{
+		dstream<<"UDPSocket::QueueSend(): "
+				"INTERNET_SIMULATOR: dumping packet."
+				<<std::endl;
+		return;
+	}
+
+	if(DP){
+		dstream<<DPS<<(int)m_handle<<" -> ";
+		destination.print();
+		dstream<<", size="<<(header_size+size)<<" (queued)"<<std::endl;
+	}
+
+	Datagram &d = m_queued[m_queued_count];
+	d.address = destination;
+	d.header = header;
+	d.header_size = header_size;
+	d.data = data;
+	d.size = size;
+	m_queued_count++;
+
+	if(m_queued_count == UDP_BATCH_SIZE)
+		Flush();
+}
+
+void UDPSocket::Flush()
+{
+#ifdef UDP_BATCHING
+	if(m_queued_count == 0)
+		return;
+
+	sockaddr_in addresses[UDP_BATCH_SIZE];
+	iovec iovs[UDP_BATCH_SIZE*2];
+	mmsghdr msgs[UDP_BATCH_SIZE];
+	memset(msgs, 0, sizeof(msgs));
+	for(unsigned int i=0; i<m_queued_count; i++)
+	{
+		Datagram &d = m_queued[i];
+		addresses[i].sin_family = AF_INET;
+		addresses[i].sin_addr.s_addr = htonl(d.address.getAddress());
+		addresses[i].sin_port = htons(d.address.getPort());
+		memset(addresses[i].sin_zero, 0, sizeof(addresses[i].sin_zero));
+		// The parts are gathered into one datagram
+		iovec *iov = &iovs[i*2];
+		size_t iovlen = 0;
+		if(d.header_size)
+		{
+			iov[iovlen].iov_base = const_cast<void*>(d.header);
+			iov[iovlen].iov_len = d.header_size;
+			iovlen++;
+		}
+		iov[iovlen].iov_base = const_cast<void*>(d.data);
+		iov[iovlen].iov_len = d.size;
+		iovlen++;
+		msgs[i].msg_hdr.msg_name = &addresses[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+		msgs[i].msg_hdr.msg_iov = iov;
+		msgs[i].msg_hdr.msg_iovlen = iovlen;
+	}
+
+	unsigned int done = 0;
+	while(done < m_queued_count)
+	{
+		int sent = sendmmsg(m_handle, &msgs[done], m_queued_count-done, 0);
+		m_send_calls++;
+		if(sent < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			// Like a lost packet, the connection sends reliable ones again
+#ifndef DISABLE_ERRNO
+			dstream<<(int)m_handle<<": sendmmsg failed: "<<strerror(errno)
+					<<", dropping "<<(m_queued_count-done)<<" datagrams"<<std::endl;
+#endif
+			break;
+		}
+		m_sent_datagrams += sent;
+		done += sent;
+	}
+
+	m_queued_count = 0;
+#endif
+}
+
+float UDPSocket::getSentPerCall()
+{
+	if(m_send_calls == 0)
+		return 0;
+	return (float)m_sent_datagrams/m_send_calls;
+}
+
+float UDPSocket::getReceivedPerCall()
+{
+	if(m_receive_calls == 0)
+		return 0;
+	return (float)m_received_datagrams/m_receive_calls;
+}
+
 int UDPSocket::GetHandle()
 {
 	return m_handle;
@@ -303,6 +517,9 @@ void UDPSocket::setTimeoutMs(int timeout_ms)
 
 bool UDPSocket::WaitData(int timeout_ms)
 {
+	if(m_received_next < m_received_count)
+		return true;
+
 	fd_set readset;
 	int result;
 
@@ -50,7 +50,19 @@ typedef int socklen_t;
 typedef int socket_t;
 #endif
 
+// recvmmsg() and sendmmsg() move several datagrams in one call
+#if defined(__linux__)
+	#define UDP_BATCHING
+#endif
+
+// Most datagrams received or sent in one call
+#define UDP_BATCH_SIZE 32
+// Largest datagram that can be received or queued in a batch, the
+// connections send at most their max packet size and headers
+#define UDP_BATCH_DATAGRAM_SIZE 4096
+
 #include <ostream>
+#include <vector>
 #include "exceptions.h"
 #include "constants.h"
 
@@ -124,9 +136,59 @@ public:
 	void setTimeoutMs(int timeout_ms);
 	// Returns true if there is data, false if timeout occurred
 	bool WaitData(int timeout_ms);
+
+	/*
+		Queued datagrams are sent together by Flush(), which is also
+		done when the queue is full. Sending and receiving can be done
+		by two different threads, but each only by one.
+	*/
+	void QueueSend(const Address & destination, const void * data, int size);
+	/*
+		Sends the header and the data as one datagram without copying
+		them where the datagrams are queued, so they have to be kept
+		until Flush() is done.
+	*/
+	void QueueSendParts(const Address & destination,
+			const void * header, int header_size, const void * data, int size);
+	void Flush();
+
+	// Datagrams moved for each send or receive call made
+	float getSentPerCall();
+	float getReceivedPerCall();
+
 private:
+	struct Datagram
+	{
+		Address address;
+		int size;
+		// Where a queued datagram is, the header goes before the data
+		const void *header;
+		int header_size;
+		const void *data;
+	};
+
+	// Gets as many waiting datagrams as there are, up to a batch
+	bool receiveBatch();
+	void queue(const Address & destination,
+			const void * header, int header_size, const void * data, int size);
+
 	int m_handle;
 	int m_timeout_ms;
+
+	// Received but not yet taken by Receive()
+	std::vector<char> m_received_data;
+	std::vector<Datagram> m_received;
+	unsigned int m_received_count;
+	unsigned int m_received_next;
+
+	std::vector<char> m_queued_data;
+	std::vector<Datagram> m_queued;
+	unsigned int m_queued_count;
+
+	unsigned int m_send_calls;
+	unsigned int m_sent_datagrams;
+	unsigned int m_receive_calls;
+	unsigned int m_received_datagrams;
 };
 
 class TCPSocket
@@ -35,10 +35,21 @@
 #include "serialization.h"
 #include "voxel.h"
 #include <sstream>
+#include <algorithm>
+#include <list>
 #include "porting.h"
 #include "content_mapnode.h"
 #include "mapsector.h"
+#include "mapblock.h"
+#include "mineral.h"
 #include "log.h"
+#include "mapdatabase.h"
+#include "path.h"
+#include "environment.h"
+#include "content_nodemeta.h"
+#include "inventory.h"
+#include "content_sao.h"
+#include "content_mob.h"
 
 /*
 	Asserts that the exception occurs
@@ -184,6 +195,127 @@ struct TestCompress
 		}
 
 		}
+
+		{ // buffers, with data after the compressed part
+
+		std::string fromdata = "voxelands voxelands voxelands";
+		std::string compressed;
+		compressBuffer((const u8*)fromdata.c_str(), fromdata.size(),
+				compressed, CODEC_ZLIB_FAST);
+		const u32 len = compressed.size();
+		compressed += "extra";
+
+		std::string str_out2;
+		u32 used = decompressBuffer((const u8*)compressed.c_str(),
+				compressed.size(), str_out2);
+		assert(used == len);
+		assert(str_out2 == fromdata);
+
+		}
+
+		{ // cut short, from a buffer and a stream
+
+		std::string fromdata = "voxelands voxelands voxelands";
+		std::string compressed;
+		compressBuffer((const u8*)fromdata.c_str(), fromdata.size(),
+				compressed, CODEC_ZLIB_FAST);
+		compressed.resize(compressed.size()/2);
+
+		bool thrown = false;
+		try {
+			std::string str_out2;
+			decompressBuffer((const u8*)compressed.c_str(),
+					compressed.size(), str_out2);
+		}catch(SerializationError &e) {
+			thrown = true;
+		}
+		assert(thrown);
+
+		thrown = false;
+		try {
+			std::istringstream is(compressed, std::ios_base::binary);
+			std::ostringstream os2(std::ios_base::binary);
+			decompressZlib(is, os2);
+		}catch(SerializationError &e) {
+			thrown = true;
+		}
+		assert(thrown);
+
+		}
+
+		benchmark();
+	}
+
+	/*
+		Blocks like the ones mapgen makes: sky, underground with
+		minerals and caves, and the surface in between
+	*/
+	void makeSample(MapBlock &b, u32 kind)
+	{
+		for (s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for (s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for (s16 x=0; x<MAP_BLOCKSIZE; x++) {
+			MapNode n(CONTENT_AIR, LIGHT_SUN);
+			if (kind == 1) {
+				n = MapNode(CONTENT_STONE);
+				if (myrand_range(0,30) == 0)
+					n.param1 = myrand_range(MINERAL_COAL, MINERAL_SILVER);
+				else if (myrand_range(0,20) == 0)
+					n = MapNode(CONTENT_AIR);
+			}else if (kind == 2) {
+				s16 h = 6+(x+z)/8;
+				if (y < h-3)
+					n = MapNode(CONTENT_STONE);
+				else if (y < h)
+					n = MapNode(CONTENT_MUD);
+				else if (y == h)
+					n = MapNode(CONTENT_MUD, 0x01);
+				else if (y < 8)
+					n = MapNode(CONTENT_WATERSOURCE);
+			}
+			b.setNodeNoCheck(x, y, z, n);
+		}
+	}
+
+	void benchmark()
+	{
+		const u32 iterations = 200;
+		const char *names[] = {"sky", "underground", "surface"};
+		const u8 versions[] = {22, 23};
+
+		mysrand(1);
+
+		for (u32 kind=0; kind<3; kind++) {
+			MapBlock b(NULL, v3s16(0,0,0));
+			makeSample(b, kind);
+
+			for (u32 v=0; v<2; v++)
+			for (u32 disk=0; disk<2; disk++) {
+				std::string data;
+				u32 t0 = porting::getTimeMs();
+				for (u32 i=0; i<iterations; i++) {
+					std::ostringstream os(std::ios_base::binary);
+					b.serialize(os, versions[v], disk);
+					data = os.str();
+				}
+				u32 t1 = porting::getTimeMs();
+				for (u32 i=0; i<iterations; i++) {
+					MemoryStreamBuffer buf(data.c_str(), data.size());
+					std::istream is(&buf);
+					MapBlock b2(NULL, v3s16(0,0,0));
+					b2.deSerialize(is, versions[v]);
+				}
+				u32 t2 = porting::getTimeMs();
+
+				// Throughput of the node data the block holds, KB/ms is MB/s
+				const u32 kb = iterations*MAP_BLOCKSIZE3*4/1000;
+				infostream<<"TestCompress: "<<names[kind]<<" v"<<(u32)versions[v]
+						<<(disk ? " disk: " : " network: ")<<data.size()<<" bytes, "
+						<<"serialize "<<kb/MYMAX(t1-t0,1)<<"MB/s, "
+						<<"deserialize "<<kb/MYMAX(t2-t1,1)<<"MB/s"
+						<<std::endl;
+			}
+		}
 	}
 };
 
@@ -678,6 +810,57 @@ struct TestMapSector
 };
 #endif
 
+/*
+	Packet buffers come back from the pool, take headers in front while
+	only one uses them, and the writer grows them as needed
+*/
+struct TestPacketBuffer
+{
+	void Run()
+	{
+		u8 *memory;
+		{
+			PacketBuffer a(100);
+			memory = *a;
+		}
+		u32 reused0, allocated0;
+		PacketBuffer::getPoolStats(reused0, allocated0);
+		PacketBuffer b(100);
+		assert(*b == memory);
+		u32 reused, allocated;
+		PacketBuffer::getPoolStats(reused, allocated);
+		assert(reused == reused0+1);
+		assert(allocated == allocated0);
+
+		b[0] = 42;
+		assert(b.unique());
+		assert(b.getHeadroom() == PACKET_HEADROOM);
+		u8 *header = b.prepend(3);
+		assert(header == *b);
+		assert(b.getSize() == 103);
+		assert(b.getHeadroom() == PACKET_HEADROOM-3);
+		assert(b[3] == 42);
+
+		PacketBuffer c = b;
+		assert(!b.unique());
+		assert(*c == *b);
+
+		PacketBufferWriter writer(4);
+		std::ostream os(&writer);
+		for (u32 i=0; i<1000; i++) {
+			os.put((char)i);
+		}
+		os.write("abc", 3);
+		PacketBuffer d = writer.getBuffer();
+		assert(d.getSize() == 1003);
+		for (u32 i=0; i<1000; i++) {
+			assert(d[i] == (u8)i);
+		}
+		assert(d[1000] == 'a');
+		assert(d[1002] == 'c');
+	}
+};
+
 struct TestSocket
 {
 	void Run()
@@ -703,6 +886,36 @@ struct TestSocket
 		//FIXME: This fails on some systems
 		assert(strncmp(sendbuffer, rcvbuffer, sizeof(sendbuffer))==0);
 		assert(sender.getAddress() == Address(127,0,0,1, 0).getAddress());
+
+		/*
+			Queued datagrams arrive in order
+		*/
+		for(int i=0; i<UDP_BATCH_SIZE+8; i++)
+		{
+			char buf[64];
+			memset(buf, 0, sizeof(buf));
+			buf[0] = i;
+			socket.QueueSend(Address(127,0,0,1,port), buf, i+1);
+		}
+		socket.Flush();
+
+		sleep_ms(50);
+
+		int count = 0;
+		for(;;)
+		{
+			int bytes_read = socket.Receive(sender, rcvbuffer, sizeof(rcvbuffer));
+			if(bytes_read < 0)
+				break;
+			assert(bytes_read == count+1);
+			assert(rcvbuffer[0] == count);
+			count++;
+		}
+		assert(count == UDP_BATCH_SIZE+8);
+#ifdef UDP_BATCHING
+		assert(socket.getSentPerCall() > 1.0);
+		assert(socket.getReceivedPerCall() > 1.0);
+#endif
 	}
 };
 
@@ -1109,6 +1322,1065 @@ struct TestConnection
 	}
 };
 
+/*
+	Sends reliable packets from a server to a client through a link with
+	a delay and losses, and reports how fast they got through
+*/
+struct TestConnectionThroughput
+{
+	// Passes packets between the server and one client, holding each
+	// one for a while and dropping some
+	class Link : public SimpleThread
+	{
+	public:
+		Link(u16 port, Address server, u32 delay_ms, u32 loss_percent):
+			m_server(server),
+			m_delay_ms(delay_ms),
+			m_loss_percent(loss_percent)
+		{
+			m_socket.Bind(port);
+			m_socket.setTimeoutMs(1);
+		}
+
+		void * Thread()
+		{
+			ThreadStarted();
+			mysrand(1);
+
+			Address client;
+			std::list<Delayed> delayed;
+			char buffer[2048];
+
+			while (getRun()) {
+				Address sender;
+				int size = m_socket.Receive(sender, buffer, sizeof(buffer));
+				u32 now = porting::getTimeMs();
+				if (size > 0 && (u32)(myrand()%100) >= m_loss_percent) {
+					Delayed d;
+					d.time = now+m_delay_ms;
+					d.data.assign(buffer,size);
+					if (sender == m_server) {
+						d.destination = client;
+					}else{
+						client = sender;
+						d.destination = m_server;
+					}
+					delayed.push_back(d);
+				}
+				while (delayed.size() && (s32)(now-delayed.front().time) >= 0) {
+					m_socket.Send(delayed.front().destination, delayed.front().data.c_str(), delayed.front().data.size());
+					delayed.pop_front();
+				}
+			}
+
+			return NULL;
+		}
+
+	private:
+		struct Delayed
+		{
+			u32 time;
+			Address destination;
+			std::string data;
+		};
+
+		UDPSocket m_socket;
+		Address m_server;
+		u32 m_delay_ms;
+		u32 m_loss_percent;
+	};
+
+	void Run()
+	{
+		DSTACK("TestConnectionThroughput::Run");
+
+		u32 proto_id = 0xad26846a;
+		const u32 count = 300;
+		const u32 size = 400;
+
+		TestConnection::Handler hand_server("server");
+		TestConnection::Handler hand_client("client");
+
+		con::Connection server(proto_id, 512, 30.0, &hand_server);
+		server.Serve(30002);
+		con::Connection client(proto_id, 512, 30.0, &hand_client);
+
+		// 150ms round trips, 2% of packets lost each way
+		Link link(30003, Address(127,0,0,1, 30002), 75, 2);
+		link.Start();
+
+		client.Connect(Address(127,0,0,1, 30003));
+
+		u32 start = porting::getTimeMs();
+		while (client.Connected() == false || hand_server.count == 0) {
+			assert(porting::getTimeMs()-start < 10000);
+			u16 peer_id;
+			SharedBuffer<u8> data;
+			try {
+				client.Receive(peer_id, data);
+			}catch(con::NoIncomingDataException &e) {
+			}
+			try {
+				server.Receive(peer_id, data);
+			}catch(con::NoIncomingDataException &e) {
+			}
+			sleep_ms(10);
+		}
+
+		start = porting::getTimeMs();
+		for (u32 i=0; i<count; i++) {
+			SharedBuffer<u8> data(size);
+			for (u32 k=0; k<size; k++) {
+				data[k] = k;
+			}
+			writeU32(&data[0], i);
+			server.Send(hand_server.last_id, 0, data, true);
+		}
+
+		u32 received = 0;
+		while (received < count) {
+			assert(porting::getTimeMs()-start < 60000);
+			u16 peer_id;
+			SharedBuffer<u8> data;
+			try {
+				client.Receive(peer_id, data);
+			}catch(con::NoIncomingDataException &e) {
+				sleep_ms(1);
+				continue;
+			}
+			assert(data.getSize() == size);
+			// In order and all there
+			assert(readU32(&data[0]) == received);
+			received++;
+		}
+
+		u32 took = porting::getTimeMs()-start;
+		if (took < 1)
+			took = 1;
+		infostream<<"TestConnectionThroughput: "<<count<<" packets of "<<size
+				<<" bytes at 150ms and 2% loss took "<<took<<"ms, "
+				<<(count*size/took)<<"KB/s"<<std::endl;
+
+		// The client acked every packet, some more than once
+		infostream<<"TestConnectionThroughput: client ";
+		client.printAckLatency(infostream);
+		u32 counts[ACK_LATENCY_BUCKETS];
+		client.getAckLatency(counts);
+		u32 acks = 0;
+		for (u32 i=0; i<ACK_LATENCY_BUCKETS; i++) {
+			acks += counts[i];
+		}
+		assert(acks >= count);
+
+		link.stop();
+	}
+};
+
+/*
+	Reliable packets are found by seqnum across the wrap around, and
+	re-sent in the order they were last sent in
+*/
+struct TestReliablePacketBuffer
+{
+	con::BufferedPacket packet(u16 seqnum)
+	{
+		Address a(127,0,0,1, 30000);
+		SharedBuffer<u8> data(1);
+		data[0] = seqnum & 0xff;
+		SharedBuffer<u8> reliable = con::makeReliablePacket(data, seqnum);
+		return con::makePacket(a, reliable, 0, 0, 0);
+	}
+
+	u16 seqnum(con::BufferedPacket &p)
+	{
+		return readU16(&p.data[BASE_HEADER_SIZE+1]);
+	}
+
+	void Run()
+	{
+		assert(con::seqnum_higher(2, 65530));
+		assert(!con::seqnum_higher(65530, 2));
+
+		con::ReliablePacketBuffer b;
+
+		for (u16 s=65530; s!=6; s++) {
+			con::BufferedPacket p = packet(s);
+			b.insert(p);
+			b.incrementTimeouts(0.1);
+		}
+		assert(b.size() == 12);
+		assert(b.getFirstSeqnum() == 65530);
+
+		bool exists = false;
+		try {
+			con::BufferedPacket p = packet(2);
+			b.insert(p);
+		}catch(AlreadyExistsException &e) {
+			exists = true;
+		}
+		assert(exists);
+
+		assert(b.fits((u16)(65530+RELIABLE_BUFFER_SIZE-1)));
+		assert(!b.fits((u16)(65530+RELIABLE_BUFFER_SIZE)));
+		assert(!b.fits(5-RELIABLE_BUFFER_SIZE));
+
+		con::BufferedPacket p = b.popSeqnum(1);
+		assert(seqnum(p) == 1);
+		assert(p.totaltime > 0.45 && p.totaltime < 0.55);
+
+		bool found = true;
+		try {
+			b.popSeqnum(1);
+		}catch(con::NotFoundException &e) {
+			found = false;
+		}
+		assert(!found);
+
+		// The first 6 were sent 0.7s ago or more
+		core::list<con::BufferedPacket> timed_outs = b.getTimedOuts(0.65);
+		assert(timed_outs.size() == 6);
+		assert(seqnum(*timed_outs.begin()) == 65530);
+		// Now they're the last to time out
+		b.incrementTimeouts(0.5);
+		timed_outs = b.getTimedOuts(0.65);
+		assert(timed_outs.size() == 4);
+		assert(seqnum(*timed_outs.begin()) == 0);
+
+		assert(!b.anyTotaltimeReached(1.75));
+		assert(b.anyTotaltimeReached(1.65));
+
+		for (u16 s=65530; s!=6; s++) {
+			if (s == 1)
+				continue;
+			assert(b.getFirstSeqnum() == s);
+			p = b.popFirst();
+			assert(seqnum(p) == s);
+		}
+		assert(b.empty());
+	}
+};
+
+/*
+	Packets lost together within a round trip only shrink the window
+	once, even before the round trip time has been measured
+*/
+struct TestChannelWindowLost
+{
+	void Run()
+	{
+		con::Peer peer(2, Address());
+		float rtt = peer.getRTT();
+		assert(rtt == (float)RTT_DEFAULT);
+
+		con::Channel *ch = &peer.channels[0];
+		for (u32 i=0; i<20; i++) {
+			ch->windowAcked();
+		}
+		float window = ch->window;
+
+		ch->window_lost_timer += rtt;
+		ch->windowLost(rtt);
+		assert(ch->window == window/2);
+		ch->window_lost_timer += rtt/2;
+		ch->windowLost(rtt);
+		assert(ch->window == window/2);
+		ch->window_lost_timer += rtt/2;
+		ch->windowLost(rtt);
+		assert(ch->window == window/4);
+	}
+};
+
+struct TestMapDatabase
+{
+	struct Receiver : public MapDatabaseReceiver
+	{
+		void receiveBlock(v3s16 pos, const char *data, size_t len)
+		{
+			blocks[pos] = std::string(data, len);
+		}
+		std::map<v3s16, std::string> blocks;
+	};
+
+	void Run()
+	{
+		char file[1024];
+		if (!path_get(NULL,"test_map.vxlog",0,file,1024))
+			return;
+		remove(file);
+
+		core::list<v3s16> wanted;
+		wanted.push_back(v3s16(0,0,0));
+		wanted.push_back(v3s16(-1,2,-3));
+		wanted.push_back(v3s16(5,5,5));
+
+		{
+			LogMapDatabase db(file);
+			db.open();
+			db.beginSave();
+			db.saveBlock(v3s16(0,0,0), "first", 5);
+			db.saveBlock(v3s16(-1,2,-3), "block", 5);
+			db.saveBlock(v3s16(0,0,0), "second", 6);
+			db.endSave();
+		}
+
+		// Garbage at the end is what a crash during a write leaves
+		{
+			FILE *f = fopen(file, "ab");
+			assert(f);
+			fwrite("\x56\x58\x42", 1, 3, f);
+			fclose(f);
+		}
+
+		{
+			LogMapDatabase db(file);
+			db.open();
+
+			Receiver r;
+			assert(db.loadBlocks(wanted, &r) == 2);
+			assert(r.blocks[v3s16(0,0,0)] == "second");
+			assert(r.blocks[v3s16(-1,2,-3)] == "block");
+
+			// Written over the garbage
+			db.saveBlock(v3s16(5,5,5), "third", 5);
+			db.compact();
+
+			core::list<v3s16> all;
+			db.listBlocks(all);
+			assert(all.size() == 3);
+		}
+
+		{
+			LogMapDatabase db(file);
+			db.open();
+
+			Receiver r;
+			assert(db.loadBlocks(wanted, &r) == 3);
+			assert(r.blocks[v3s16(0,0,0)] == "second");
+			assert(r.blocks[v3s16(5,5,5)] == "third");
+		}
+
+		remove(file);
+
+		for (s16 i=-2047; i<2048; i+=511)
+		{
+			v3s16 p(i, -i, i/2);
+			assert(MapDatabase::getIntegerAsBlock(MapDatabase::getBlockAsInteger(p)) == p);
+		}
+	}
+};
+
+struct TestMapBlockSerialize
+{
+	void check(MapBlock &b, u8 version)
+	{
+		std::ostringstream os(std::ios_base::binary);
+		b.serialize(os, version);
+		std::istringstream is(os.str(), std::ios_base::binary);
+		MapBlock b2(NULL, v3s16(0,0,0));
+		b2.deSerialize(is, version);
+
+		for (s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for (s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for (s16 x=0; x<MAP_BLOCKSIZE; x++) {
+			v3s16 p(x,y,z);
+			MapNode n = mapnode_translate_to_internal(b.getNodeNoEx(p), version);
+			MapNode n2 = b2.getNodeNoEx(p);
+			assert(n2.getContent() == n.getContent());
+			assert(n2.param1 == n.param1);
+			assert(n2.param2 == n.param2);
+		}
+	}
+
+	void fill(MapBlock &b, u32 palette_size)
+	{
+		for (u32 i=0; i<MAP_BLOCKSIZE3; i++) {
+			MapNode n(i%palette_size, i&0xFF, (i>>4)&0xFF);
+			b.setNodeNoCheck(i%MAP_BLOCKSIZE, (i/MAP_BLOCKSIZE)%MAP_BLOCKSIZE,
+					i/(MAP_BLOCKSIZE2), n);
+		}
+	}
+
+	void Run()
+	{
+		MapBlock b(NULL, v3s16(0,0,0));
+
+		// Uniform
+		MapNode air(CONTENT_AIR);
+		for (u32 i=0; i<MAP_BLOCKSIZE3; i++)
+			b.setNodeNoCheck(i%MAP_BLOCKSIZE, (i/MAP_BLOCKSIZE)%MAP_BLOCKSIZE,
+					i/(MAP_BLOCKSIZE2), air);
+		check(b, 22);
+		check(b, 23);
+
+		// Two contents and a param1 plane
+		MapNode stone(CONTENT_STONE, 7);
+		b.setNodeNoCheck(v3s16(1,2,3), stone);
+		check(b, 22);
+		check(b, 23);
+
+		// Palettes needing every index size
+		u32 sizes[] = {3, 15, 200, 300, MAX_CONTENT};
+		for (u32 k=0; k<5; k++) {
+			fill(b, sizes[k]);
+			check(b, 23);
+		}
+
+		// Changing the block drops the cached packet
+		PacketBuffer packet(8);
+		b.setCachedPacket(23, packet);
+		assert(b.getCachedPacket(23, packet));
+		assert(!b.getCachedPacket(22, packet));
+		b.setTimestamp(1);
+		assert(b.getCachedPacket(23, packet));
+		b.setNodeNoCheck(v3s16(0,0,0), stone);
+		assert(!b.getCachedPacket(23, packet));
+	}
+};
+
+struct TestMapBlockUniform
+{
+	void Run()
+	{
+		MapBlock b(NULL, v3s16(0,0,0));
+		assert(b.isDummy() == false);
+		assert(b.isUniform());
+		assert(b.getNodeNoEx(v3s16(1,2,3)).getContent() == CONTENT_IGNORE);
+
+		// Writing the same node doesn't allocate anything
+		MapNode ignore(CONTENT_IGNORE);
+		b.setNode(v3s16(4,5,6), ignore);
+		assert(b.isUniform());
+
+		MapNode air(CONTENT_AIR);
+		for (u32 i=0; i<MAP_BLOCKSIZE3; i++)
+			b.setNodeNoCheck(i%MAP_BLOCKSIZE, (i/MAP_BLOCKSIZE)%MAP_BLOCKSIZE,
+					i/(MAP_BLOCKSIZE2), air);
+		assert(b.isUniform() == false);
+		assert(b.compact());
+		assert(b.getNodeNoEx(v3s16(15,15,15)).getContent() == CONTENT_AIR);
+
+		b.incNodeTicks();
+		assert(b.getNodeNoEx(v3s16(0,0,0)).envticks == 1);
+
+		// The first different node expands the block
+		MapNode stone(CONTENT_STONE);
+		b.setNode(v3s16(1,2,3), stone);
+		assert(b.isUniform() == false);
+		assert(b.getNodeNoEx(v3s16(1,2,3)).getContent() == CONTENT_STONE);
+		assert(b.getNodeNoEx(v3s16(3,2,1)).getContent() == CONTENT_AIR);
+		assert(b.getNodeNoEx(v3s16(3,2,1)).envticks == 1);
+		assert(b.compact() == false);
+
+		// Uniform blocks are read back uniform
+		b.setNode(v3s16(1,2,3), air);
+		std::ostringstream os(std::ios_base::binary);
+		b.serialize(os, SER_FMT_VER_HIGHEST);
+		std::istringstream is(os.str(), std::ios_base::binary);
+		MapBlock b2(NULL, v3s16(0,0,0));
+		b2.deSerialize(is, SER_FMT_VER_HIGHEST);
+		assert(b2.isUniform());
+		assert(b2.getNodeNoEx(v3s16(1,2,3)).getContent() == CONTENT_AIR);
+
+		// Copying to a VoxelManipulator doesn't need the node array
+		VoxelManipulator v;
+		v.addArea(VoxelArea(v3s16(0,0,0), v3s16(15,15,15)));
+		b2.copyTo(v);
+		assert(b2.isUniform());
+		assert(v.getNode(v3s16(7,8,9)).getContent() == CONTENT_AIR);
+	}
+};
+
+struct TestMapBlockNodestep
+{
+	void Run()
+	{
+		assert(content_nodestep(CONTENT_SAPLING) & NODESTEP_HANDLER);
+		assert(!(content_nodestep(CONTENT_STONE) & NODESTEP_HANDLER));
+
+		MapBlock b(NULL, v3s16(0,0,0));
+		assert(b.getNodestepCount() == 0);
+
+		MapNode stone(CONTENT_STONE);
+		MapNode sapling(CONTENT_SAPLING);
+		b.setNode(v3s16(0,0,0), stone);
+		b.setNode(v3s16(1,0,0), sapling);
+		b.setNode(v3s16(2,0,0), sapling);
+		assert(b.getNodestepCount() == 2);
+		b.setNode(v3s16(2,0,0), stone);
+		assert(b.getNodestepCount() == 1);
+
+		// Deserializing counts them again
+		std::ostringstream os(std::ios_base::binary);
+		b.serialize(os, SER_FMT_VER_HIGHEST);
+		std::istringstream is(os.str(), std::ios_base::binary);
+		MapBlock b2(NULL, v3s16(0,0,0));
+		b2.deSerialize(is, SER_FMT_VER_HIGHEST);
+		assert(b2.getNodestepCount() == 1);
+		b2.setNode(v3s16(1,0,0), stone);
+		assert(b2.getNodestepCount() == 0);
+	}
+};
+
+/*
+	Blocks only catch up on the nodesteps they missed while unloaded, not
+	on the hour emerging blocks are activated with
+*/
+struct TestBlockMissedNodesteps
+{
+	void Run()
+	{
+		// Just generated
+		MapBlock b(NULL, v3s16(0,0,0));
+		assert(b.getTimestamp() == BLOCK_TIMESTAMP_UNDEFINED);
+		assert(block_missed_nodesteps(5000,b.getTimestamp()) == 0);
+
+		// Saved just now
+		b.setTimestamp(5000);
+		assert(block_missed_nodesteps(5000,b.getTimestamp()) == 0);
+		assert(block_missed_nodesteps(5005,b.getTimestamp()) == 0);
+
+		// Unloaded for ten minutes
+		assert(block_missed_nodesteps(5600,b.getTimestamp()) == 600/NODESTEP_INTERVAL);
+
+		// From a world with a later game time
+		assert(block_missed_nodesteps(4000,b.getTimestamp()) == 0);
+	}
+};
+
+struct TestMapBlockNodeVersion
+{
+	void Run()
+	{
+		MapBlock b(NULL, v3s16(0,0,0));
+		MapBlock b2(NULL, v3s16(0,0,0));
+		assert(b.getNodeVersion() != b2.getNodeVersion());
+
+		MapNode stone(CONTENT_STONE);
+		MapNode air(CONTENT_AIR);
+		uint64_t v = b.getNodeVersion();
+		b.setNode(v3s16(1,2,3), stone);
+		assert(b.getNodeVersion() != v);
+
+		// Only changes of content count
+		v = b.getNodeVersion();
+		b.setNode(v3s16(1,2,3), stone);
+		uint64_t c = b.getChangeCount();
+		stone.param1 = 15;
+		b.setNode(v3s16(1,2,3), stone);
+		assert(b.getNodeVersion() == v);
+		// but the change count sees the rest
+		assert(b.getChangeCount() != c);
+		assert(b.getChangeCount() != b2.getChangeCount());
+
+		b.setNode(v3s16(1,2,3), air);
+		assert(b.getNodeVersion() != v);
+
+		// A block read back is a different one
+		std::ostringstream os(std::ios_base::binary);
+		b.serialize(os, SER_FMT_VER_HIGHEST);
+		std::istringstream is(os.str(), std::ios_base::binary);
+		b2.deSerialize(is, SER_FMT_VER_HIGHEST);
+		assert(b2.getNodeVersion() != b.getNodeVersion());
+	}
+};
+
+/*
+	Moves players around and checks the incrementally updated active
+	block list against one made from scratch
+*/
+struct TestActiveBlockList
+{
+	void Run()
+	{
+		ActiveBlockList list;
+		std::map<u16,v3s16> positions;
+		std::set<v3s16> active;
+		s16 radius = 2;
+
+		for (u32 step=0; step<200; step++) {
+			if (step == 100)
+				radius = 1;
+			for (u16 id=1; id<=4; id++) {
+				u32 r = myrand()%4;
+				if (r == 0)
+					positions.erase(id);
+				else if (r == 1 || positions.find(id) == positions.end())
+					positions[id] = v3s16(myrand()%7-3,myrand()%7-3,myrand()%7-3);
+			}
+
+			std::set<v3s16> removed;
+			std::set<v3s16> added;
+			list.update(positions, radius, removed, added);
+
+			std::set<v3s16> expected;
+			for (std::map<u16,v3s16>::iterator i = positions.begin(); i != positions.end(); i++) {
+				v3s16 p;
+				for (p.X=i->second.X-radius; p.X<=i->second.X+radius; p.X++)
+				for (p.Y=i->second.Y-radius; p.Y<=i->second.Y+radius; p.Y++)
+				for (p.Z=i->second.Z-radius; p.Z<=i->second.Z+radius; p.Z++)
+					expected.insert(p);
+			}
+
+			assert(list.m_list.size() == expected.size());
+			for (std::set<v3s16>::iterator i = expected.begin(); i != expected.end(); i++) {
+				assert(list.contains(*i));
+				if (active.find(*i) == active.end())
+					assert(added.find(*i) != added.end());
+				else
+					assert(added.find(*i) == added.end());
+			}
+			for (std::set<v3s16>::iterator i = active.begin(); i != active.end(); i++) {
+				if (expected.find(*i) == expected.end())
+					assert(removed.find(*i) != removed.end());
+				else
+					assert(removed.find(*i) == removed.end());
+			}
+			assert(added.size() + active.size() == expected.size() + removed.size());
+			active = expected;
+		}
+	}
+};
+
+/*
+	Moves objects around and checks that radius lookups in the active
+	object index find everything going through all of them would
+*/
+struct TestActiveObjectIndex
+{
+	void Run()
+	{
+		ActiveObjectIndex index;
+		std::map<u16,v3f> objects;
+
+		for (u32 step=0; step<200; step++) {
+			for (u16 id=1; id<=50; id++) {
+				u32 r = myrand()%8;
+				if (r == 0) {
+					objects.erase(id);
+					index.remove(id);
+				}else if (r < 4 || objects.find(id) == objects.end()) {
+					v3f pos((myrand()%2000-1000)*BS/10,(myrand()%400-200)*BS/10,(myrand()%2000-1000)*BS/10);
+					if (objects.find(id) == objects.end())
+						index.add(id,pos);
+					else
+						index.update(id,pos);
+					objects[id] = pos;
+				}
+			}
+
+			v3f pos((myrand()%2000-1000)*BS/10,(myrand()%400-200)*BS/10,(myrand()%2000-1000)*BS/10);
+			f32 radius = (myrand()%800)*BS/10;
+			std::vector<u16> ids;
+			index.find(pos,radius,ids);
+
+			for (u32 i=1; i<ids.size(); i++) {
+				assert(ids[i-1] < ids[i]);
+			}
+			for (std::map<u16,v3f>::iterator i = objects.begin(); i != objects.end(); i++) {
+				if (i->second.getDistanceFrom(pos) > radius)
+					continue;
+				assert(std::binary_search(ids.begin(),ids.end(),i->first));
+			}
+			for (u32 i=0; i<ids.size(); i++) {
+				assert(objects.find(ids[i]) != objects.end());
+			}
+		}
+	}
+};
+
+/*
+	Worker threads do their work each time they are woken, and say when
+	they're done
+*/
+struct TestWorkerThread
+{
+	struct Adder : public WorkerThread
+	{
+		Adder(JSemaphore *done):
+			WorkerThread("TestWorkerThread",done),
+			count(0)
+		{
+		}
+		void work()
+		{
+			count++;
+		}
+		u32 count;
+	};
+
+	void Run()
+	{
+		JSemaphore done;
+		// Nothing posted, times out
+		assert(!done.Wait(10));
+
+		Adder a(&done);
+		Adder b(&done);
+		for (u32 i=0; i<100; i++) {
+			a.wake();
+			b.wake();
+			done.Wait();
+			done.Wait();
+		}
+		assert(a.count == 100);
+		assert(b.count == 100);
+		assert(!done.Wait(0));
+
+		a.stopWorker();
+		b.stopWorker();
+		assert(!a.IsRunning());
+		assert(!b.IsRunning());
+	}
+};
+
+/*
+	Liquid nodes are handed out by block, blocks in the order they were
+	first queued in and again at the back once they've had their turn
+*/
+struct TestLiquidQueue
+{
+	void Run()
+	{
+		LiquidQueue q;
+
+		q.push_back(v3s16(1,2,3));
+		q.push_back(v3s16(20,2,3));
+		q.push_back(v3s16(4,5,6));
+		q.push_back(v3s16(1,2,3));
+		q.push_back(v3s16(-1,2,3));
+		assert(q.size() == 4);
+		assert(q.blockCount() == 3);
+
+		std::vector<v3s16> blocks;
+		q.getBlocks(blocks);
+		assert(blocks.size() == 3);
+		assert(blocks[0] == v3s16(0,0,0));
+		assert(blocks[1] == v3s16(1,0,0));
+		assert(blocks[2] == v3s16(-1,0,0));
+
+		std::vector<v3s16> nodes;
+		q.takeBlock(v3s16(0,0,0),nodes);
+		assert(nodes.size() == 2);
+		assert(nodes[0] == v3s16(1,2,3));
+		assert(nodes[1] == v3s16(4,5,6));
+		assert(q.size() == 2);
+
+		// Nothing queued there now
+		nodes.clear();
+		q.takeBlock(v3s16(0,0,0),nodes);
+		assert(nodes.size() == 0);
+
+		q.push_back(v3s16(1,2,3));
+		blocks.clear();
+		q.getBlocks(blocks);
+		assert(blocks.size() == 3);
+		assert(blocks[0] == v3s16(1,0,0));
+		assert(blocks[2] == v3s16(0,0,0));
+		assert(q.size() == 3);
+	}
+};
+
+/*
+	Flow field distances over a small flat floor, before and after a wall
+	is put up
+*/
+struct TestPathfinder
+{
+	struct TestMap : public Map
+	{
+		TestMap():
+			Map(dstream)
+		{
+			ServerMapSector *sector = new ServerMapSector(this, v2s16(0,0));
+			m_sectors.insert(v2s16(0,0), sector);
+			MapBlock *block = sector->createBlankBlock(0);
+			v3s16 p;
+			for (p.Z=0; p.Z<MAP_BLOCKSIZE; p.Z++)
+			for (p.Y=0; p.Y<MAP_BLOCKSIZE; p.Y++)
+			for (p.X=0; p.X<MAP_BLOCKSIZE; p.X++) {
+				MapNode n(p.Y == 0 ? CONTENT_STONE : CONTENT_AIR);
+				block->setNode(p,n);
+			}
+		}
+	};
+
+	void Run()
+	{
+		TestMap map;
+		Pathfinder pathfinder(&map);
+		v3s16 size(1,2,1);
+		v3s16 target(2,1,2);
+
+		assert(pathfinder.getDistance(target,size,target) == 0);
+		assert(pathfinder.getDistance(target,size,v3s16(5,1,2)) == 3);
+		// Diagonal steps count as one
+		assert(pathfinder.getDistance(target,size,v3s16(5,1,6)) == 4);
+		// In the floor
+		assert(pathfinder.getDistance(target,size,v3s16(5,0,2)) == -1);
+		// Too far
+		assert(pathfinder.getDistance(target,size,v3s16(2,1,2+PATH_FIELD_RADIUS+1)) == -1);
+
+		// A target that moved a little uses the same field until it times out
+		v3s16 moved(3,1,2);
+		assert(pathfinder.getDistance(moved,size,target) == 0);
+		pathfinder.step(PATH_FIELD_TIMEOUT);
+		assert(pathfinder.getDistance(moved,size,target) == 1);
+
+		// A wall across the floor, two nodes high
+		for (s16 z=0; z<MAP_BLOCKSIZE; z++) {
+			for (s16 y=1; y<=2; y++) {
+				MapNode n(CONTENT_STONE);
+				map.setNode(v3s16(6,y,z),n);
+			}
+		}
+		assert(pathfinder.getDistance(moved,size,v3s16(8,1,2)) == 5);
+
+		// Not seen until the event, then the far side can't be reached
+		MapEditEvent event;
+		event.type = MEET_ADDNODE;
+		event.p = v3s16(6,1,2);
+		pathfinder.onMapEditEvent(&event);
+		pathfinder.step(0);
+		assert(pathfinder.getDistance(moved,size,v3s16(8,1,2)) == -1);
+		assert(pathfinder.getDistance(moved,size,v3s16(5,1,2)) == 2);
+	}
+};
+
+/*
+	A flood of energy is only done again while the blocks it went through
+	are as they were and the nodes take the energy the same way
+*/
+struct TestCircuitFlood
+{
+	void Run()
+	{
+		TestPathfinder::TestMap map;
+		v3s16 src(1,1,1);
+		CircuitFlood flood;
+		flood.level = ENERGY_MAX;
+		for (s16 x=2; x<=4; x++) {
+			v3s16 p(x,1,1);
+			MapNode n(CONTENT_CIRCUIT_MITHRILWIRE);
+			map.setNode(p,n);
+			map.setNodeMetadata(p,new CircuitNodeMetadata());
+			flood.addNode(p);
+			CircuitEnergise e;
+			e.level = ENERGY_MAX-(x-2);
+			e.powersrc = src;
+			e.signalsrc = p-v3s16(1,0,0);
+			e.pos = p;
+			e.taken = true;
+			flood.energised.push_back(e);
+		}
+		flood.setVersions(&map);
+		assert(flood.versions.size() == 1);
+
+		assert(flood.replay(&map));
+		assert(map.getNodeMetadata(v3s16(2,1,1))->getEnergy() == ENERGY_MAX);
+		assert(map.getNodeMetadata(v3s16(4,1,1))->getEnergy() == ENERGY_MAX-2);
+		// Nothing has changed, again
+		assert(flood.replay(&map));
+
+		// A node that doesn't take the energy as it did
+		flood.energised[1].taken = false;
+		assert(!flood.replay(&map));
+		flood.energised[1].taken = true;
+
+		// A node changed along the way
+		MapNode n(CONTENT_STONE);
+		map.setNode(v3s16(5,1,1),n);
+		assert(!flood.replay(&map));
+		flood.setVersions(&map);
+		assert(flood.replay(&map));
+	}
+};
+
+/*
+	Mobs left out when they go over their time budget are stepped first
+	next time, and don't save up more than MOB_AI_MAX_DTIME
+*/
+struct TestMobDeferStep
+{
+	void Run()
+	{
+		std::map<u16, ServerActiveObject*> objects;
+		for (u16 id=1; id<=6; id++) {
+			objects[id] = new MobSAO(NULL, id, v3f(0,0,0), CONTENT_MOB_RAT);
+		}
+
+		std::vector<ServerActiveObject*> order;
+		active_object_step_order(objects,0,order);
+		assert(order.size() == 6);
+		assert(order[0]->getId() == 1);
+
+		// Over budget after stepping 3, the rest put their steps off
+		for (u32 i=3; i<order.size(); i++) {
+			((MobSAO*)order[i])->deferStep(0.2);
+		}
+		order.clear();
+		active_object_step_order(objects,3+1,order);
+		assert(order.size() == 6);
+		assert(order[0]->getId() == 4);
+		assert(order[5]->getId() == 3);
+		assert(((MobSAO*)order[0])->getDeferredTime() > 0.15);
+
+		// Over budget after the last one goes back round to the start
+		order.clear();
+		active_object_step_order(objects,6+1,order);
+		assert(order[0]->getId() == 1);
+		order.clear();
+		active_object_step_order(objects,(u16)(65535+1),order);
+		assert(order[0]->getId() == 1);
+
+		// Left out for a long time
+		MobSAO *mob = (MobSAO*)objects[4];
+		for (u32 i=0; i<1000; i++) {
+			mob->deferStep(0.2);
+		}
+		assert(mob->getDeferredTime() <= MOB_AI_MAX_DTIME);
+		assert(mob->getDeferredTime() > MOB_AI_MAX_DTIME-0.01);
+
+		// The budget isn't used up by mobs that step quickly
+		{
+			MobStepBudget budget(20,1000);
+			assert(!budget.stepped(1,1019));
+			assert(!budget.isOver());
+			assert(budget.stepped(2,1020));
+			assert(budget.isOver());
+			MobStepBudget none(0,1000);
+			assert(!none.stepped(1,100000));
+		}
+
+		/*
+			Stepped the way ServerEnvironment::step does, with each mob
+			taking a millisecond of a three millisecond budget
+		*/
+		u16 next = 0;
+		std::map<u16, u32> steps;
+		for (u32 round=0; round<20; round++) {
+			u32 now = round*1000;
+			MobStepBudget budget(3,now);
+			u32 stepped = 0;
+			order.clear();
+			active_object_step_order(objects,next,order);
+			for (u32 i=0; i<order.size(); i++) {
+				MobSAO *m = (MobSAO*)order[i];
+				if (budget.isOver()) {
+					m->deferStep(0.2);
+					continue;
+				}
+				now++;
+				stepped++;
+				steps[m->getId()]++;
+				if (budget.stepped(m->getId(),now))
+					next = budget.getNext();
+			}
+			assert(stepped == 3);
+		}
+		// Everyone had their turn, and time saved up stays capped
+		for (std::map<u16, ServerActiveObject*>::iterator i = objects.begin(); i != objects.end(); i++) {
+			assert(steps[i->first] == 10);
+			assert(((MobSAO*)i->second)->getDeferredTime() <= MOB_AI_MAX_DTIME);
+		}
+
+		for (std::map<u16, ServerActiveObject*>::iterator i = objects.begin(); i != objects.end(); i++) {
+			delete i->second;
+		}
+	}
+};
+
+/*
+	A furnace fast forwarded over a long time should cook what stepping
+	it would have
+*/
+struct TestFurnaceFastForward
+{
+	void Run()
+	{
+		for (u16 src_count=1; src_count<=40; src_count+=13)
+		for (u16 fuel_count=1; fuel_count<=20; fuel_count+=6)
+		for (u32 dtime=5; dtime<=86400; dtime*=6)
+		{
+			FurnaceNodeMetadata stepped;
+			Inventory *inv = stepped.getInventory();
+			inv->getList("src")->addItem(0,InventoryItem::create(CONTENT_ROUGHSTONEBRICK,src_count,0,0));
+			inv->getList("fuel")->addItem(0,InventoryItem::create(CONTENT_WOOD,fuel_count,0,0));
+			NodeMetadata *forwarded = stepped.clone();
+
+			stepped.step(dtime,v3s16(0,0,0),NULL);
+			forwarded->fastForward(dtime,v3s16(0,0,0),NULL);
+
+			std::ostringstream a(std::ios_base::binary);
+			std::ostringstream b(std::ios_base::binary);
+			stepped.getInventory()->serialize(a);
+			forwarded->getInventory()->serialize(b);
+			assert(a.str() == b.str());
+			delete forwarded;
+		}
+	}
+};
+
+/*
+	Compares scanning the contents of blocks stored as MapNode arrays,
+	the way blocks used to be, with scanning the content plane
+*/
+struct TestMapBlockScan
+{
+	void Run()
+	{
+		const u32 blockcount = 256;
+		const u32 passes = 20;
+		TestCompress samples;
+		mysrand(1);
+
+		core::array<MapBlock*> blocks;
+		MapNode *nodes = new MapNode[blockcount*MAP_BLOCKSIZE3];
+		for (u32 k=0; k<blockcount; k++) {
+			MapBlock *b = new MapBlock(NULL, v3s16(k,0,0));
+			samples.makeSample(*b, 1+k%2);
+			for (u32 i=0; i<MAP_BLOCKSIZE3; i++) {
+				v3s16 p(i%MAP_BLOCKSIZE, (i/MAP_BLOCKSIZE)%MAP_BLOCKSIZE, i/(MAP_BLOCKSIZE2));
+				nodes[k*MAP_BLOCKSIZE3+i] = b->getNodeNoEx(p);
+			}
+			blocks.push_back(b);
+		}
+
+		u32 found_nodes = 0;
+		u32 t0 = porting::getTimeMs();
+		for (u32 pass=0; pass<passes; pass++) {
+			for (u32 i=0; i<blockcount*MAP_BLOCKSIZE3; i++) {
+				if (nodes[i].getContent() == CONTENT_MUD)
+					found_nodes++;
+			}
+		}
+		u32 t1 = porting::getTimeMs();
+		u32 found_planes = 0;
+		for (u32 pass=0; pass<passes; pass++) {
+			for (u32 k=0; k<blockcount; k++) {
+				const content_t *content = blocks[k]->getContentPlane();
+				assert(content != NULL);
+				for (u32 i=0; i<MAP_BLOCKSIZE3; i++) {
+					if (content[i] == CONTENT_MUD)
+						found_planes++;
+				}
+			}
+		}
+		u32 t2 = porting::getTimeMs();
+
+		assert(found_nodes == found_planes);
+
+		// Nodes per ms, thousands per ms is millions per second
+		const u32 knodes = passes*blockcount*MAP_BLOCKSIZE3/1000;
+		infostream<<"TestMapBlockScan: node array "<<knodes/MYMAX(t1-t0,1)
+				<<"M nodes/s, content plane "<<knodes/MYMAX(t2-t1,1)
+				<<"M nodes/s"<<std::endl;
+
+		for (u32 k=0; k<blockcount; k++)
+			delete blocks[k];
+		delete[] nodes;
+	}
+};
+
 #define TEST(X)\
 {\
 	X x;\
@@ -1126,10 +2398,29 @@ void run_tests()
 	TEST(TestVoxelManipulator);
 	//TEST(TestMapBlock);
 	//TEST(TestMapSector);
+	TEST(TestMapBlockSerialize);
+	TEST(TestMapBlockUniform);
+	TEST(TestMapBlockNodestep);
+	TEST(TestBlockMissedNodesteps);
+	TEST(TestMapBlockNodeVersion);
+	TEST(TestMapBlockScan);
+	TEST(TestActiveBlockList);
+	TEST(TestActiveObjectIndex);
+	TEST(TestWorkerThread);
+	TEST(TestLiquidQueue);
+	TEST(TestPathfinder);
+	TEST(TestCircuitFlood);
+	TEST(TestMobDeferStep);
+	TEST(TestFurnaceFastForward);
+	TEST(TestMapDatabase);
+	TEST(TestReliablePacketBuffer);
+	TEST(TestChannelWindowLost);
+	TEST(TestPacketBuffer);
 	if(INTERNET_SIMULATOR == false){
 		TEST(TestSocket);
 		dout_con<<"=== BEGIN RUNNING UNIT TESTS FOR CONNECTION ==="<<std::endl;
 		TEST(TestConnection);
+		TEST(TestConnectionThroughput);
 		dout_con<<"=== END RUNNING UNIT TESTS FOR CONNECTION ==="<<std::endl;
 	}
 	infostream<<"run_tests() passed"<<std::endl;
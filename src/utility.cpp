@@ -273,5 +273,26 @@ std::string translatePassword(std::string playername, std::wstring password)
 	return std::string(buff);
 }
 
+void * WorkerThread::Thread()
+{
+	ThreadStarted();
+	log_mutex.Lock();
+	log_register_thread(m_name);
+	log_mutex.Unlock();
+
+	DSTACK(__FUNCTION_NAME);
+
+	BEGIN_DEBUG_EXCEPTION_HANDLER
 
+	for (;;) {
+		m_wake.Wait();
+		if (!getRun())
+			break;
+		work();
+		m_done->Post();
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
 
+	return NULL;
+}
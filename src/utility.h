@@ -35,6 +35,7 @@
 #include <jthread.h>
 #include <jmutex.h>
 #include <jmutexautolock.h>
+#include <jsemaphore.h>
 #include <cstring>
 
 #include "common_irrlicht.h"
@@ -1002,6 +1003,51 @@ public:
 	}
 };
 
+/*
+	A thread that is kept waiting for work rather than started each
+	time, as starting a thread takes about a millisecond. Each wake()
+	has it call work() once, then post the done semaphore, so whoever
+	shares out the work waits on that for all of them to finish.
+*/
+class WorkerThread : public SimpleThread
+{
+public:
+	WorkerThread(const char *name, JSemaphore *done):
+		SimpleThread(),
+		m_name(name),
+		m_done(done)
+	{
+	}
+
+	void * Thread();
+
+	virtual void work() = 0;
+
+	void wake()
+	{
+		if (!IsRunning()) {
+			setRun(true);
+			Start();
+		}
+		m_wake.Post();
+	}
+	// Waits for the work being done to finish
+	void stopWorker()
+	{
+		if (!IsRunning())
+			return;
+		setRun(false);
+		m_wake.Post();
+		while (IsRunning())
+			sleep_ms(1);
+	}
+
+private:
+	const char *m_name;
+	JSemaphore m_wake;
+	JSemaphore *m_done;
+};
+
 /*
 	FIFO queue (well, actually a FILO also)
 */
@@ -1134,6 +1180,89 @@ class MutexedQueue
 	core::list<T> m_list;
 };
 
+/*
+	FIFO queue for one thread putting things in and one thread taking
+	them out, neither of them waiting for the other. Several threads can
+	put things in if they take turns holding a mutex.
+*/
+
+template<typename T>
+class SPSCQueue
+{
+	struct Node
+	{
+		T item;
+		Node * volatile next;
+	};
+
+    public:
+	SPSCQueue():
+		m_size(0)
+	{
+		// The head is always a node that has been taken out
+		m_head = new Node;
+		m_head->next = NULL;
+		m_tail = m_head;
+	}
+	~SPSCQueue()
+	{
+		while(m_head != NULL)
+		{
+			Node *next = m_head->next;
+			delete m_head;
+			m_head = next;
+		}
+	}
+	u32 size()
+	{
+		return X1SyncGet(&m_size);
+	}
+	void push_back(T t)
+	{
+		Node *node = new Node;
+		node->item = t;
+		node->next = NULL;
+		// The node is filled in before it can be seen
+		X1SyncBarrier();
+		m_tail->next = node;
+		m_tail = node;
+		X1SyncInc(&m_size);
+	}
+	T pop_front(u32 wait_time_max_ms=0)
+	{
+		u32 wait_time_ms = 0;
+
+		for(;;)
+		{
+			Node *next = m_head->next;
+			if(next != NULL)
+			{
+				X1SyncBarrier();
+				T t = next->item;
+				next->item = T();
+				delete m_head;
+				m_head = next;
+				X1SyncDec(&m_size);
+				return t;
+			}
+
+			if(wait_time_ms >= wait_time_max_ms)
+				throw ItemNotFoundException("SPSCQueue: queue is empty");
+
+			// Wait a while before trying again
+			sleep_ms(1);
+			wait_time_ms += 1;
+		}
+	}
+
+    private:
+	// Only used by the thread taking things out
+	Node *m_head;
+	// Only used by the thread putting things in
+	Node *m_tail;
+	volatile int m_size;
+};
+
 /*
 	A single worker thread - multiple client threads queue framework.
 */
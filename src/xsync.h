@@ -24,6 +24,10 @@
 #ifndef XSYNC_HEADER
 #define XSYNC_HEADER
 
+#ifdef _MSC_VER
+#include <windows.h>
+#endif
+
 #if defined(__GNUC__) || defined(__clang__)
 #  define XINLINE inline
 #  define XFINLINE inline __attribute__ ((always_inline))
@@ -55,6 +59,21 @@
     {
 	    return __sync_fetch_and_sub(pval,1);
     }
+# elif defined(_MSC_VER)
+    XFINLINE static int X1SyncGet(volatile int* const pval)
+    {
+	    return InterlockedExchangeAdd((volatile LONG*)pval,0);
+    }
+
+    XFINLINE static int X1SyncInc(volatile int* const pval)
+    {
+	    return InterlockedExchangeAdd((volatile LONG*)pval,1);
+    }
+
+    XFINLINE static int X1SyncDec(volatile int* const pval)
+    {
+	    return InterlockedExchangeAdd((volatile LONG*)pval,-1);
+    }
 # else
     XFINLINE static int X1SyncGet(volatile int* const pval)
     {
@@ -95,6 +114,32 @@
 			    oldval2);
 	    return oldval;
     }
+
+    // Nothing before it is moved after it, or after it before it
+    XFINLINE static void X1SyncBarrier()
+    {
+	    __sync_synchronize();
+    }
+#elif defined(_MSC_VER)
+    XFINLINE static int X1SyncBReset(volatile int* const pval)
+    {
+	    return InterlockedCompareExchange((volatile LONG*)pval,0,1) == 1;
+    }
+
+    XFINLINE static int X1SyncBSet(volatile int* const pval)
+    {
+	    return InterlockedCompareExchange((volatile LONG*)pval,1,0) == 0;
+    }
+
+    XFINLINE static int X1SyncSet(volatile int* const pval,const int newval)
+    {
+	    return InterlockedExchange((volatile LONG*)pval,newval);
+    }
+
+    XFINLINE static void X1SyncBarrier()
+    {
+	    MemoryBarrier();
+    }
 #else
     XFINLINE static int X1SyncBReset(volatile int* const pval)
     {
@@ -119,6 +164,10 @@
 	    *pval = newval;
 	    return oldval;
     }
+
+    XFINLINE static void X1SyncBarrier()
+    {
+    }
 #endif
 
 #endif